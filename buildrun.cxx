@@ -448,6 +448,7 @@ compile_pass (systemtap_session& s)
 
   // RHBZ1233912 - s390 temporary workaround for non-atomic udelay()
   output_exportconf(s, o, "udelay_simple", "STAPCONF_UDELAY_SIMPLE");
+  output_exportconf(s, o, "irq_work_queue", "STAPCONF_IRQ_WORK_QUEUE");
 
   output_autoconf(s, o, "autoconf-tracepoint-strings.c", "STAPCONF_TRACEPOINT_STRINGS", NULL);
   output_autoconf(s, o, "autoconf-timerfd.c", "STAPCONF_TIMERFD_H", NULL);
@@ -526,6 +527,13 @@ compile_pass (systemtap_session& s)
       objname[objname.size()-1] = 'o'; // now objname
       o << " " + objname;
     }
+  // symbol data objects taken from the cache have no source to build
+  for (unsigned i=0; i<s.symbol_objects.size(); i++)
+    {
+      string objname = s.symbol_objects[i];
+      assert (objname != "" && objname.rfind('/') != string::npos);
+      o << " " + objname.substr(objname.rfind('/')+1); // basename
+    }
   // and once again, for the translated_source file.  It can't simply
   // be named MODULENAME.c, since kbuild doesn't allow a foo.ko file
   // consisting of multiple .o's to have foo.o/foo.c as a source.
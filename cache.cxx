@@ -9,6 +9,9 @@
 #include "config.h"
 #include "session.h"
 #include "cache.h"
+#include "hash.h"
+#include "parse.h"
+#include "elaborate.h"
 #include "util.h"
 #include "stap-probe.h"
 #include <cerrno>
@@ -137,6 +140,49 @@ get_stapconf_from_cache(systemtap_session& s)
 }
 
 
+void
+add_symbol_objects_to_cache(systemtap_session& s)
+{
+  bool verbose = s.verbose > 1;
+
+  for (unsigned i = 0; i < s.symbol_object_cache.size(); i++)
+    {
+      const string& obj_path = s.symbol_object_cache[i].first;
+      const string& cache_path = s.symbol_object_cache[i].second;
+
+      // The object may be missing if pass 4 stopped early; that just
+      // means there's nothing to keep this time.
+      if (file_exists(obj_path))
+        copy_file(obj_path, cache_path, verbose);
+    }
+}
+
+
+bool
+get_symbol_object_from_cache(systemtap_session& s, const string& cache_path,
+                             const string& obj_path)
+{
+  if (s.poison_cache)
+    return false;
+
+  int fd_obj = open(cache_path.c_str(), O_RDONLY);
+  if (fd_obj == -1)
+    return false;
+
+  if (!get_file_size(fd_obj) || !copy_file(cache_path, obj_path))
+    {
+      close(fd_obj);
+      return false;
+    }
+  close(fd_obj);
+
+  if (s.verbose > 1)
+    clog << _("Pass 3: using cached ") << cache_path << endl;
+
+  return true;
+}
+
+
 bool
 get_script_from_cache(systemtap_session& s)
 {
@@ -228,6 +274,245 @@ get_script_from_cache(systemtap_session& s)
 }
 
 
+// Look up a process or library name as pass 2 does.
+static string
+resolve_early_name(systemtap_session& s, const string& kind,
+                   const string& name)
+{
+  if (kind == "library")
+    return find_executable(name, s.sysroot, s.sysenv, "LD_LIBRARY_PATH");
+  return find_executable(name, "", s.sysenv);
+}
+
+
+// Record in the early link what the names of processes and libraries
+// given without a path resolved to, since that depends on $PATH or
+// $LD_LIBRARY_PATH rather than on the script.  Module and file name
+// wildcards match whatever is installed or loaded at the time, which
+// can't be checked cheaply, so return false for those to not link at
+// all.
+static bool
+add_early_probe_points(systemtap_session& s, ostream& o,
+                       const vector<probe_point*>& pps)
+{
+  for (unsigned i = 0; i < pps.size(); i++)
+    for (unsigned j = 0; j < pps[i]->components.size(); j++)
+      {
+        probe_point::component* c = pps[i]->components[j];
+        literal_string* arg = dynamic_cast<literal_string*>(c->arg);
+        if (!arg || (c->functor != "module" && c->functor != "process"
+                     && c->functor != "library"))
+          continue;
+
+        const string kind = c->functor.to_string();
+        const string name = arg->value.to_string();
+        if (contains_glob_chars(name))
+          return false;
+        if (kind == "module" || name.find('/') != string::npos)
+          continue;
+
+        o << "exe " << kind << " " << name << endl
+          << resolve_early_name(s, kind, name) << endl;
+      }
+  return true;
+}
+
+
+void
+add_early_script_to_cache(systemtap_session& s)
+{
+  if (s.early_hash_path.empty() || s.hash_path.empty())
+    return;
+
+  // Record which module the pre-pass-1 hash led to, along with
+  // everything pass 2 learned that isn't covered by that hash: the
+  // runtime flags it set, the user-space binaries it resolved probes
+  // in, and the kernel and modules whose build ids went into the hash.
+  string tmp_path = s.early_hash_path + ".tmp" + lex_cast(getpid());
+  ofstream o(tmp_path.c_str(), ios::out | ios::trunc);
+  o << "module_name " << s.module_name << endl;
+  o << "hash_path " << s.hash_path << endl;
+  o << "need_uprobes " << s.need_uprobes << endl;
+  o << "read_stdin " << s.read_stdin << endl;
+
+  // The probe points as written, and as pass 2 derived them, which
+  // covers those that came from aliases.
+  bool linkable = true;
+  for (unsigned i = 0; linkable && i < s.user_files.size(); i++)
+    for (unsigned j = 0; linkable && j < s.user_files[i]->probes.size(); j++)
+      linkable = add_early_probe_points(s, o, s.user_files[i]->probes[j]->locations);
+  for (unsigned i = 0; linkable && i < s.probes.size(); i++)
+    {
+      vector<probe_point*> pps;
+      s.probes[i]->collect_derivation_pp_chain(pps);
+      linkable = add_early_probe_points(s, o, pps);
+    }
+  if (!linkable)
+    {
+      o.close();
+      unlink(tmp_path.c_str());
+      return;
+    }
+
+  set<string> files(s.unwindsym_modules);
+  files.insert(s.build_id_files.begin(), s.build_id_files.end());
+  for (set<string>::iterator it = files.begin(); it != files.end(); ++it)
+    {
+      struct stat st;
+      if ((*it)[0] != '/')
+        continue;
+      if (stat(it->c_str(), &st) != 0)
+        {
+          // Can't check it later, so don't link at all.
+          o.close();
+          unlink(tmp_path.c_str());
+          return;
+        }
+      o << "file " << st.st_size << " " << st.st_mtime << " " << *it << endl;
+    }
+  o.close();
+
+  if (o.fail() || rename(tmp_path.c_str(), s.early_hash_path.c_str()) != 0)
+    unlink(tmp_path.c_str());
+}
+
+
+bool
+get_early_script_from_cache(systemtap_session& s)
+{
+  if (s.poison_cache || s.early_hash_path.empty())
+    return false;
+
+  ifstream i(s.early_hash_path.c_str());
+  if (i.fail())
+    {
+      // It isn't in cache.
+      return false;
+    }
+
+  string module_name, hash_path;
+  bool need_uprobes = false, read_stdin = false;
+  string key;
+  while (i >> key)
+    {
+      if (key == "module_name")
+        i >> module_name;
+      else if (key == "hash_path")
+        {
+          i >> ws;
+          getline(i, hash_path);
+        }
+      else if (key == "need_uprobes")
+        i >> need_uprobes;
+      else if (key == "read_stdin")
+        i >> read_stdin;
+      else if (key == "exe")
+        {
+          // A process or library name now resolves elsewhere.
+          string kind, name, path;
+          i >> kind >> ws;
+          getline(i, name);
+          getline(i, path);
+          if (resolve_early_name(s, kind, name) != path)
+            return false;
+        }
+      else if (key == "file")
+        {
+          // A binary that pass 2 looked at has changed since.
+          off_t size;
+          time_t mtime;
+          string path;
+          struct stat st;
+          i >> size >> mtime >> ws;
+          getline(i, path);
+          if (stat(path.c_str(), &st) != 0 ||
+              st.st_size != size || st.st_mtime != mtime)
+            return false;
+        }
+      else
+        return false;
+    }
+  if (module_name.empty() || hash_path.empty())
+    return false;
+
+  // Pick up where find_script_hash() would have left off.
+  string saved_module_name = s.module_name;
+  string saved_translated_source = s.translated_source;
+  s.module_name = module_name;
+  s.hash_path = hash_path;
+  s.translated_source = string(s.tmpdir) + "/" + s.module_name + "_src.c";
+  s.need_uprobes = need_uprobes;
+  s.read_stdin = read_stdin;
+
+  if (!get_script_from_cache(s))
+    {
+      s.module_name = saved_module_name;
+      s.translated_source = saved_translated_source;
+      s.hash_path.clear();
+      s.need_uprobes = false;
+      s.read_stdin = false;
+      return false;
+    }
+
+  if (s.perpass_verbose[0])
+    clog << _("Passes 1-2: skipped, using cache link ") << s.early_hash_path << endl;
+  return true;
+}
+
+
+stapfile*
+get_tapset_from_cache(systemtap_session& s, const string& path, unsigned flags)
+{
+  if (s.poison_cache)
+    return NULL;
+
+  string ast_path = find_tapset_hash(s, path, flags);
+  if (ast_path.empty())
+    return NULL;
+
+  ifstream i(ast_path.c_str(), ios::in | ios::binary);
+  if (i.fail())
+    {
+      // It isn't in cache.
+      return NULL;
+    }
+
+  stapfile* f = read_parsed_file(s, i, path);
+  if (f && s.verbose > 2)
+    clog << _F("Pass 1: using cached %s for \"%s\"",
+               ast_path.c_str(), path.c_str()) << endl;
+  return f;
+}
+
+
+void
+add_tapset_to_cache(systemtap_session& s, const string& path, unsigned flags,
+                    const stapfile* f)
+{
+  string ast_path = find_tapset_hash(s, path, flags);
+  if (ast_path.empty())
+    return;
+
+  // Write to a temporary name and rename it into place, so concurrent
+  // sessions never see a partial file.
+  string tmp_path = ast_path + ".tmp" + lex_cast(getpid());
+  ofstream o(tmp_path.c_str(), ios::out | ios::binary | ios::trunc);
+  bool ok = !o.fail() && write_parsed_file(s, o, f);
+  o.close();
+
+  if (!ok || o.fail() || rename(tmp_path.c_str(), ast_path.c_str()) != 0)
+    {
+      // NB: this just means the tapset gets parsed again next time.
+      unlink(tmp_path.c_str());
+      return;
+    }
+
+  if (s.verbose > 2)
+    clog << _F("Pass 1: added \"%s\" to cache as %s",
+               path.c_str(), ast_path.c_str()) << endl;
+}
+
+
 void
 clean_cache(systemtap_session& s)
 {
@@ -1,9 +1,24 @@
+struct stapfile;
+
 void add_script_to_cache(systemtap_session& s);
 bool get_script_from_cache(systemtap_session& s);
 
+void add_early_script_to_cache(systemtap_session& s);
+bool get_early_script_from_cache(systemtap_session& s);
+
 void add_stapconf_to_cache(systemtap_session& s);
 bool get_stapconf_from_cache(systemtap_session& s);
 
+void add_symbol_objects_to_cache(systemtap_session& s);
+bool get_symbol_object_from_cache(systemtap_session& s,
+                                  const std::string& cache_path,
+                                  const std::string& obj_path);
+
+stapfile* get_tapset_from_cache(systemtap_session& s, const std::string& path,
+                                unsigned flags);
+void add_tapset_to_cache(systemtap_session& s, const std::string& path,
+                         unsigned flags, const stapfile* f);
+
 void clean_cache(systemtap_session& s);
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
@@ -28,6 +28,7 @@
 #include <cstdlib>
 #include <algorithm>
 #include <deque>
+#include <fstream>
 #include <iostream>
 #include <map>
 #include <set>
@@ -38,6 +39,8 @@
 #include <cassert>
 #include <iomanip>
 #include <cerrno>
+#include <atomic>
+#include <thread>
 
 extern "C" {
 #include <fcntl.h>
@@ -50,6 +53,7 @@ extern "C" {
 #include <fnmatch.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
@@ -107,6 +111,8 @@ dwflpp::~dwflpp()
   delete_map(mod_function_cache);
   delete_map(cu_inl_function_cache);
   delete_map(global_alias_cache);
+  delete_map(function_index);
+  delete_map(type_index);
   delete_map(cu_die_parent_cache);
 
   for (auto i = cu_lines_cache.begin(); i != cu_lines_cache.end(); ++i)
@@ -892,16 +898,14 @@ dwflpp::global_alias_caching_callback_cus(Dwarf_Die *die, dwflpp *dw)
 Dwarf_Die *
 dwflpp::declaration_resolve_other_cus(const string& name)
 {
-  iterate_over_cus(global_alias_caching_callback_cus, this, true);
-  for (auto i = global_alias_cache.begin();
-         i != global_alias_cache.end(); ++i)
-    {
-      cu_type_cache_t *v = (*i).second;
-      if (v->find(name) != v->end())
-        return & ((*v)[name]);
-    }
+  cu_type_cache_t *v = get_type_index();
+  if (!v)
+    return NULL;
 
-  return NULL;
+  auto it = v->find(name);
+  if (it == v->end())
+    return NULL;
+  return &it->second;
 }
 
 Dwarf_Die *
@@ -953,16 +957,483 @@ dwflpp::cu_function_caching_callback (Dwarf_Die* func, cu_function_cache_t *v)
 }
 
 
-int
-dwflpp::mod_function_caching_callback (Dwarf_Die* cu, cu_function_cache_t *v)
+// Reading the function DIEs of every CU is most of pass 2 for wildcard
+// probes over big modules, and CUs can be read independently.  libdw
+// handles aren't thread-safe though, so each worker opens the
+// debuginfo file itself and only reports function names and DIE
+// offsets.  The caller turns those into DIEs of module_dwarf in CU
+// order, so the caches come out exactly as a serial scan builds them.
+// $SYSTEMTAP_SCAN_THREADS overrides the number of threads; 1 forces the
+// serial scan.
+
+#define MAX_SCAN_THREADS 8
+#define MIN_SCAN_CUS 16
+
+static int
+scan_function_callback (Dwarf_Die* func, void* arg)
 {
-  // need to cast callback to func which accepts void*
-  dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
-                  v, 0);
+  const char *name = dwarf_diename(func);
+  if (name)
+    ((scanned_functions_t*) arg)->push_back(make_pair(string(name),
+                                                      dwarf_dieoffset(func)));
   return DWARF_CB_OK;
 }
 
 
+static void
+scan_functions_worker (const string* path, const vector<Dwarf_Off>* offsets,
+                       vector<scanned_functions_t>* funcs,
+                       vector<char>* scanned, atomic<size_t>* next)
+{
+  int fd = open (path->c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+
+  Elf *elf = elf_begin (fd, ELF_C_READ_MMAP, NULL);
+  Dwarf *dw = elf ? dwarf_begin_elf (elf, DWARF_C_READ, NULL) : NULL;
+  if (dw)
+    {
+      size_t i;
+      while (!pending_interrupts && (i = (*next)++) < offsets->size())
+        {
+          Dwarf_Die cu_mem;
+          Dwarf_Die *cu;
+          if ((*offsets)[i] == (Dwarf_Off) -1)
+            continue; // not a compile unit
+
+          cu = dwarf_offdie (dw, (*offsets)[i], &cu_mem);
+          if (cu && dwarf_tag (cu) == DW_TAG_compile_unit
+              && dwarf_getfuncs (cu, scan_function_callback,
+                                 &(*funcs)[i], 0) == 0)
+            (*scanned)[i] = 1;
+        }
+      dwarf_end (dw);
+    }
+  if (elf)
+    elf_end (elf);
+  close (fd);
+}
+
+
+// Scan the functions of CUS on worker threads.  CUs that couldn't be
+// scanned are left unmarked in SCANNED, and false means none were.
+bool
+dwflpp::scan_functions_parallel (const vector<Dwarf_Die*>& cus,
+                                 vector<scanned_functions_t>& funcs,
+                                 vector<char>& scanned)
+{
+  unsigned threads = thread::hardware_concurrency();
+  const char *env = getenv ("SYSTEMTAP_SCAN_THREADS");
+  if (env)
+    threads = strtoul (env, NULL, 10);
+  threads = min (threads, (unsigned) MAX_SCAN_THREADS);
+  if (threads < 2 || cus.size() < MIN_SCAN_CUS || !module_dwarf)
+    return false;
+
+  // Relocatable files (kernel modules) only make sense after libdwfl
+  // applies their relocations, and dwz alternate files would need
+  // handles of their own; leave those to the serial scan.
+  GElf_Ehdr ehdr_mem;
+  GElf_Shdr shdr_mem;
+  Elf *elf = dwarf_getelf (module_dwarf);
+  GElf_Ehdr *ehdr = elf ? gelf_getehdr (elf, &ehdr_mem) : NULL;
+  if (!ehdr || ehdr->e_type == ET_REL
+      || get_section (".gnu_debugaltlink", &shdr_mem))
+    return false;
+
+  const char *mainfile = NULL, *debugfile = NULL;
+  dwfl_module_info (module, NULL, NULL, NULL, NULL, NULL,
+                    &mainfile, &debugfile);
+  if (!debugfile && !mainfile)
+    return false;
+  string path = debugfile ?: mainfile;
+
+  vector<Dwarf_Off> offsets;
+  for (size_t i = 0; i < cus.size(); i++)
+    offsets.push_back (dwarf_tag (cus[i]) == DW_TAG_compile_unit
+                       ? dwarf_dieoffset (cus[i]) : (Dwarf_Off) -1);
+
+  funcs.assign (cus.size(), scanned_functions_t());
+  scanned.assign (cus.size(), 0);
+  atomic<size_t> next (0);
+
+  if (sess.verbose > 2)
+    clog << _F("scanning %zu CUs of %s on %u threads", cus.size(),
+               module_name.c_str(), threads) << endl;
+
+  vector<thread> workers;
+  for (unsigned i = 0; i < threads; i++)
+    workers.push_back (thread (scan_functions_worker, &path, &offsets,
+                               &funcs, &scanned, &next));
+  for (unsigned i = 0; i < threads; i++)
+    workers[i].join();
+  assert_no_interrupts();
+
+  if (sess.verbose > 3)
+    clog << _F("scanned functions of %zu CUs in %s with %u threads",
+               cus.size(), module_name.c_str(), threads) << endl;
+
+  return find (scanned.begin(), scanned.end(), 1) != scanned.end();
+}
+
+
+void
+dwflpp::cache_scanned_functions (const scanned_functions_t& funcs,
+                                 cu_function_cache_t *v)
+{
+  for (auto it = funcs.begin(); it != funcs.end(); ++it)
+    {
+      Dwarf_Die die;
+      if (dwarf_offdie (module_dwarf, it->second, &die))
+        v->insert(make_pair(it->first, die));
+    }
+}
+
+
+static int
+collect_cus_callback (Dwarf_Die* cu, vector<Dwarf_Die*>* cus)
+{
+  cus->push_back(cu);
+  return DWARF_CB_OK;
+}
+
+
+// The module-wide function and type indexes only depend on the
+// debuginfo file, so they're kept in the cache, keyed by its build-id.
+// Files with a dwz alternate file are left out, since some of their
+// DIEs can't be found again from an offset into the main file.
+string
+dwflpp::dwarf_index_path(const string& kind)
+{
+  if (!sess.use_cache || !module_dwarf)
+    return "";
+
+  const unsigned char *bits;
+  GElf_Addr vaddr;
+  int bits_length = dwfl_module_build_id(module, &bits, &vaddr);
+  if (bits_length <= 0)
+    return "";
+
+  GElf_Shdr shdr_mem;
+  if (get_section (".gnu_debugaltlink", &shdr_mem))
+    return "";
+
+  const char *mainfile = NULL, *debugfile = NULL;
+  dwfl_module_info (module, NULL, NULL, NULL, NULL, NULL,
+                    &mainfile, &debugfile);
+  if (!debugfile && !mainfile)
+    return "";
+
+  string path = find_dwarf_index_hash (sess, hex_dump(bits, bits_length),
+                                       debugfile ?: mainfile);
+  if (path.empty())
+    return "";
+  return path + "." + kind;
+}
+
+
+// Each index file ends with an "end" line, so that a truncated one is
+// told apart from a complete one.
+#define DWARF_INDEX_MAGIC "stap-dwarf-index 2"
+#define DWARF_INDEX_END "end"
+
+// Whether the DIE at OFF is NAME (or, for a type, ends with NAME's
+// last component), so that a corrupted index is rejected rather than
+// trusted.
+static bool
+dwarf_index_entry_ok (Dwarf_Die *die, const string& name, bool exact)
+{
+  const char *diename = dwarf_diename (die);
+  if (!diename)
+    return false;
+  size_t len = strlen (diename);
+  if (exact || name.size() == len)
+    return name == diename;
+  return (name.size() > len
+          && name.compare (name.size() - len, len, diename) == 0);
+}
+
+function_index_t *
+dwflpp::load_function_index()
+{
+  string path = dwarf_index_path("funcs");
+  if (path.empty() || sess.poison_cache)
+    return NULL;
+
+  ifstream f(path.c_str());
+  string line;
+  if (!getline(f, line) || line != DWARF_INDEX_MAGIC)
+    return NULL;
+
+  // "c OFFSET" starts a CU, then "OFFSET NAME" for each of its functions
+  function_index_t *idx = new function_index_t;
+  scanned_functions_t *funcs = NULL;
+  bool ended = false;
+  while (getline(f, line))
+    {
+      istringstream l(line);
+      Dwarf_Off off;
+      string name;
+      Dwarf_Die die;
+      if (line == DWARF_INDEX_END)
+        {
+          ended = true;
+          break;
+        }
+      else if (line.compare(0, 2, "c ") == 0)
+        {
+          l.ignore(2);
+          if (!(l >> off) || !dwarf_offdie (module_dwarf, off, &die)
+              || dwarf_tag (&die) != DW_TAG_compile_unit)
+            break;
+          funcs = &(*idx)[off];
+        }
+      else if (funcs && (l >> off) && l.get() == ' ' && getline(l, name)
+               && dwarf_offdie (module_dwarf, off, &die)
+               && dwarf_index_entry_ok (&die, name, true))
+        funcs->push_back(make_pair(name, off));
+      else
+        break;
+    }
+
+  if (!ended || getline(f, line))
+    {
+      if (sess.verbose > 2)
+        clog << _F("ignoring bad function index %s", path.c_str()) << endl;
+      delete idx;
+      return NULL;
+    }
+
+  if (sess.verbose > 2)
+    clog << _F("using cached function index %s for %s", path.c_str(),
+               module_name.c_str()) << endl;
+  return idx;
+}
+
+
+void
+dwflpp::save_function_index(function_index_t *idx)
+{
+  string path = dwarf_index_path("funcs");
+  if (path.empty())
+    return;
+
+  string tmp_path = path + ".tmp" + lex_cast(getpid());
+  ofstream f(tmp_path.c_str());
+  f << DWARF_INDEX_MAGIC << endl;
+  for (auto i = idx->begin(); i != idx->end(); ++i)
+    {
+      f << "c " << i->first << "\n";
+      for (auto j = i->second.begin(); j != i->second.end(); ++j)
+        f << j->second << " " << j->first << "\n";
+    }
+  f << DWARF_INDEX_END << endl;
+  f.close();
+
+  if (!f.good() || rename(tmp_path.c_str(), path.c_str()) != 0)
+    unlink(tmp_path.c_str());
+}
+
+
+// The functions of each CU of the current module, from the cache if
+// possible.  Otherwise with BUILD, walk all the CUs (in parallel where
+// scan_functions_parallel can) and save the result for next time.
+function_index_t *
+dwflpp::get_function_index(bool build)
+{
+  get_module_dwarf(false);
+  if (!module_dwarf)
+    return NULL;
+
+  // A NULL entry means it isn't in the cache and wasn't built yet.
+  function_index_t *idx;
+  auto it = function_index.find(module_dwarf);
+  if (it != function_index.end())
+    idx = it->second;
+  else
+    idx = function_index[module_dwarf] = load_function_index();
+  if (idx || !build)
+    return idx;
+
+  // Type units hold no function definitions; leave them out.
+  vector<Dwarf_Die*> all_cus, cus;
+  iterate_over_cus (collect_cus_callback, &all_cus, false);
+  for (auto i = all_cus.begin(); i != all_cus.end(); ++i)
+    if (dwarf_tag (*i) == DW_TAG_compile_unit)
+      cus.push_back (*i);
+
+  vector<scanned_functions_t> funcs;
+  vector<char> scanned;
+  if (!scan_functions_parallel (cus, funcs, scanned))
+    {
+      funcs.assign (cus.size(), scanned_functions_t());
+      scanned.assign (cus.size(), 0);
+    }
+
+  idx = new function_index_t;
+  for (size_t i = 0; i < cus.size(); i++)
+    {
+      if (!scanned[i])
+        {
+          assert_no_interrupts();
+          funcs[i].clear();
+          dwarf_getfuncs (cus[i], scan_function_callback, &funcs[i], 0);
+        }
+      (*idx)[dwarf_dieoffset (cus[i])].swap (funcs[i]);
+    }
+  function_index[module_dwarf] = idx;
+
+  save_function_index(idx);
+  return idx;
+}
+
+
+// The first definition of each global type name across the CUs and
+// type units of the current module, from the cache if possible.
+cu_type_cache_t *
+dwflpp::get_type_index()
+{
+  get_module_dwarf(false);
+  if (!module_dwarf)
+    return NULL;
+
+  cu_type_cache_t *v = type_index[module_dwarf];
+  if (v)
+    return v;
+  v = type_index[module_dwarf] = new cu_type_cache_t;
+
+  // "i OFFSET NAME" for a .debug_info DIE, "t OFFSET NAME" for .debug_types
+  string path = dwarf_index_path("types");
+  if (!path.empty() && !sess.poison_cache)
+    {
+      ifstream f(path.c_str());
+      string line;
+      bool ok = getline(f, line) && line == DWARF_INDEX_MAGIC;
+      bool ended = false;
+      while (ok && getline(f, line))
+        {
+          istringstream l(line);
+          char kind = 0;
+          Dwarf_Off off;
+          string name;
+          Dwarf_Die die;
+          if (line == DWARF_INDEX_END)
+            {
+              ended = true;
+              break;
+            }
+          ok = ((l >> kind >> off) && l.get() == ' ' && getline(l, name)
+                && (kind == 'i' ? dwarf_offdie (module_dwarf, off, &die)
+                    : kind == 't' ? dwarf_offdie_types (module_dwarf, off, &die)
+                    : NULL)
+                && dwarf_index_entry_ok (&die, name, false));
+          if (ok)
+            v->insert(make_pair(name, die));
+        }
+      if (ok && ended && !getline(f, line))
+        {
+          if (sess.verbose > 2)
+            clog << _F("using cached type index %s for %s", path.c_str(),
+                       module_name.c_str()) << endl;
+          return v;
+        }
+      if (sess.verbose > 2)
+        clog << _F("ignoring bad type index %s", path.c_str()) << endl;
+      v->clear();
+    }
+
+  // Build it from the per-CU caches, first CU first.
+  vector<Dwarf_Die*> cus;
+  iterate_over_cus(global_alias_caching_callback_cus, this, true);
+  iterate_over_cus(collect_cus_callback, &cus, true);
+
+  ostringstream entries;
+  for (auto i = cus.begin(); i != cus.end(); ++i)
+    {
+      cu_type_cache_t *cu_types = global_alias_cache[(*i)->addr];
+      if (!cu_types)
+        continue;
+      char kind = (dwarf_tag (*i) == DW_TAG_type_unit) ? 't' : 'i';
+      for (auto j = cu_types->begin(); j != cu_types->end(); ++j)
+        if (v->insert(*j).second)
+          entries << kind << " " << dwarf_dieoffset (&j->second)
+                  << " " << j->first << "\n";
+    }
+
+  if (!path.empty())
+    {
+      string tmp_path = path + ".tmp" + lex_cast(getpid());
+      ofstream f(tmp_path.c_str());
+      f << DWARF_INDEX_MAGIC << endl << entries.str()
+        << DWARF_INDEX_END << endl;
+      f.close();
+      if (!f.good() || rename(tmp_path.c_str(), path.c_str()) != 0)
+        unlink(tmp_path.c_str());
+    }
+
+  return v;
+}
+
+
+// Fill the per-CU function caches of the current module in parallel,
+// for the CUs iterate_over_functions will be asked about: all of them,
+// or those with a source file matching FILE_PATTERN.
+void
+dwflpp::prime_function_caches (const string& file_pattern)
+{
+  assert (module);
+
+  // With the module-wide index at hand, filling a CU's cache is cheap.
+  // Without a file pattern, all the CUs get scanned anyway, so build it.
+  if (get_function_index (file_pattern.empty()))
+    return;
+
+  vector<Dwarf_Die*> all_cus, cus;
+  iterate_over_cus (collect_cus_callback, &all_cus, false);
+
+  // Same matching as collect_srcfiles_matching(), minus the chatter.
+  string prefixed_pattern = string("*/") + file_pattern;
+  for (auto i = all_cus.begin(); i != all_cus.end(); ++i)
+    {
+      if (cu_function_cache.find((*i)->addr) != cu_function_cache.end())
+        continue;
+
+      Dwarf_Files *srcfiles;
+      size_t nfiles;
+      bool matched = file_pattern.empty();
+      if (!matched && dwarf_getsrcfiles (*i, &srcfiles, &nfiles) == 0)
+        for (size_t j = 0; j < nfiles && !matched; ++j)
+          {
+            char const * fname = dwarf_filesrc (srcfiles, j, NULL, NULL);
+            matched = (fname &&
+                       (fnmatch (file_pattern.c_str(), fname, 0) == 0 ||
+                        fnmatch (prefixed_pattern.c_str(), fname, 0) == 0));
+          }
+      if (matched)
+        cus.push_back (*i);
+    }
+
+  vector<scanned_functions_t> funcs;
+  vector<char> scanned;
+  if (!scan_functions_parallel (cus, funcs, scanned))
+    return;
+
+  for (size_t i = 0; i < cus.size(); i++)
+    {
+      if (!scanned[i])
+        continue; // iterate_over_functions will do it the slow way
+
+      cu_function_cache_t *v = new cu_function_cache_t;
+      cu_function_cache[cus[i]->addr] = v;
+      cache_scanned_functions (funcs[i], v);
+      if (sess.verbose > 4)
+        clog << _F("function cache %s:%s size %zu", module_name.c_str(),
+                   dwarf_diename(cus[i]) ?: "<unknown source>", v->size()) << endl;
+      mod_info->update_symtab(v);
+    }
+}
+
+
 template<> int
 dwflpp::iterate_over_functions<void>(int (*callback)(Dwarf_Die*, void*),
                                      void *data, const string& function)
@@ -976,9 +1447,15 @@ dwflpp::iterate_over_functions<void>(int (*callback)(Dwarf_Die*, void*),
     {
       v = new cu_function_cache_t;
       cu_function_cache[cu->addr] = v;
-      // need to cast callback to func which accepts void*
-      dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
-                      v, 0);
+
+      function_index_t *idx = get_function_index(false);
+      function_index_t::iterator fi;
+      if (idx && (fi = idx->find(dwarf_dieoffset(cu))) != idx->end())
+        cache_scanned_functions (fi->second, v);
+      else
+        // need to cast callback to func which accepts void*
+        dwarf_getfuncs (cu, (int (*)(Dwarf_Die*, void*))cu_function_caching_callback,
+                        v, 0);
       if (sess.verbose > 4)
         clog << _F("function cache %s:%s size %zu", module_name.c_str(),
                    cu_name().c_str(), v->size()) << endl;
@@ -1064,7 +1541,10 @@ dwflpp::iterate_single_function<void>(int (*callback)(Dwarf_Die*, void*),
     {
       v = new cu_function_cache_t;
       mod_function_cache[module_dwarf] = v;
-      iterate_over_cus (mod_function_caching_callback, v, false);
+
+      function_index_t *idx = get_function_index(true);
+      for (auto i = idx->begin(); i != idx->end(); ++i)
+        cache_scanned_functions (i->second, v);
       if (sess.verbose > 4)
         clog << _F("module function cache %s size %zu", module_name.c_str(),
                    v->size()) << endl;
@@ -4636,6 +5116,13 @@ dwflpp::add_module_build_id_to_hash (Dwfl_Module *m,
 
       // Store the build ID in the session
       s->build_ids.push_back(hex);
+
+      // and where it came from, so a rebuilt module invalidates the
+      // early cache link (see add_early_script_to_cache)
+      const char *mainfile = NULL;
+      dwfl_module_info (m, NULL, NULL, NULL, NULL, NULL, &mainfile, NULL);
+      if (mainfile)
+        s->build_id_files.insert(mainfile);
     }
 
   return DWARF_CB_OK;
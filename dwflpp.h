@@ -97,6 +97,13 @@ typedef std::unordered_map<void*, srcfile_lines_cache_t*> cu_lines_cache_t;
 typedef std::unordered_set<Dwarf_Addr> entry_pc_cache_t;
 typedef std::unordered_map<void*, entry_pc_cache_t*> cu_entry_pc_cache_t;
 
+// names and DIE offsets of a CU's functions, from a parallel scan
+typedef std::vector<std::pair<std::string, Dwarf_Off> > scanned_functions_t;
+
+// cu offset -> functions, for all the CUs of a module
+typedef std::map<Dwarf_Off, scanned_functions_t> function_index_t;
+typedef std::unordered_map<Dwarf*, function_index_t*> mod_function_index_t;
+
 typedef std::vector<base_func_info> base_func_info_map_t;
 typedef std::vector<func_info> func_info_map_t;
 typedef std::vector<inline_instance_info> inline_instance_map_t;
@@ -284,6 +291,8 @@ struct dwflpp
                                           (void*)data, function);
     }
 
+  void prime_function_caches (const std::string& file_pattern);
+
   template<typename T>
   int iterate_single_function (int (* callback)(Dwarf_Die*, T*),
                                T *data, const std::string& function)
@@ -496,6 +505,15 @@ private:
   mod_cu_function_cache_t cu_function_cache;
   mod_function_cache_t mod_function_cache;
 
+  // Module-wide indexes, kept in the cache by build-id
+  mod_function_index_t function_index;
+  mod_cu_type_cache_t type_index;
+  std::string dwarf_index_path(const std::string& kind);
+  function_index_t *load_function_index();
+  void save_function_index(function_index_t *idx);
+  function_index_t *get_function_index(bool build);
+  cu_type_cache_t *get_type_index();
+
   std::set<void*> cu_inl_function_cache_done; // CUs that are already cached
   cu_inl_function_cache_t cu_inl_function_cache;
   void cache_inline_instances (Dwarf_Die* die);
@@ -562,8 +580,12 @@ private:
                                       (void*)data);
     }
 
-  static int mod_function_caching_callback (Dwarf_Die* func, cu_function_cache_t *v);
   static int cu_function_caching_callback (Dwarf_Die* func, cu_function_cache_t *v);
+  bool scan_functions_parallel (const std::vector<Dwarf_Die*>& cus,
+                                std::vector<scanned_functions_t>& funcs,
+                                std::vector<char>& scanned);
+  void cache_scanned_functions (const scanned_functions_t& funcs,
+                                cu_function_cache_t *v);
 
   lines_t* get_cu_lines_sorted_by_lineno(const char *srcfile);
 
@@ -1289,7 +1289,8 @@ struct stat_decl_collector
   {
     symbol *sym = get_symbol_within_expression (e->stat);
     statistic_decl new_stat = statistic_decl();
-    int bit_shift = (e->params.size() == 0) ? 0 : e->params[0];
+    int bit_shift = (e->ctype != sc_variance || e->params.size() == 0)
+                    ? 0 : e->params[0];
     int stat_op = STAT_OP_NONE;
 
     if ((bit_shift < 0) || (bit_shift > 62))
@@ -1313,6 +1314,8 @@ struct stat_decl_collector
       stat_op = STAT_OP_AVG;
     else if (e->ctype == sc_variance)
       stat_op = STAT_OP_VARIANCE;
+    else if (e->ctype == sc_quantile)
+      stat_op = STAT_OP_QUANTILE;
 
     new_stat.bit_shift = bit_shift;
     new_stat.stat_ops |= stat_op;
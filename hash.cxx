@@ -16,6 +16,7 @@
 
 #include "config.h"
 #include "session.h"
+#include "staptree.h"
 #include "hash.h"
 #include "util.h"
 
@@ -30,6 +31,7 @@ extern "C" {
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <ftw.h>
 #include "mdfour.h"
 }
 
@@ -209,11 +211,9 @@ create_hashdir (systemtap_session& s, const string& result, string& hashdir)
 }
 
 
-void
-find_script_hash (systemtap_session& s, const string& script)
+static void
+add_script_options (systemtap_session& s, stap_hash& h)
 {
-  stap_hash h(get_base_hash(s));
-
   // Hash getuid.  This really shouldn't be necessary (since who you
   // are doesn't change the generated output), but the hash gets used
   // as the module name.  If two different users try to run the same
@@ -247,6 +247,16 @@ find_script_hash (systemtap_session& s, const string& script)
        it != s.unwindsym_modules.end();
        it++)
     h.add_path("Unwindsym Modules ", *it);
+}
+
+
+void
+find_script_hash (systemtap_session& s, const string& script)
+{
+  stap_hash h(get_base_hash(s));
+
+  // Hash the options that change the generated module.
+  add_script_options(s, h);
 
   // Add the build id of each module
   for(vector<string>::iterator it = s.build_ids.begin();
@@ -287,6 +297,96 @@ find_script_hash (systemtap_session& s, const string& script)
 }
 
 
+static vector<string> tapset_fingerprint_files;
+
+static int
+collect_tapset_fingerprint (const char* fpath, const struct stat*,
+                            int typeflag, struct FTW*)
+{
+  if (typeflag == FTW_F)
+    tapset_fingerprint_files.push_back(fpath);
+  return FTW_CONTINUE;
+}
+
+
+// Hash everything that determines the pass-2 output, but that's known
+// before pass 1 starts: the script text, the command line, and the
+// tapset library.  This is used to find the module that a previous
+// run produced for the same input, without parsing or elaborating.
+// Sets s.early_hash_path to the link file recording that module, or
+// leaves it empty if this kind of lookup isn't possible.
+void
+find_early_script_hash (systemtap_session& s)
+{
+  s.early_hash_path.clear();
+
+  // NB: we can't read stdin ahead of pass 1.
+  if (s.script_file == "-")
+    return;
+
+  stap_hash h(get_base_hash(s));
+
+  // Hash the same options as find_script_hash() ...
+  add_script_options(s, h);
+
+  // ... plus those which only matter through elaboration.
+  h.add("Guru Mode (-g): ", s.guru_mode);
+  h.add("Unoptimized (-u): ", s.unoptimized);
+  h.add("Runtime Mode: ", int(s.runtime_mode));
+  h.add("Monitor (--monitor): ", s.monitor);
+  h.add("Sysroot: ", s.sysroot);
+  for (unsigned i = 0; i < s.globalopts.size(); i++)
+    h.add("Globals (-G): ", s.globalopts[i]);
+  for (unsigned i = 0; i < s.args.size(); i++)
+    h.add("Argument: ", s.args[i]);
+
+  // Process probes without a path resolve to the target command.
+  h.add("Command (-c): ", s.cmd);
+  if (s.target_pid)
+    h.add("Target Executable (-x): ",
+          resolve_path("/proc/" + lex_cast(s.target_pid) + "/exe"));
+
+  // Hash every file in the tapset search path.
+  for (unsigned i = 0; i < s.include_path.size(); i++)
+    {
+      tapset_fingerprint_files.clear();
+      (void) nftw(s.include_path[i].c_str(), collect_tapset_fingerprint, 8,
+                  FTW_ACTIONRETVAL);
+      sort(tapset_fingerprint_files.begin(), tapset_fingerprint_files.end());
+      h.add("Tapset Directory: ", s.include_path[i]);
+      for (unsigned j = 0; j < tapset_fingerprint_files.size(); j++)
+        h.add_path("Tapset ", tapset_fingerprint_files[j]);
+    }
+  tapset_fingerprint_files.clear();
+
+  // Add the raw script text.
+  if (s.script_file != "")
+    {
+      ifstream i(s.script_file.c_str());
+      if (i.fail())
+        return;
+      ostringstream o;
+      o << i.rdbuf();
+      h.add("Script File: ", s.script_file);
+      h.add("Script Text:\n", o.str());
+    }
+  else
+    h.add("Script Text:\n", s.cmdline_script);
+  for (unsigned i = 0; i < s.additional_scripts.size(); i++)
+    h.add("Additional Script (-E):\n", s.additional_scripts[i]);
+
+  // Get the directory path to store our link file
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return;
+
+  s.early_hash_path = hashdir + "/early_" + result + ".link";
+  create_hash_log(string("early_script_hash"), h.get_parms(), result,
+                  hashdir + "/early_" + result + "_hash.log");
+}
+
+
 void
 find_stapconf_hash (systemtap_session& s)
 {
@@ -309,6 +409,92 @@ find_stapconf_hash (systemtap_session& s)
 }
 
 
+string
+find_tapset_hash (systemtap_session& s, const string& path, unsigned flags)
+{
+  stap_hash h(get_base_hash(s));
+
+  // Add the tapset itself
+  h.add_path("Tapset ", path);
+  h.add("Parse Flags: ", flags);
+
+  // Add everything the preprocessor conditionals and the lexer's
+  // keyword set may depend on.  The kernel release, arch and .config
+  // are already part of the base hash.
+  h.add("Kernel Base Release: ", s.kernel_base_release);
+  h.add("Runtime Mode: ", int(s.runtime_mode));
+  h.add("Privilege (--privilege): ", s.privilege);
+  h.add("Compatible (--compatible): ", s.compatible);
+  h.add("Guru Mode (-g): ", s.guru_mode);
+
+  // Add the library macro files, which may be expanded in the tapset.
+  // They're all parsed before any regular tapset.
+  for (unsigned i = 0; i < s.library_files.size(); i++)
+    if (endswith(s.library_files[i]->name, ".stpm"))
+      h.add_path("Library Macros ", s.library_files[i]->name);
+
+  // Get the directory path to store our cached parse tree.  NB: no
+  // hash log here, since there's one of these for every tapset file.
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  return hashdir + "/tapset_" + result + ".ast";
+}
+
+
+string
+find_symbol_object_hash (systemtap_session& s, const string& modname,
+                         const string& build_id)
+{
+  stap_hash h(get_base_hash(s));
+
+  // The build-id pins down the contents of the module, so its tables
+  // can be shared by any script that needs the same kinds of data.
+  h.add("Module Name: ", modname);
+  h.add("Build ID: ", build_id);
+  h.add("Need Symbols: ", s.need_symbols);
+  h.add("Need Unwind: ", s.need_unwind);
+  h.add("Need Lines: ", s.need_lines);
+
+  // Add any custom kbuild flags
+  for (unsigned i = 0; i < s.kbuildflags.size(); i++)
+    h.add("Kbuildflags: ", s.kbuildflags[i]);
+
+  // Get the directory path to store our cached object
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("symdata_hash"), h.get_parms(), result,
+                  hashdir + "/symdata_" + result + "_hash.log");
+  return hashdir + "/symdata_" + result + ".o";
+}
+
+string
+find_dwarf_index_hash (systemtap_session& s, const string& build_id,
+                       const string& path)
+{
+  stap_hash h(get_base_hash(s));
+
+  // The offsets in the index are only good for the file they came
+  // from, which may be the module itself or its separate debuginfo.
+  h.add("Build ID: ", build_id);
+  h.add("Debuginfo Path: ", path);
+
+  // Get the directory path to store our cached index
+  string result, hashdir;
+  h.result(result);
+  if (!create_hashdir(s, result, hashdir))
+    return "";
+
+  create_hash_log(string("dwarfidx_hash"), h.get_parms(), result,
+                  hashdir + "/dwarfidx_" + result + "_hash.log");
+  return hashdir + "/dwarfidx_" + result;
+}
+
 string
 find_tracequery_hash (systemtap_session& s, const string& header)
 {
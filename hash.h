@@ -5,7 +5,16 @@
 #define MODULE_NAME_LEN (64 - sizeof(unsigned long))
 
 void find_script_hash (systemtap_session& s, const std::string& script);
+void find_early_script_hash (systemtap_session& s);
 void find_stapconf_hash (systemtap_session& s);
+std::string find_tapset_hash (systemtap_session& s, const std::string& path,
+                              unsigned flags);
+std::string find_symbol_object_hash (systemtap_session& s,
+                                     const std::string& modname,
+                                     const std::string& build_id);
+std::string find_dwarf_index_hash (systemtap_session& s,
+                                   const std::string& build_id,
+                                   const std::string& path);
 std::string find_tracequery_hash (systemtap_session& s,
                                   const std::string& header);
 std::string find_typequery_hash (systemtap_session& s, const std::string& name);
@@ -402,6 +402,18 @@ static int collect_stpm(const char* fpath, const struct stat*,
   return FTW_CONTINUE;
 }
 
+// Whether the source text may expand command line arguments ($1, @#,
+// ...).  This errs on the side of yes, e.g. for "$1" in comments.
+static bool
+source_uses_args(const string& text)
+{
+  for (size_t i = text.find_first_of("$@"); i != string::npos && i + 1 < text.size();
+       i = text.find_first_of("$@", i + 1))
+    if (text[i+1] == '#' || isdigit(text[i+1]))
+      return true;
+  return false;
+}
+
 #ifndef HAVE_LINUX_BPF_H
 int
 translate_bpf_pass (systemtap_session &)
@@ -484,6 +496,22 @@ passes_0_4 (systemtap_session &s)
 
   PROBE1(stap, pass0__end, &s);
 
+  // See if an earlier run already built a module from this very
+  // input.  If so, passes 1-4 would only regenerate what's cached.
+  if (s.use_script_cache && s.last_pass >= 3 && !s.dump_mode)
+    {
+      find_early_script_hash (s);
+      if (get_early_script_from_cache (s))
+        {
+	  // We may still need to build uprobes, if it's not also cached.
+	  if (s.need_uprobes)
+	    rc = uprobes_pass(s);
+
+	  assert_no_interrupts();
+	  return rc;
+	}
+    }
+
   struct tms tms_before;
   times (& tms_before);
   struct timeval tv_before;
@@ -651,6 +679,13 @@ passes_0_4 (systemtap_session &s)
       set<pair<dev_t, ino_t> > seen_library_files;
       set<string> seen_library_files_names;
 
+      // Parsed tapsets are cached, unless a library macro they might
+      // expand depends on the command line arguments.
+      bool cache_tapsets = s.use_cache;
+      for (unsigned i=0; cache_tapsets && i<s.library_files.size(); i++)
+        if (source_uses_args(s.library_files[i]->file_contents))
+          cache_tapsets = false;
+
       for (unsigned i=0; i<s.include_path.size(); i++)
         {
 	  // now iterate upon it
@@ -731,7 +766,22 @@ passes_0_4 (systemtap_session &s)
 		  // a trusted environment, where client-side
 		  // $XDG_DATA_DIRS are not passed.
 
-		  stapfile* f = parse (s, *it, tapset_flags);
+		  stapfile* f = 0;
+		  if (cache_tapsets)
+		    f = get_tapset_from_cache (s, *it, tapset_flags);
+		  if (f == 0)
+		    {
+		      size_t warnings = s.seen_warnings.size();
+		      f = parse (s, *it, tapset_flags);
+
+		      // Only cache a clean parse that doesn't depend on
+		      // the command line arguments, so that a cache hit
+		      // is indistinguishable from parsing.
+		      if (f && cache_tapsets
+			  && s.seen_warnings.size() == warnings
+			  && !source_uses_args (f->file_contents))
+			add_tapset_to_cache (s, *it, tapset_flags, f);
+		    }
 		  if (f == 0)
 		    s.print_warning(_F("tapset \"%s\" has errors, and will be skipped", it->c_str()));
 		  else
@@ -1010,6 +1060,9 @@ passes_0_4 (systemtap_session &s)
       // See if we can use cached source/module.
       if (get_script_from_cache(s))
         {
+	  // Let the next run find it before pass 1.
+	  add_early_script_to_cache(s);
+
 	  // We may still need to build uprobes, if it's not also cached.
 	  if (s.need_uprobes)
 	    rc = uprobes_pass(s);
@@ -1105,9 +1158,17 @@ passes_0_4 (systemtap_session &s)
       // Update cache. Cache cleaning is kicked off at the
       // beginning of this function.
       if (s.use_script_cache)
-        add_script_to_cache(s);
+        {
+          add_script_to_cache(s);
+          if (s.use_script_cache)
+            add_early_script_to_cache(s);
+        }
       if (s.use_cache && !s.runtime_usermode_p())
-        add_stapconf_to_cache(s);
+        {
+          add_stapconf_to_cache(s);
+          if (! rc)
+            add_symbol_objects_to_cache(s);
+        }
 
       // We may need to save the module in $CWD if the cache was
       // inaccessible for some reason.
@@ -29,6 +29,7 @@
 #include <cctype>
 #include <iterator>
 #include <unordered_set>
+#include <unordered_map>
 
 extern "C" {
 #include <fnmatch.h>
@@ -1452,6 +1453,11 @@ lexer::lexer (istream& input, const string& in, systemtap_session& s, bool cc):
           atwords.insert("const");
           atwords.insert("variance");
         }
+      if (has_version("3.2"))
+        {
+          atwords.insert("quantile");
+          atwords.insert("percentile");
+        }
     }
 }
 
@@ -3821,6 +3827,10 @@ expression* parser::parse_symbol ()
 	    sop->ctype = sc_average;
 	  else if (name == "@variance")
 	    sop->ctype = sc_variance, max_params = 1;
+	  else if (name == "@quantile")
+	    sop->ctype = sc_quantile, max_params = 2;
+	  else if (name == "@percentile")
+	    sop->ctype = sc_quantile, max_params = 1;
 	  else if (name == "@count")
 	    sop->ctype = sc_count;
 	  else if (name == "@sum")
@@ -3857,6 +3867,23 @@ expression* parser::parse_symbol ()
 	          sop->params.push_back (tnum);
 	        }
 	    }
+
+	  // @quantile(S, N, D) estimates the N/D quantile of S, and
+	  // @percentile(S, P) is just @quantile(S, P, 100).
+	  if (sop->ctype == sc_quantile)
+	    {
+	      if (sop->params.size() != max_params)
+	        throw PARSE_ERROR(_NF("expected %d parameter",
+	                              "expected %d parameters",
+	                              max_params+1, max_params+1), sop->tok);
+	      if (name == "@percentile")
+	        sop->params.push_back (100);
+	      if (sop->params[1] <= 0 || sop->params[0] < 0
+	          || sop->params[0] > sop->params[1])
+	        throw PARSE_ERROR(_F("quantile %lld/%lld out of range <0..1>",
+	                             (long long) sop->params[0],
+	                             (long long) sop->params[1]), sop->tok);
+	    }
 	  return sop;
 	}
 
@@ -4259,4 +4286,1566 @@ parser::parse_target_symbol_components (target_symbol* e)
     throw PARSE_ERROR(_("-> and [ are not accepted for a pretty-printing variable"));
 }
 
+// ------------------------------------------------------------------------
+// Parsed file serialization, for the tapset parse cache.
+//
+// A tapset's parse tree depends only on its own text and on session
+// state that find_tapset_hash() folds into the cache key, so it can be
+// written out once and read back by later runs instead of lexing and
+// parsing the file again.  The format is private to a given stap
+// binary (which is also part of the key): a magic string, the token
+// table, then the stapfile contents in pre-order.  Nodes the parser
+// shares between several parents (e.g. probe point components and
+// conditions in a cartesian product) are written once and referred to
+// by index afterwards.
+
+static const char parsed_file_magic[] = "stap-parsed-file 1";
+
+enum parsed_node_tag
+  {
+    pn_block = 1, pn_try_block, pn_embeddedcode, pn_null_statement,
+    pn_expr_statement, pn_if_statement, pn_for_loop, pn_foreach_loop,
+    pn_return_statement, pn_delete_statement, pn_next_statement,
+    pn_break_statement, pn_continue_statement,
+
+    pn_literal_string, pn_literal_number, pn_embedded_expr,
+    pn_binary_expression, pn_unary_expression, pn_pre_crement,
+    pn_post_crement, pn_logical_or_expr, pn_logical_and_expr, pn_array_in,
+    pn_regex_query, pn_compound_expression, pn_comparison, pn_concatenation,
+    pn_ternary_expression, pn_assignment, pn_symbol, pn_target_register,
+    pn_target_deref, pn_target_bitfield, pn_target_symbol, pn_arrayindex,
+    pn_functioncall, pn_print_format, pn_stat_op, pn_hist_op, pn_cast_op,
+    pn_autocast_op, pn_atvar_op, pn_defined_op, pn_entry_op, pn_perf_op,
+  };
+
+enum parsed_node_kind
+  {
+    pk_expression, pk_statement, pk_component, pk_probe_point
+  };
+
+// Reference markers preceding each shared-able node: 0 is NULL, 1 is a
+// new node that follows inline, and N >= 2 is node number N-2.
+enum { pr_null = 0, pr_new = 1, pr_first_backref = 2 };
+
+
+class parsed_file_writer: public visitor
+{
+public:
+  parsed_file_writer (systemtap_session& s, const stapfile* f):
+    session (s), file (f) {}
+  bool write (ostream& o);
+
+private:
+  systemtap_session& session;
+  const stapfile* file;
+  ostringstream tree;
+  vector<const token*> tokens;
+  unordered_map<const token*, unsigned> token_ids;
+  unordered_map<const void*, unsigned> node_ids;
+
+  static void put_num (ostream& o, uint64_t v);
+  static void put_str (ostream& o, const string& str);
+
+  void put_num (uint64_t v) { put_num (tree, v); }
+  void put_int (int64_t v) { put_num (tree, ((uint64_t) v << 1) ^ (uint64_t) (v >> 63)); }
+  void put_str (const string& str) { put_str (tree, str); }
+  void put_str (interned_string str) { put_str (tree, string (str)); }
+  unsigned token_id (const token* t);
+  void put_tok (const token* t) { put_num (token_id (t)); }
+  bool put_ref (const void* n);
+
+  void put_expr (expression* e);
+  void put_exprs (const vector<expression*>& v);
+  void put_stmt (statement* s);
+  void put_vardecl (vardecl* v);
+  void put_component (probe_point::component* c);
+  void put_probe_point (probe_point* pp);
+  void put_probe (probe* p);
+  void put_functiondecl (functiondecl* fd);
+
+  void start_expr (parsed_node_tag tag, expression* e);
+  void start_stmt (parsed_node_tag tag, statement* s);
+  void put_binary (parsed_node_tag tag, binary_expression* e);
+  void put_unary (parsed_node_tag tag, unary_expression* e);
+  void put_target_symbol (target_symbol* e);
+
+  void visit_block (block *s);
+  void visit_try_block (try_block *s);
+  void visit_embeddedcode (embeddedcode *s);
+  void visit_null_statement (null_statement *s);
+  void visit_expr_statement (expr_statement *s);
+  void visit_if_statement (if_statement* s);
+  void visit_for_loop (for_loop* s);
+  void visit_foreach_loop (foreach_loop* s);
+  void visit_return_statement (return_statement* s);
+  void visit_delete_statement (delete_statement* s);
+  void visit_next_statement (next_statement* s);
+  void visit_break_statement (break_statement* s);
+  void visit_continue_statement (continue_statement* s);
+  void visit_literal_string (literal_string* e);
+  void visit_literal_number (literal_number* e);
+  void visit_embedded_expr (embedded_expr* e);
+  void visit_binary_expression (binary_expression* e);
+  void visit_unary_expression (unary_expression* e);
+  void visit_pre_crement (pre_crement* e);
+  void visit_post_crement (post_crement* e);
+  void visit_logical_or_expr (logical_or_expr* e);
+  void visit_logical_and_expr (logical_and_expr* e);
+  void visit_array_in (array_in* e);
+  void visit_regex_query (regex_query* e);
+  void visit_compound_expression (compound_expression * e);
+  void visit_comparison (comparison* e);
+  void visit_concatenation (concatenation* e);
+  void visit_ternary_expression (ternary_expression* e);
+  void visit_assignment (assignment* e);
+  void visit_symbol (symbol* e);
+  void visit_target_register (target_register* e);
+  void visit_target_deref (target_deref* e);
+  void visit_target_bitfield (target_bitfield* e);
+  void visit_target_symbol (target_symbol* e);
+  void visit_arrayindex (arrayindex* e);
+  void visit_functioncall (functioncall* e);
+  void visit_print_format (print_format* e);
+  void visit_stat_op (stat_op* e);
+  void visit_hist_op (hist_op* e);
+  void visit_cast_op (cast_op* e);
+  void visit_autocast_op (autocast_op* e);
+  void visit_atvar_op (atvar_op* e);
+  void visit_defined_op (defined_op* e);
+  void visit_entry_op (entry_op* e);
+  void visit_perf_op (perf_op* e);
+};
+
+
+void
+parsed_file_writer::put_num (ostream& o, uint64_t v)
+{
+  // LEB128, since nearly everything is a small number
+  do
+    {
+      unsigned char c = v & 0x7f;
+      v >>= 7;
+      if (v)
+        c |= 0x80;
+      o.put (c);
+    }
+  while (v);
+}
+
+void
+parsed_file_writer::put_str (ostream& o, const string& str)
+{
+  put_num (o, str.size ());
+  o.write (str.data (), str.size ());
+}
+
+unsigned
+parsed_file_writer::token_id (const token* t)
+{
+  // 0 is NULL, N > 0 is tokens[N-1]
+  if (t == 0)
+    return 0;
+
+  unordered_map<const token*, unsigned>::iterator it = token_ids.find (t);
+  if (it != token_ids.end ())
+    return it->second + 1;
+
+  unsigned id = tokens.size ();
+  tokens.push_back (t);
+  token_ids[t] = id;
+  return id + 1;
+}
+
+bool
+parsed_file_writer::put_ref (const void* n)
+{
+  if (n == 0)
+    {
+      put_num (pr_null);
+      return true;
+    }
+
+  unordered_map<const void*, unsigned>::iterator it = node_ids.find (n);
+  if (it != node_ids.end ())
+    {
+      put_num (it->second + pr_first_backref);
+      return true;
+    }
+
+  unsigned id = node_ids.size ();
+  node_ids[n] = id;
+  put_num (pr_new);
+  return false;
+}
+
+void
+parsed_file_writer::put_expr (expression* e)
+{
+  if (!put_ref (e))
+    e->visit (this);
+}
+
+void
+parsed_file_writer::put_exprs (const vector<expression*>& v)
+{
+  put_num (v.size ());
+  for (unsigned i = 0; i < v.size (); ++i)
+    put_expr (v[i]);
+}
+
+void
+parsed_file_writer::put_stmt (statement* s)
+{
+  if (!put_ref (s))
+    s->visit (this);
+}
+
+void
+parsed_file_writer::put_vardecl (vardecl* v)
+{
+  put_tok (v->tok);
+  put_tok (v->systemtap_v_conditional);
+  put_str (v->name);
+  put_str (v->unmangled_name);
+  put_num (v->type);
+  put_tok (v->arity_tok);
+  put_int (v->arity);
+  put_int (v->maxsize);
+  put_num (v->index_types.size ());
+  for (unsigned i = 0; i < v->index_types.size (); ++i)
+    put_num (v->index_types[i]);
+  put_expr (v->init);
+  put_num (v->synthetic);
+  put_num (v->wrap);
+}
+
+void
+parsed_file_writer::put_component (probe_point::component* c)
+{
+  if (put_ref (c))
+    return;
+  put_str (c->functor);
+  put_expr (c->arg);
+  put_num (c->from_glob);
+  put_tok (c->tok);
+}
+
+void
+parsed_file_writer::put_probe_point (probe_point* pp)
+{
+  if (put_ref (pp))
+    return;
+  put_num (pp->components.size ());
+  for (unsigned i = 0; i < pp->components.size (); ++i)
+    put_component (pp->components[i]);
+  put_num (pp->optional);
+  put_num (pp->sufficient);
+  put_num (pp->well_formed);
+  put_expr (pp->condition);
+  put_str (pp->auto_path);
+}
+
+void
+parsed_file_writer::put_probe (probe* p)
+{
+  put_num (p->locations.size ());
+  for (unsigned i = 0; i < p->locations.size (); ++i)
+    put_probe_point (p->locations[i]);
+  put_stmt (p->body);
+  put_tok (p->tok);
+  put_tok (p->systemtap_v_conditional);
+  put_num (p->privileged);
+  put_num (p->synthetic);
+}
+
+void
+parsed_file_writer::put_functiondecl (functiondecl* fd)
+{
+  put_tok (fd->tok);
+  put_tok (fd->systemtap_v_conditional);
+  put_str (fd->name);
+  put_str (fd->unmangled_name);
+  put_num (fd->type);
+  put_num (fd->formal_args.size ());
+  for (unsigned i = 0; i < fd->formal_args.size (); ++i)
+    put_vardecl (fd->formal_args[i]);
+  put_stmt (fd->body);
+  put_num (fd->synthetic);
+  put_num (fd->mangle_oldstyle);
+  put_num (fd->has_next);
+  put_int (fd->priority);
+}
+
+void
+parsed_file_writer::start_expr (parsed_node_tag tag, expression* e)
+{
+  put_num (tag);
+  put_tok (e->tok);
+  put_num (e->type);
+}
+
+void
+parsed_file_writer::start_stmt (parsed_node_tag tag, statement* s)
+{
+  put_num (tag);
+  put_tok (s->tok);
+}
+
+void
+parsed_file_writer::put_binary (parsed_node_tag tag, binary_expression* e)
+{
+  start_expr (tag, e);
+  put_expr (e->left);
+  put_str (e->op);
+  put_expr (e->right);
+}
+
+void
+parsed_file_writer::put_unary (parsed_node_tag tag, unary_expression* e)
+{
+  start_expr (tag, e);
+  put_str (e->op);
+  put_expr (e->operand);
+}
+
+void
+parsed_file_writer::put_target_symbol (target_symbol* e)
+{
+  put_str (e->name);
+  put_num (e->addressof);
+  put_num (e->synthetic);
+  put_num (e->components.size ());
+  for (unsigned i = 0; i < e->components.size (); ++i)
+    {
+      const target_symbol::component& c = e->components[i];
+      put_tok (c.tok);
+      put_num (c.type);
+      put_str (c.member);
+      put_int (c.num_index);
+      put_expr (c.expr_index);
+    }
+}
+
+void
+parsed_file_writer::visit_block (block *s)
+{
+  start_stmt (pn_block, s);
+  put_num (s->statements.size ());
+  for (unsigned i = 0; i < s->statements.size (); ++i)
+    put_stmt (s->statements[i]);
+}
+
+void
+parsed_file_writer::visit_try_block (try_block *s)
+{
+  start_stmt (pn_try_block, s);
+  put_stmt (s->try_block);
+  put_stmt (s->catch_block);
+  put_expr (s->catch_error_var);
+}
+
+void
+parsed_file_writer::visit_embeddedcode (embeddedcode *s)
+{
+  start_stmt (pn_embeddedcode, s);
+  put_str (s->code);
+}
+
+void
+parsed_file_writer::visit_null_statement (null_statement *s)
+{
+  start_stmt (pn_null_statement, s);
+}
+
+void
+parsed_file_writer::visit_expr_statement (expr_statement *s)
+{
+  start_stmt (pn_expr_statement, s);
+  put_expr (s->value);
+}
+
+void
+parsed_file_writer::visit_if_statement (if_statement* s)
+{
+  start_stmt (pn_if_statement, s);
+  put_expr (s->condition);
+  put_stmt (s->thenblock);
+  put_stmt (s->elseblock);
+}
+
+void
+parsed_file_writer::visit_for_loop (for_loop* s)
+{
+  start_stmt (pn_for_loop, s);
+  put_stmt (s->init);
+  put_expr (s->cond);
+  put_stmt (s->incr);
+  put_stmt (s->block);
+}
+
+void
+parsed_file_writer::visit_foreach_loop (foreach_loop* s)
+{
+  start_stmt (pn_foreach_loop, s);
+  put_num (s->indexes.size ());
+  for (unsigned i = 0; i < s->indexes.size (); ++i)
+    put_expr (s->indexes[i]);
+  put_exprs (s->array_slice);
+  put_expr (s->base);
+  put_int (s->sort_direction);
+  put_num (s->sort_column);
+  put_num (s->sort_aggr);
+  put_expr (s->value);
+  put_expr (s->limit);
+  put_stmt (s->block);
+}
+
+void
+parsed_file_writer::visit_return_statement (return_statement* s)
+{
+  start_stmt (pn_return_statement, s);
+  put_expr (s->value);
+}
+
+void
+parsed_file_writer::visit_delete_statement (delete_statement* s)
+{
+  start_stmt (pn_delete_statement, s);
+  put_expr (s->value);
+}
+
+void
+parsed_file_writer::visit_next_statement (next_statement* s)
+{
+  start_stmt (pn_next_statement, s);
+}
+
+void
+parsed_file_writer::visit_break_statement (break_statement* s)
+{
+  start_stmt (pn_break_statement, s);
+}
+
+void
+parsed_file_writer::visit_continue_statement (continue_statement* s)
+{
+  start_stmt (pn_continue_statement, s);
+}
+
+void
+parsed_file_writer::visit_literal_string (literal_string* e)
+{
+  start_expr (pn_literal_string, e);
+  put_str (e->value);
+}
+
+void
+parsed_file_writer::visit_literal_number (literal_number* e)
+{
+  start_expr (pn_literal_number, e);
+  put_int (e->value);
+  put_num (e->print_hex);
+}
+
+void
+parsed_file_writer::visit_embedded_expr (embedded_expr* e)
+{
+  start_expr (pn_embedded_expr, e);
+  put_str (e->code);
+}
+
+void
+parsed_file_writer::visit_binary_expression (binary_expression* e)
+{
+  put_binary (pn_binary_expression, e);
+}
+
+void
+parsed_file_writer::visit_unary_expression (unary_expression* e)
+{
+  put_unary (pn_unary_expression, e);
+}
+
+void
+parsed_file_writer::visit_pre_crement (pre_crement* e)
+{
+  put_unary (pn_pre_crement, e);
+}
+
+void
+parsed_file_writer::visit_post_crement (post_crement* e)
+{
+  put_unary (pn_post_crement, e);
+}
+
+void
+parsed_file_writer::visit_logical_or_expr (logical_or_expr* e)
+{
+  put_binary (pn_logical_or_expr, e);
+}
+
+void
+parsed_file_writer::visit_logical_and_expr (logical_and_expr* e)
+{
+  put_binary (pn_logical_and_expr, e);
+}
+
+void
+parsed_file_writer::visit_array_in (array_in* e)
+{
+  start_expr (pn_array_in, e);
+  put_expr (e->operand);
+}
+
+void
+parsed_file_writer::visit_regex_query (regex_query* e)
+{
+  start_expr (pn_regex_query, e);
+  put_expr (e->left);
+  put_str (e->op);
+  put_expr (e->right);
+}
+
+void
+parsed_file_writer::visit_compound_expression (compound_expression * e)
+{
+  put_binary (pn_compound_expression, e);
+}
+
+void
+parsed_file_writer::visit_comparison (comparison* e)
+{
+  put_binary (pn_comparison, e);
+}
+
+void
+parsed_file_writer::visit_concatenation (concatenation* e)
+{
+  put_binary (pn_concatenation, e);
+}
+
+void
+parsed_file_writer::visit_ternary_expression (ternary_expression* e)
+{
+  start_expr (pn_ternary_expression, e);
+  put_expr (e->cond);
+  put_expr (e->truevalue);
+  put_expr (e->falsevalue);
+}
+
+void
+parsed_file_writer::visit_assignment (assignment* e)
+{
+  put_binary (pn_assignment, e);
+}
+
+void
+parsed_file_writer::visit_symbol (symbol* e)
+{
+  start_expr (pn_symbol, e);
+  put_str (e->name);
+}
+
+void
+parsed_file_writer::visit_target_register (target_register* e)
+{
+  start_expr (pn_target_register, e);
+  put_num (e->regno);
+  put_num (e->userspace_p);
+}
+
+void
+parsed_file_writer::visit_target_deref (target_deref* e)
+{
+  start_expr (pn_target_deref, e);
+  put_expr (e->addr);
+  put_num (e->size);
+  put_num (e->signed_p);
+  put_num (e->userspace_p);
+}
+
+void
+parsed_file_writer::visit_target_bitfield (target_bitfield* e)
+{
+  start_expr (pn_target_bitfield, e);
+  put_expr (e->base);
+  put_num (e->offset);
+  put_num (e->size);
+  put_num (e->signed_p);
+}
+
+void
+parsed_file_writer::visit_target_symbol (target_symbol* e)
+{
+  start_expr (pn_target_symbol, e);
+  put_target_symbol (e);
+}
+
+void
+parsed_file_writer::visit_arrayindex (arrayindex* e)
+{
+  start_expr (pn_arrayindex, e);
+  put_exprs (e->indexes);
+  put_expr (e->base);
+}
+
+void
+parsed_file_writer::visit_functioncall (functioncall* e)
+{
+  start_expr (pn_functioncall, e);
+  put_str (e->function);
+  put_exprs (e->args);
+}
+
+void
+parsed_file_writer::visit_print_format (print_format* e)
+{
+  start_expr (pn_print_format, e);
+  put_num (e->print_to_stream);
+  put_num (e->print_with_format);
+  put_num (e->print_with_delim);
+  put_num (e->print_with_newline);
+  put_num (e->print_char);
+  put_str (e->raw_components);
+  put_num (e->components.size ());
+  for (unsigned i = 0; i < e->components.size (); ++i)
+    {
+      const print_format::format_component& c = e->components[i];
+      put_num (c.base);
+      put_num (c.width);
+      put_num (c.precision);
+      put_num (c.flags);
+      put_num (c.widthtype);
+      put_num (c.prectype);
+      put_num (c.type);
+      put_str (c.literal_string);
+    }
+  put_str (e->delimiter);
+  put_exprs (e->args);
+  put_expr (e->hist);
+}
+
+void
+parsed_file_writer::visit_stat_op (stat_op* e)
+{
+  start_expr (pn_stat_op, e);
+  put_num (e->ctype);
+  put_expr (e->stat);
+  put_num (e->params.size ());
+  for (unsigned i = 0; i < e->params.size (); ++i)
+    put_int (e->params[i]);
+}
+
+void
+parsed_file_writer::visit_hist_op (hist_op* e)
+{
+  start_expr (pn_hist_op, e);
+  put_num (e->htype);
+  put_expr (e->stat);
+  put_num (e->params.size ());
+  for (unsigned i = 0; i < e->params.size (); ++i)
+    put_int (e->params[i]);
+}
+
+void
+parsed_file_writer::visit_cast_op (cast_op* e)
+{
+  start_expr (pn_cast_op, e);
+  put_target_symbol (e);
+  put_expr (e->operand);
+  put_str (e->type_name);
+  put_str (e->module);
+}
+
+void
+parsed_file_writer::visit_autocast_op (autocast_op* e)
+{
+  start_expr (pn_autocast_op, e);
+  put_target_symbol (e);
+  put_expr (e->operand);
+}
+
+void
+parsed_file_writer::visit_atvar_op (atvar_op* e)
+{
+  start_expr (pn_atvar_op, e);
+  put_target_symbol (e);
+  put_str (e->target_name);
+  put_str (e->cu_name);
+  put_str (e->module);
+}
+
+void
+parsed_file_writer::visit_defined_op (defined_op* e)
+{
+  start_expr (pn_defined_op, e);
+  put_expr (e->operand);
+}
+
+void
+parsed_file_writer::visit_entry_op (entry_op* e)
+{
+  start_expr (pn_entry_op, e);
+  put_expr (e->operand);
+}
+
+void
+parsed_file_writer::visit_perf_op (perf_op* e)
+{
+  start_expr (pn_perf_op, e);
+  put_expr (e->operand);
+}
+
+bool
+parsed_file_writer::write (ostream& o)
+{
+  put_num (file->globals.size ());
+  for (unsigned i = 0; i < file->globals.size (); ++i)
+    put_vardecl (file->globals[i]);
+
+  put_num (file->functions.size ());
+  for (unsigned i = 0; i < file->functions.size (); ++i)
+    put_functiondecl (file->functions[i]);
+
+  put_num (file->probes.size ());
+  for (unsigned i = 0; i < file->probes.size (); ++i)
+    put_probe (file->probes[i]);
+
+  put_num (file->aliases.size ());
+  for (unsigned i = 0; i < file->aliases.size (); ++i)
+    {
+      probe_alias* a = file->aliases[i];
+      put_num (a->alias_names.size ());
+      for (unsigned j = 0; j < a->alias_names.size (); ++j)
+        put_probe_point (a->alias_names[j]);
+      put_num (a->epilogue_style);
+      put_probe (a);
+    }
+
+  put_num (file->embeds.size ());
+  for (unsigned i = 0; i < file->embeds.size (); ++i)
+    put_stmt (file->embeds[i]);
+
+  // The token table goes first in the output, so the reader can
+  // resolve token references as it builds the tree.  Chained tokens
+  // (macro invocation sites) may extend the table as we go.
+  ostringstream toks;
+  for (unsigned i = 0; i < tokens.size (); ++i)
+    {
+      const token* t = tokens[i];
+
+      // Tokens either come from this file, or from a library macro
+      // file expanded into it, which the reader looks up by name.
+      if (t->location.file == 0)
+        put_num (toks, 0);
+      else if (t->location.file == file)
+        put_num (toks, 1);
+      else
+        {
+          if (find (session.library_files.begin (), session.library_files.end (),
+                    t->location.file) == session.library_files.end ())
+            return false;
+          put_num (toks, 2);
+          put_str (toks, t->location.file->name);
+        }
+      put_num (toks, t->location.line);
+      put_num (toks, t->location.column);
+      put_str (toks, t->content);
+      put_num (toks, t->type);
+      put_num (toks, t->junk_type);
+      put_num (toks, token_id (t->chain));
+    }
+
+  o << parsed_file_magic << '\n';
+  put_num (o, tokens.size ());
+  o << toks.str () << tree.str ();
+  return o.good ();
+}
+
+class parsed_file_reader
+{
+public:
+  parsed_file_reader (systemtap_session& s, istream& i):
+    session (s), input (i), file (0) {}
+  stapfile* read (const string& name);
+
+private:
+  systemtap_session& session;
+  istream& input;
+  stapfile* file;
+  vector<token*> tokens;
+  vector<pair<void*, parsed_node_kind> > nodes;
+
+  uint64_t get_num ();
+  int64_t get_int () { uint64_t v = get_num (); return (int64_t) (v >> 1) ^ -(int64_t) (v & 1); }
+  bool get_bool () { return get_num () != 0; }
+  string get_str ();
+  const token* get_tok ();
+  bool get_ref (parsed_node_kind kind, void*& n);
+  template <class T> T* add_node (T* n, parsed_node_kind kind);
+
+  expression* get_expr ();
+  template <class T> T* get_expr_as ();
+  void get_exprs (vector<expression*>& v);
+  statement* get_stmt ();
+  template <class T> T* get_stmt_as ();
+  vardecl* get_vardecl ();
+  probe_point::component* get_component ();
+  probe_point* get_probe_point ();
+  void get_probe (probe* p);
+  functiondecl* get_functiondecl ();
+
+  template <class T> T* get_binary (const token* tok);
+  template <class T> T* get_unary (const token* tok);
+  template <class T> T* get_target_symbol (const token* tok);
+};
+
+
+static runtime_error
+parsed_file_error (const string& what)
+{
+  return runtime_error (_F("corrupt parsed file: %s", what.c_str()));
+}
+
+uint64_t
+parsed_file_reader::get_num ()
+{
+  uint64_t v = 0;
+  for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+      int c = input.get ();
+      if (c == EOF)
+        throw parsed_file_error (_("unexpected end of file"));
+      v |= (uint64_t) (c & 0x7f) << shift;
+      if (!(c & 0x80))
+        return v;
+    }
+  throw parsed_file_error (_("number too large"));
+}
+
+string
+parsed_file_reader::get_str ()
+{
+  uint64_t size = get_num ();
+  if (size > (1 << 28))
+    throw parsed_file_error (_("string too large"));
+  string str (size, '\0');
+  if (size && !input.read (&str[0], size))
+    throw parsed_file_error (_("unexpected end of file"));
+  return str;
+}
+
+const token*
+parsed_file_reader::get_tok ()
+{
+  uint64_t id = get_num ();
+  if (id > tokens.size ())
+    throw parsed_file_error (_("bad token reference"));
+  return id ? tokens[id - 1] : 0;
+}
+
+bool
+parsed_file_reader::get_ref (parsed_node_kind kind, void*& n)
+{
+  uint64_t ref = get_num ();
+  if (ref == pr_new)
+    return false;
+
+  n = 0;
+  if (ref != pr_null)
+    {
+      ref -= pr_first_backref;
+      if (ref >= nodes.size () || nodes[ref].second != kind)
+        throw parsed_file_error (_("bad node reference"));
+      n = nodes[ref].first;
+    }
+  return true;
+}
+
+template <class T> T*
+parsed_file_reader::add_node (T* n, parsed_node_kind kind)
+{
+  // NB: register before reading any children, to match the
+  // writer's numbering.
+  nodes.push_back (make_pair ((void*) n, kind));
+  return n;
+}
+
+template <class T> T*
+parsed_file_reader::get_expr_as ()
+{
+  expression* e = get_expr ();
+  T* t = dynamic_cast<T*> (e);
+  if (e && !t)
+    throw parsed_file_error (_("unexpected expression type"));
+  return t;
+}
+
+template <class T> T*
+parsed_file_reader::get_stmt_as ()
+{
+  statement* s = get_stmt ();
+  T* t = dynamic_cast<T*> (s);
+  if (s && !t)
+    throw parsed_file_error (_("unexpected statement type"));
+  return t;
+}
+
+void
+parsed_file_reader::get_exprs (vector<expression*>& v)
+{
+  uint64_t n = get_num ();
+  for (uint64_t i = 0; i < n; ++i)
+    v.push_back (get_expr ());
+}
+
+template <class T> T*
+parsed_file_reader::get_binary (const token* tok)
+{
+  T* e = add_node (new T, pk_expression);
+  e->tok = tok;
+  e->left = get_expr ();
+  e->op = get_str ();
+  e->right = get_expr ();
+  return e;
+}
+
+template <class T> T*
+parsed_file_reader::get_unary (const token* tok)
+{
+  T* e = add_node (new T, pk_expression);
+  e->tok = tok;
+  e->op = get_str ();
+  e->operand = get_expr ();
+  return e;
+}
+
+template <class T> T*
+parsed_file_reader::get_target_symbol (const token* tok)
+{
+  T* e = add_node (new T, pk_expression);
+  e->tok = tok;
+  e->name = get_str ();
+  e->addressof = get_bool ();
+  e->synthetic = get_bool ();
+  uint64_t n = get_num ();
+  for (uint64_t i = 0; i < n; ++i)
+    {
+      const token* ctok = get_tok ();
+      target_symbol::component c (ctok, (int64_t) 0);
+      c.type = (target_symbol::component_type) get_num ();
+      c.member = get_str ();
+      c.num_index = get_int ();
+      c.expr_index = get_expr ();
+      e->components.push_back (c);
+    }
+  return e;
+}
+
+expression*
+parsed_file_reader::get_expr ()
+{
+  void* n;
+  if (get_ref (pk_expression, n))
+    return static_cast<expression*> (n);
+
+  unsigned tag = get_num ();
+  const token* tok = get_tok ();
+  exp_type type = (exp_type) get_num ();
+
+  expression* e;
+  switch (tag)
+    {
+    case pn_literal_string:
+      {
+        literal_string* ls = add_node (new literal_string (""), pk_expression);
+        ls->value = get_str ();
+        e = ls;
+        break;
+      }
+    case pn_literal_number:
+      {
+        literal_number* ln = add_node (new literal_number (0), pk_expression);
+        ln->value = get_int ();
+        ln->print_hex = get_bool ();
+        e = ln;
+        break;
+      }
+    case pn_embedded_expr:
+      {
+        embedded_expr* ee = add_node (new embedded_expr, pk_expression);
+        ee->code = get_str ();
+        e = ee;
+        break;
+      }
+    case pn_binary_expression:
+      e = get_binary<binary_expression> (tok);
+      break;
+    case pn_logical_or_expr:
+      e = get_binary<logical_or_expr> (tok);
+      break;
+    case pn_logical_and_expr:
+      e = get_binary<logical_and_expr> (tok);
+      break;
+    case pn_compound_expression:
+      e = get_binary<compound_expression> (tok);
+      break;
+    case pn_comparison:
+      e = get_binary<comparison> (tok);
+      break;
+    case pn_concatenation:
+      e = get_binary<concatenation> (tok);
+      break;
+    case pn_assignment:
+      e = get_binary<assignment> (tok);
+      break;
+    case pn_unary_expression:
+      e = get_unary<unary_expression> (tok);
+      break;
+    case pn_pre_crement:
+      e = get_unary<pre_crement> (tok);
+      break;
+    case pn_post_crement:
+      e = get_unary<post_crement> (tok);
+      break;
+    case pn_array_in:
+      {
+        array_in* ai = add_node (new array_in, pk_expression);
+        ai->tok = tok;
+        ai->operand = get_expr_as<arrayindex> ();
+        e = ai;
+        break;
+      }
+    case pn_regex_query:
+      {
+        regex_query* rq = add_node (new regex_query, pk_expression);
+        rq->tok = tok;
+        rq->left = get_expr ();
+        rq->op = get_str ();
+        rq->right = get_expr_as<literal_string> ();
+        e = rq;
+        break;
+      }
+    case pn_ternary_expression:
+      {
+        ternary_expression* te = add_node (new ternary_expression, pk_expression);
+        te->tok = tok;
+        te->cond = get_expr ();
+        te->truevalue = get_expr ();
+        te->falsevalue = get_expr ();
+        e = te;
+        break;
+      }
+    case pn_symbol:
+      {
+        symbol* sym = add_node (new symbol, pk_expression);
+        sym->name = get_str ();
+        e = sym;
+        break;
+      }
+    case pn_target_register:
+      {
+        target_register* tr = add_node (new target_register, pk_expression);
+        tr->regno = get_num ();
+        tr->userspace_p = get_bool ();
+        e = tr;
+        break;
+      }
+    case pn_target_deref:
+      {
+        target_deref* td = add_node (new target_deref, pk_expression);
+        td->tok = tok;
+        td->addr = get_expr ();
+        td->size = get_num ();
+        td->signed_p = get_bool ();
+        td->userspace_p = get_bool ();
+        e = td;
+        break;
+      }
+    case pn_target_bitfield:
+      {
+        target_bitfield* tb = add_node (new target_bitfield, pk_expression);
+        tb->tok = tok;
+        tb->base = get_expr ();
+        tb->offset = get_num ();
+        tb->size = get_num ();
+        tb->signed_p = get_bool ();
+        e = tb;
+        break;
+      }
+    case pn_target_symbol:
+      e = get_target_symbol<target_symbol> (tok);
+      break;
+    case pn_cast_op:
+      {
+        cast_op* co = get_target_symbol<cast_op> (tok);
+        co->operand = get_expr ();
+        co->type_name = get_str ();
+        co->module = get_str ();
+        e = co;
+        break;
+      }
+    case pn_autocast_op:
+      {
+        autocast_op* ao = get_target_symbol<autocast_op> (tok);
+        ao->operand = get_expr ();
+        e = ao;
+        break;
+      }
+    case pn_atvar_op:
+      {
+        atvar_op* ao = get_target_symbol<atvar_op> (tok);
+        ao->target_name = get_str ();
+        ao->cu_name = get_str ();
+        ao->module = get_str ();
+        e = ao;
+        break;
+      }
+    case pn_arrayindex:
+      {
+        arrayindex* ai = add_node (new arrayindex, pk_expression);
+        ai->tok = tok;
+        get_exprs (ai->indexes);
+        ai->base = get_expr_as<indexable> ();
+        e = ai;
+        break;
+      }
+    case pn_functioncall:
+      {
+        functioncall* fc = add_node (new functioncall, pk_expression);
+        fc->function = get_str ();
+        fc->tok = tok;
+        get_exprs (fc->args);
+        e = fc;
+        break;
+      }
+    case pn_print_format:
+      {
+        print_format* pf = tok ? print_format::create (tok) : 0;
+        if (!pf)
+          throw parsed_file_error (_("bad print format token"));
+        add_node (pf, pk_expression);
+        pf->print_to_stream = get_bool ();
+        pf->print_with_format = get_bool ();
+        pf->print_with_delim = get_bool ();
+        pf->print_with_newline = get_bool ();
+        pf->print_char = get_bool ();
+        pf->raw_components = get_str ();
+        uint64_t n = get_num ();
+        for (uint64_t i = 0; i < n; ++i)
+          {
+            print_format::format_component c;
+            c.base = get_num ();
+            c.width = get_num ();
+            c.precision = get_num ();
+            c.flags = get_num ();
+            c.widthtype = (print_format::width_type) get_num ();
+            c.prectype = (print_format::precision_type) get_num ();
+            c.type = (print_format::conversion_type) get_num ();
+            c.literal_string = get_str ();
+            pf->components.push_back (c);
+          }
+        pf->delimiter = get_str ();
+        get_exprs (pf->args);
+        pf->hist = get_expr_as<hist_op> ();
+        e = pf;
+        break;
+      }
+    case pn_stat_op:
+      {
+        stat_op* so = add_node (new stat_op, pk_expression);
+        so->tok = tok;
+        so->ctype = (stat_component_type) get_num ();
+        so->stat = get_expr ();
+        uint64_t n = get_num ();
+        for (uint64_t i = 0; i < n; ++i)
+          so->params.push_back (get_int ());
+        e = so;
+        break;
+      }
+    case pn_hist_op:
+      {
+        hist_op* ho = add_node (new hist_op, pk_expression);
+        ho->tok = tok;
+        ho->htype = (histogram_type) get_num ();
+        ho->stat = get_expr ();
+        uint64_t n = get_num ();
+        for (uint64_t i = 0; i < n; ++i)
+          ho->params.push_back (get_int ());
+        e = ho;
+        break;
+      }
+    case pn_defined_op:
+      {
+        defined_op* dop = add_node (new defined_op, pk_expression);
+        dop->tok = tok;
+        dop->operand = get_expr ();
+        e = dop;
+        break;
+      }
+    case pn_entry_op:
+      {
+        entry_op* eop = add_node (new entry_op, pk_expression);
+        eop->tok = tok;
+        eop->operand = get_expr ();
+        e = eop;
+        break;
+      }
+    case pn_perf_op:
+      {
+        perf_op* pop = add_node (new perf_op, pk_expression);
+        pop->tok = tok;
+        pop->operand = get_expr_as<literal_string> ();
+        e = pop;
+        break;
+      }
+    default:
+      throw parsed_file_error (_F("unknown expression tag %u", tag));
+    }
+
+  e->tok = tok;
+  e->type = type;
+  return e;
+}
+
+statement*
+parsed_file_reader::get_stmt ()
+{
+  void* n;
+  if (get_ref (pk_statement, n))
+    return static_cast<statement*> (n);
+
+  unsigned tag = get_num ();
+  const token* tok = get_tok ();
+
+  statement* s;
+  switch (tag)
+    {
+    case pn_block:
+      {
+        block* b = add_node (new block, pk_statement);
+        uint64_t n = get_num ();
+        for (uint64_t i = 0; i < n; ++i)
+          b->statements.push_back (get_stmt ());
+        s = b;
+        break;
+      }
+    case pn_try_block:
+      {
+        try_block* tb = add_node (new try_block, pk_statement);
+        tb->try_block = get_stmt ();
+        tb->catch_block = get_stmt ();
+        tb->catch_error_var = get_expr_as<symbol> ();
+        s = tb;
+        break;
+      }
+    case pn_embeddedcode:
+      {
+        embeddedcode* ec = add_node (new embeddedcode, pk_statement);
+        ec->code = get_str ();
+        s = ec;
+        break;
+      }
+    case pn_null_statement:
+      s = add_node (new null_statement (tok), pk_statement);
+      break;
+    case pn_expr_statement:
+      {
+        expr_statement* es = add_node (new expr_statement, pk_statement);
+        es->value = get_expr ();
+        s = es;
+        break;
+      }
+    case pn_if_statement:
+      {
+        if_statement* is = add_node (new if_statement, pk_statement);
+        is->condition = get_expr ();
+        is->thenblock = get_stmt ();
+        is->elseblock = get_stmt ();
+        s = is;
+        break;
+      }
+    case pn_for_loop:
+      {
+        for_loop* fl = add_node (new for_loop, pk_statement);
+        fl->init = get_stmt_as<expr_statement> ();
+        fl->cond = get_expr ();
+        fl->incr = get_stmt_as<expr_statement> ();
+        fl->block = get_stmt ();
+        s = fl;
+        break;
+      }
+    case pn_foreach_loop:
+      {
+        foreach_loop* fl = add_node (new foreach_loop, pk_statement);
+        uint64_t n = get_num ();
+        for (uint64_t i = 0; i < n; ++i)
+          fl->indexes.push_back (get_expr_as<symbol> ());
+        get_exprs (fl->array_slice);
+        fl->base = get_expr_as<indexable> ();
+        fl->sort_direction = get_int ();
+        fl->sort_column = get_num ();
+        fl->sort_aggr = (stat_component_type) get_num ();
+        fl->value = get_expr_as<symbol> ();
+        fl->limit = get_expr ();
+        fl->block = get_stmt ();
+        s = fl;
+        break;
+      }
+    case pn_return_statement:
+      {
+        return_statement* rs = add_node (new return_statement, pk_statement);
+        rs->value = get_expr ();
+        s = rs;
+        break;
+      }
+    case pn_delete_statement:
+      {
+        delete_statement* ds = add_node (new delete_statement, pk_statement);
+        ds->value = get_expr ();
+        s = ds;
+        break;
+      }
+    case pn_next_statement:
+      s = add_node (new next_statement, pk_statement);
+      break;
+    case pn_break_statement:
+      s = add_node (new break_statement, pk_statement);
+      break;
+    case pn_continue_statement:
+      s = add_node (new continue_statement, pk_statement);
+      break;
+    default:
+      throw parsed_file_error (_F("unknown statement tag %u", tag));
+    }
+
+  s->tok = tok;
+  return s;
+}
+
+vardecl*
+parsed_file_reader::get_vardecl ()
+{
+  vardecl* v = new vardecl;
+  v->tok = get_tok ();
+  v->systemtap_v_conditional = get_tok ();
+  v->name = get_str ();
+  v->unmangled_name = get_str ();
+  v->type = (exp_type) get_num ();
+  v->arity_tok = get_tok ();
+  v->arity = get_int ();
+  v->maxsize = get_int ();
+  uint64_t n = get_num ();
+  for (uint64_t i = 0; i < n; ++i)
+    v->index_types.push_back ((exp_type) get_num ());
+  v->init = get_expr_as<literal> ();
+  v->synthetic = get_bool ();
+  v->wrap = get_bool ();
+  return v;
+}
+
+probe_point::component*
+parsed_file_reader::get_component ()
+{
+  void* n;
+  if (get_ref (pk_component, n))
+    return static_cast<probe_point::component*> (n);
+
+  probe_point::component* c = add_node (new probe_point::component, pk_component);
+  c->functor = get_str ();
+  c->arg = get_expr_as<literal> ();
+  c->from_glob = get_bool ();
+  c->tok = get_tok ();
+  return c;
+}
+
+probe_point*
+parsed_file_reader::get_probe_point ()
+{
+  void* n;
+  if (get_ref (pk_probe_point, n))
+    return static_cast<probe_point*> (n);
+
+  probe_point* pp = add_node (new probe_point, pk_probe_point);
+  uint64_t num = get_num ();
+  for (uint64_t i = 0; i < num; ++i)
+    pp->components.push_back (get_component ());
+  pp->optional = get_bool ();
+  pp->sufficient = get_bool ();
+  pp->well_formed = get_bool ();
+  pp->condition = get_expr ();
+  pp->auto_path = get_str ();
+  return pp;
+}
+
+void
+parsed_file_reader::get_probe (probe* p)
+{
+  uint64_t n = get_num ();
+  for (uint64_t i = 0; i < n; ++i)
+    p->locations.push_back (get_probe_point ());
+  p->body = get_stmt ();
+  p->tok = get_tok ();
+  p->systemtap_v_conditional = get_tok ();
+  p->privileged = get_bool ();
+  p->synthetic = get_bool ();
+}
+
+functiondecl*
+parsed_file_reader::get_functiondecl ()
+{
+  functiondecl* fd = new functiondecl;
+  fd->tok = get_tok ();
+  fd->systemtap_v_conditional = get_tok ();
+  string name = get_str ();
+  fd->unmangled_name = get_str ();
+  fd->type = (exp_type) get_num ();
+  uint64_t n = get_num ();
+  for (uint64_t i = 0; i < n; ++i)
+    fd->formal_args.push_back (get_vardecl ());
+  fd->body = get_stmt ();
+  fd->synthetic = get_bool ();
+  fd->mangle_oldstyle = get_bool ();
+  fd->has_next = get_bool ();
+  fd->priority = get_int ();
+
+  // The overload index in the mangled name depends on what was parsed
+  // before this file, so redo it as do_parse_functiondecl would.
+  size_t overload = name.rfind ("__overload_");
+  if (overload == string::npos)
+    throw parsed_file_error (_("unmangled function name"));
+  name.erase (overload);
+  fd->name = name + "__overload_"
+    + lex_cast (session.overload_count[fd->unmangled_name]++);
+  return fd;
+}
+
+stapfile*
+parsed_file_reader::read (const string& name)
+{
+  string magic;
+  if (!getline (input, magic) || magic != parsed_file_magic)
+    throw parsed_file_error (_("bad magic"));
+
+  // The source text is kept around for error messages, as the lexer
+  // would have.
+  ifstream src (name.c_str (), ios::in);
+  if (src.fail ())
+    throw parsed_file_error (_F("can't open \"%s\"", name.c_str ()));
+  string contents;
+  getline (src, contents, '\0');
+
+  file = new stapfile;
+  file->name = name;
+  file->file_contents = contents;
+
+  // The token table; chains can refer forward, so fix them up after.
+  uint64_t ntokens = get_num ();
+  vector<uint64_t> chains;
+  for (uint64_t i = 0; i < ntokens; ++i)
+    {
+      token* t = new token;
+      switch (get_num ())
+        {
+        case 0:
+          break;
+        case 1:
+          t->location.file = file;
+          break;
+        case 2:
+          {
+            string lib = get_str ();
+            for (unsigned j = 0; j < session.library_files.size (); ++j)
+              if (session.library_files[j]->name == lib)
+                {
+                  t->location.file = session.library_files[j];
+                  break;
+                }
+            if (t->location.file == 0)
+              throw parsed_file_error (_F("unknown library file \"%s\"", lib.c_str ()));
+            break;
+          }
+        default:
+          throw parsed_file_error (_("bad token file"));
+        }
+      t->location.line = get_num ();
+      t->location.column = get_num ();
+      t->content = get_str ();
+      t->type = (token_type) get_num ();
+      t->junk_type = (token_junk_type) get_num ();
+      chains.push_back (get_num ());
+      tokens.push_back (t);
+    }
+  for (unsigned i = 0; i < tokens.size (); ++i)
+    {
+      if (chains[i] > tokens.size ())
+        throw parsed_file_error (_("bad token chain"));
+      tokens[i]->chain = chains[i] ? tokens[chains[i] - 1] : 0;
+    }
+
+  uint64_t n = get_num ();
+  for (uint64_t i = 0; i < n; ++i)
+    file->globals.push_back (get_vardecl ());
+
+  n = get_num ();
+  for (uint64_t i = 0; i < n; ++i)
+    file->functions.push_back (get_functiondecl ());
+
+  n = get_num ();
+  for (uint64_t i = 0; i < n; ++i)
+    {
+      probe* p = new probe;
+      get_probe (p);
+      file->probes.push_back (p);
+    }
+
+  n = get_num ();
+  for (uint64_t i = 0; i < n; ++i)
+    {
+      vector<probe_point*> alias_names;
+      uint64_t m = get_num ();
+      for (uint64_t j = 0; j < m; ++j)
+        alias_names.push_back (get_probe_point ());
+      probe_alias* a = new probe_alias (alias_names);
+      a->epilogue_style = get_bool ();
+      get_probe (a);
+      file->aliases.push_back (a);
+    }
+
+  n = get_num ();
+  for (uint64_t i = 0; i < n; ++i)
+    file->embeds.push_back (get_stmt_as<embeddedcode> ());
+
+  if (input.peek () != EOF)
+    throw parsed_file_error (_("trailing data"));
+
+  return file;
+}
+
+
+bool
+write_parsed_file (systemtap_session& s, ostream& o, const stapfile* f)
+{
+  parsed_file_writer w (s, f);
+  return w.write (o);
+}
+
+stapfile*
+read_parsed_file (systemtap_session& s, istream& i, const string& name)
+{
+  // NB: a partially read file is simply leaked, like the parser does
+  // with its own partial results on errors.
+  try
+    {
+      parsed_file_reader r (s, i);
+      return r.read (name);
+    }
+  catch (const runtime_error& e)
+    {
+      if (s.verbose > 1)
+        clog << _F("Ignoring cached parse of \"%s\": %s", name.c_str(), e.what()) << endl;
+      return 0;
+    }
+}
+
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
@@ -68,6 +68,7 @@ struct token
   
   friend class parser;
   friend class lexer;
+  friend class parsed_file_reader;
 private:
   void make_junk (token_junk_type);
   token(): chain(0), type(tok_junk), junk_type(tok_junk_unknown) {}
@@ -115,6 +116,10 @@ stapfile* parse_library_macros (systemtap_session& s, const std::string& n);
 
 probe* parse_synthetic_probe (systemtap_session &s, std::istream& i, const token* tok);
 
+// Save/restore a parsed file, for the tapset parse cache.
+bool write_parsed_file (systemtap_session& s, std::ostream& o, const stapfile* f);
+stapfile* read_parsed_file (systemtap_session& s, std::istream& i, const std::string& n);
+
 #endif // PARSE_H
 
 /* vim: set sw=2 ts=8 cino=>4,n-2,{2,^-2,t0,(0,u0,w1,M1 : */
@@ -36,6 +36,7 @@
 
 #define mhlist_add_head	ohlist_add_head
 #define mhlist_del_init	ohlist_del_init
+#define mhlist_unhashed	ohlist_unhashed
 
 #define mhlist_for_each_entry	ohlist_for_each_entry
 
@@ -48,6 +48,14 @@ static inline void _stp_pmap_set_map(PMAP p, MAP m, unsigned cpu)
 }
 
 
+/* All nodes live in the shared memory allocated with the map, so it
+ * never grows. */
+static inline int _stp_map_grow(MAP m __attribute__((unused)))
+{
+	return 0;
+}
+
+
 static void __stp_map_del(MAP map)
 {
 }
@@ -46,6 +46,7 @@ static inline struct list_head* list_prev(struct list_head* head)
 
 #define mhlist_add_head	hlist_add_head
 #define mhlist_del_init	hlist_del_init
+#define mhlist_unhashed	hlist_unhashed
 
 #define mhlist_for_each_entry	stap_hlist_for_each_entry
 
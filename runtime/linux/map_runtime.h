@@ -11,6 +11,9 @@
 #ifndef _LINUX_MAP_RUNTIME_H_
 #define _LINUX_MAP_RUNTIME_H_
 
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+
 /* get/put_cpu wrappers.  Unnecessary if caller is already atomic. */
 #define MAP_GET_CPU()	smp_processor_id()
 #define MAP_PUT_CPU()	do {} while (0)
@@ -20,6 +23,9 @@ struct pmap {
 	int bit_shift;	/* scale factor for integer arithmetic */
 	int stat_ops;	/* related statistical operators */
 	MAP agg;	/* aggregation map */
+#ifdef PMAP_NODE_AGG
+	MAP *node_agg;	/* per-node partial aggregation maps, or NULL */
+#endif
 	MAP map[];	/* per-cpu maps */
 };
 
@@ -28,6 +34,21 @@ static inline MAP _stp_pmap_get_agg(PMAP p)
 	return p->agg;
 }
 
+#ifdef PMAP_NODE_AGG
+static inline int _stp_pmap_cpu_node(unsigned cpu)
+{
+	int node = cpu_to_node(cpu);
+	return (node < 0 || node >= nr_node_ids) ? 0 : node;
+}
+
+/* The partial aggregation map of NODE, NULL if it has no cpus or the
+ * pmap aggregates the per-cpu maps directly. */
+static inline MAP _stp_pmap_get_node_agg(PMAP p, int node)
+{
+	return p->node_agg ? p->node_agg[node] : NULL;
+}
+#endif
+
 static inline void _stp_pmap_set_agg(PMAP p, MAP agg)
 {
 	p->agg = agg;
@@ -48,6 +69,248 @@ static inline void _stp_pmap_set_map(PMAP p, MAP m, unsigned cpu)
 }
 
 
+/* Map nodes beyond the first chunk are allocated in chunks of about
+ * MAP_CHUNK_SIZE bytes as the map fills up, rather than all
+ * max_entries of them when the map is created.  Each map that can
+ * grow has a spare chunk ready, which probes take when the pool runs
+ * dry; probes never allocate nodes themselves.  Taking the spare has a
+ * work item allocate the next one, through irq_work, which is safe
+ * even from NMI probes.  Kernels without irq_work_queue have the work
+ * check the maps every MAP_REFILL_INTERVAL instead.  Define
+ * STP_MAP_PREALLOC to allocate all nodes up front. */
+#ifndef MAP_CHUNK_SIZE
+#define MAP_CHUNK_SIZE 32768
+#endif
+
+#ifndef MAP_REFILL_INTERVAL
+#define MAP_REFILL_INTERVAL ((HZ + 49) / 50)
+#endif
+
+#ifdef STAPCONF_IRQ_WORK_QUEUE
+#include <linux/irq_work.h>
+#define MAP_REFILL_KICK 1
+#endif
+
+static LIST_HEAD(_stp_map_list);
+static DEFINE_MUTEX(_stp_map_list_mutex);
+static void _stp_map_refill_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(_stp_map_refill_work, _stp_map_refill_fn);
+
+#ifdef MAP_REFILL_KICK
+static struct irq_work _stp_map_refill_kick;
+
+static void _stp_map_refill_kick_fn(struct irq_work *work)
+{
+	schedule_delayed_work(&_stp_map_refill_work, 0);
+}
+#endif
+
+
+static void *_stp_map_chunk_alloc(MAP m, gfp_t gfp_mask)
+{
+	size_t size = m->chunk_nodes * m->node_size;
+
+	if (m->cpu < 0)
+		return _stp_kzalloc_gfp(size, gfp_mask);
+	return _stp_kzalloc_node_gfp(size, cpu_to_node(m->cpu), gfp_mask);
+}
+
+
+/* Add the spare chunk of map M to its pool.  Called from probe context
+ * when the pool is empty.  Returns 0 if the map is at max_entries, or
+ * the work has not put up the next spare yet. */
+static int _stp_map_grow(MAP m)
+{
+	unsigned i, n;
+	void *chunk;
+
+	if (m->num_nodes >= m->maxnum)
+		return 0;
+
+	chunk = xchg(&m->spare_chunk, NULL);
+	if (chunk == NULL)
+		return 0;
+#ifdef MAP_REFILL_KICK
+	irq_work_queue(&_stp_map_refill_kick);
+#endif
+
+	m->node_chunks[m->num_chunks++] = chunk;
+	n = min(m->chunk_nodes, m->maxnum - m->num_nodes);
+	for (i = 0; i < n; i++) {
+		struct map_node *node = chunk + i * m->node_size;
+		mlist_add(&node->lnode, &m->pool);
+		_stp_map_node_init(node);
+	}
+	m->num_nodes += n;
+	return 1;
+}
+
+
+#ifdef MAP_VARSTRINGS
+/* String blocks are carved out of chunks allocated as needed.  Each
+ * block is preceded by its size class; free ones are linked through
+ * their first word. */
+static int _stp_map_str_grow(MAP m, unsigned cls)
+{
+	size_t unit = sizeof(unsigned long) + (16 << cls);
+	size_t size = max_t(size_t, MAP_CHUNK_SIZE, sizeof(void *) + unit);
+	char *chunk, *p;
+
+	if (m->cpu < 0)
+		chunk = _stp_kmalloc_gfp(size, STP_ALLOC_FLAGS);
+	else
+		chunk = _stp_kmalloc_node_gfp(size, cpu_to_node(m->cpu),
+					      STP_ALLOC_FLAGS);
+	if (chunk == NULL)
+		return 0;
+
+	*(void **)chunk = m->str_chunks;
+	m->str_chunks = chunk;
+
+	for (p = chunk + sizeof(void *); p + unit <= chunk + size; p += unit) {
+		void **blk = (void **)(p + sizeof(unsigned long));
+		((unsigned long *)blk)[-1] = cls;
+		*blk = m->str_free[cls];
+		m->str_free[cls] = blk;
+	}
+	return 1;
+}
+
+/* Get a block of at least SIZE bytes for strings of map M. */
+static void *_stp_map_str_alloc(MAP m, unsigned size)
+{
+	unsigned cls = 0;
+	void **blk;
+
+	while ((16U << cls) < size)
+		if (++cls == MAP_STR_CLASSES)
+			return NULL;
+
+	if (m->str_free[cls] == NULL && !_stp_map_str_grow(m, cls))
+		return NULL;
+
+	blk = m->str_free[cls];
+	m->str_free[cls] = *blk;
+	return blk;
+}
+
+static void _stp_map_str_free(MAP m, void *blk)
+{
+	unsigned cls = ((unsigned long *)blk)[-1];
+
+	*(void **)blk = m->str_free[cls];
+	m->str_free[cls] = blk;
+}
+
+/* The usable size of a string block. */
+static unsigned _stp_map_str_room(void *blk)
+{
+	return 16U << ((unsigned long *)blk)[-1];
+}
+#endif
+
+
+#ifdef MAP_SPARSE_HIST
+/* Get an array for all the histogram buckets of a node of map M.  The
+ * node keeps it when it goes back to the pool, so arrays are never
+ * freed before the map. */
+static int64_t *_stp_map_hist_alloc(MAP m)
+{
+	size_t size = m->hist.buckets * sizeof(int64_t);
+	int64_t *h;
+
+	if (m->hist_room < size) {
+		size_t csize = max_t(size_t, MAP_CHUNK_SIZE,
+				     sizeof(void *) + size);
+		char *chunk;
+
+		if (m->cpu < 0)
+			chunk = _stp_kmalloc_gfp(csize, STP_ALLOC_FLAGS);
+		else
+			chunk = _stp_kmalloc_node_gfp(csize,
+						      cpu_to_node(m->cpu),
+						      STP_ALLOC_FLAGS);
+		if (chunk == NULL)
+			return NULL;
+
+		*(void **)chunk = m->hist_chunks;
+		m->hist_chunks = chunk;
+		m->hist_free = chunk + sizeof(void *);
+		m->hist_room = csize - sizeof(void *);
+	}
+
+	h = (int64_t *)m->hist_free;
+	m->hist_free += size;
+	m->hist_room -= size;
+	return h;
+}
+#endif
+
+
+/* Give maps that took their spare chunk a new one. */
+static void _stp_map_refill_fn(struct work_struct *work)
+{
+	MAP m;
+
+	mutex_lock(&_stp_map_list_mutex);
+	list_for_each_entry(m, &_stp_map_list, map_list) {
+		void *chunk;
+
+		/* Racy reads, but the worst that happens is that a
+		 * spare comes a little late, or goes unused. */
+		if (m->spare_chunk || m->num_nodes >= m->maxnum)
+			continue;
+
+		chunk = _stp_map_chunk_alloc(m, STP_ALLOC_SLEEP_FLAGS);
+		if (chunk && cmpxchg(&m->spare_chunk, NULL, chunk) != NULL)
+			_stp_kfree(chunk);
+	}
+#ifndef MAP_REFILL_KICK
+	if (!list_empty(&_stp_map_list))
+		schedule_delayed_work(&_stp_map_refill_work,
+				      MAP_REFILL_INTERVAL);
+#endif
+	mutex_unlock(&_stp_map_list_mutex);
+}
+
+
+static void _stp_map_register(MAP m)
+{
+	mutex_lock(&_stp_map_list_mutex);
+	if (list_empty(&_stp_map_list)) {
+#ifdef MAP_REFILL_KICK
+		init_irq_work(&_stp_map_refill_kick, _stp_map_refill_kick_fn);
+#else
+		schedule_delayed_work(&_stp_map_refill_work,
+				      MAP_REFILL_INTERVAL);
+#endif
+	}
+	list_add(&m->map_list, &_stp_map_list);
+	mutex_unlock(&_stp_map_list_mutex);
+}
+
+
+static void _stp_map_unregister(MAP m)
+{
+	int last = 0;
+
+	if (list_empty(&m->map_list))
+		return;
+
+	mutex_lock(&_stp_map_list_mutex);
+	list_del_init(&m->map_list);
+	last = list_empty(&_stp_map_list);
+	mutex_unlock(&_stp_map_list_mutex);
+
+	if (last) {
+#ifdef MAP_REFILL_KICK
+		irq_work_sync(&_stp_map_refill_kick);
+#endif
+		cancel_delayed_work_sync(&_stp_map_refill_work);
+	}
+}
+
+
 /** Deletes a map.
  * Deletes a map, freeing all memory in all elements.
  * Normally done only when the module exits.
@@ -56,12 +319,48 @@ static inline void _stp_pmap_set_map(PMAP p, MAP m, unsigned cpu)
 
 static void _stp_map_del(MAP map)
 {
+	unsigned i;
+
 	if (map == NULL)
 		return;
 
+	_stp_map_unregister(map);
+
 	if (map->node_mem)
 		_stp_vfree(map->node_mem);
 
+	if (map->node_chunks) {
+		for (i = 0; i < map->num_chunks; i++)
+			_stp_kfree(map->node_chunks[i]);
+		_stp_vfree(map->node_chunks);
+	}
+
+	if (map->spare_chunk)
+		_stp_kfree(map->spare_chunk);
+
+#ifdef MAP_OPENHASH
+	if (map->entries)
+		_stp_vfree(map->entries);
+	if (map->sort_buf)
+		_stp_vfree(map->sort_buf);
+#endif
+
+#ifdef MAP_VARSTRINGS
+	while (map->str_chunks) {
+		void *chunk = map->str_chunks;
+		map->str_chunks = *(void **)chunk;
+		_stp_kfree(chunk);
+	}
+#endif
+
+#ifdef MAP_SPARSE_HIST
+	while (map->hist_chunks) {
+		void *chunk = map->hist_chunks;
+		map->hist_chunks = *(void **)chunk;
+		_stp_kfree(chunk);
+	}
+#endif
+
 	_stp_vfree(map);
 }
 
@@ -77,6 +376,14 @@ static void _stp_pmap_del(PMAP pmap)
 		_stp_map_del(m);
 	}
 
+#ifdef PMAP_NODE_AGG
+	if (pmap->node_agg) {
+		for_each_node(i)
+			_stp_map_del(pmap->node_agg[i]);
+		_stp_vfree(pmap->node_agg);
+	}
+#endif
+
 	/* free agg map elements */
 	_stp_map_del(_stp_pmap_get_agg(pmap));
 	_stp_vfree(pmap);
@@ -97,28 +404,58 @@ static int
 _stp_map_init(MAP m, unsigned max_entries, unsigned hash_table_mask,
               int wrap, int node_size, int cpu)
 {
-	unsigned i;
+	unsigned i, max_chunks;
 
 	INIT_MLIST_HEAD(&m->pool);
-	INIT_MLIST_HEAD(&m->head);
 
         m->hash_table_mask = hash_table_mask;
-	for (i = 0; i <= hash_table_mask; i++)
-		INIT_MHLIST_HEAD(&m->hashes[i]);
-
 	m->maxnum = max_entries;
 	m->wrap = wrap;
-
-	/* Since we're using _stp_map_vzalloc(), we can afford to
-	 * allocate the nodes in one big chunk. */
-	m->node_mem = _stp_map_vzalloc(node_size * max_entries, cpu);
+	m->node_size = node_size;
+	m->cpu = cpu;
+	/* before anything can fail: _stp_map_del() unregisters the map */
+	INIT_LIST_HEAD(&m->map_list);
+
+#ifdef MAP_OPENHASH
+	/* the slots start out empty, zeroed by _stp_map_vzalloc() */
+	m->entries = _stp_map_vzalloc(max_entries * sizeof(struct map_node *),
+				      cpu);
+	m->sort_buf = _stp_map_vzalloc(max_entries * sizeof(struct map_node *),
+				       cpu);
+	if (m->entries == NULL || m->sort_buf == NULL)
+		return -1;
+#else
+	INIT_MLIST_HEAD(&m->head);
+	for (i = 0; i <= hash_table_mask; i++)
+		INIT_MHLIST_HEAD(&m->hashes[i]);
+#endif
+
+	m->chunk_nodes = max(MAP_CHUNK_SIZE / node_size, 1);
+#ifdef STP_MAP_PREALLOC
+	m->num_nodes = max_entries;
+#else
+	m->num_nodes = min(m->chunk_nodes, max_entries);
+#endif
+
+	/* The first nodes come in one block from _stp_map_vzalloc(),
+	 * the rest in chunks from _stp_map_grow(). */
+	m->node_mem = _stp_map_vzalloc(node_size * m->num_nodes, cpu);
 	if (m->node_mem == NULL)
 		return -1;
 
-	for (i = 0; i < max_entries; i++) {
+	for (i = 0; i < m->num_nodes; i++) {
 		struct map_node *node = m->node_mem + i * node_size;
 		mlist_add(&node->lnode, &m->pool);
-		INIT_MHLIST_NODE(&node->hnode);
+		_stp_map_node_init(node);
+	}
+
+	max_chunks = (max_entries - m->num_nodes + m->chunk_nodes - 1)
+		/ m->chunk_nodes;
+	if (max_chunks) {
+		m->node_chunks = _stp_map_vzalloc(max_chunks * sizeof(void *),
+						  cpu);
+		if (m->node_chunks == NULL)
+			return -1;
 	}
 
 	return 0;
@@ -127,9 +464,10 @@ _stp_map_init(MAP m, unsigned max_entries, unsigned hash_table_mask,
 
 /** Create a new map.
  * Maps must be created at module initialization time.
- * @param max_entries The maximum number of entries allowed. Currently that
- * number will be preallocated.If more entries are required, the oldest ones
- * will be deleted. This makes it effectively a circular buffer.
+ * @param max_entries The maximum number of entries allowed. Nodes are
+ * allocated in chunks as the map grows, up to that number. If more entries
+ * are required, the oldest ones will be deleted. This makes it effectively
+ * a circular buffer.
  * @return A MAP on success or NULL on failure.
  * @ingroup map_create
  */
@@ -138,10 +476,22 @@ static MAP
 _stp_map_new(unsigned max_entries, int wrap, int node_size, int cpu)
 {
 	MAP m;
+#ifdef MAP_OPENHASH
+	/* Twice the natural size, so the table stays about half full at
+	 * most, and always more slots than entries, so that every probe
+	 * sequence ends at an empty slot. */
+	unsigned hash_table_mask = max_t(unsigned long,
+					 HASHTABLESIZE(max_entries) << 1,
+					 roundup_pow_of_two(max_entries + 1)) - 1;
+	m = _stp_map_vzalloc(sizeof(struct map_root) +
+                             sizeof(struct map_slot) * (hash_table_mask+1),
+                             cpu);
+#else
         unsigned hash_table_mask = HASHTABLESIZE(max_entries)-1; /* usable as bitmask */
 	m = _stp_map_vzalloc(sizeof(struct map_root) +
                              sizeof(struct mhlist_head) * (hash_table_mask+1),
                              cpu);
+#endif
 	if (m == NULL)
 		return NULL;
 
@@ -149,11 +499,61 @@ _stp_map_new(unsigned max_entries, int wrap, int node_size, int cpu)
 		_stp_map_del(m);
 		return NULL;
 	}
+	if (m->node_chunks) {
+		/* the first spare; the work allocates the next ones */
+		m->spare_chunk = _stp_map_chunk_alloc(m, STP_ALLOC_SLEEP_FLAGS);
+		if (m->spare_chunk == NULL) {
+			_stp_map_del(m);
+			return NULL;
+		}
+		_stp_map_register(m);
+	}
 	return m;
 }
 
+#ifdef PMAP_NODE_AGG
+/* Allocate a partial aggregation map in the memory of each node that
+ * has cpus, if there are several such nodes. */
+static int
+_stp_pmap_new_node_aggs(PMAP pmap, unsigned max_entries, int wrap,
+			int node_size)
+{
+	int i, node, nodes = 0;
+	MAP m;
+
+	pmap->node_agg = _stp_map_vzalloc(nr_node_ids * sizeof(MAP), -1);
+	if (pmap->node_agg == NULL)
+		return -1;
+
+	for_each_possible_cpu(i) {
+		node = _stp_pmap_cpu_node(i);
+		if (pmap->node_agg[node])
+			continue;
+		/* allocated on the node of cpu i */
+		m = _stp_map_new(max_entries, wrap, node_size, i);
+		if (m == NULL)
+			return -1;
+		m->track_dirty = 1;
+		pmap->node_agg[node] = m;
+		nodes++;
+	}
+
+	/* one node is just another copy of the aggregate */
+	if (nodes < 2) {
+		for_each_node(node)
+			_stp_map_del(pmap->node_agg[node]);
+		_stp_vfree(pmap->node_agg);
+		pmap->node_agg = NULL;
+	}
+	return 0;
+}
+#endif
+
+/* Make a pmap whose per-cpu maps have nodes of cpu_node_size bytes,
+ * and whose aggregation maps have nodes of node_size bytes. */
 static PMAP
-_stp_pmap_new(unsigned max_entries, int wrap, int node_size)
+_stp_pmap_new_sized(unsigned max_entries, int wrap, int cpu_node_size,
+		    int node_size)
 {
 	int i;
 	MAP m;
@@ -165,10 +565,15 @@ _stp_pmap_new(unsigned max_entries, int wrap, int node_size)
 
 	/* Allocate the per-cpu maps.  */
 	for_each_possible_cpu(i) {
-		m = _stp_map_new(max_entries, wrap, node_size, i);
+		m = _stp_map_new(max_entries, wrap, cpu_node_size, i);
 		if (m == NULL)
 			goto err1;
                 _stp_pmap_set_map(pmap, m, i);
+
+#ifndef STP_PMAP_FULL_AGG
+		/* Record changed nodes for incremental aggregation. */
+		m->track_dirty = 1;
+#endif
 	}
 
 	/* Allocate the aggregate map.  */
@@ -177,15 +582,22 @@ _stp_pmap_new(unsigned max_entries, int wrap, int node_size)
 		goto err1;
         _stp_pmap_set_agg(pmap, m);
 
+#ifdef PMAP_NODE_AGG
+	if (_stp_pmap_new_node_aggs(pmap, max_entries, wrap, node_size))
+		goto err1;
+#endif
+
 	return pmap;
 
 err1:
-	for_each_possible_cpu(i) {
-		m = _stp_pmap_get_map (pmap, i);
-		_stp_map_del(m);
-	}
-	_stp_vfree(pmap);
+	_stp_pmap_del(pmap);
 	return NULL;
 }
 
+static PMAP
+_stp_pmap_new(unsigned max_entries, int wrap, int node_size)
+{
+	return _stp_pmap_new_sized(max_entries, wrap, node_size, node_size);
+}
+
 #endif /* _LINUX_MAP_RUNTIME_H_ */
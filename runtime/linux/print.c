@@ -35,9 +35,28 @@
  * @{
  */
 
+/* With STP_DEFERRED_PRINT (see transport.c), the buffer holds struct
+ * _stp_print_record records.  The last one is always a text record,
+ * which starts at run and gets its header filled in once it is closed;
+ * _stp_print() and friends just append to it.  The buffer has room for
+ * that header on top of STP_BUFFER_SIZE bytes of text. */
+#ifdef _STP_DEFERRED_PRINT
+#define _STP_PBUF_START sizeof(struct _stp_print_record)
+#else
+#define _STP_PBUF_START 0
+#endif
+#define _STP_PBUF_SIZE (STP_BUFFER_SIZE + _STP_PBUF_START)
+
 typedef struct __stp_pbuf {
 	uint32_t len;			/* bytes used in the buffer */
-	char buf[STP_BUFFER_SIZE];
+#ifdef _STP_DEFERRED_PRINT
+	uint32_t run;			/* start of the open text record */
+#endif
+#ifdef STP_LOSSLESS_PRINT
+	uint64_t dropped;		/* bytes the transport had no room for */
+	uint64_t stalled;		/* microseconds spent waiting for room */
+#endif
+	char buf[_STP_PBUF_SIZE];
 } _stp_pbuf;
 
 static void *Stp_pbuf = NULL;
@@ -50,6 +69,28 @@ static void *Stp_pbuf = NULL;
 typedef char _stp_lbuf[STP_LOG_BUF_LEN];
 static void *Stp_lbuf = NULL;
 
+#ifdef _STP_DEFERRED_PRINT
+/* Start a text record at the end of the print buffer. */
+static inline void _stp_pbuf_open_run(_stp_pbuf *pb)
+{
+	pb->run = pb->len;
+	pb->len += sizeof(struct _stp_print_record);
+}
+
+/* Fill in the header of the open text record, or drop it if empty. */
+static inline void _stp_pbuf_close_run(_stp_pbuf *pb)
+{
+	struct _stp_print_record r = { .id = 0 };
+
+	r.len = pb->len - pb->run - sizeof(r);
+	if (r.len == 0)
+		pb->len = pb->run;
+	else
+		/* prevent unaligned access by using memcpy() */
+		memcpy(pb->buf + pb->run, &r, sizeof(r));
+}
+#endif
+
 /* create percpu print and io buffers */
 static int _stp_print_init (void)
 {
@@ -57,6 +98,17 @@ static int _stp_print_init (void)
 	if (unlikely(Stp_pbuf == 0))
 		return -1;
 
+#ifdef _STP_DEFERRED_PRINT
+	{
+		int cpu;
+		for_each_possible_cpu(cpu) {
+			_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, cpu);
+			pb->len = 0;
+			_stp_pbuf_open_run(pb);
+		}
+	}
+#endif
+
 	/* now initialize IO buffer used in io.c */
 	Stp_lbuf = _stp_alloc_percpu(sizeof(_stp_lbuf));
 	if (unlikely(Stp_lbuf == 0)) {
@@ -80,6 +132,27 @@ static inline void _stp_print_flush(void)
 {
 	stp_print_flush(per_cpu_ptr(Stp_pbuf, smp_processor_id()));
 }
+
+#ifdef STP_LOSSLESS_PRINT
+/* Tell how much each cpu waited for the transport, and lost anyway. */
+static void _stp_print_lossless_report(void)
+{
+	int cpu;
+
+	if (Stp_pbuf == NULL)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, cpu);
+
+		if (pb->dropped || pb->stalled)
+			_stp_warn("cpu %d: %llu bytes of output dropped, "
+				  "%llu us waiting for the transport\n", cpu,
+				  (unsigned long long) pb->dropped,
+				  (unsigned long long) pb->stalled);
+	}
+}
+#endif
 #ifndef STP_MAXBINARYARGS
 #define STP_MAXBINARYARGS 127
 #endif
@@ -90,7 +163,7 @@ static inline void _stp_print_flush(void)
 static void * _stp_reserve_bytes (int numbytes)
 {
 	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
-	int size = STP_BUFFER_SIZE - pb->len;
+	int size = _STP_PBUF_SIZE - pb->len;
 	void * ret;
 
 	if (unlikely(numbytes == 0 || numbytes > STP_BUFFER_SIZE))
@@ -115,6 +188,49 @@ static void _stp_unreserve_bytes (int numbytes)
 	pb->len -= numbytes;
 }
 
+#ifdef _STP_DEFERRED_PRINT
+/** Reserves a record for the arguments of a printf with a deferred format.
+ * @param id The number of the format in _stp_deferred_format()
+ * @param size The size of the arguments
+ * @returns Where to write the arguments, or NULL if they don't fit
+ * in the print buffer, in which case the caller formats them itself.
+ */
+static char *_stp_reserve_record (unsigned id, size_t size)
+{
+	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
+	struct _stp_print_record r = { .id = id + 1, .len = size };
+
+	/* leave room for the text record after it */
+	if (unlikely(size > _STP_PBUF_SIZE - 2 * sizeof(r)))
+		return NULL;
+
+	if (unlikely(pb->len + 2 * sizeof(r) + size > _STP_PBUF_SIZE))
+		_stp_print_flush();
+
+	_stp_pbuf_close_run(pb);
+	memcpy(pb->buf + pb->len, &r, sizeof(r));
+	pb->len += sizeof(r) + size;
+	_stp_pbuf_open_run(pb);
+	return pb->buf + pb->run - size;
+}
+
+/** Writes a number argument into a record from _stp_reserve_record(). */
+static inline char *_stp_record_long (char *rec, int64_t val)
+{
+	memcpy(rec, &val, sizeof(val));
+	return rec + sizeof(val);
+}
+
+/** Writes a string argument into a record from _stp_reserve_record(). */
+static inline char *_stp_record_string (char *rec, const char *str,
+					uint32_t len)
+{
+	memcpy(rec, &len, sizeof(len));
+	memcpy(rec + sizeof(len), str, len);
+	return rec + sizeof(len) + len;
+}
+#endif
+
 /** Write 64-bit args directly into the output stream.
  * This function takes a variable number of 64-bit arguments
  * and writes them directly into the output stream.  Marginally faster
@@ -161,7 +277,7 @@ static void _stp_printf (const char *fmt, ...)
 static void _stp_print (const char *str)
 {
 	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
-	char *end = pb->buf + STP_BUFFER_SIZE;
+	char *end = pb->buf + _STP_PBUF_SIZE;
 	char *ptr = pb->buf + pb->len;
 	char *instr = (char *)str;
 
@@ -173,7 +289,7 @@ static void _stp_print (const char *str)
 		/* Don't break strings across subbufs. */
 		/* Restart after flushing. */
 		_stp_print_flush();
-		end = pb->buf + STP_BUFFER_SIZE;
+		end = pb->buf + _STP_PBUF_SIZE;
 		ptr = pb->buf + pb->len;
 		instr = (char *)str;
 		while (ptr < end && *instr)
@@ -185,7 +301,7 @@ static void _stp_print (const char *str)
 static void _stp_print_char (const char c)
 {
 	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
-	int size = STP_BUFFER_SIZE - pb->len;
+	int size = _STP_PBUF_SIZE - pb->len;
 	if (unlikely(1 >= size))
 		_stp_print_flush();
 	
@@ -80,14 +80,17 @@ static void _stp_error (const char *fmt, ...) __attribute__ ((format (printf, 1,
 static void _stp_warn (const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
 
 static void _stp_exit(void);
+static inline void stp_synchronize_sched(void);
 
 
 #ifdef STAPCONF_HLIST_4ARGS
 #define stap_hlist_for_each_entry(a,b,c,d) hlist_for_each_entry(a,b,c,d)
 #define stap_hlist_for_each_entry_safe(a,b,c,d,e) hlist_for_each_entry_safe(a,b,c,d,e)
+#define stap_hlist_for_each_entry_rcu(a,b,c,d) hlist_for_each_entry_rcu(a,b,c,d)
 #else
 #define stap_hlist_for_each_entry(a,b,c,d) (void) b; hlist_for_each_entry(a,c,d)
 #define stap_hlist_for_each_entry_safe(a,b,c,d,e) (void) b; hlist_for_each_entry_safe(a,c,d,e)
+#define stap_hlist_for_each_entry_rcu(a,b,c,d) (void) b; hlist_for_each_entry_rcu(a,c,d)
 #endif
 
 #ifndef preempt_enable_no_resched
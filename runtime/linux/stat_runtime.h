@@ -11,6 +11,8 @@
 #ifndef _LINUX_STAT_RUNTIME_H_
 #define _LINUX_STAT_RUNTIME_H_
 
+#include <linux/seqlock.h>
+
 #define STAT_LOCK(sd)		do {} while (0)
 #define STAT_UNLOCK(sd)		do {} while (0)
 /* get/put_cpu wrappers.  Unnecessary if caller is already atomic. */
@@ -21,6 +23,18 @@
 #endif
 #define STAT_PUT_CPU()		do {} while (0)
 
+/* Probes add to the stat_data of their own cpu without the global
+ * lock of the Stat.  Readers copy each cpu's stat_data under that
+ * cpu's sequence count, and clear a Stat by bumping its generation,
+ * which each cpu applies to its own stat_data when it next adds to
+ * it.  See _stp_stat_add() and _stp_stat_snapshot(). */
+#define STAT_SEQCOUNT 1
+
+struct _stp_stat_seq {
+	seqcount_t seq;
+	unsigned gen;	/* of the Stat, when this cpu last cleared */
+};
+
 /** Stat struct. Maps do not need this */
 typedef struct _Stat {
 	struct _Hist hist;
@@ -28,48 +42,67 @@ typedef struct _Stat {
 	/* aggregated data */
 	stat_data *agg;
 
+	/* a reader's copy of the stat data of one cpu */
+	stat_data *snap;
+	size_t size;
+
+	/* bumped to clear the stat data of all cpus */
+	unsigned gen;
+
 	/* The stat data is per-cpu data.  */
+	struct _stp_stat_seq *seq;
 	stat_data *sd;
 } *Stat;
 
+static void _stp_stat_free(Stat st);
+
 static Stat _stp_stat_alloc(size_t stat_data_size)
 {
 	Stat st;
+	int cpu;
 
 	if (stat_data_size < sizeof(stat_data))
 		return NULL;
 
 	/* Called from module_init, so user context, may sleep alloc. */
-	st = _stp_kmalloc_gfp (sizeof(struct _Stat), STP_ALLOC_SLEEP_FLAGS);
+	st = _stp_kzalloc_gfp (sizeof(struct _Stat), STP_ALLOC_SLEEP_FLAGS);
 	if (st == NULL)
 		return NULL;
+	st->size = stat_data_size;
 
 	st->agg = _stp_kzalloc_gfp (stat_data_size, STP_ALLOC_SLEEP_FLAGS);
-	if (st->agg == NULL) {
-		_stp_kfree (st);
-		return NULL;
-	}
-
+	st->snap = _stp_kzalloc_gfp (stat_data_size, STP_ALLOC_SLEEP_FLAGS);
+	st->seq = _stp_alloc_percpu (sizeof(struct _stp_stat_seq));
 	st->sd = _stp_alloc_percpu (stat_data_size);
-	if (st->sd == NULL) {
-		_stp_kfree (st->agg);
-		_stp_kfree (st);
+	if (st->agg == NULL || st->snap == NULL || st->seq == NULL
+	    || st->sd == NULL) {
+		_stp_stat_free (st);
 		return NULL;
 	}
 
+	for_each_possible_cpu(cpu)
+		seqcount_init(&per_cpu_ptr(st->seq, cpu)->seq);
+
 	return st;
 }
 
 static void _stp_stat_free(Stat st)
 {
 	if (st) {
-		_stp_free_percpu (st->sd);
-		_stp_kfree (st->agg);
+		if (st->sd)
+			_stp_free_percpu (st->sd);
+		if (st->seq)
+			_stp_free_percpu (st->seq);
+		if (st->snap)
+			_stp_kfree (st->snap);
+		if (st->agg)
+			_stp_kfree (st->agg);
 		_stp_kfree (st);
 	}
 }
 
 #define _stp_stat_get_agg(stat) ((stat)->agg)
 #define _stp_stat_per_cpu_ptr(stat, cpu) per_cpu_ptr((stat)->sd, (cpu))
+#define _stp_stat_per_cpu_seq(stat, cpu) per_cpu_ptr((stat)->seq, (cpu))
 
 #endif /* _LINUX_STAT_RUNTIME_H_ */
@@ -46,9 +46,15 @@
 #define VSTYPE char*
 #define VALNAME str
 #define VALN s
+#ifdef MAP_VARSTRINGS
+#define VALSTOR char value[0]
+#define MAP_GET_VAL(n) ((n)->node.val_str ?: "")
+#define MAP_SET_VAL(map,n,val,add,s1,s2,s3,s4,s5) _new_map_set_vstr(map,&(n)->node,val,add)
+#else
 #define VALSTOR char value[MAP_STRING_LENGTH]
 #define MAP_GET_VAL(node) ((node)->value)
 #define MAP_SET_VAL(map,node,val,add,s1,s2,s3,s4,s5) _new_map_set_str(map,MAP_GET_VAL(node),val,add)
+#endif
 #define MAP_COPY_VAL(map,node,val,add) MAP_SET_VAL(map,node,val,add,0,0,0,0,0)
 #define NULLRET ""
 #elif VALUE_TYPE == INT64
@@ -97,7 +103,7 @@
                 len += 8;                                               \
         } while(0)
 #define MURMUR_STRING(v) do { \
-                uint32_t mylen = strlen(v); \
+                uint32_t mylen = strnlen(v, MAP_STRING_LENGTH - 1); \
                 int nblocks = mylen / 4; \
                 const uint32_t * blocks = (const uint32_t *)(v + nblocks*4); \
                 const uint8_t * tail; \
@@ -126,14 +132,22 @@
 #define KEY1TYPE char*
 #define KEY1NAME str
 #define KEY1N s
+#ifdef MAP_VARSTRINGS
+#define KEY1STOR char *key1
+#define KEY1SIZE size += _stp_map_str_size(key1)
+#define KEY1CPY(m) m->key1 = _stp_map_str_put(&p, key1)
+#else
 #define KEY1STOR char key1[MAP_STRING_LENGTH]
+#define KEY1SIZE
 #define KEY1CPY(m) str_copy(m->key1, key1)
+#endif
 #define KEY1_HASH MURMUR_STRING(key1)
 #else
 #define KEY1TYPE int64_t
 #define KEY1NAME int64
 #define KEY1N i
 #define KEY1STOR int64_t key1
+#define KEY1SIZE
 #define KEY1CPY(m) m->key1=key1
 
 /* Instead of ...
@@ -158,14 +172,22 @@
 #define KEY2TYPE char*
 #define KEY2NAME str
 #define KEY2N s
+#ifdef MAP_VARSTRINGS
+#define KEY2STOR char *key2
+#define KEY2SIZE size += _stp_map_str_size(key2)
+#define KEY2CPY(m) m->key2 = _stp_map_str_put(&p, key2)
+#else
 #define KEY2STOR char key2[MAP_STRING_LENGTH]
+#define KEY2SIZE
 #define KEY2CPY(m) str_copy(m->key2, key2)
+#endif
 #define KEY2_HASH MURMUR_STRING(key2)
 #else
 #define KEY2TYPE int64_t
 #define KEY2NAME int64
 #define KEY2N i
 #define KEY2STOR int64_t key2
+#define KEY2SIZE
 #define KEY2CPY(m) m->key2=key2
 #define KEY2_HASH MURMUR_INT64(key2)
 #endif
@@ -179,14 +201,22 @@
 #define KEY3TYPE char*
 #define KEY3NAME str
 #define KEY3N s
+#ifdef MAP_VARSTRINGS
+#define KEY3STOR char *key3
+#define KEY3SIZE size += _stp_map_str_size(key3)
+#define KEY3CPY(m) m->key3 = _stp_map_str_put(&p, key3)
+#else
 #define KEY3STOR char key3[MAP_STRING_LENGTH]
+#define KEY3SIZE
 #define KEY3CPY(m) str_copy(m->key3, key3)
+#endif
 #define KEY3_HASH MURMUR_STRING(key3)
 #else
 #define KEY3TYPE int64_t
 #define KEY3NAME int64
 #define KEY3N i
 #define KEY3STOR int64_t key3
+#define KEY3SIZE
 #define KEY3CPY(m) m->key3=key3
 #define KEY3_HASH MURMUR_INT64(key3)
 #endif
@@ -200,14 +230,22 @@
 #define KEY4TYPE char*
 #define KEY4NAME str
 #define KEY4N s
+#ifdef MAP_VARSTRINGS
+#define KEY4STOR char *key4
+#define KEY4SIZE size += _stp_map_str_size(key4)
+#define KEY4CPY(m) m->key4 = _stp_map_str_put(&p, key4)
+#else
 #define KEY4STOR char key4[MAP_STRING_LENGTH]
+#define KEY4SIZE
 #define KEY4CPY(m) str_copy(m->key4, key4)
+#endif
 #define KEY4_HASH MURMUR_STRING(key4)
 #else
 #define KEY4TYPE int64_t
 #define KEY4NAME int64
 #define KEY4N i
 #define KEY4STOR int64_t key4
+#define KEY4SIZE
 #define KEY4CPY(m) m->key4=key4
 #define KEY4_HASH MURMUR_INT64(key4)
 #endif
@@ -221,14 +259,22 @@
 #define KEY5TYPE char*
 #define KEY5NAME str
 #define KEY5N s
+#ifdef MAP_VARSTRINGS
+#define KEY5STOR char *key5
+#define KEY5SIZE size += _stp_map_str_size(key5)
+#define KEY5CPY(m) m->key5 = _stp_map_str_put(&p, key5)
+#else
 #define KEY5STOR char key5[MAP_STRING_LENGTH]
+#define KEY5SIZE
 #define KEY5CPY(m) str_copy(m->key5, key5)
+#endif
 #define KEY5_HASH MURMUR_STRING(key5)
 #else
 #define KEY5TYPE int64_t
 #define KEY5NAME int64
 #define KEY5N i
 #define KEY5STOR int64_t key5
+#define KEY5SIZE
 #define KEY5CPY(m) m->key5=key5
 #define KEY5_HASH MURMUR_INT64(key5)
 #endif
@@ -242,14 +288,22 @@
 #define KEY6TYPE char*
 #define KEY6NAME str
 #define KEY6N s
+#ifdef MAP_VARSTRINGS
+#define KEY6STOR char *key6
+#define KEY6SIZE size += _stp_map_str_size(key6)
+#define KEY6CPY(m) m->key6 = _stp_map_str_put(&p, key6)
+#else
 #define KEY6STOR char key6[MAP_STRING_LENGTH]
+#define KEY6SIZE
 #define KEY6CPY(m) str_copy(m->key6, key6)
+#endif
 #define KEY6_HASH MURMUR_STRING(key6)
 #else
 #define KEY6TYPE int64_t
 #define KEY6NAME int64
 #define KEY6N i
 #define KEY6STOR int64_t key6
+#define KEY6SIZE
 #define KEY6CPY(m) m->key6=key6
 #define KEY6_HASH MURMUR_INT64(key6)
 #endif
@@ -263,14 +317,22 @@
 #define KEY7TYPE char*
 #define KEY7NAME str
 #define KEY7N s
+#ifdef MAP_VARSTRINGS
+#define KEY7STOR char *key7
+#define KEY7SIZE size += _stp_map_str_size(key7)
+#define KEY7CPY(m) m->key7 = _stp_map_str_put(&p, key7)
+#else
 #define KEY7STOR char key7[MAP_STRING_LENGTH]
+#define KEY7SIZE
 #define KEY7CPY(m) str_copy(m->key7, key7)
+#endif
 #define KEY7_HASH MURMUR_STRING(key7)
 #else
 #define KEY7TYPE int64_t
 #define KEY7NAME int64
 #define KEY7N i
 #define KEY7STOR int64_t key7
+#define KEY7SIZE
 #define KEY7CPY(m) m->key7=key7
 #define KEY7_HASH MURMUR_INT64(key7)
 #endif
@@ -284,14 +346,22 @@
 #define KEY8TYPE char*
 #define KEY8NAME str
 #define KEY8N s
+#ifdef MAP_VARSTRINGS
+#define KEY8STOR char *key8
+#define KEY8SIZE size += _stp_map_str_size(key8)
+#define KEY8CPY(m) m->key8 = _stp_map_str_put(&p, key8)
+#else
 #define KEY8STOR char key8[MAP_STRING_LENGTH]
+#define KEY8SIZE
 #define KEY8CPY(m) str_copy(m->key8, key8)
+#endif
 #define KEY8_HASH MURMUR_STRING(key8)
 #else
 #define KEY8TYPE int64_t
 #define KEY8NAME int64
 #define KEY8N i
 #define KEY8STOR int64_t key8
+#define KEY8SIZE
 #define KEY8CPY(m) m->key8=key8
 #define KEY8_HASH MURMUR_INT64(key8)
 #endif
@@ -305,14 +375,22 @@
 #define KEY9TYPE char*
 #define KEY9NAME str
 #define KEY9N s
+#ifdef MAP_VARSTRINGS
+#define KEY9STOR char *key9
+#define KEY9SIZE size += _stp_map_str_size(key9)
+#define KEY9CPY(m) m->key9 = _stp_map_str_put(&p, key9)
+#else
 #define KEY9STOR char key9[MAP_STRING_LENGTH]
+#define KEY9SIZE
 #define KEY9CPY(m) str_copy(m->key9, key9)
+#endif
 #define KEY9_HASH MURMUR_STRING(key9)
 #else
 #define KEY9TYPE int64_t
 #define KEY9NAME int64
 #define KEY9N i
 #define KEY9STOR int64_t key9
+#define KEY9SIZE
 #define KEY9CPY(m) m->key9=key9
 #define KEY9_HASH MURMUR_INT64(key9)
 #endif
@@ -434,6 +512,51 @@ KEYSYM(get_map_node) (struct map_node* m)
 	return container_of(m, struct KEYSYM(map_node), node);
 }
 
+/* Copy the keys into node N.  Returns 0 if there is no room for
+ * their strings. */
+static int KEYSYM(keycpy) (MAP map, struct KEYSYM(map_node) *n,
+			   ALLKEYSD(key))
+{
+#ifdef MAP_VARSTRINGS
+	unsigned size = 0;
+	char *p = NULL;
+
+	KEY1SIZE;
+#if KEY_ARITY > 1
+	KEY2SIZE;
+#if KEY_ARITY > 2
+	KEY3SIZE;
+#if KEY_ARITY > 3
+	KEY4SIZE;
+#if KEY_ARITY > 4
+	KEY5SIZE;
+#if KEY_ARITY > 5
+	KEY6SIZE;
+#if KEY_ARITY > 6
+	KEY7SIZE;
+#if KEY_ARITY > 7
+	KEY8SIZE;
+#if KEY_ARITY > 8
+	KEY9SIZE;
+#endif
+#endif
+#endif
+#endif
+#endif
+#endif
+#endif
+#endif
+	if (size) {
+		p = n->node.key_str = _stp_map_str_alloc(map, size);
+		if (p == NULL)
+			return 0;
+	}
+	(void) p; /* unused if all the keys are numbers */
+#endif
+	KEYCPY(n);
+	return 1;
+}
+
 #define type_to_enum(type)						\
 	({								\
 		int ret;						\
@@ -802,8 +925,8 @@ static MAP KEYSYM(_stp_map_new) (int first_arg, ...)
 static inline int KEYSYM(__stp_map_set) (MAP map, ALLKEYSD(key), VSTYPE val, int add, int s1, int s2, int s3, int s4, int s5)
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	map_hash_cursor e;
+	struct map_node *mn;
 	struct KEYSYM(map_node) *n;
 
 	if (map == NULL)
@@ -812,19 +935,26 @@ static inline int KEYSYM(__stp_map_set) (MAP map, ALLKEYSD(key), VSTYPE val, int
 	if (KEYSYM(keycheck) (ALLKEYS(key)) == 0)
 		return -2;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
+	hv = KEYSYM(hash) (ALLKEYS(key));
 
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	map_for_each_hashed(map, hv, mn, e) {
+		n = KEYSYM(get_map_node)(mn);
 		if (KEY_EQ_P(n)) {
+			_stp_map_touch(map, &n->node);
+			_stp_map_ref(map, &n->node);
 			return MAP_SET_VAL(map, n, val, add, s1, s2, s3, s4, s5);
 		}
 	}
 	/* key not found */
-	n = KEYSYM(get_map_node)(_new_map_create (map, head));
-	if (n == NULL)
+	mn = _new_map_create (map, hv);
+	if (mn == NULL)
 		return -1;
-	KEYCPY(n);
+	n = KEYSYM(get_map_node)(mn);
+	if (!KEYSYM(keycpy)(map, n, ALLKEYS(key))) {
+		_new_map_del_node(map, &n->node);
+		return -1;
+	}
+	_stp_map_touch(map, &n->node);
 	return MAP_SET_VAL(map, n, val, 0, s1, s2, s3, s4, s5);
 }
 
@@ -842,18 +972,19 @@ static int KEYSYM(_stp_map_add) (MAP map, ALLKEYSD(key), VSTYPE val)
 static VALTYPE KEYSYM(_stp_map_get) (MAP map, ALLKEYSD(key))
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	map_hash_cursor e;
+	struct map_node *mn;
 	struct KEYSYM(map_node) *n;
 
 	if (map == NULL)
 		return NULLRET;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
+	hv = KEYSYM(hash) (ALLKEYS(key));
 
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	map_for_each_hashed(map, hv, mn, e) {
+		n = KEYSYM(get_map_node)(mn);
 		if (KEY_EQ_P(n)) {
+			_stp_map_ref(map, &n->node);
 			return MAP_GET_VAL(n);
 		}
 	}
@@ -864,8 +995,8 @@ static VALTYPE KEYSYM(_stp_map_get) (MAP map, ALLKEYSD(key))
 static int KEYSYM(_stp_map_del) (MAP map, ALLKEYSD(key))
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	map_hash_cursor e;
+	struct map_node *mn;
 	struct KEYSYM(map_node) *n;
 
 	if (map == NULL)
@@ -874,10 +1005,10 @@ static int KEYSYM(_stp_map_del) (MAP map, ALLKEYSD(key))
 	if (KEYSYM(keycheck) (ALLKEYS(key)) == 0)
 		return -1;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
+	hv = KEYSYM(hash) (ALLKEYS(key));
 
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	map_for_each_hashed(map, hv, mn, e) {
+		n = KEYSYM(get_map_node)(mn);
 		if (KEY_EQ_P(n)) {
 			_new_map_del_node(map, &n->node);
 			return 0;
@@ -887,18 +1018,18 @@ static int KEYSYM(_stp_map_del) (MAP map, ALLKEYSD(key))
 	return 0;
 }
 
-static int KEYSYM(_stp_map_del_hash) (MAP map, unsigned int hv /* scaled */,
+static int KEYSYM(_stp_map_del_hash) (MAP map, unsigned int hv /* unscaled */,
                                       ALLKEYSD(key))
 {
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	map_hash_cursor e;
+	struct map_node *mn;
 	struct KEYSYM(map_node) *n;
 
 	if (map == NULL)
 		return -1;
 
-	head = &map->hashes[hv];
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	map_for_each_hashed(map, hv, mn, e) {
+		n = KEYSYM(get_map_node)(mn);
 		if (KEY_EQ_P(n)) {
 			_new_map_del_node(map, &n->node);
 			return 0;
@@ -911,18 +1042,19 @@ static int KEYSYM(_stp_map_del_hash) (MAP map, unsigned int hv /* scaled */,
 static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	map_hash_cursor e;
+	struct map_node *mn;
 	struct KEYSYM(map_node) *n;
 
 	if (map == NULL)
 		return 0;
 
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
+	hv = KEYSYM(hash) (ALLKEYS(key));
 
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	map_for_each_hashed(map, hv, mn, e) {
+		n = KEYSYM(get_map_node)(mn);
 		if (KEY_EQ_P(n)) {
+			_stp_map_ref(map, &n->node);
 			return 1;
 		}
 	}
@@ -943,6 +1075,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY1_TYPE
 #undef KEY1STOR
 #undef KEY1CPY
+#undef KEY1SIZE
 #undef KEY1_HASH
 
 #undef KEY2NAME
@@ -951,6 +1084,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY2_TYPE
 #undef KEY2STOR
 #undef KEY2CPY
+#undef KEY2SIZE
 #undef KEY2_HASH
 
 #undef KEY3NAME
@@ -959,6 +1093,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY3_TYPE
 #undef KEY3STOR
 #undef KEY3CPY
+#undef KEY3SIZE
 #undef KEY3_HASH
 
 #undef KEY4NAME
@@ -967,6 +1102,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY4_TYPE
 #undef KEY4STOR
 #undef KEY4CPY
+#undef KEY4SIZE
 #undef KEY4_HASH
 
 #undef KEY5NAME
@@ -975,6 +1111,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY5_TYPE
 #undef KEY5STOR
 #undef KEY5CPY
+#undef KEY5SIZE
 #undef KEY5_HASH
 
 #undef KEY6NAME
@@ -983,6 +1120,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY6_TYPE
 #undef KEY6STOR
 #undef KEY6CPY
+#undef KEY6SIZE
 #undef KEY6_HASH
 
 #undef KEY7NAME
@@ -991,6 +1129,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY7_TYPE
 #undef KEY7STOR
 #undef KEY7CPY
+#undef KEY7SIZE
 #undef KEY7_HASH
 
 #undef KEY8NAME
@@ -999,6 +1138,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY8_TYPE
 #undef KEY8STOR
 #undef KEY8CPY
+#undef KEY8SIZE
 #undef KEY8_HASH
 
 #undef KEY9NAME
@@ -1007,6 +1147,7 @@ static int KEYSYM(_stp_map_exists) (MAP map, ALLKEYSD(key))
 #undef KEY9_TYPE
 #undef KEY9STOR
 #undef KEY9CPY
+#undef KEY9SIZE
 #undef KEY9_HASH
 
 #undef KEY_ARITY
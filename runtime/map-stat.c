@@ -19,6 +19,16 @@ static void _stp_map_print_histogram (MAP map, stat_data *sd)
 	_stp_stat_print_histogram (&map->hist, sd);
 }
 
+static void _stp_map_set_hist (MAP m, int type, int start, int stop,
+			       int interval, int buckets)
+{
+	m->hist.type = type;
+	m->hist.start = start;
+	m->hist.stop = stop;
+	m->hist.interval = interval;
+	m->hist.buckets = buckets;
+}
+
 static MAP _stp_map_new_hstat (unsigned max_entries, int wrap, int node_size)
 {
 	MAP m = _stp_map_new (max_entries, wrap, node_size, -1);
@@ -66,6 +76,58 @@ _stp_map_new_hstat_linear (unsigned max_entries, int wrap, int node_size,
 }
 
 
+/* Set the histogram parameters of each cpu map of PMAP, and of its
+ * aggregation maps. */
+static void _stp_pmap_set_hist (PMAP pmap, int type, int start, int stop,
+				int interval, int buckets)
+{
+	int i;
+	MAP m;
+
+	for_each_possible_cpu(i) {
+		m = _stp_pmap_get_map (pmap, i);
+		_stp_map_set_hist (m, type, start, stop, interval, buckets);
+	}
+#ifdef PMAP_NODE_AGG
+	for_each_node(i) {
+		m = _stp_pmap_get_node_agg (pmap, i);
+		if (m)
+			_stp_map_set_hist (m, type, start, stop, interval,
+					   buckets);
+	}
+#endif
+	/* now set agg map params */
+	m = _stp_pmap_get_agg(pmap);
+	_stp_map_set_hist (m, type, start, stop, interval, buckets);
+}
+
+/* Make a pmap for histograms of the given number of buckets.  With
+ * MAP_SPARSE_HIST, the per-cpu maps get sparse histograms, if those
+ * are the smaller. */
+static PMAP _stp_pmap_new_hist (unsigned max_entries, int wrap, int node_size,
+				int buckets)
+{
+#ifdef MAP_SPARSE_HIST
+	if (STAT_SPARSE_WORDS < buckets) {
+		PMAP pmap;
+		int i;
+
+		pmap = _stp_pmap_new_sized (max_entries, wrap,
+					    node_size + STAT_SPARSE_WORDS * sizeof(int64_t),
+					    node_size + buckets * sizeof(int64_t));
+		if (pmap) {
+			for_each_possible_cpu(i) {
+				MAP m = _stp_pmap_get_map (pmap, i);
+				m->stat_ops = m->hist.stat_ops = STAT_HIST_SPARSE;
+			}
+		}
+		return pmap;
+	}
+#endif
+	return _stp_pmap_new (max_entries, wrap,
+			      node_size + buckets * sizeof(int64_t));
+}
+
 static PMAP
 _stp_pmap_new_hstat_linear (unsigned max_entries, int wrap, int node_size,
 			    int start, int stop, int interval)
@@ -76,29 +138,10 @@ _stp_pmap_new_hstat_linear (unsigned max_entries, int wrap, int node_size,
 		return NULL;
 
 	/* the node already has stat_data, just add size for buckets */
-	node_size += buckets * sizeof(int64_t);
-
-	pmap = _stp_pmap_new (max_entries, wrap, node_size);
-	if (pmap) {
-		int i;
-		MAP m;
-
-		for_each_possible_cpu(i) {
-			m = _stp_pmap_get_map (pmap, i);
-			m->hist.type = HIST_LINEAR;
-			m->hist.start = start;
-			m->hist.stop = stop;
-			m->hist.interval = interval;
-			m->hist.buckets = buckets;
-		}
-		/* now set agg map params */
-		m = _stp_pmap_get_agg(pmap);
-		m->hist.type = HIST_LINEAR;
-		m->hist.start = start;
-		m->hist.stop = stop;
-		m->hist.interval = interval;
-		m->hist.buckets = buckets;
-	}
+	pmap = _stp_pmap_new_hist (max_entries, wrap, node_size, buckets);
+	if (pmap)
+		_stp_pmap_set_hist (pmap, HIST_LINEAR, start, stop, interval,
+				    buckets);
 	return pmap;
 }
 
@@ -108,38 +151,49 @@ _stp_pmap_new_hstat_log (unsigned max_entries, int wrap, int node_size)
 	PMAP pmap;
 
 	/* the node already has stat_data, just add size for buckets */
-	node_size += HIST_LOG_BUCKETS * sizeof(int64_t);
-	pmap = _stp_pmap_new (max_entries, wrap, node_size);
-	if (pmap) {
-		int i;
-		MAP m;
-		for_each_possible_cpu(i) {
-			m = _stp_pmap_get_map (pmap, i);
-			m->hist.type = HIST_LOG;
-			m->hist.buckets = HIST_LOG_BUCKETS;
+	pmap = _stp_pmap_new_hist (max_entries, wrap, node_size,
+				   HIST_LOG_BUCKETS);
+	if (pmap)
+		_stp_pmap_set_hist (pmap, HIST_LOG, 0, 0, 0, HIST_LOG_BUCKETS);
+	return pmap;
+}
+
+/* Set the statistical operators of PMAP, including those of each cpu
+ * map and of the aggregation maps, which need to know up front whether
+ * their stat_data carries a quantile sketch.  The cpu maps keep
+ * STAT_HIST_SPARSE, if they have it. */
+static void _stp_pmap_set_stat_ops (PMAP pmap, int bit_shift, int stat_ops)
+{
+	int i;
+	MAP m;
+
+	pmap->bit_shift = bit_shift;
+	pmap->stat_ops = stat_ops;
+	for_each_possible_cpu(i) {
+		m = _stp_pmap_get_map (pmap, i);
+		m->bit_shift = m->hist.bit_shift = bit_shift;
+		m->stat_ops = m->hist.stat_ops
+			= stat_ops | (m->stat_ops & STAT_HIST_SPARSE);
+	}
+#ifdef PMAP_NODE_AGG
+	for_each_node(i) {
+		m = _stp_pmap_get_node_agg (pmap, i);
+		if (m) {
+			m->bit_shift = m->hist.bit_shift = bit_shift;
+			m->stat_ops = m->hist.stat_ops = stat_ops;
 		}
-		/* now set agg map params */
-		m = _stp_pmap_get_agg(pmap);
-		m->hist.type = HIST_LOG;
-		m->hist.buckets = HIST_LOG_BUCKETS;
 	}
-	return pmap;
+#endif
+	m = _stp_pmap_get_agg(pmap);
+	m->bit_shift = m->hist.bit_shift = bit_shift;
+	m->stat_ops = m->hist.stat_ops = stat_ops;
 }
 
 static PMAP
 _stp_pmap_new_hstat (unsigned max_entries, int wrap, int node_size)
 {
 	PMAP pmap = _stp_pmap_new (max_entries, wrap, node_size);
-	if (pmap) {
-		int i;
-		MAP m;
-		for_each_possible_cpu(i) {
-			m = _stp_pmap_get_map (pmap, i);
-			m->hist.type = HIST_NONE;
-		}
-		/* now set agg map params */
-		m = _stp_pmap_get_agg(pmap);
-		m->hist.type = HIST_NONE;
-	}
+	if (pmap)
+		_stp_pmap_set_hist (pmap, HIST_NONE, 0, 0, 0, 0);
 	return pmap;
 }
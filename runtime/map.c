@@ -37,11 +37,143 @@ static void str_add(void *dest, char *val)
 	strlcat(dst, val, MAP_STRING_LENGTH);
 }
 
+#ifdef MAP_VARSTRINGS
+/* Map strings are stored with their length in front, padded so the
+ * next one stays aligned.  Like str_copy(), they are truncated to
+ * MAP_STRING_LENGTH - 1 characters. */
+static unsigned _stp_map_str_size(const char *s)
+{
+	return sizeof(u32) + ALIGN(strnlen(s, MAP_STRING_LENGTH - 1) + 1,
+				   sizeof(u32));
+}
+
+static unsigned _stp_map_str_len(const char *s)
+{
+	return ((const u32 *)s)[-1];
+}
+
+/* Store S at *P and advance *P past it.  Returns the stored string. */
+static char *_stp_map_str_put(char **p, const char *s)
+{
+	unsigned len = strnlen(s, MAP_STRING_LENGTH - 1);
+	char *str = *p + sizeof(u32);
+
+	*(u32 *)*p = len;
+	memcpy(str, s, len);
+	str[len] = 0;
+	*p += sizeof(u32) + ALIGN(len + 1, sizeof(u32));
+	return str;
+}
+#endif
+
 static int str_eq_p (char *key1, char *key2)
 {
+#ifdef MAP_VARSTRINGS
+	/* key1 is always a map string, so its length is known */
+	unsigned len = _stp_map_str_len(key1);
+
+	return strncmp(key1, key2, len) == 0
+		&& (key2[len] == 0 || len == MAP_STRING_LENGTH - 1);
+#else
 	return strncmp(key1, key2, MAP_STRING_LENGTH - 1) == 0;
+#endif
 }
 
+/* Release the strings of a node that is going back to the pool. */
+static void _stp_map_node_free_strs(MAP map, struct map_node *n)
+{
+#ifdef MAP_VARSTRINGS
+	if (n->key_str) {
+		_stp_map_str_free(map, n->key_str);
+		n->key_str = NULL;
+	}
+	if (n->val_str) {
+		_stp_map_str_free(map, n->val_str - sizeof(u32));
+		n->val_str = NULL;
+	}
+#endif
+}
+
+
+#ifdef MAP_OPENHASH
+/* Put node N with hash value HV into the first free slot from its
+ * home slot on.  There always is one, since the table has more slots
+ * than the map has nodes. */
+static void _stp_map_hash_add(MAP map, struct map_node *n, uint32_t hv)
+{
+	unsigned i = hv & map->hash_table_mask;
+
+	while (map->slots[i].node)
+		i = (i + 1) & map->hash_table_mask;
+	map->slots[i].node = n;
+	map->slots[i].hash = hv;
+	n->hash = hv;
+}
+
+/* Take node N out of the table, moving later nodes of the same run
+ * back so that no lookup has to step over an empty slot. */
+static void _stp_map_hash_del(MAP map, struct map_node *n)
+{
+	unsigned mask = map->hash_table_mask;
+	unsigned i = n->hash & mask, j, home;
+
+	while (map->slots[i].node != n)
+		i = (i + 1) & mask;
+
+	for (j = (i + 1) & mask; map->slots[j].node; j = (j + 1) & mask) {
+		home = map->slots[j].hash & mask;
+		/* may it move back to i, between its home and j? */
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			map->slots[i] = map->slots[j];
+			i = j;
+		}
+	}
+	map->slots[i].node = NULL;
+}
+
+/* Close the holes in the entries array, keeping the order. */
+static void _stp_map_compact(MAP map)
+{
+	unsigned i, j = 0;
+
+	for (i = 0; i < map->used; i++) {
+		struct map_node *n = map->entries[i];
+		if (n) {
+			n->index = j;
+			map->entries[j++] = n;
+		}
+	}
+	map->used = j;
+}
+
+/* Append node N to the entries array. */
+static void _stp_map_entry_add(MAP map, struct map_node *n)
+{
+	if (map->used == map->maxnum)
+		_stp_map_compact(map);
+	n->index = map->used;
+	map->entries[map->used++] = n;
+}
+
+/* Remove node N from the entries array, leaving a hole. */
+static void _stp_map_entry_del(MAP map, struct map_node *n)
+{
+	map->entries[n->index] = NULL;
+	n->index = MAP_NO_INDEX;
+	while (map->used && map->entries[map->used - 1] == NULL)
+		map->used--;
+}
+
+/* The first entry at or after index I. */
+static struct map_node *_stp_map_next_entry(MAP map, unsigned i)
+{
+	for (; i < map->used; i++)
+		if (map->entries[i])
+			return map->entries[i];
+	return NULL;
+}
+#endif
+
 
 /** @addtogroup maps 
  * Implements maps (associative arrays) and lists
@@ -59,12 +191,16 @@ static int str_eq_p (char *key1, char *key2)
 
 static struct map_node *_stp_map_start(MAP map)
 {
+#ifdef MAP_OPENHASH
+	return _stp_map_next_entry(map, 0);
+#else
 	//dbug ("%lx\n", (long)mlist_next(&map->head));
 
 	if (mlist_empty(&map->head))
 		return NULL;
 
 	return mlist_map_node(mlist_next(&map->head));
+#endif
 }
 
 /** Get the next element in a map.
@@ -79,10 +215,14 @@ static struct map_node *_stp_map_start(MAP map)
 
 static struct map_node *_stp_map_iter(MAP map, struct map_node *m)
 {
+#ifdef MAP_OPENHASH
+	return _stp_map_next_entry(map, m->index + 1);
+#else
 	if (mlist_next(&m->lnode) == &map->head)
 		return NULL;
 
 	return mlist_map_node(mlist_next(&m->lnode));
+#endif
 }
 
 static struct map_node *_stp_map_iterdel(MAP map, struct map_node *m)
@@ -102,9 +242,25 @@ static struct map_node *_stp_map_iterdel(MAP map, struct map_node *m)
 static void _stp_map_clear(MAP map)
 {
 	struct map_node *m;
+#ifdef MAP_OPENHASH
+	unsigned i;
+#endif
 
 	map->num = 0;
 
+#ifdef MAP_OPENHASH
+	for (i = 0; i < map->used; i++) {
+		m = map->entries[i];
+		if (m == NULL)
+			continue;
+		m->index = MAP_NO_INDEX;
+		_stp_map_node_free_strs(map, m);
+		mlist_add(&m->lnode, &map->pool);
+	}
+	map->used = 0;
+	memset(map->slots, 0,
+	       sizeof(struct map_slot) * (map->hash_table_mask + 1));
+#else
 	while (!mlist_empty(&map->head)) {
 		m = mlist_map_node(mlist_next(&map->head));
 
@@ -115,8 +271,10 @@ static void _stp_map_clear(MAP map)
 		mlist_del(&m->lnode);
 
 		/* add to free pool */
+		_stp_map_node_free_strs(map, m);
 		mlist_add(&m->lnode, &map->pool);
 	}
+#endif
 }
 
 static void _stp_pmap_clear(PMAP pmap)
@@ -127,6 +285,13 @@ static void _stp_pmap_clear(PMAP pmap)
 		MAP m = _stp_pmap_get_map (pmap, i);
 		_stp_map_clear(m);
 	}
+#ifdef PMAP_NODE_AGG
+	for_each_node(i) {
+		MAP m = _stp_pmap_get_node_agg(pmap, i);
+		if (m)
+			_stp_map_clear(m);
+	}
+#endif
 	_stp_map_clear(_stp_pmap_get_agg(pmap));
 }
 
@@ -139,13 +304,13 @@ static void _stp_pmap_clear(PMAP pmap)
 #define SORT_AVG   -1
 
 /* comparison function for sorts. */
-static int _stp_cmp (struct mlist_head *h1, struct mlist_head *h2,
-		     int keynum, int dir, map_get_key_fn get_key)
+static int _stp_cmp_nodes (struct map_node *n1, struct map_node *n2,
+			   int keynum, int dir, map_get_key_fn get_key)
 {
 	int64_t a = 0, b = 0;
 	int type = END;
-	key_data k1 = (*get_key)(mlist_map_node(h1), keynum, &type);
-	key_data k2 = (*get_key)(mlist_map_node(h2), keynum, NULL);
+	key_data k1 = (*get_key)(n1, keynum, &type);
+	key_data k2 = (*get_key)(n2, keynum, NULL);
 	if (type == INT64) {
 		a = k1.val;
 		b = k2.val;
@@ -186,11 +351,11 @@ static int _stp_cmp (struct mlist_head *h1, struct mlist_head *h2,
 	return 0;
 }
 
-/* swap function for bubble sort */
-static inline void _stp_swap (struct mlist_head *a, struct mlist_head *b)
+static inline int _stp_cmp (struct mlist_head *h1, struct mlist_head *h2,
+			    int keynum, int dir, map_get_key_fn get_key)
 {
-	mlist_del(a);
-	mlist_add(a, b);
+	return _stp_cmp_nodes(mlist_map_node(h1), mlist_map_node(h2),
+			      keynum, dir, get_key);
 }
 
 
@@ -203,6 +368,43 @@ static inline void _stp_swap (struct mlist_head *a, struct mlist_head *b)
  * @sa _stp_map_sortn()
  */
 
+#ifdef MAP_OPENHASH
+static void _stp_map_sort (MAP map, int keynum, int dir,
+			   map_get_key_fn get_key)
+{
+	struct map_node **a = map->entries, **b = map->sort_buf, **t;
+	unsigned n, width, i, l, lend, r, rend, k;
+
+	/* bottom-up merge sort of the entries, from a into b and back */
+	_stp_map_compact(map);
+	n = map->used;
+	for (width = 1; width < n; width *= 2) {
+		for (i = 0; i < n; i += 2 * width) {
+			l = i;
+			lend = r = min(i + width, n);
+			rend = min(i + 2 * width, n);
+			k = i;
+			while (l < lend && r < rend) {
+				if (_stp_cmp_nodes(a[l], a[r], keynum, dir, get_key))
+					b[k++] = a[r++];
+				else
+					b[k++] = a[l++];
+			}
+			while (l < lend)
+				b[k++] = a[l++];
+			while (r < rend)
+				b[k++] = a[r++];
+		}
+		t = a;
+		a = b;
+		b = t;
+	}
+	if (a != map->entries)
+		memcpy(map->entries, a, n * sizeof(*a));
+	for (i = 0; i < n; i++)
+		map->entries[i]->index = i;
+}
+#else
 static void _stp_map_sort (MAP map, int keynum, int dir,
 			   map_get_key_fn get_key)
 {
@@ -252,12 +454,56 @@ static void _stp_map_sort (MAP map, int keynum, int dir,
                 insize += insize;
         } while (nmerges > 1);
 }
+#endif
+
+/* An entry of the heap used by _stp_map_sortn(), with the position of
+ * its node in the map so that ties keep their order. */
+struct _stp_sort_item {
+	struct map_node *node;
+	unsigned pos;
+};
+
+/* Does item a sort after item b? */
+static int _stp_sort_after(struct _stp_sort_item *a, struct _stp_sort_item *b,
+			   int keynum, int dir, map_get_key_fn get_key)
+{
+	if (_stp_cmp_nodes(a->node, b->node, keynum, dir, get_key))
+		return 1;
+	if (_stp_cmp_nodes(b->node, a->node, keynum, dir, get_key))
+		return 0;
+	return a->pos > b->pos;
+}
+
+/* Move item i down the heap of num items until no child sorts after it. */
+static void _stp_sort_sift(struct _stp_sort_item *heap, unsigned num,
+			   unsigned i, int keynum, int dir,
+			   map_get_key_fn get_key)
+{
+	struct _stp_sort_item tmp;
+	unsigned c;
+
+	while ((c = 2 * i + 1) < num) {
+		if (c + 1 < num && _stp_sort_after(&heap[c + 1], &heap[c],
+						   keynum, dir, get_key))
+			c++;
+		if (!_stp_sort_after(&heap[c], &heap[i], keynum, dir, get_key))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[c];
+		heap[c] = tmp;
+		i = c;
+	}
+}
 
 /** Get the top values from an array.
  * Sorts an array such that the start of the array contains the top
- * or bottom 'n' values. Use this when sorting the entire array
- * would be too time-consuming and you are only interested in the
- * highest or lowest values.
+ * or bottom 'n' values, in order. The rest of the array keeps its
+ * order. Use this when sorting the entire array would be too
+ * time-consuming and you are only interested in the highest or
+ * lowest values.
+ *
+ * The top values are selected with a heap of 'n' entries, so this
+ * takes O(size * log n) time rather than O(size * log size).
  *
  * @param map Map
  * @param n Top (or bottom) number of elements. 0 sorts the entire array.
@@ -268,149 +514,551 @@ static void _stp_map_sort (MAP map, int keynum, int dir,
 static void _stp_map_sortn(MAP map, int n, int keynum, int dir,
 			   map_get_key_fn get_key)
 {
-	if (n == 0 || n > 30) {
+	struct _stp_sort_item *heap, item;
+	struct map_node *ptr;
+	unsigned i, k = n, pos = 0;
+
+	if (n < 0)
+		return;
+	if (n == 0 || k >= map->num) {
 		_stp_map_sort(map, keynum, dir, get_key);
-	} else {
-		struct mlist_head *head = &map->head;
-		struct mlist_head *c, *a, *last, *tmp;
-		int num, swaps = 1;
-
-		if (mlist_empty(head))
-			return;
-
-		/* start off with a modified bubble sort of the first n elements */
-		while (swaps) {
-			num = n;
-			swaps = 0;
-			a = mlist_next(head);
-			c = mlist_next(mlist_next(a));
-			while ((mlist_next(a) != head) && (--num > 0)) {
-				if (_stp_cmp(a, mlist_next(a), keynum, dir, get_key)) {
-					swaps++;
-					_stp_swap(a, mlist_next(a));
-				}
-				a = mlist_prev(c);
-				c = mlist_next(c);
-			}
+		return;
+	}
+
+	heap = _stp_kmalloc(k * sizeof(struct _stp_sort_item));
+	if (heap == NULL) {
+		_stp_map_sort(map, keynum, dir, get_key);
+		return;
+	}
+
+	/* Keep the k entries that sort first seen so far, with the one
+	 * that sorts last of them at the top of the heap. */
+	foreach (map, ptr) {
+		item.node = ptr;
+		item.pos = pos++;
+		if (item.pos < k) {
+			heap[item.pos] = item;
+			if (item.pos == k - 1)
+				for (i = k / 2; i-- > 0; )
+					_stp_sort_sift(heap, k, i, keynum, dir,
+						       get_key);
+		} else if (_stp_sort_after(&heap[0], &item, keynum, dir,
+					   get_key)) {
+			heap[0] = item;
+			_stp_sort_sift(heap, k, 0, keynum, dir, get_key);
 		}
+	}
 
-		/* Now use a kind of insertion sort for the rest of the array. */
-		/* Each element is tested to see if it should be be in the top 'n' */
-		last = a;
-		a = mlist_next(a);
-		while (a != head) {
-			tmp = mlist_next(a);
-			c = last;
-			while (c != head && _stp_cmp(c, a, keynum, dir, get_key))
-				c = mlist_prev(c);
-			if (c != last) {
-				mlist_del(a);
-				mlist_add(a, c);
-				last = mlist_prev(last);
-			}
-			a = tmp;
+	/* Sort them by taking the last one off the heap each time. */
+	for (i = k - 1; i > 0; i--) {
+		item = heap[0];
+		heap[0] = heap[i];
+		heap[i] = item;
+		_stp_sort_sift(heap, i, 0, keynum, dir, get_key);
+	}
+
+	/* Move them to the front. */
+#ifdef MAP_OPENHASH
+	{
+		struct map_node **b = map->sort_buf;
+		unsigned j = 0;
+
+		for (i = 0; i < k; i++) {
+			b[j++] = heap[i].node;
+			heap[i].node->index = MAP_NO_INDEX;
 		}
+		for (i = 0; i < map->used; i++) {
+			ptr = map->entries[i];
+			if (ptr && ptr->index != MAP_NO_INDEX)
+				b[j++] = ptr;
+		}
+		for (i = 0; i < j; i++) {
+			map->entries[i] = b[i];
+			b[i]->index = i;
+		}
+		map->used = j;
+	}
+#else
+	for (i = k; i-- > 0; ) {
+		mlist_del(&heap[i].node->lnode);
+		mlist_add(&heap[i].node->lnode, &map->head);
 	}
+#endif
+	_stp_kfree(heap);
 }
 
-static struct map_node *_stp_new_agg(MAP agg, struct mhlist_head *ahead,
+static struct map_node *_stp_new_agg(MAP agg, unsigned int hv,
 				     struct map_node *ptr, map_update_fn update)
 {
 	struct map_node *aptr;
 	/* copy keys and aggregate */
-	aptr = _new_map_create(agg, ahead);
+	aptr = _new_map_create(agg, hv);
 	if (aptr == NULL)
 		return NULL;
-	(*update)(agg, aptr, ptr, 0);
+	if (!(*update)(agg, aptr, ptr, 0)) {
+		_new_map_del_node(agg, aptr);
+		return NULL;
+	}
 	return aptr;
 }
 
+/* Forget the changes recorded for a per-cpu map. */
+static void _stp_map_clean(MAP m)
+{
+	struct map_node *n;
+
+	for (n = m->dirty; n; n = n->dirty_next)
+		n->dirty = 0;
+	m->dirty = NULL;
+	m->resync = 0;
+}
+
+/* Find the node of map M with the keys of node PTR, whose hash value
+ * is HV. */
+static struct map_node *_stp_map_find_keys (MAP m, struct map_node *ptr,
+					    map_cmp_fn cmp, unsigned int hv)
+{
+	struct map_node *nptr;
+	map_hash_cursor e;
+
+	map_for_each_hashed(m, hv, nptr, e) {
+		if ((*cmp)(ptr, nptr))
+			return nptr;
+	}
+	return NULL;
+}
+
+/* Fold the node of map M with the keys of PTR, if it has one, into
+ * *APTR of map AGG, creating *APTR if needed, and mark it clean.  The
+ * first node folded in replaces the old value of *APTR.
+ * Returns 0 if the aggregate map has no room for it. */
+static int _stp_agg_fold (MAP agg, struct map_node **aptr, int *first,
+			  MAP m, struct map_node *ptr, map_update_fn update,
+			  map_cmp_fn cmp, unsigned int hv)
+{
+	struct map_node *nptr = _stp_map_find_keys(m, ptr, cmp, hv);
+
+	if (nptr == NULL)
+		return 1;
+	nptr->dirty = 0;
+	if (*aptr == NULL) {
+		*aptr = _stp_new_agg(agg, hv, nptr, update);
+		if (*aptr == NULL)
+			return 0;
+	} else if (!(*update)(agg, *aptr, nptr, !*first))
+		return 0;
+	*first = 0;
+	return 1;
+}
+
+/* Merge all the nodes of map M into map AGG.
+ * Returns 0 if AGG has no room for them, and marks it for a rebuild. */
+static int _stp_agg_merge (MAP agg, MAP m, map_update_fn update,
+			   map_cmp_fn cmp)
+{
+	struct map_node *ptr, *aptr;
+#ifdef MAP_OPENHASH
+	/* walk the entries, whose hash values are at hand. */
+	foreach (m, ptr) {
+		aptr = _stp_map_find_keys(agg, ptr, cmp, ptr->hash);
+		if (aptr) {
+			if ((*update)(agg, aptr, ptr, 1))
+				continue;
+		} else if (_stp_new_agg(agg, ptr->hash, ptr, update))
+			continue;
+
+		agg->resync = 1;
+		return 0;
+	}
+#else
+	int hash_idx;
+	struct mhlist_head *head;
+	struct mhlist_node *e;
+
+	/* walk the hash chains. */
+	for (hash_idx = 0; hash_idx <= m->hash_table_mask; hash_idx++) {
+		head = &m->hashes[hash_idx];
+		mhlist_for_each_entry(ptr, e, head, hnode) {
+			/* same table size, so the same bucket */
+			aptr = _stp_map_find_keys(agg, ptr, cmp, hash_idx);
+			if (aptr) {
+				if ((*update)(agg, aptr, ptr, 1))
+					continue;
+			} else if (_stp_new_agg(agg, hash_idx, ptr, update))
+				continue;
+
+			agg->resync = 1;
+			return 0;
+		}
+	}
+#endif
+	return 1;
+}
+
+/* Recompute the aggregate of the key of per-cpu node PTR from all
+ * the per-cpu maps, and mark their nodes for it clean.
+ * Returns 0 if the aggregate map has no room for it. */
+static int _stp_pmap_agg_key (PMAP pmap, struct map_node *ptr,
+			      map_update_fn update, map_cmp_fn cmp,
+			      unsigned int hv)
+{
+	int i, first = 1;
+	MAP agg = _stp_pmap_get_agg(pmap);
+	struct map_node *aptr = _stp_map_find_keys(agg, ptr, cmp, hv);
+
+	for_each_possible_cpu(i) {
+		if (!_stp_agg_fold(agg, &aptr, &first,
+				   _stp_pmap_get_map (pmap, i),
+				   ptr, update, cmp, hv))
+			return 0;
+	}
+	return 1;
+}
+
+#ifdef PMAP_NODE_AGG
+/* Recompute the partial aggregate of NODE for the key of per-cpu
+ * node PTR from the maps of the cpus of NODE, and mark their nodes
+ * for it clean and the partial aggregate dirty.
+ * Returns 0 if the partial aggregation map has no room for it. */
+static int _stp_pmap_node_agg_key (PMAP pmap, int node, struct map_node *ptr,
+				   map_update_fn update, map_cmp_fn cmp,
+				   unsigned int hv)
+{
+	int i, first = 1;
+	MAP nagg = _stp_pmap_get_node_agg(pmap, node);
+	struct map_node *aptr = _stp_map_find_keys(nagg, ptr, cmp, hv);
+
+	for_each_possible_cpu(i) {
+		if (_stp_pmap_cpu_node(i) != node)
+			continue;
+		if (!_stp_agg_fold(nagg, &aptr, &first,
+				   _stp_pmap_get_map (pmap, i),
+				   ptr, update, cmp, hv))
+			return 0;
+	}
+	if (aptr)
+		_stp_map_touch(nagg, aptr);
+	return 1;
+}
+
+/* Recompute the aggregate for the key of node PTR of a partial
+ * aggregate from all the partial aggregates. */
+static int _stp_pmap_agg_node_key (PMAP pmap, struct map_node *ptr,
+				   map_update_fn update, map_cmp_fn cmp,
+				   unsigned int hv)
+{
+	int node, first = 1;
+	MAP nagg, agg = _stp_pmap_get_agg(pmap);
+	struct map_node *aptr = _stp_map_find_keys(agg, ptr, cmp, hv);
+
+	for_each_node(node) {
+		nagg = _stp_pmap_get_node_agg(pmap, node);
+		if (nagg && !_stp_agg_fold(agg, &aptr, &first, nagg,
+					   ptr, update, cmp, hv))
+			return 0;
+	}
+	return 1;
+}
+
+/* Bring the partial aggregate of NODE up to date with the per-cpu
+ * maps of its cpus, the same way _stp_pmap_agg() does for the whole
+ * pmap.  Returns 1 if it was rebuilt from scratch, 0 if it was
+ * updated in place, or -1 if it ran out of room. */
+static int _stp_pmap_node_agg_update (PMAP pmap, int node,
+				      map_update_fn update, map_cmp_fn cmp,
+				      map_hash_fn hash)
+{
+	int i, rebuild;
+	MAP m, nagg = _stp_pmap_get_node_agg(pmap, node);
+	struct map_node *ptr;
+
+	rebuild = nagg->resync;
+	for_each_possible_cpu(i) {
+		m = _stp_pmap_get_map (pmap, i);
+		if (_stp_pmap_cpu_node(i) == node
+		    && (!m->track_dirty || m->resync))
+			rebuild = 1;
+	}
+
+	if (rebuild) {
+		_stp_map_clear (nagg);
+		_stp_map_clean (nagg);
+		for_each_possible_cpu(i) {
+			if (_stp_pmap_cpu_node(i) == node)
+				_stp_map_clean(_stp_pmap_get_map (pmap, i));
+		}
+		for_each_possible_cpu(i) {
+			if (_stp_pmap_cpu_node(i) == node
+			    && !_stp_agg_merge(nagg, _stp_pmap_get_map (pmap, i),
+					       update, cmp))
+				return -1;
+		}
+		return 1;
+	}
+
+	for_each_possible_cpu(i) {
+		if (_stp_pmap_cpu_node(i) != node)
+			continue;
+		m = _stp_pmap_get_map (pmap, i);
+		for (ptr = m->dirty; ptr; ptr = ptr->dirty_next) {
+			if (!ptr->dirty || !_stp_map_node_hashed(ptr))
+				continue;
+			if (!_stp_pmap_node_agg_key(pmap, node, ptr, update,
+						    cmp, (*hash)(ptr)))
+				return -1;
+		}
+		_stp_map_clean(m);
+	}
+	return 0;
+}
+
+/* _stp_pmap_agg() through the partial aggregates of each node. */
+static MAP _stp_pmap_node_agg (PMAP pmap, map_update_fn update,
+			       map_cmp_fn cmp, map_hash_fn hash)
+{
+	int node, res, rebuild;
+	MAP nagg, agg = _stp_pmap_get_agg(pmap);
+	struct map_node *ptr;
+
+	rebuild = agg->resync;
+	for_each_node(node) {
+		if (_stp_pmap_get_node_agg(pmap, node) == NULL)
+			continue;
+		res = _stp_pmap_node_agg_update(pmap, node, update, cmp, hash);
+		if (res < 0)
+			goto fail;
+		if (res > 0)
+			rebuild = 1;
+	}
+
+	if (rebuild) {
+		_stp_map_clear (agg);
+		agg->resync = 0;
+		for_each_node(node) {
+			nagg = _stp_pmap_get_node_agg(pmap, node);
+			if (nagg)
+				_stp_map_clean(nagg);
+		}
+		for_each_node(node) {
+			nagg = _stp_pmap_get_node_agg(pmap, node);
+			if (nagg && !_stp_agg_merge(agg, nagg, update, cmp))
+				return NULL;
+		}
+		return agg;
+	}
+
+	for_each_node(node) {
+		nagg = _stp_pmap_get_node_agg(pmap, node);
+		if (nagg == NULL)
+			continue;
+		for (ptr = nagg->dirty; ptr; ptr = ptr->dirty_next) {
+			if (!ptr->dirty || !_stp_map_node_hashed(ptr))
+				continue;
+			if (!_stp_pmap_agg_node_key(pmap, ptr, update, cmp,
+						    (*hash)(ptr))) {
+				/* the partial aggregates are fine, so
+				 * just rebuild from them next time. */
+				for_each_node(node) {
+					nagg = _stp_pmap_get_node_agg(pmap, node);
+					if (nagg)
+						_stp_map_clean(nagg);
+				}
+				agg->resync = 1;
+				return NULL;
+			}
+		}
+		_stp_map_clean(nagg);
+	}
+	return agg;
+
+fail:
+	/* Start over next time. */
+	for_each_node(node) {
+		nagg = _stp_pmap_get_node_agg(pmap, node);
+		if (nagg) {
+			_stp_map_clean(nagg);
+			nagg->resync = 1;
+		}
+	}
+	agg->resync = 1;
+	return NULL;
+}
+#endif
+
 /** Aggregate per-cpu maps.
  * This function aggregates the per-cpu maps into an aggregated
  * map. A pointer to that aggregated map is returned.
+ *
+ * The aggregate is kept between calls.  Only the keys whose per-cpu
+ * nodes changed since the last call are recomputed, unless a per-cpu
+ * map doesn't track its changes or recycled nodes (wrap), in which
+ * case the whole aggregate is rebuilt.  On NUMA machines, this goes
+ * through partial aggregates per node (see PMAP_NODE_AGG), which are
+ * kept between calls the same way.
  * 
  * A write lock must be held on the map during this function.
  *
  * @param map A pointer to a pmap.
  * @returns a pointer to the aggregated map. Null on failure.
  */
-static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp)
+
+static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp,
+			  map_hash_fn hash)
 {
-	int i, hash;
+	int i;
 	MAP m, agg;
-	struct map_node *ptr, *aptr = NULL;
-	struct mhlist_head *head, *ahead;
-	struct mhlist_node *e, *f;
-	int quit = 0;
+	struct map_node *ptr;
+	int rebuild;
 
-	agg = _stp_pmap_get_agg(pmap);
+#ifdef PMAP_NODE_AGG
+	if (pmap->node_agg)
+		return _stp_pmap_node_agg(pmap, update, cmp, hash);
+#endif
 
-        /* FIXME. we either clear the aggregation map or clear each local map */
-	/* every time we aggregate. which would be best? */
-	_stp_map_clear (agg);
+	agg = _stp_pmap_get_agg(pmap);
 
+	rebuild = agg->resync;
 	for_each_possible_cpu(i) {
 		m = _stp_pmap_get_map (pmap, i);
-		/* walk the hash chains. */
-		for (hash = 0; hash <= m->hash_table_mask; hash++) {
-			head = &m->hashes[hash];
-			ahead = &agg->hashes[hash];
-			mhlist_for_each_entry(ptr, e, head, hnode) {
-				int match = 0;
-				mhlist_for_each_entry(aptr, f, ahead, hnode) {
-					if ((*cmp)(ptr, aptr)) {
-						match = 1;
-						break;
-					}
-				}
-				if (match)
-					(*update)(agg, aptr, ptr, 1);
-				else {
-					if (!_stp_new_agg(agg, ahead, ptr, update)) {
-                                                agg = NULL;
-						goto out;
-                                                // NB: break would head out to the for (hash...) 
-                                                // loop, which behaves badly with an agg==NULL.
-					}
+		if (!m->track_dirty || m->resync)
+			rebuild = 1;
+	}
+
+	if (!rebuild) {
+		for_each_possible_cpu(i) {
+			m = _stp_pmap_get_map (pmap, i);
+			for (ptr = m->dirty; ptr; ptr = ptr->dirty_next) {
+				/* done already for another cpu's node, or
+				 * deleted since */
+				if (!ptr->dirty || !_stp_map_node_hashed(ptr))
+					continue;
+				if (!_stp_pmap_agg_key(pmap, ptr, update, cmp,
+						       (*hash)(ptr))) {
+					agg = NULL;
+					break;
 				}
 			}
+			if (agg == NULL)
+				break;
+			_stp_map_clean(m);
 		}
+		if (agg == NULL) {
+			/* Start over next time. */
+			for_each_possible_cpu(i)
+				_stp_map_clean(_stp_pmap_get_map (pmap, i));
+			_stp_pmap_get_agg(pmap)->resync = 1;
+		}
+		return agg;
+	}
+
+	_stp_map_clear (agg);
+	agg->resync = 0;
+	for_each_possible_cpu(i) {
+		m = _stp_pmap_get_map (pmap, i);
+		_stp_map_clean(m);
 	}
 
-out:
+	for_each_possible_cpu(i) {
+		m = _stp_pmap_get_map (pmap, i);
+		if (!_stp_agg_merge(agg, m, update, cmp))
+			return NULL;
+	}
 	return agg;
 }
 
-static struct map_node *_new_map_create (MAP map, struct mhlist_head *head)
+/* The node to recycle when the wrapping map MAP is full: the oldest,
+ * after giving those referenced since the last pass another round. */
+static struct map_node *_stp_map_victim (MAP map)
+{
+	struct map_node *m;
+#if defined(MAP_LRU) && defined(MAP_OPENHASH)
+	/* ends within two turns, since every pass clears a mark */
+	for (;; map->hand++) {
+		if (map->hand >= map->used)
+			map->hand = 0;
+		m = map->entries[map->hand];
+		if (m == NULL)
+			continue;
+		if (!m->referenced)
+			break;
+		m->referenced = 0;
+	}
+	map->hand++;
+#else
+	m = _stp_map_start(map);
+#ifdef MAP_LRU
+	/* ends, since every pass clears a mark */
+	while (m->referenced) {
+		m->referenced = 0;
+		mlist_move_tail(&m->lnode, &map->head);
+		m = _stp_map_start(map);
+	}
+#endif
+#endif
+	return m;
+}
+
+/* Get a node for new keys with hash value HV (unscaled) and put it
+ * in the map, recycling the oldest node of a full wrapping map. */
+static struct map_node *_new_map_create (MAP map, unsigned int hv)
 {
 	struct map_node *m;
-	if (mlist_empty(&map->pool)) {
+	if (mlist_empty(&map->pool) && !_stp_map_grow(map)) {
 		if (!map->wrap) {
 			/* ERROR. no space left */
 			return NULL;
 		}
-		m = mlist_map_node(mlist_next(&map->head));
+		m = _stp_map_victim(map);
+#ifdef MAP_OPENHASH
+		_stp_map_hash_del(map, m);
+#ifndef MAP_LRU
+		_stp_map_entry_del(map, m);
+#endif
+#else
 		mhlist_del_init(&m->hnode);
+#endif
+		_stp_map_node_free_strs(map, m);
+		map->resync = 1;
 	} else {
 		m = mlist_map_node(mlist_next(&map->pool));
 		map->num++;
+#ifdef MAP_OPENHASH
+		mlist_del(&m->lnode);
+#endif
 	}
+#ifdef MAP_LRU
+	m->referenced = 0;
+#endif
+
+#ifdef MAP_OPENHASH
+	/* a row recycled by the clock keeps its slot */
+	if (m->index == MAP_NO_INDEX)
+		_stp_map_entry_add(map, m);
+	_stp_map_hash_add(map, m, hv);
+#else
 	mlist_move_tail(&m->lnode, &map->head);
 
 	/* add node to new hash list */
-	mhlist_add_head(&m->hnode, head);
+	mhlist_add_head(&m->hnode, &map->hashes[hv & map->hash_table_mask]);
+#endif
 	return m;
 }
 
 static void _new_map_del_node (MAP map, struct map_node *n)
 {
+#ifdef MAP_OPENHASH
+	_stp_map_hash_del(map, n);
+	_stp_map_entry_del(map, n);
+#else
 	/* remove node from old hash list */
 	mhlist_del_init(&n->hnode);
 
 	/* remove from entry list */
 	mlist_del(&n->lnode);
+#endif
 
 	/* add it back to the pool */
+	_stp_map_node_free_strs(map, n);
 	mlist_add(&n->lnode, &map->pool);
 
 	map->num--;
@@ -436,20 +1084,77 @@ static int _new_map_set_str (MAP map, char *dst, char *val, int add)
 	return 0;
 }
 
+#ifdef MAP_VARSTRINGS
+/* Set or append to the string value of node N, moving it to a larger
+ * block if it outgrows the one it is in. */
+static int _new_map_set_vstr (MAP map, struct map_node *n, char *val, int add)
+{
+	char *old = n->val_str, *blk, *str;
+	unsigned olen = (old && add) ? _stp_map_str_len(old) : 0;
+	unsigned len;
+
+	if (val == NULL)
+		val = "";
+	len = min_t(unsigned, olen + strnlen(val, MAP_STRING_LENGTH - 1),
+		    MAP_STRING_LENGTH - 1);
+
+	if (old && _stp_map_str_room(old - sizeof(u32))
+	    >= sizeof(u32) + len + 1) {
+		blk = old - sizeof(u32);
+		str = old;
+	} else {
+		blk = _stp_map_str_alloc(map, sizeof(u32) + len + 1);
+		if (blk == NULL)
+			return -1;
+		str = blk + sizeof(u32);
+		if (olen)
+			memcpy(str, old, olen);
+	}
+	memmove(str + olen, val, len - olen);
+	str[len] = 0;
+	*(u32 *)blk = len;
+
+	if (old && str != old)
+		_stp_map_str_free(map, old - sizeof(u32));
+	n->val_str = str;
+	return 0;
+}
+#endif
+
 static int _new_map_set_stat (MAP map, struct stat_data *sd, int64_t val, int add, int s1, int s2, int s3, int s4, int s5)
 {
+	Hist st = &map->hist;
+
+	st->bit_shift = map->bit_shift;
+	st->stat_ops = map->stat_ops;
 	if (!add) {
-		Hist st = &map->hist;
 		sd->count = 0;
-		if (st->type != HIST_NONE) {
+		if (st->stat_ops & STAT_HIST_SPARSE) {
+			/* keeps any array of all buckets for later */
+			_stp_stat_sparse(sd)->nz = 0;
+		} else if (st->type != HIST_NONE) {
 			int j;
 			for (j = 0; j < st->buckets; j++)
 				sd->histogram[j] = 0;
 		}
+		if (st->stat_ops & STAT_OP_QUANTILE)
+			memset(_stp_stat_sketch(st, sd), 0,
+			       STAT_SKETCH_SIZE(st->stat_ops));
+	}
+#ifdef MAP_SPARSE_HIST
+	if (st->stat_ops & STAT_HIST_SPARSE) {
+		struct stat_sparse *sp = _stp_stat_sparse(sd);
+
+		/* Get the array of all buckets before the slots can
+		 * run out, so that adding the value cannot fail. */
+		if (sp->nz == STAT_SPARSE_SLOTS && sp->dense == NULL) {
+			sp->dense = _stp_map_hist_alloc(map);
+			if (sp->dense == NULL)
+				return -1;
+		}
 	}
-	(&map->hist)->bit_shift = map->bit_shift;
-	(&map->hist)->stat_ops = map->stat_ops;
-	__stp_stat_add (&map->hist, sd, val, s1, s2, s3, s4, s5);
+#endif
+	__stp_stat_add (st, sd, val, s1, s2, s3, s4, s5);
 	return 0;
 }
 
@@ -468,6 +1173,9 @@ static int _new_map_copy_stat (MAP map, struct stat_data *sd1, struct stat_data
                         for (j = 0; j < st->buckets; j++)
                                 sd1->histogram[j] = 0;
                 }
+		if (st->stat_ops & STAT_OP_QUANTILE)
+			memset(&sd1->histogram[st->buckets], 0,
+			       STAT_SKETCH_SIZE(st->stat_ops));
         } else if (add && sd1->count > 0 && sd2->count > 0) {
 		sd1_count = sd1->count;
 		sd1_avg_s = sd1->avg_s;
@@ -498,11 +1206,21 @@ static int _new_map_copy_stat (MAP map, struct stat_data *sd1, struct stat_data
                         sd1->variance_s = _stp_div64(NULL, (S11 + S12 + S21 + S22), (sd1->count - 1));
                         sd1->variance = sd1->variance_s >> (2 * sd2->shift);
                 }
-		if (st->type != HIST_NONE) {
+		if (sd2->stat_ops & STAT_HIST_SPARSE) {
+			_stp_stat_sparse_merge(st, sd1->histogram,
+					       _stp_stat_sparse(sd2), 1);
+		} else if (st->type != HIST_NONE) {
 			int j;
 			for (j = 0; j < st->buckets; j++)
 				sd1->histogram[j] += sd2->histogram[j];
 		}
+		if (st->stat_ops & STAT_OP_QUANTILE) {
+			int64_t *sk1 = &sd1->histogram[st->buckets];
+			int64_t *sk2 = &sd2->histogram[_stp_stat_hist_words(st, sd2->stat_ops)];
+			int j;
+			for (j = 0; j < STAT_QUANTILE_BUCKETS; j++)
+				sk1[j] += sk2[j];
+		}
 	} else {
 		sd1->count = sd2->count;
 		sd1->sum = sd2->sum;
@@ -514,12 +1232,23 @@ static int _new_map_copy_stat (MAP map, struct stat_data *sd1, struct stat_data
                         sd1->variance_s = sd2->variance_s;
                         sd1->variance = sd2->variance_s >> (2 * sd2->shift);
                 }
-		if (st->type != HIST_NONE) {
+		if (sd2->stat_ops & STAT_HIST_SPARSE) {
+			_stp_stat_sparse_merge(st, sd1->histogram,
+					       _stp_stat_sparse(sd2), 0);
+		} else if (st->type != HIST_NONE) {
 			int j;
 			for (j = 0; j < st->buckets; j++)
 				sd1->histogram[j] = sd2->histogram[j];
 		}
+		if (st->stat_ops & STAT_OP_QUANTILE)
+			memcpy(&sd1->histogram[st->buckets],
+			       &sd2->histogram[_stp_stat_hist_words(st, sd2->stat_ops)],
+			       STAT_SKETCH_SIZE(st->stat_ops));
 	}
+	/* sd1 may be copied on in turn, from a partial aggregate; its
+	   histogram has all buckets whatever sd2 had */
+	if (sd2)
+		sd1->stat_ops = sd2->stat_ops & ~STAT_HIST_SPARSE;
 	return 0;
 }
 
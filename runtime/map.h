@@ -50,6 +50,56 @@
 #define MAP_STRING_LENGTH MAXSTRINGLEN
 #endif
 
+/** With STP_MAP_VARSTRINGS, string keys and values are kept in
+    per-map storage sized to the actual strings, instead of reserving
+    MAP_STRING_LENGTH bytes for each of them in every node.  The
+    MAP_STRING_LENGTH limit on their length still applies.  Only the
+    kernel runtime supports this. */
+#if defined(STP_MAP_VARSTRINGS) && defined(__KERNEL__)
+#define MAP_VARSTRINGS 1
+#endif
+
+/** With STP_MAP_OPENHASH, maps find their nodes through an open
+    addressing table whose slots carry the full hash of the keys next
+    to the node pointer, so a lookup rarely touches more than one
+    cache line before the node itself.  Iteration walks a dense array
+    of the live nodes instead of a linked list.  Only the kernel
+    runtime supports this. */
+#if defined(STP_MAP_OPENHASH) && defined(__KERNEL__)
+#define MAP_OPENHASH 1
+#endif
+
+/** With STP_MAP_SPARSE_HIST, the per-cpu copies of arrays of
+    histograms keep the histogram of each key as a few (bucket, count)
+    slots, and only allocate all the buckets for keys whose values
+    spread over more buckets than that.  Aggregation adds up just the
+    used buckets.  The aggregate keeps all buckets.  Only the kernel
+    runtime supports this. */
+#if defined(STP_MAP_SPARSE_HIST) && defined(__KERNEL__)
+#define MAP_SPARSE_HIST 1
+#endif
+
+/** With STP_MAP_LRU, a full wrapping ("%") array makes room by
+    evicting a row that has not been used lately rather than the
+    oldest one.  Lookups and updates mark their row as referenced; the
+    eviction skips referenced rows, clearing their mark and moving them
+    to the back of the line, as in the CLOCK algorithm.  With
+    STP_MAP_OPENHASH, the line is the entries array, which a clock hand
+    goes around, and new rows take the slot of the row they replace. */
+#ifdef STP_MAP_LRU
+#define MAP_LRU 1
+#endif
+
+/** On NUMA machines, pmaps keep a partial aggregate per node, in that
+    node's memory, of the per-cpu maps of its cpus.  Aggregation first
+    brings the partial aggregates up to date, then merges them, so
+    that a changed key is looked up in the maps of the cpus of its node
+    and in one map per node, rather than in the maps of all cpus.
+    Define STP_PMAP_FLAT_AGG to aggregate the per-cpu maps directly. */
+#if defined(__KERNEL__) && defined(CONFIG_NUMA) && !defined(STP_PMAP_FLAT_AGG)
+#define PMAP_NODE_AGG 1
+#endif
+
 /** @cond DONT_INCLUDE */
 #define INT64 0
 #define STRING 1
@@ -69,15 +119,53 @@ typedef union {
 
 /* basic map element */
 struct map_node {
-	/* list of other nodes in the map */
+	/* list of other nodes in the map, or in the pool */
 	struct mlist_head lnode;
 
+#ifdef MAP_OPENHASH
+	/* hash value of the keys, and place in the entries array */
+	uint32_t hash;
+	unsigned index;
+#else
 	/* list of nodes with the same hash value */
 	struct mhlist_node hnode;
+#endif
+
+	/* changed since the last aggregation (per-cpu maps of a pmap),
+	   and the next such node */
+	int dirty;
+	struct map_node *dirty_next;
+
+#ifdef MAP_LRU
+	/* used since the eviction last passed over it */
+	int referenced;
+#endif
+
+#ifdef MAP_VARSTRINGS
+	/* the string keys, in one block, and the string value */
+	char *key_str;
+	char *val_str;
+#endif
 };
 
+#ifdef MAP_VARSTRINGS
+/* String blocks come in sizes of 16 << class bytes. */
+#define MAP_STR_CLASSES 13
+#endif
+
 #define mlist_map_node(head) mlist_entry((head), struct map_node, lnode)
 
+#ifdef MAP_OPENHASH
+/* index of a node that is not in the map */
+#define MAP_NO_INDEX (~0U)
+
+/* A slot of the open addressing table.  An empty slot has no node. */
+struct map_slot {
+	struct map_node *node;
+	uint32_t hash;
+};
+#endif
+
 /* This structure contains all information about a map.
  * It is allocated once when _stp_map_new() is called. 
  */
@@ -98,11 +186,43 @@ struct map_root {
 	int stat_ops;
 
 #ifdef __KERNEL__
+	/* the first nodes, allocated with the map */
 	void *node_mem;
+
+	/* further nodes, allocated in chunks of chunk_nodes as needed */
+	void **node_chunks;
+	unsigned num_chunks;
+	unsigned chunk_nodes;
+	unsigned node_size;
+
+	/* number of nodes allocated so far, at most maxnum */
+	unsigned num_nodes;
+
+	/* cpu whose NUMA node the memory comes from, or -1 */
+	int cpu;
+
+	/* next chunk, allocated ahead of time by _stp_map_refill_fn */
+	void *spare_chunk;
+
+	/* on _stp_map_list while the map can still grow */
+	struct list_head map_list;
 #endif
 
+#ifdef MAP_OPENHASH
+	/* current entries in order, with holes left by deletions, and
+	   the number of slots in use including holes; sort_buf is
+	   scratch space for sorting them */
+	struct map_node **entries;
+	struct map_node **sort_buf;
+	unsigned used;
+#ifdef MAP_LRU
+	/* where the next eviction looks for a row to recycle */
+	unsigned hand;
+#endif
+#else
 	/* linked list of current entries */
 	struct mlist_head head;
+#endif
 
 	/* pool of unused entries. */
 	struct mlist_head pool;
@@ -110,9 +230,38 @@ struct map_root {
 	/* used if this map's nodes contain stats */
 	struct _Hist hist;
 
+	/* For the per-cpu maps of a pmap, the nodes changed since the
+	   last aggregation, which is all it needs to fold in.  If
+	   track_dirty is not set, every aggregation starts from scratch. */
+	struct map_node *dirty;
+	int track_dirty;
+
+	/* set when a node was recycled to make room (wrap), so the
+	   aggregate needs rebuilding from scratch */
+	int resync;
+
+#ifdef MAP_VARSTRINGS
+	/* free lists of string blocks by size, and the chunks they
+	   are carved from */
+	void *str_free[MAP_STR_CLASSES];
+	void *str_chunks;
+#endif
+
+#ifdef MAP_SPARSE_HIST
+	/* chunks that the bucket arrays of sparse histograms are carved
+	   from, and the room left in the latest one */
+	void *hist_chunks;
+	char *hist_free;
+	size_t hist_room;
+#endif
+
 	/* the hash table for this array */
         unsigned hash_table_mask;
+#ifdef MAP_OPENHASH
+	struct map_slot slots[0]; /* dynamically allocated at tail */
+#else
 	struct mhlist_head hashes[0]; /* dynamically allocated at tail */
+#endif
 };
 
 /** All maps are of this type. */
@@ -122,8 +271,75 @@ struct pmap; /* defined in map_runtime.h */
 typedef struct pmap *PMAP;
 
 typedef key_data (*map_get_key_fn)(struct map_node *mn, int n, int *type);
-typedef void (*map_update_fn)(MAP m, struct map_node *dst, struct map_node *src, int add);
+typedef int (*map_update_fn)(MAP m, struct map_node *dst, struct map_node *src, int add);
 typedef int (*map_cmp_fn)(struct map_node *dst, struct map_node *src);
+typedef unsigned int (*map_hash_fn)(struct map_node *n);
+
+
+/* Record a change to node N, for incremental pmap aggregation. */
+static inline void _stp_map_touch(MAP map, struct map_node *n)
+{
+	if (map->track_dirty && !n->dirty) {
+		n->dirty = 1;
+		n->dirty_next = map->dirty;
+		map->dirty = n;
+	}
+}
+
+
+/* Record a use of node N, for picking which node to evict.  Readers
+ * may race to set the mark, which is harmless. */
+static inline void _stp_map_ref(MAP map, struct map_node *n)
+{
+#ifdef MAP_LRU
+	if (map->wrap && !n->referenced)
+		n->referenced = 1;
+#endif
+}
+
+
+/* Prepare node N for the pool. */
+static inline void _stp_map_node_init(struct map_node *n)
+{
+#ifdef MAP_OPENHASH
+	n->index = MAP_NO_INDEX;
+#else
+	INIT_MHLIST_NODE(&n->hnode);
+#endif
+}
+
+/* Is node N in its map? */
+static inline int _stp_map_node_hashed(struct map_node *n)
+{
+#ifdef MAP_OPENHASH
+	return n->index != MAP_NO_INDEX;
+#else
+	return !mhlist_unhashed(&n->hnode);
+#endif
+}
+
+
+/** Loop through the nodes of a map that may have keys with hash value
+ * hv (unscaled).  The caller compares the keys.
+ * @param map
+ * @param hv hash value
+ * @param n struct map_node pointer set to each node
+ * @param c a map_hash_cursor
+ */
+#ifdef MAP_OPENHASH
+typedef unsigned map_hash_cursor;
+#define map_for_each_hashed(map, hv, n, c)				\
+	for (c = (hv) & (map)->hash_table_mask;				\
+	     ((n) = (map)->slots[c].node) != NULL;			\
+	     c = (c + 1) & (map)->hash_table_mask)			\
+		if ((map)->slots[c].hash != (uint32_t)(hv)) {} else
+#else
+typedef struct mhlist_node *map_hash_cursor;
+#define map_for_each_hashed(map, hv, n, c)				\
+	mhlist_for_each_entry(n, c,					\
+			      &(map)->hashes[(hv) & (map)->hash_table_mask], \
+			      hnode)
+#endif
 
 
 /** Loop through all elements of a map or list.
@@ -166,9 +382,14 @@ static struct map_node * _stp_map_iter(MAP map, struct map_node *m);
 static void _stp_map_del(MAP map);
 static void _stp_map_clear(MAP map);
 
-static struct map_node *_new_map_create (MAP map, struct mhlist_head *head);
+static struct map_node *_new_map_create (MAP map, unsigned int hv);
 static int _new_map_set_int64 (MAP map, int64_t *dst, int64_t val, int add);
 static int _new_map_set_str (MAP map, char* dst, char *val, int add);
+#ifdef MAP_VARSTRINGS
+static int _new_map_set_vstr (MAP map, struct map_node *n, char *val, int add);
+static unsigned _stp_map_str_size(const char *s);
+static char *_stp_map_str_put(char **p, const char *s);
+#endif
 static void _new_map_del_node (MAP map, struct map_node *n);
 static PMAP _stp_pmap_new_hstat_linear (unsigned max_entries, int wrap,
 					int node_size, int start, int stop,
@@ -176,8 +397,9 @@ static PMAP _stp_pmap_new_hstat_linear (unsigned max_entries, int wrap,
 static PMAP _stp_pmap_new_hstat_log (unsigned max_entries, int wrap, int node_size);
 static PMAP _stp_pmap_new_hstat (unsigned max_entries, int wrap, int node_size);
 static void _stp_pmap_del(PMAP pmap);
-static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp);
-static struct map_node *_stp_new_agg(MAP agg, struct mhlist_head *ahead,
+static MAP _stp_pmap_agg (PMAP pmap, map_update_fn update, map_cmp_fn cmp,
+			  map_hash_fn hash);
+static struct map_node *_stp_new_agg(MAP agg, unsigned int hv,
 				     struct map_node *ptr, map_update_fn update);
 static int _new_map_set_stat (MAP map, struct stat_data *dst, int64_t val, int add, int s1, int s2, int s3, int s4, int s5);
 static int _new_map_copy_stat (MAP map, struct stat_data *dst, struct stat_data *src, int add);
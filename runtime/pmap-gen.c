@@ -52,95 +52,72 @@ static int KEYSYM(pmap_key_cmp) (struct map_node *m1, struct map_node *m2)
 			return 0;
 }
 
-/* copy keys for m2 -> m1 */
-static void KEYSYM(pmap_copy_keys) (struct map_node *m1, struct map_node *m2)
+/* returns the (unscaled) hash of the keys of a node */
+static unsigned int KEYSYM(pmap_key_hash) (struct map_node *m)
+{
+	struct KEYSYM(map_node) *n = KEYSYM(get_map_node)(m);
+	return KEYSYM(hash) (ALLKEYS(n->key));
+}
+
+/* copy keys for m2 -> m1; returns 0 if there is no room for them */
+static int KEYSYM(pmap_copy_keys) (MAP m, struct map_node *m1, struct map_node *m2)
 {
 	struct KEYSYM(map_node) *dst = KEYSYM(get_map_node)(m1);
 	struct KEYSYM(map_node) *src = KEYSYM(get_map_node)(m2);
-#if KEY1_TYPE == STRING
-	str_copy (dst->key1, src->key1); 
-#else
-	dst->key1 = src->key1;
-#endif
-#if KEY_ARITY > 1
-#if KEY2_TYPE == STRING
-	str_copy (dst->key2, src->key2); 
-#else
-	dst->key2 = src->key2;
-#endif
-#if KEY_ARITY > 2
-#if KEY3_TYPE == STRING
-	str_copy (dst->key3, src->key3); 
-#else
-	dst->key3 = src->key3;
-#endif
-#if KEY_ARITY > 3
-#if KEY4_TYPE == STRING
-	str_copy (dst->key4, src->key4); 
-#else
-	dst->key4 = src->key4;
-#endif
-#if KEY_ARITY > 4
-#if KEY5_TYPE == STRING
-	str_copy (dst->key5, src->key5); 
-#else
-	dst->key5 = src->key5;
-#endif
-#if KEY_ARITY > 5
-#if KEY6_TYPE == STRING
-	str_copy (dst->key6, src->key6); 
-#else
-	dst->key6 = src->key6;
-#endif
-#if KEY_ARITY > 6
-#if KEY7_TYPE == STRING
-	str_copy (dst->key7, src->key7); 
-#else
-	dst->key7 = src->key7;
-#endif
-#if KEY_ARITY > 7
-#if KEY8_TYPE == STRING
-	str_copy (dst->key8, src->key8); 
-#else
-	dst->key8 = src->key8;
-#endif
-#if KEY_ARITY > 8
-#if KEY9_TYPE == STRING
-	str_copy (dst->key9, src->key9); 
-#else
-	dst->key9 = src->key9;
-#endif
-#endif
-#endif
-#endif
-#endif
-#endif
-#endif
-#endif
+
+#ifdef MAP_VARSTRINGS
+	/* already there; the keys of a node never change */
+	if (dst->node.key_str)
+		return 1;
 #endif
+	return KEYSYM(keycpy)(m, dst, ALLKEYS(src->key));
 }
 
-/* update the keys and value of a map_node */
-static void KEYSYM(pmap_update_node) (MAP m, struct map_node *m1, struct map_node *m2, int add)
+/* update the keys and value of a map_node; returns 0 on failure */
+static int KEYSYM(pmap_update_node) (MAP m, struct map_node *m1, struct map_node *m2, int add)
 {
 	struct KEYSYM(map_node) *src, * dst = KEYSYM(get_map_node)(m1);
 
-	if (!m2) {
-		MAP_COPY_VAL(m, dst, NULLRET, 0);
-		return;
-	}
+	if (!m2)
+		return MAP_COPY_VAL(m, dst, NULLRET, 0) == 0;
 
 	src = KEYSYM(get_map_node)(m2);
-	if (!add)
-		KEYSYM(pmap_copy_keys)(m1, m2);
-	MAP_COPY_VAL(m, dst, MAP_GET_VAL(src), add);
+	if (!add && !KEYSYM(pmap_copy_keys)(m, m1, m2))
+		return 0;
+	return MAP_COPY_VAL(m, dst, MAP_GET_VAL(src), add) == 0;
 }
 
 #if VALUE_TYPE == INT64 || VALUE_TYPE == STRING
-static PMAP KEYSYM(_stp_pmap_new) (unsigned max_entries, int wrap)
+/*
+ * _stp_pmap_new* ()
+ * @param max_entries (KEY_MAPENTRIES and associated parameter)
+ * @param wrap (KEY_STAT_WRAP)
+ */
+static PMAP KEYSYM(_stp_pmap_new) (int first_arg, ...)
 {
-	PMAP pmap = _stp_pmap_new (max_entries, wrap,
-				   sizeof(struct KEYSYM(map_node)));
+	int max_entries=0, wrap=0;
+	int arg = first_arg;
+	PMAP pmap;
+	va_list ap;
+
+	va_start (ap, first_arg);
+	do {
+		switch (arg) {
+		case KEY_MAPENTRIES:
+			max_entries = va_arg(ap, int);
+			break;
+		case KEY_STAT_WRAP:
+			wrap = 1;
+			break;
+		default:
+			_stp_warn ("Unknown argument %d\n", arg);
+		}
+		arg = va_arg(ap, int);
+	} while (arg);
+	va_end (ap);
+
+	pmap = _stp_pmap_new (max_entries, wrap,
+			      sizeof(struct KEYSYM(map_node)));
 	return pmap;
 }
 #else
@@ -156,6 +133,7 @@ KEYSYM(_stp_pmap_new) (int first_arg, ...)
 {
 	int start=0, stop=0, interval=0, bit_shift=0;
 	int max_entries=0, wrap=0, stat_ops=0, htype=0;
+	int node_size;
 	int arg = first_arg;
 	PMAP pmap;
 	va_list ap;
@@ -196,6 +174,9 @@ KEYSYM(_stp_pmap_new) (int first_arg, ...)
 			stat_ops |= STAT_OP_VARIANCE;
 			bit_shift = va_arg(ap, int);
 			break;
+		case STAT_OP_QUANTILE:
+			stat_ops |= STAT_OP_QUANTILE;
+			break;
 		default:
 			_stp_warn ("Unknown argument %d\n", arg);
 		}
@@ -203,20 +184,18 @@ KEYSYM(_stp_pmap_new) (int first_arg, ...)
 	} while (arg);
 	va_end (ap);
 
+	/* the quantile sketch goes after any histogram buckets */
+	node_size = sizeof(struct KEYSYM(map_node)) + STAT_SKETCH_SIZE(stat_ops);
+
 	switch (htype) {
 	case HIST_NONE:
-		pmap = _stp_pmap_new_hstat (max_entries, wrap,
-		                            sizeof(struct KEYSYM(map_node)));
-		pmap->bit_shift = bit_shift;
-		pmap->stat_ops = stat_ops;
+		pmap = _stp_pmap_new_hstat (max_entries, wrap, node_size);
 		break;
 	case HIST_LOG:
-		pmap = _stp_pmap_new_hstat_log (max_entries, wrap,
-		                                sizeof(struct KEYSYM(map_node)));
+		pmap = _stp_pmap_new_hstat_log (max_entries, wrap, node_size);
 		break;
 	case HIST_LINEAR:
-		pmap = _stp_pmap_new_hstat_linear (max_entries, wrap,
-		                                   sizeof(struct KEYSYM(map_node)),
+		pmap = _stp_pmap_new_hstat_linear (max_entries, wrap, node_size,
 		                                   start, stop, interval);
 		break;
 	default:
@@ -224,6 +203,8 @@ KEYSYM(_stp_pmap_new) (int first_arg, ...)
 		pmap = NULL;
 	}
 
+	if (pmap)
+		_stp_pmap_set_stat_ops (pmap, bit_shift, stat_ops);
 
 	return pmap;
 }
@@ -243,8 +224,6 @@ static inline int KEYSYM(_stp_pmap_add) (PMAP pmap, ALLKEYSD(key), VSTYPE val, i
 {
 	int res;
 	MAP m = _stp_pmap_get_map (pmap, MAP_GET_CPU());
-	m->bit_shift = pmap->bit_shift;
-	m->stat_ops = pmap->stat_ops;
 	res = KEYSYM(__stp_map_set) (m, ALLKEYS(key), val, 1, s1, s2, s3, s4, s5);
         MAP_PUT_CPU();
 	return res;
@@ -254,16 +233,16 @@ static inline int KEYSYM(_stp_pmap_add) (PMAP pmap, ALLKEYSD(key), VSTYPE val, i
 static VALTYPE KEYSYM(_stp_pmap_get_cpu) (PMAP pmap, ALLKEYSD(key))
 {
 	unsigned int hv;
-	struct mhlist_head *head;
-	struct mhlist_node *e;
+	map_hash_cursor e;
+	struct map_node *mn;
 	struct KEYSYM(map_node) *n;
 	VALTYPE res;
 	MAP map;
 
 	map = _stp_pmap_get_map (pmap, MAP_GET_CPU());
-	hv = KEYSYM(hash) (ALLKEYS(key)) & map->hash_table_mask;
-	head = &map->hashes[hv];
-	mhlist_for_each_entry(n, e, head, node.hnode) {
+	hv = KEYSYM(hash) (ALLKEYS(key));
+	map_for_each_hashed(map, hv, mn, e) {
+		n = KEYSYM(get_map_node)(mn);
 		if (KEY_EQ_P(n)) {
 			res = MAP_GET_VAL(n);
 			MAP_PUT_CPU();
@@ -279,8 +258,8 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 {
 	unsigned int hv;
 	int cpu, clear_agg = 0;
-	struct mhlist_head *head, *ahead;
-	struct mhlist_node *e;
+	map_hash_cursor e;
+	struct map_node *mn;
 	struct KEYSYM(map_node) *n;
 	struct map_node *anode = NULL;
 	MAP map, agg;
@@ -289,8 +268,8 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 
 	/* first look it up in the aggregation map */
 	agg = _stp_pmap_get_agg(pmap);
-	ahead = &agg->hashes[hv & agg->hash_table_mask];
-	mhlist_for_each_entry(n, e, ahead, node.hnode) {
+	map_for_each_hashed(agg, hv, mn, e) {
+		n = KEYSYM(get_map_node)(mn);
 		if (KEY_EQ_P(n)) {
 			anode = &n->node;
 			clear_agg = 1;
@@ -301,11 +280,11 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 	/* now total each cpu */
 	for_each_possible_cpu(cpu) {
 		map = _stp_pmap_get_map (pmap, cpu);
-		head = &map->hashes[hv & map->hash_table_mask];
-		mhlist_for_each_entry(n, e, head, node.hnode) {
+		map_for_each_hashed(map, hv, mn, e) {
+			n = KEYSYM(get_map_node)(mn);
 			if (KEY_EQ_P(n)) {
 				if (anode == NULL) {
-					anode = _stp_new_agg(agg, ahead, &n->node,
+					anode = _stp_new_agg(agg, hv, &n->node,
 							     KEYSYM(pmap_update_node));
 				} else {
 					if (clear_agg) {
@@ -324,10 +303,34 @@ static VALTYPE KEYSYM(_stp_pmap_get) (PMAP pmap, ALLKEYSD(key))
 	return NULLRET;
 }
 
+static int KEYSYM(_stp_pmap_exists) (PMAP pmap, ALLKEYSD(key))
+{
+	unsigned int hv;
+	int cpu;
+	map_hash_cursor e;
+	struct map_node *mn;
+	struct KEYSYM(map_node) *n;
+	MAP map;
+
+	hv = KEYSYM(hash) (ALLKEYS(key));
+
+	/* the key exists if any cpu has it */
+	for_each_possible_cpu(cpu) {
+		map = _stp_pmap_get_map (pmap, cpu);
+		map_for_each_hashed(map, hv, mn, e) {
+			n = KEYSYM(get_map_node)(mn);
+			if (KEY_EQ_P(n))
+				return 1;
+		}
+	}
+	/* key not found */
+	return 0;
+}
+
 static MAP KEYSYM(_stp_pmap_agg) (PMAP pmap)
 {
 	return _stp_pmap_agg(pmap, KEYSYM(pmap_update_node),
-			     KEYSYM(pmap_key_cmp));
+			     KEYSYM(pmap_key_cmp), KEYSYM(pmap_key_hash));
 }
 
 static int KEYSYM(_stp_pmap_del) (PMAP pmap, ALLKEYSD(key))
@@ -344,12 +347,23 @@ static int KEYSYM(_stp_pmap_del) (PMAP pmap, ALLKEYSD(key))
 	/* Delete in each cpu's map */
 	for_each_possible_cpu(cpu) {
 		m = _stp_pmap_get_map (pmap, cpu);
-		(void)KEYSYM(_stp_map_del_hash) (m, hv & m->hash_table_mask,
-                                                 ALLKEYS(key));
+		(void)KEYSYM(_stp_map_del_hash) (m, hv, ALLKEYS(key));
 	}
 
-	/* Note that we don't need to delete the aggregate's value,
-	 * since it isn't "live" between statements. */
+	/* The aggregates are only updated for changed keys, so drop the
+	 * key there too. */
+#ifdef PMAP_NODE_AGG
+	{
+		int node;
+		for_each_node(node) {
+			m = _stp_pmap_get_node_agg(pmap, node);
+			if (m)
+				(void)KEYSYM(_stp_map_del_hash) (m, hv, ALLKEYS(key));
+		}
+	}
+#endif
+	m = _stp_pmap_get_agg(pmap);
+	(void)KEYSYM(_stp_map_del_hash) (m, hv, ALLKEYS(key));
 	return 1;
 }
 
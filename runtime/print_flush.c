@@ -18,17 +18,61 @@
 
 static STP_DEFINE_SPINLOCK(_stp_print_lock);
 
+#ifdef STP_LOSSLESS_PRINT
+#ifndef STP_LOSSLESS_WAIT
+/* Longest time in microseconds a flush waits for room (default 10 ms) */
+#define STP_LOSSLESS_WAIT 10000
+#endif
+
+/* microseconds between attempts to write to the transport */
+#define _STP_LOSSLESS_STEP 10
+
+/* With STP_LOSSLESS_PRINT, a flush that finds the transport buffers full
+ * waits up to STP_LOSSLESS_WAIT for stapio to make room, rather than
+ * dropping the output right away.  Only where waiting is harmless:
+ * neither in interrupts nor where the probe had them disabled
+ * (IRQS_OFF), where the timer that wakes up stapio may not run, nor in
+ * stapio itself.  The time waited, and the bytes dropped anyway, add
+ * up in the per-cpu print buffer, and get reported at exit.  Returns
+ * whether to try again. */
+static int _stp_print_wait(_stp_pbuf *pb, unsigned *waited, int irqs_off)
+{
+	if (*waited >= STP_LOSSLESS_WAIT || in_interrupt() || irqs_off
+	    || current->tgid == _stp_pid)
+		return 0;
+
+	udelay(_STP_LOSSLESS_STEP);
+	*waited += _STP_LOSSLESS_STEP;
+	pb->stalled += _STP_LOSSLESS_STEP;
+	return 1;
+}
+
+#define _stp_print_dropped(pb, len) ((pb)->dropped += (len))
+#else
+#define _stp_print_wait(pb, waited, irqs_off) ((void) (waited), 0)
+#define _stp_print_dropped(pb, len) do { } while (0)
+#endif
+
 void stp_print_flush(_stp_pbuf *pb)
 {
-	size_t len = pb->len;
+	size_t len;
 	void *entry = NULL;
+	unsigned waited = 0;
+
+#ifdef _STP_DEFERRED_PRINT
+	_stp_pbuf_close_run(pb);
+#endif
+	len = pb->len;
+	pb->len = 0;
+#ifdef _STP_DEFERRED_PRINT
+	/* the data stays put; this only reserves the header */
+	_stp_pbuf_open_run(pb);
+#endif
 
 	/* check to see if there is anything in the buffer */
 	if (likely(len == 0))
 		return;
 
-	pb->len = 0;
-
 	if (unlikely(_stp_transport_get_state() != STP_TRANSPORT_RUNNING))
 		return;
 
@@ -50,8 +94,9 @@ void stp_print_flush(_stp_pbuf *pb)
 				bufp += bytes_reserved;
 				len -= bytes_reserved;
 			}
-			else {
+			else if (!_stp_print_wait(pb, &waited, irqs_disabled())) {
 				atomic_inc(&_stp_transport_failures);
+				_stp_print_dropped(pb, len);
 				break;
 			}
 		}
@@ -65,15 +110,19 @@ void stp_print_flush(_stp_pbuf *pb)
 					.pdu_len = len};
 		size_t bytes_reserved;
 
-		bytes_reserved = _stp_data_write_reserve(sizeof(struct _stp_trace), &entry);
-		if (likely(entry && bytes_reserved > 0)) {
-			/* prevent unaligned access by using memcpy() */
-			memcpy(_stp_data_entry_data(entry), &t, sizeof(t));
-			_stp_data_write_commit(entry);
-		}
-		else {
-			atomic_inc(&_stp_transport_failures);
-			return;
+		for (;;) {
+			bytes_reserved = _stp_data_write_reserve(sizeof(struct _stp_trace), &entry);
+			if (likely(entry && bytes_reserved > 0)) {
+				/* prevent unaligned access by using memcpy() */
+				memcpy(_stp_data_entry_data(entry), &t, sizeof(t));
+				_stp_data_write_commit(entry);
+				break;
+			}
+			else if (!_stp_print_wait(pb, &waited, irqs_disabled())) {
+				atomic_inc(&_stp_transport_failures);
+				_stp_print_dropped(pb, len);
+				return;
+			}
 		}
 
 		while (len > 0) {
@@ -85,8 +134,9 @@ void stp_print_flush(_stp_pbuf *pb)
 				bufp += bytes_reserved;
 				len -= bytes_reserved;
 			}
-			else {
+			else if (!_stp_print_wait(pb, &waited, irqs_disabled())) {
 				atomic_inc(&_stp_transport_failures);
+				_stp_print_dropped(pb, len);
 				break;
 			}
 		}
@@ -105,7 +155,47 @@ void stp_print_flush(_stp_pbuf *pb)
 	if (unlikely(_stp_ctl_send(STP_REALTIME_DATA, pb->buf, len) <= 0))
 		atomic_inc (&_stp_transport_failures);
 
-#else  /* STP_TRANSPORT_VERSION != 1 */
+#elif defined(_STP_PERCPU_STREAM)
+	{
+		unsigned long flags;
+		struct context* __restrict__ c = NULL;
+		struct _stp_trace t = { .pdu_len = len };
+		size_t bytes_reserved;
+
+		/* Each cpu writes to its own relay buffer, so nothing but
+		 * probes (see the reentrancy note below) and interrupts on
+		 * this cpu can get in the way; no global lock is needed.
+		 * The header and the data go in one reservation, and the
+		 * sequence number is only taken once that succeeded, so
+		 * that stapio sees no gaps from dropped output. */
+		c = _stp_runtime_entryfn_get_context();
+		for (;;) {
+			local_irq_save(flags);
+			bytes_reserved = _stp_data_write_reserve(sizeof(t) + len,
+								 &entry);
+			if (likely(entry && bytes_reserved == sizeof(t) + len)) {
+				unsigned char *data = _stp_data_entry_data(entry);
+
+				t.sequence = _stp_seq_inc();
+				/* prevent unaligned access by using memcpy() */
+				memcpy(data, &t, sizeof(t));
+				memcpy(data + sizeof(t), pb->buf, len);
+				_stp_data_write_commit(entry);
+				local_irq_restore(flags);
+				break;
+			}
+			local_irq_restore(flags);
+
+			if (!_stp_print_wait(pb, &waited, irqs_disabled())) {
+				atomic_inc(&_stp_transport_failures);
+				_stp_print_dropped(pb, len);
+				break;
+			}
+		}
+		_stp_runtime_entryfn_put_context(c);
+	}
+
+#else  /* STP_TRANSPORT_VERSION != 1 && !_STP_PERCPU_STREAM */
 	{
 		unsigned long flags;
 		struct context* __restrict__ c = NULL;
@@ -129,6 +219,16 @@ void stp_print_flush(_stp_pbuf *pb)
 		 */
 		c = _stp_runtime_entryfn_get_context();
 
+		/* With STP_LOSSLESS_PRINT, a flush waits for room without
+		 * the lock, and with irqs as the probe had them, while none
+		 * of it went to the transport yet.  For relay_v2 that is
+		 * always so: a reservation there is all or nothing, as
+		 * __stp_relay_switch_subbuf never splits one.  The
+		 * ring_buffer transport does split a flush at
+		 * __STP_MAX_RESERVE_SIZE, though, and once part of it is
+		 * in, no other cpu's output may come in between, so then
+		 * the lock stays held while waiting.  Other flushes spin
+		 * on it meanwhile, which STP_LOSSLESS_WAIT bounds. */
 		dbug_trans(1, "calling _stp_data_write...\n");
 		stp_spin_lock_irqsave(&_stp_print_lock, flags);
 		while (len > 0) {
@@ -143,13 +243,29 @@ void stp_print_flush(_stp_pbuf *pb)
 				len -= bytes_reserved;
 			}
 			else {
-			    atomic_inc(&_stp_transport_failures);
-			    break;
+				int again;
+
+				if (bufp == pb->buf) {
+					stp_spin_unlock_irqrestore(&_stp_print_lock,
+								   flags);
+					again = _stp_print_wait(pb, &waited,
+								irqs_disabled());
+					stp_spin_lock_irqsave(&_stp_print_lock,
+							      flags);
+				}
+				else
+					again = _stp_print_wait(pb, &waited,
+								irqs_disabled_flags(flags));
+				if (again)
+					continue;
+				atomic_inc(&_stp_transport_failures);
+				_stp_print_dropped(pb, len);
+				break;
 			}
 		}
 		stp_spin_unlock_irqrestore(&_stp_print_lock, flags);
 		_stp_runtime_entryfn_put_context(c);
 	}
-#endif /* STP_TRANSPORT_VERSION != 1 */
+#endif /* STP_TRANSPORT_VERSION != 1 && !_STP_PERCPU_STREAM */
 #endif /* !STP_BULKMODE */
 }
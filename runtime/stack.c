@@ -611,12 +611,14 @@ static void _stp_stack_kernel_sprint(char *str, int size, struct context* c,
 	 * then copy the result into the output string
 	 * and clear the print buffer. */
 	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
+	int len;
 	_stp_print_flush();
 
 	_stp_stack_kernel_print(c, sym_flags);
 
-	strlcpy(str, pb->buf, size < (int)pb->len ? size : (int)pb->len);
-	pb->len = 0;
+	len = pb->len - _STP_PBUF_START;
+	strlcpy(str, pb->buf + _STP_PBUF_START, size < len ? size : len);
+	pb->len = _STP_PBUF_START;
 }
 
 static void _stp_stack_user_sprint(char *str, int size, struct context* c,
@@ -628,12 +630,14 @@ static void _stp_stack_user_sprint(char *str, int size, struct context* c,
 	 * then copy the result into the output string
 	 * and clear the print buffer. */
 	_stp_pbuf *pb = per_cpu_ptr(Stp_pbuf, smp_processor_id());
+	int len;
 	_stp_print_flush();
 
 	_stp_stack_user_print(c, sym_flags);
 
-	strlcpy(str, pb->buf, size < (int)pb->len ? size : (int)pb->len);
-	pb->len = 0;
+	len = pb->len - _STP_PBUF_START;
+	strlcpy(str, pb->buf + _STP_PBUF_START, size < len ? size : len);
+	pb->len = _STP_PBUF_START;
 }
 
 #endif /* _STACK_C_ */
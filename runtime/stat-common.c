@@ -123,6 +123,145 @@ static int _stp_val_to_bucket(int64_t val)
 	return res;
 }
 
+/* The number of words the histogram of a stat_data with stat_ops
+ * takes, for histogram parameters st. */
+static inline int _stp_stat_hist_words(Hist st, int stat_ops)
+{
+	return (stat_ops & STAT_HIST_SPARSE) ? STAT_SPARSE_WORDS : st->buckets;
+}
+
+/* The quantile sketch of sd, or NULL if it has none. */
+static inline int64_t *_stp_stat_sketch(Hist st, stat_data *sd)
+{
+	if (!(st->stat_ops & STAT_OP_QUANTILE))
+		return NULL;
+	return &sd->histogram[_stp_stat_hist_words(st, st->stat_ops)];
+}
+
+static inline struct stat_sparse *_stp_stat_sparse(stat_data *sd)
+{
+	return (struct stat_sparse *)sd->histogram;
+}
+
+/* Moves the counts of sparse histogram sp into its array of all
+ * buckets, which it must have. */
+static void _stp_stat_sparse_expand(Hist st, struct stat_sparse *sp)
+{
+	unsigned i;
+
+	memset(sp->dense, 0, st->buckets * sizeof(int64_t));
+	for (i = 0; i < sp->nz; i++)
+		sp->dense[sp->bucket[i]] = sp->count[i];
+	sp->nz = STAT_SPARSE_DENSE;
+}
+
+/* Counts a value in bucket n of sparse histogram sp.  Once the slots
+ * are all used, sp must have an array of all buckets to move to. */
+static void _stp_stat_sparse_add(Hist st, struct stat_sparse *sp, int n)
+{
+	unsigned i;
+
+	if (sp->nz != STAT_SPARSE_DENSE) {
+		for (i = 0; i < sp->nz; i++) {
+			if (sp->bucket[i] == n) {
+				sp->count[i]++;
+				return;
+			}
+		}
+		if (sp->nz < STAT_SPARSE_SLOTS) {
+			sp->bucket[sp->nz] = n;
+			sp->count[sp->nz++] = 1;
+			return;
+		}
+		if (sp->dense == NULL)
+			return;
+		_stp_stat_sparse_expand(st, sp);
+	}
+	sp->dense[n]++;
+}
+
+/* Adds the buckets of sparse histogram sp to the histogram h of all
+ * buckets, or copies them to it if !add. */
+static void _stp_stat_sparse_merge(Hist st, int64_t *h,
+				   struct stat_sparse *sp, int add)
+{
+	unsigned i;
+
+	if (sp->nz == STAT_SPARSE_DENSE) {
+		for (i = 0; i < st->buckets; i++)
+			h[i] = add ? h[i] + sp->dense[i] : sp->dense[i];
+		return;
+	}
+	if (!add)
+		memset(h, 0, st->buckets * sizeof(int64_t));
+	for (i = 0; i < sp->nz; i++)
+		h[sp->bucket[i]] += sp->count[i];
+}
+
+/* Returns the quantile sketch bucket for val. */
+static int _stp_quantile_bucket(int64_t val)
+{
+	int shift;
+
+	if (val < STAT_QUANTILE_SUB)
+		return val < 0 ? 0 : val;
+
+	/* log2(val), from the log histogram bucket */
+	shift = _stp_val_to_bucket(val) - HIST_LOG_BUCKET0 - 1
+		- STAT_QUANTILE_BITS;
+	return shift * STAT_QUANTILE_SUB + (val >> shift);
+}
+
+/* Returns the middle of quantile sketch bucket num. */
+static int64_t _stp_quantile_bucket_val(int num)
+{
+	int shift;
+
+	if (num < STAT_QUANTILE_SUB)
+		return num;
+	shift = num / STAT_QUANTILE_SUB - 1;
+	return ((int64_t)(num - shift * STAT_QUANTILE_SUB) << shift)
+		+ ((1LL << shift) >> 1);
+}
+
+/** Estimate the num/den quantile of the values added to sd.
+ * The estimate is kept within the min and max of the values.
+ */
+static int64_t _stp_stat_quantile(Hist st, stat_data *sd, int64_t num,
+				  int64_t den)
+{
+	int64_t *sketch = _stp_stat_sketch(st, sd);
+	int64_t total = 0, rank, seen = 0, val = 0;
+	int i;
+
+	if (sketch == NULL || den <= 0)
+		return 0;
+
+	for (i = 0; i < STAT_QUANTILE_BUCKETS; i++)
+		total += sketch[i];
+	if (total == 0)
+		return 0;
+
+	/* the value with this rank, counting from 1 */
+	rank = _stp_div64(NULL, total * num + den - 1, den);
+	if (rank < 1)
+		rank = 1;
+
+	for (i = 0; i < STAT_QUANTILE_BUCKETS; i++) {
+		seen += sketch[i];
+		if (seen >= rank) {
+			val = _stp_quantile_bucket_val(i);
+			break;
+		}
+	}
+
+	if (val < sd->min)
+		val = sd->min;
+	if (val > sd->max)
+		val = sd->max;
+	return val;
+}
+
 #ifndef HIST_WIDTH
 #define HIST_WIDTH 50
 #endif
@@ -294,6 +433,7 @@ static inline void __stp_stat_add(Hist st, stat_data *sd, int64_t val,
 {
 	int n;
 	int delta = 0;
+	int64_t *sketch = _stp_stat_sketch(st, sd);
 
 	sd->shift = st->bit_shift;
 	sd->stat_ops = st->stat_ops;
@@ -323,12 +463,14 @@ static inline void __stp_stat_add(Hist st, stat_data *sd, int64_t val,
 		}
 	}
 
+	if (sketch)
+		sketch[_stp_quantile_bucket(val)]++;
+
 	switch (st->type) {
 	case HIST_LOG:
 		n = _stp_val_to_bucket (val);
 		if (n >= st->buckets)
 			n = st->buckets - 1;
-		sd->histogram[n]++;
 		break;
 	case HIST_LINEAR:
 		val -= st->start;
@@ -348,10 +490,16 @@ static inline void __stp_stat_add(Hist st, stat_data *sd, int64_t val,
 		if (val >= st->buckets - 1)
 			val = st->buckets - 1;
 
-		sd->histogram[val]++;
-	default:
+		n = val;
 		break;
+	default:
+		return;
 	}
+
+	if (st->stat_ops & STAT_HIST_SPARSE)
+		_stp_stat_sparse_add(st, _stp_stat_sparse(sd), n);
+	else
+		sd->histogram[n]++;
 }
 
 #endif /* _STAT_COMMON_C_ */
@@ -21,6 +21,9 @@
  * while probes are running, the values may be slightly off due
  * to a probe updating the statistics of one cpu while another cpu attempts
  * to read the same data. This will also negatively impact performance.
+ * In the kernel runtime, probes add to Stats without locking them, and
+ * readers copy the data of each cpu under a sequence count (see
+ * STAT_SEQCOUNT), so each cpu's data is at least self-consistent.
  *
  * Stats keep track of count, sum, min, max, avg, and variance.  Bit-shift
  * can be optionally specified, scaling the numbers, in order to improve the
@@ -34,6 +37,8 @@
 
 #include "stat-common.c"
 
+static void _stp_stat_clear_data (Stat st, stat_data *sd);
+
 
 /** Initialize a Stat.
  * Call this during probe initialization to create a Stat.
@@ -96,6 +101,9 @@ static Stat _stp_stat_init (int first_arg, ...)
 			stat_ops |= STAT_OP_VARIANCE;
 			bit_shift = va_arg(ap, int);
 			break;
+		case STAT_OP_QUANTILE:
+			stat_ops |= STAT_OP_QUANTILE;
+			break;
 		default:
 			_stp_warn ("Unknown argument %d\n", arg);
 		}
@@ -103,7 +111,8 @@ static Stat _stp_stat_init (int first_arg, ...)
 	} while (arg);
 	va_end (ap);
 
-	size = buckets * sizeof(int64_t) + sizeof(stat_data);
+	size = buckets * sizeof(int64_t) + STAT_SKETCH_SIZE(stat_ops)
+		+ sizeof(stat_data);
 	st = _stp_stat_alloc (size);
 	if (st == NULL)
 		return NULL;
@@ -148,14 +157,49 @@ static inline void _stp_stat_add (Stat st, int64_t val, int stat_op_count,
                                   int stat_op_sum, int stat_op_min,
 				  int stat_op_max, int stat_op_variance)
 {
-	stat_data *sd = _stp_stat_per_cpu_ptr (st, STAT_GET_CPU());
+	int cpu = STAT_GET_CPU();
+	stat_data *sd = _stp_stat_per_cpu_ptr (st, cpu);
+#ifdef STAT_SEQCOUNT
+	struct _stp_stat_seq *seq = _stp_stat_per_cpu_seq (st, cpu);
+
+	write_seqcount_begin(&seq->seq);
+	if (unlikely(seq->gen != st->gen)) {
+		/* cleared since this cpu last added to it */
+		_stp_stat_clear_data (st, sd);
+		seq->gen = st->gen;
+	}
+#endif
 	STAT_LOCK(sd);
 	__stp_stat_add (&st->hist, sd, val, stat_op_count, stat_op_sum,
 	                stat_op_min, stat_op_max, stat_op_variance);
 	STAT_UNLOCK(sd);
+#ifdef STAT_SEQCOUNT
+	write_seqcount_end(&seq->seq);
+#endif
 	STAT_PUT_CPU();
 }
 
+/* Get the stat data of CPU for reading, or NULL if it was cleared.
+ * With STAT_SEQCOUNT, this is a consistent copy made while probes may
+ * be adding to it, which stays valid until the next call. */
+static stat_data *_stp_stat_read_cpu (Stat st, int cpu)
+{
+#ifdef STAT_SEQCOUNT
+	struct _stp_stat_seq *seq = _stp_stat_per_cpu_seq (st, cpu);
+	unsigned start, gen;
+
+	do {
+		start = read_seqcount_begin(&seq->seq);
+		gen = seq->gen;
+		memcpy(st->snap, _stp_stat_per_cpu_ptr (st, cpu), st->size);
+	} while (read_seqcount_retry(&seq->seq, start));
+
+	return gen == st->gen ? st->snap : NULL;
+#else
+	return _stp_stat_per_cpu_ptr (st, cpu);
+#endif
+}
+
 static void _stp_stat_clear_data (Stat st, stat_data *sd)
 {
         int j;
@@ -166,6 +210,10 @@ static void _stp_stat_clear_data (Stat st, stat_data *sd)
                 for (j = 0; j < st->hist.buckets; j++)
                         sd->histogram[j] = 0;
         }
+        if (st->hist.stat_ops & STAT_OP_QUANTILE) {
+                for (j = 0; j < STAT_QUANTILE_BUCKETS; j++)
+                        sd->histogram[st->hist.buckets + j] = 0;
+        }
 }
 
 /** Get Stats.
@@ -187,9 +235,9 @@ static stat_data *_stp_stat_get (Stat st, int clear)
 	S1 = S2 = 0;
 
 	for_each_possible_cpu(i) {
-		stat_data *sd = _stp_stat_per_cpu_ptr (st, i);
+		stat_data *sd = _stp_stat_read_cpu (st, i);
 		STAT_LOCK(sd);
-		if (sd->count) {
+		if (sd && sd->count) {
 			agg->shift = sd->shift;
 			if (agg->count == 0) {
 				agg->min = sd->min;
@@ -205,6 +253,11 @@ static stat_data *_stp_stat_get (Stat st, int clear)
 				for (j = 0; j < st->hist.buckets; j++)
 					agg->histogram[j] += sd->histogram[j];
 			}
+			if (st->hist.stat_ops & STAT_OP_QUANTILE) {
+				for (j = st->hist.buckets;
+				     j < st->hist.buckets + STAT_QUANTILE_BUCKETS; j++)
+					agg->histogram[j] += sd->histogram[j];
+			}
 		}
 		STAT_UNLOCK(sd);
 	}
@@ -219,16 +272,22 @@ static stat_data *_stp_stat_get (Stat st, int clear)
 	 * Available at: http://web.cse.ohio-state.edu/~kamatn/variance.pdf
 	 */
 	for_each_possible_cpu(i) {
-		sd = _stp_stat_per_cpu_ptr (st, i);
+		sd = _stp_stat_read_cpu (st, i);
 		STAT_LOCK(sd);
-		if (sd->count) {
+		if (sd && sd->count) {
 			S1 += sd->count * (sd->avg_s - agg->avg_s) * (sd->avg_s - agg->avg_s);
 			S2 += (sd->count - 1) * sd->variance_s;
 		}
+#ifndef STAT_SEQCOUNT
 		if (clear)
 			_stp_stat_clear_data (st, sd);
+#endif
 		STAT_UNLOCK(sd);
 	}
+#ifdef STAT_SEQCOUNT
+	if (clear)
+		st->gen++;
+#endif
 
 	agg->variance_s = _stp_div64(NULL, (S1 + S2), (agg->count - 1));
 	agg->variance = agg->variance_s >> (2 * agg->shift);
@@ -259,6 +318,11 @@ static stat_data *_stp_stat_get (Stat st, int clear)
  */
 static void _stp_stat_clear (Stat st)
 {
+#ifdef STAT_SEQCOUNT
+	/* Probes may be adding to the stat data of other cpus, so leave
+	 * it to each cpu to clear its own. */
+	st->gen++;
+#else
 	int i;
 
 	for_each_possible_cpu(i) {
@@ -267,6 +331,7 @@ static void _stp_stat_clear (Stat st)
 		_stp_stat_clear_data (st, sd);
 		STAT_UNLOCK(sd);
 	}
+#endif
 }
 /** @} */
 #endif /* _STAT_C_ */
@@ -27,6 +27,7 @@
 #define STAT_OP_MAX       1 << 4
 #define STAT_OP_AVG       1 << 5
 #define STAT_OP_VARIANCE  1 << 6
+#define STAT_OP_QUANTILE  1 << 10
 
 /** other defines used for passing translator information to the runtime
     values must not collide with the above statistical operations defines */
@@ -34,11 +35,55 @@
 #define KEY_STAT_WRAP     1 << 8
 #define KEY_HIST_TYPE     1 << 9
 
+/** Quantile sketch for @quantile() and @percentile().  Values below
+    STAT_QUANTILE_SUB get a bucket each; above that, each power of two
+    is split into STAT_QUANTILE_SUB buckets, so the estimates are
+    within 1 / (2 * STAT_QUANTILE_SUB) of the true value.  Negative
+    values count as 0.  The buckets follow the histogram buckets of
+    each stat_data, and add up across cpus. */
+#ifndef STAT_QUANTILE_BITS
+#define STAT_QUANTILE_BITS 3
+#endif
+#define STAT_QUANTILE_SUB (1 << STAT_QUANTILE_BITS)
+#define STAT_QUANTILE_BUCKETS ((64 - STAT_QUANTILE_BITS) * STAT_QUANTILE_SUB)
+
+/* extra bytes of stat_data for the sketch, if stat_ops needs one */
+#define STAT_SKETCH_SIZE(stat_ops) \
+	(((stat_ops) & STAT_OP_QUANTILE) ? STAT_QUANTILE_BUCKETS * sizeof(int64_t) : 0)
+
+/** A sparse histogram counts the first STAT_SPARSE_SLOTS distinct
+    buckets that get values in slots, and only then moves to an array
+    of all the buckets.  Per-cpu copies of arrays of histograms keep
+    their histograms this way with STP_MAP_SPARSE_HIST (see map.h);
+    their stat_data then have STAT_HIST_SPARSE in stat_ops, and a
+    struct stat_sparse in place of the buckets.  The slots are kept
+    even once the buckets are in the array, for when the stat_data
+    gets reused. */
+#define STAT_HIST_SPARSE  1 << 11
+
+#ifndef STAT_SPARSE_SLOTS
+#define STAT_SPARSE_SLOTS 8
+#endif
+
+/* value of stat_sparse.nz once all counts are in stat_sparse.dense */
+#define STAT_SPARSE_DENSE (~0U)
+
+struct stat_sparse {
+	int64_t *dense;
+	unsigned nz;
+	unsigned short bucket[STAT_SPARSE_SLOTS];
+	int64_t count[STAT_SPARSE_SLOTS];
+};
+
+#define STAT_SPARSE_WORDS \
+	((sizeof(struct stat_sparse) + sizeof(int64_t) - 1) / sizeof(int64_t))
+
 /** histogram type */
 enum histtype { HIST_NONE, HIST_LOG, HIST_LINEAR };
 
 /** Statistics are stored in this struct.  This is per-cpu or per-node data 
-    and is variable length due to the unknown size of the histogram. */
+    and is variable length due to the unknown size of the histogram
+    and quantile sketch. */
 struct stat_data {
 	int shift;
 	int stat_ops;
@@ -22,6 +22,8 @@
 #include <asm/uaccess.h>
 #include <linux/list.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/sort.h>
 #ifdef STAPCONF_PROBE_KERNEL
 #include <linux/uaccess.h>
 #endif
@@ -100,13 +102,156 @@ static unsigned long _stp_umodule_relocate(const char *path,
   return 0;
 }
 
+/* Sorted index over the address ranges of all kernel module sections
+   currently in memory, so that _stp_kmod_sec_lookup() is one binary
+   search instead of a scan of every section of every module.
+
+   The index is rebuilt (in process context) whenever section addresses
+   change: at startup once staprun has sent its relocations, and from
+   the module notifier.  Two buffers are preallocated; a rebuild fills
+   the one not currently published, switches readers over to it with
+   rcu_assign_pointer(), and waits for a grace period so that the old
+   one may be reused next time.  Readers run in probe context, so
+   rcu_read_lock_sched() is all they need. */
+struct _stp_kmod_sec_range {
+  unsigned long start;
+  unsigned long end;
+  struct _stp_module *module;
+  struct _stp_section *section;
+};
+
+struct _stp_kmod_sec_index {
+  unsigned num;
+  struct _stp_kmod_sec_range ranges[0];
+};
+
+static struct _stp_kmod_sec_index *_stp_kmod_sec_index; /* RCU protected */
+static struct _stp_kmod_sec_index *_stp_kmod_sec_index_bufs[2];
+static DEFINE_MUTEX(_stp_kmod_sec_index_mutex);
+
+static int _stp_kmod_sec_range_cmp(const void *a, const void *b)
+{
+  const struct _stp_kmod_sec_range *ra = a;
+  const struct _stp_kmod_sec_range *rb = b;
+  if (ra->start < rb->start)
+    return -1;
+  return ra->start > rb->start;
+}
+
+/* Allocate the index buffers; sized for every section of every module,
+   whether in memory or not.  Called from module init. */
+static int _stp_kmod_sec_index_init(void)
+{
+  unsigned mi, i, num = 0;
+  size_t size;
+
+  for (mi = 0; mi < _stp_num_modules; mi++)
+    num += _stp_modules[mi]->num_sections;
+
+  size = sizeof(struct _stp_kmod_sec_index)
+         + num * sizeof(struct _stp_kmod_sec_range);
+  for (i = 0; i < 2; i++) {
+    _stp_kmod_sec_index_bufs[i] = _stp_vzalloc(size);
+    if (_stp_kmod_sec_index_bufs[i] == NULL)
+      return -ENOMEM;
+  }
+  return 0;
+}
+
+/* Free the index.  No probes may be running anymore. */
+static void _stp_kmod_sec_index_free(void)
+{
+  unsigned i;
+
+  rcu_assign_pointer(_stp_kmod_sec_index, NULL);
+  for (i = 0; i < 2; i++) {
+    if (_stp_kmod_sec_index_bufs[i])
+      _stp_vfree(_stp_kmod_sec_index_bufs[i]);
+    _stp_kmod_sec_index_bufs[i] = NULL;
+  }
+}
+
+/* Rebuild the index from the current section addresses.  May sleep. */
+static void _stp_kmod_sec_index_rebuild(void)
+{
+  struct _stp_kmod_sec_index *idx;
+  unsigned mi, si, n = 0;
+
+  if (_stp_kmod_sec_index_bufs[0] == NULL)
+    return;
+
+  mutex_lock(&_stp_kmod_sec_index_mutex);
+  idx = _stp_kmod_sec_index_bufs[0];
+  if (idx == _stp_kmod_sec_index)
+    idx = _stp_kmod_sec_index_bufs[1];
+
+  for (mi = 0; mi < _stp_num_modules; mi++)
+    {
+      struct _stp_module *m = _stp_modules[mi];
+      for (si = 0; si < m->num_sections; si++)
+	{
+	  struct _stp_section *s = &m->sections[si];
+	  /* Not in memory (or a user-space module's section). */
+	  if (s->static_addr == 0 || s->size == 0)
+	    continue;
+	  idx->ranges[n].start = s->static_addr;
+	  idx->ranges[n].end = s->static_addr + s->size;
+	  idx->ranges[n].module = m;
+	  idx->ranges[n].section = s;
+	  n++;
+	}
+    }
+  idx->num = n;
+  sort(idx->ranges, n, sizeof(struct _stp_kmod_sec_range),
+       _stp_kmod_sec_range_cmp, NULL);
+  dbug_sym(1, "indexed %u kernel module sections\n", n);
+
+  rcu_assign_pointer(_stp_kmod_sec_index, idx);
+  /* Let readers drain from the old buffer before it can be refilled. */
+  stp_synchronize_sched();
+  mutex_unlock(&_stp_kmod_sec_index_mutex);
+}
+
 /* Return (kernel) module owner and, if sec != NULL, fills in closest
    section of the address if found, return NULL otherwise. */
 static struct _stp_module *_stp_kmod_sec_lookup(unsigned long addr,
 						struct _stp_section **sec)
 {
+  struct _stp_kmod_sec_index *idx;
+  struct _stp_module *m = NULL;
   unsigned midx = 0;
 
+  rcu_read_lock_sched();
+  idx = rcu_dereference_sched(_stp_kmod_sec_index);
+  if (likely(idx != NULL))
+    {
+      /* Find the last range starting at or below addr. */
+      unsigned lo = 0, hi = idx->num;
+      while (lo < hi)
+	{
+	  unsigned mid = lo + (hi - lo) / 2;
+	  if (idx->ranges[mid].start <= addr)
+	    lo = mid + 1;
+	  else
+	    hi = mid;
+	}
+      if (lo > 0)
+	{
+	  struct _stp_kmod_sec_range *r = &idx->ranges[lo - 1];
+	  /* The section may have been unloaded since the last rebuild. */
+	  if (addr < r->end && r->section->static_addr == r->start)
+	    {
+	      if (sec)
+		*sec = r->section;
+	      m = r->module;
+	    }
+	}
+      rcu_read_unlock_sched();
+      return m;
+    }
+  rcu_read_unlock_sched();
+
+  /* No index (yet), scan all sections. */
   for (midx = 0; midx < _stp_num_modules; midx++)
     {
       unsigned secidx;
@@ -4,22 +4,26 @@
 #include <linux/file.h>
 #include <linux/list.h>
 #include <linux/jhash.h>
+#include <linux/rcupdate.h>
 
 #include <linux/fs.h>
 #include <linux/dcache.h>
 
 #include "stp_helper_lock.h"
 
-// __stp_tf_vma_lock protects the hash table.
-// Documentation/spinlocks.txt suggest we can be a bit more clever
-// if we guarantee that in interrupt context we only read, not write
-// the datastructures. We should never change the hash table or the
-// contents in interrupt context (which should only ever call 
-// stap_find_vma_map_info for getting stored vma info). So we might
-// want to look into that if this seems a bottleneck.
-static STP_DEFINE_RWLOCK(__stp_tf_vma_lock);
-
-#define __STP_TF_HASH_BITS 4
+// The vma map is a hash table of processes, each of which holds an
+// array of its vma entries sorted by vm_start.  Lookups, which happen
+// in probe context for every user-space symbol or backtrace, are
+// lock-free: readers walk the process hash chain and binary search the
+// array under rcu_read_lock_sched().  Writers (the task finder's
+// mmap/munmap/exec callbacks) serialize on __stp_tf_vma_lock and never
+// modify a published array; they publish a new copy instead and free
+// the old one after an RCU grace period.
+static STP_DEFINE_SPINLOCK(__stp_tf_vma_lock);
+
+#ifndef __STP_TF_HASH_BITS
+#define __STP_TF_HASH_BITS 8
+#endif
 #define __STP_TF_TABLE_SIZE (1 << __STP_TF_HASH_BITS)
 
 #ifndef TASK_FINDER_VMA_ENTRY_PATHLEN
@@ -28,11 +32,20 @@ static STP_DEFINE_RWLOCK(__stp_tf_vma_lock);
 #error "gimme a little more TASK_FINDER_VMA_ENTRY_PATHLEN"
 #endif
 
+// Readers only ever run with preemption disabled, so the sched flavor
+// of RCU covers them.  (Since 5.0, plain call_rcu() does too.)
+#if defined(STAPCONF_SYNCHRONIZE_SCHED)
+#define __stp_tf_call_rcu(head, func)	call_rcu_sched(head, func)
+#define __stp_tf_rcu_barrier()		rcu_barrier_sched()
+#else
+#define __stp_tf_call_rcu(head, func)	call_rcu(head, func)
+#define __stp_tf_rcu_barrier()		rcu_barrier()
+#endif
+
 
 struct __stp_tf_vma_entry {
-	struct hlist_node hlist;
+	struct rcu_head rcu;
 
-	pid_t pid;
 	unsigned long vm_start;
 	unsigned long vm_end;
         char path[TASK_FINDER_VMA_ENTRY_PATHLEN]; /* mmpath name, if known */
@@ -41,6 +54,21 @@ struct __stp_tf_vma_entry {
 	void *user;
 };
 
+// An immutable snapshot of one process's vma entries, sorted by vm_start.
+struct __stp_tf_vma_array {
+	struct rcu_head rcu;
+	unsigned num;
+	struct __stp_tf_vma_entry *entries[0];
+};
+
+struct __stp_tf_vma_proc {
+	struct hlist_node hlist;
+	struct rcu_head rcu;
+
+	pid_t pid;
+	struct __stp_tf_vma_array *vmas; /* RCU protected, may be NULL */
+};
+
 static struct hlist_head *__stp_tf_vma_map;
 
 // __stp_tf_vma_new_entry(): Returns an newly allocated or NULL.
@@ -69,6 +97,56 @@ __stp_tf_vma_release_entry(struct __stp_tf_vma_entry *entry)
 	_stp_kfree (entry);
 }
 
+static void
+__stp_tf_vma_release_entry_rcu(struct rcu_head *rcu)
+{
+	__stp_tf_vma_release_entry(container_of(rcu, struct __stp_tf_vma_entry,
+						rcu));
+}
+
+// __stp_tf_vma_new_array(): Returns a new array with room for num
+// entries, or NULL.  Called with __stp_tf_vma_lock held, so can't sleep.
+static struct __stp_tf_vma_array *
+__stp_tf_vma_new_array(unsigned num)
+{
+	struct __stp_tf_vma_array *vmas;
+	size_t size = sizeof (struct __stp_tf_vma_array)
+		      + num * sizeof (struct __stp_tf_vma_entry *);
+	vmas = (struct __stp_tf_vma_array *) _stp_kmalloc_gfp(size,
+							      STP_ALLOC_FLAGS);
+	if (vmas != NULL)
+		vmas->num = num;
+	return vmas;
+}
+
+static void
+__stp_tf_vma_release_array_rcu(struct rcu_head *rcu)
+{
+	_stp_kfree (container_of(rcu, struct __stp_tf_vma_array, rcu));
+}
+
+// Frees a process along with all its entries.  Nothing may reference
+// it anymore.
+static void
+__stp_tf_vma_release_proc(struct __stp_tf_vma_proc *proc)
+{
+	struct __stp_tf_vma_array *vmas = proc->vmas;
+	if (vmas != NULL) {
+		unsigned i;
+		for (i = 0; i < vmas->num; i++)
+			__stp_tf_vma_release_entry(vmas->entries[i]);
+		_stp_kfree (vmas);
+	}
+	_stp_kfree (proc);
+}
+
+static void
+__stp_tf_vma_release_proc_rcu(struct rcu_head *rcu)
+{
+	__stp_tf_vma_release_proc(container_of(rcu, struct __stp_tf_vma_proc,
+					       rcu));
+}
+
 // stap_initialize_vma_map():  Initialize the free list.  Grabs the
 // spinlock.  Should be called before any of the other stap_*_vma_map
 // functions.  Since this is run before any other function is called,
@@ -95,18 +173,22 @@ stap_destroy_vma_map(void)
 {
 	if (__stp_tf_vma_map != NULL) {
 		int i;
+
+		// Let any pending RCU frees finish before we go away.
+		__stp_tf_rcu_barrier();
+
 		for (i = 0; i < __STP_TF_TABLE_SIZE; i++) {
 			struct hlist_head *head = &__stp_tf_vma_map[i];
 			struct hlist_node *node;
 			struct hlist_node *n;
-			struct __stp_tf_vma_entry *entry = NULL;
+			struct __stp_tf_vma_proc *proc = NULL;
 
 			if (hlist_empty(head))
 				continue;
 
-		        stap_hlist_for_each_entry_safe(entry, node, n, head, hlist) {
-				hlist_del(&entry->hlist);
-				__stp_tf_vma_release_entry(entry);
+		        stap_hlist_for_each_entry_safe(proc, node, n, head, hlist) {
+				hlist_del(&proc->hlist);
+				__stp_tf_vma_release_proc(proc);
 			}
 		}
 		_stp_kfree(__stp_tf_vma_map);
@@ -121,50 +203,99 @@ __stp_tf_vma_map_hash(struct task_struct *tsk)
     return (jhash_1word(tsk->pid, 0) & (__STP_TF_TABLE_SIZE - 1));
 }
 
-// Get vma_entry if the vma is present in the vma map hash table.
-// Returns NULL if not present.  The __stp_tf_vma_lock must be read locked
-// before calling this function.
-static struct __stp_tf_vma_entry *
-__stp_tf_get_vma_map_entry_internal(struct task_struct *tsk,
-				    unsigned long vm_start)
+// Get the process entry for tsk, or NULL if it has no vmas.  Either the
+// __stp_tf_vma_lock must be held, or the caller must be inside
+// rcu_read_lock_sched().
+static struct __stp_tf_vma_proc *
+__stp_tf_get_vma_proc(struct task_struct *tsk)
 {
 	struct hlist_head *head;
 	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
+	struct __stp_tf_vma_proc *proc;
 
 	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	stap_hlist_for_each_entry(entry, node, head, hlist) {
-		if (tsk->pid == entry->pid
-		    && vm_start == entry->vm_start) {
-			return entry;
-		}
+	stap_hlist_for_each_entry_rcu(proc, node, head, hlist) {
+		if (tsk->pid == proc->pid)
+			return proc;
 	}
 	return NULL;
 }
 
-// Get vma_entry if the vma with the given vm_end is present in the vma map
-// hash table for the tsk.  Returns NULL if not present.
-// The __stp_tf_vma_lock must be read locked before calling this function.
+// Returns the number of entries in vmas with vm_start <= addr, i.e. the
+// index just past the only entry which could contain addr.
+static unsigned
+__stp_tf_vma_upper_bound(const struct __stp_tf_vma_array *vmas,
+			 unsigned long addr)
+{
+	unsigned lo = 0, hi = vmas->num;
+
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (vmas->entries[mid]->vm_start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// Get vma_entry if the vma is present in the vma map for tsk.
+// Returns NULL if not present.  The __stp_tf_vma_lock must be held
+// before calling this function.
 static struct __stp_tf_vma_entry *
-__stp_tf_get_vma_map_entry_end_internal(struct task_struct *tsk,
-					unsigned long vm_end)
+__stp_tf_get_vma_map_entry_internal(struct __stp_tf_vma_proc *proc,
+				    unsigned long vm_start, unsigned *index)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
+	struct __stp_tf_vma_array *vmas = proc ? proc->vmas : NULL;
+	unsigned i;
 
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	stap_hlist_for_each_entry(entry, node, head, hlist) {
-		if (tsk->pid == entry->pid
-		    && vm_end == entry->vm_end) {
-			return entry;
-		}
+	if (vmas == NULL)
+		return NULL;
+
+	i = __stp_tf_vma_upper_bound(vmas, vm_start);
+	if (i > 0 && vmas->entries[i-1]->vm_start == vm_start) {
+		if (index != NULL)
+			*index = i - 1;
+		return vmas->entries[i-1];
 	}
 	return NULL;
 }
 
+// Get vma_entry if the vma with the given vm_end is present in the vma
+// map for tsk.  Returns NULL if not present.  The __stp_tf_vma_lock must
+// be held before calling this function.
+static struct __stp_tf_vma_entry *
+__stp_tf_get_vma_map_entry_end_internal(struct __stp_tf_vma_proc *proc,
+					unsigned long vm_end)
+{
+	struct __stp_tf_vma_array *vmas = proc ? proc->vmas : NULL;
+	unsigned i;
+
+	if (vmas == NULL || vm_end == 0)
+		return NULL;
+
+	// Entries don't overlap, so only the last one starting before
+	// vm_end can end there.
+	i = __stp_tf_vma_upper_bound(vmas, vm_end - 1);
+	if (i > 0 && vmas->entries[i-1]->vm_end == vm_end)
+		return vmas->entries[i-1];
+	return NULL;
+}
+
+// Publish a new sorted array for proc, retiring the old one.  The
+// __stp_tf_vma_lock must be held.
+static void
+__stp_tf_vma_replace_array(struct __stp_tf_vma_proc *proc,
+			   struct __stp_tf_vma_array *vmas)
+{
+	struct __stp_tf_vma_array *old = proc->vmas;
+	rcu_assign_pointer(proc->vmas, vmas);
+	if (old != NULL)
+		__stp_tf_call_rcu(&old->rcu, __stp_tf_vma_release_array_rcu);
+}
+
 
-// Add the vma info to the vma map hash table.
+// Add the vma info to the vma map.
 // Caller is responsible for name lifetime.
 // Can allocate memory, so needs to be called
 // only from user context.
@@ -173,32 +304,48 @@ stap_add_vma_map_info(struct task_struct *tsk,
 		      unsigned long vm_start, unsigned long vm_end,
 		      const char *path, void *user)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
+	struct __stp_tf_vma_proc *proc;
+	struct __stp_tf_vma_array *vmas, *old;
 	struct __stp_tf_vma_entry *entry;
 	struct __stp_tf_vma_entry *new_entry;
 	unsigned long flags;
+	unsigned i, num;
 
-	// Take a write lock, since we are most likely going to write
-	// after reading. But reserve a new entry first outside the lock.
+	// Reserve a new entry first outside the lock.
 	new_entry = __stp_tf_vma_new_entry();
-	stp_write_lock_irqsave(&__stp_tf_vma_lock, flags);
-	entry = __stp_tf_get_vma_map_entry_internal(tsk, vm_start);
+	stp_spin_lock_irqsave(&__stp_tf_vma_lock, flags);
+	proc = __stp_tf_get_vma_proc(tsk);
+	entry = __stp_tf_get_vma_map_entry_internal(proc, vm_start, NULL);
 	if (entry != NULL) {
-		stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+		stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
 		if (new_entry)
 			__stp_tf_vma_release_entry(new_entry);
 		return -EBUSY;	/* Already there */
 	}
 
-	if (!new_entry) {
-		stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
-		return -ENOMEM;
+	if (!new_entry)
+		goto nomem;
+
+	if (proc == NULL) {
+		proc = (struct __stp_tf_vma_proc *)
+			_stp_kmalloc_gfp(sizeof (struct __stp_tf_vma_proc),
+					 STP_ALLOC_FLAGS);
+		if (proc == NULL)
+			goto nomem;
+		proc->pid = tsk->pid;
+		proc->vmas = NULL;
+		hlist_add_head_rcu(&proc->hlist,
+				   &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)]);
 	}
 
+	old = proc->vmas;
+	num = old ? old->num : 0;
+	vmas = __stp_tf_vma_new_array(num + 1);
+	if (vmas == NULL)
+		goto nomem;
+
 	// Fill in the info
 	entry = new_entry;
-	entry->pid = tsk->pid;
 	entry->vm_start = vm_start;
 	entry->vm_end = vm_end;
         if (strlen(path) >= TASK_FINDER_VMA_ENTRY_PATHLEN-3)
@@ -213,13 +360,28 @@ stap_add_vma_map_info(struct task_struct *tsk,
           }
 	entry->user = user;
 
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	hlist_add_head(&entry->hlist, head);
-	stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	// Copy the old entries around the new one, keeping them sorted.
+	i = old ? __stp_tf_vma_upper_bound(old, vm_start) : 0;
+	if (i > 0)
+		memcpy(&vmas->entries[0], &old->entries[0],
+		       i * sizeof (struct __stp_tf_vma_entry *));
+	vmas->entries[i] = entry;
+	if (num > i)
+		memcpy(&vmas->entries[i+1], &old->entries[i],
+		       (num - i) * sizeof (struct __stp_tf_vma_entry *));
+
+	__stp_tf_vma_replace_array(proc, vmas);
+	stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
 	return 0;
+
+nomem:
+	stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	if (new_entry)
+		__stp_tf_vma_release_entry(new_entry);
+	return -ENOMEM;
 }
 
-// Extend the vma info vm_end in the vma map hash table if there is already
+// Extend the vma info vm_end in the vma map if there is already
 // a vma_info which ends precisely where this new one starts for the given
 // task. Returns zero on success, -ESRCH if no existing matching entry could
 // be found.
@@ -227,78 +389,90 @@ static int
 stap_extend_vma_map_info(struct task_struct *tsk,
 			 unsigned long vm_start, unsigned long vm_end)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
 	struct __stp_tf_vma_entry *entry;
 
 	unsigned long flags;
 	int res = -ESRCH; // Entry not there or doesn't match.
 
-	// Take a write lock, since we are most likely going to write
-	// to the entry after reading, if its vm_end matches our vm_start.
-	stp_write_lock_irqsave(&__stp_tf_vma_lock, flags);
-	entry = __stp_tf_get_vma_map_entry_end_internal(tsk, vm_start);
+	stp_spin_lock_irqsave(&__stp_tf_vma_lock, flags);
+	entry = __stp_tf_get_vma_map_entry_end_internal(
+			__stp_tf_get_vma_proc(tsk), vm_start);
 	if (entry != NULL) {
+		// A single word store, so concurrent readers see either
+		// the old or the new end; the sort order is unaffected.
 		entry->vm_end = vm_end;
 		res = 0;
 	}
-	stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
 	return res;
 }
 
 
-// Remove the vma entry from the vma hash table.
+// Remove the vma entry from the vma map.
 // Returns -ESRCH if the entry isn't present.
 static int
 stap_remove_vma_map_info(struct task_struct *tsk, unsigned long vm_start)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
+	struct __stp_tf_vma_proc *proc;
+	struct __stp_tf_vma_array *vmas, *old;
 	struct __stp_tf_vma_entry *entry;
+	unsigned long flags;
+	unsigned i;
 	int rc = -ESRCH;
 
-	// Take a write lock since we are most likely going to delete
-	// after reading.
-	unsigned long flags;
-	stp_write_lock_irqsave(&__stp_tf_vma_lock, flags);
-	entry = __stp_tf_get_vma_map_entry_internal(tsk, vm_start);
+	stp_spin_lock_irqsave(&__stp_tf_vma_lock, flags);
+	proc = __stp_tf_get_vma_proc(tsk);
+	entry = __stp_tf_get_vma_map_entry_internal(proc, vm_start, &i);
 	if (entry != NULL) {
-		hlist_del(&entry->hlist);
-		__stp_tf_vma_release_entry(entry);
+		old = proc->vmas;
+		if (old->num > 1) {
+			vmas = __stp_tf_vma_new_array(old->num - 1);
+			if (vmas == NULL) {
+				rc = -ENOMEM;
+				goto out;
+			}
+			memcpy(&vmas->entries[0], &old->entries[0],
+			       i * sizeof (struct __stp_tf_vma_entry *));
+			memcpy(&vmas->entries[i], &old->entries[i+1],
+			       (old->num - i - 1)
+			       * sizeof (struct __stp_tf_vma_entry *));
+		} else
+			vmas = NULL;
+
+		__stp_tf_vma_replace_array(proc, vmas);
+		__stp_tf_call_rcu(&entry->rcu, __stp_tf_vma_release_entry_rcu);
                 rc = 0;
 	}
-	stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+out:
+	stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
 	return rc;
 }
 
-// Finds vma info if the vma is present in the vma map hash table for
+// Finds vma info if the vma is present in the vma map for
 // a given task and address (between vm_start and vm_end).
-// Returns -ESRCH if not present.  The __stp_tf_vma_lock must *not* be
-// locked before calling this function.
+// Returns -ESRCH if not present.  Lock-free; the __stp_tf_vma_lock
+// must *not* be held before calling this function.
 static int
 stap_find_vma_map_info(struct task_struct *tsk, unsigned long addr,
 		       unsigned long *vm_start, unsigned long *vm_end,
 		       const char **path, void **user)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
+	struct __stp_tf_vma_proc *proc;
+	struct __stp_tf_vma_array *vmas;
 	struct __stp_tf_vma_entry *found_entry = NULL;
 	int rc = -ESRCH;
-	unsigned long flags;
+	unsigned i;
 
 	if (__stp_tf_vma_map == NULL)
 		return rc;
 
-	stp_read_lock_irqsave(&__stp_tf_vma_lock, flags);
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	stap_hlist_for_each_entry(entry, node, head, hlist) {
-		if (tsk->pid == entry->pid
-		    && addr >= entry->vm_start
-		    && addr < entry->vm_end) {
-			found_entry = entry;
-			break;
-		}
+	rcu_read_lock_sched();
+	proc = __stp_tf_get_vma_proc(tsk);
+	vmas = proc ? rcu_dereference_sched(proc->vmas) : NULL;
+	if (vmas != NULL) {
+		i = __stp_tf_vma_upper_bound(vmas, addr);
+		if (i > 0 && addr < vmas->entries[i-1]->vm_end)
+			found_entry = vmas->entries[i-1];
 	}
 	if (found_entry != NULL) {
 		if (vm_start != NULL)
@@ -311,35 +485,34 @@ stap_find_vma_map_info(struct task_struct *tsk, unsigned long addr,
 			*user = found_entry->user;
 		rc = 0;
 	}
-	stp_read_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	rcu_read_unlock_sched();
 	return rc;
 }
 
-// Finds vma info if the vma is present in the vma map hash table for
+// Finds vma info if the vma is present in the vma map for
 // a given task with the given user handle.
-// Returns -ESRCH if not present.  The __stp_tf_vma_lock must *not* be
-// locked before calling this function.
+// Returns -ESRCH if not present.  Lock-free; the __stp_tf_vma_lock
+// must *not* be held before calling this function.
 static int
 stap_find_vma_map_info_user(struct task_struct *tsk, void *user,
 			    unsigned long *vm_start, unsigned long *vm_end,
 			    const char **path)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct __stp_tf_vma_entry *entry;
+	struct __stp_tf_vma_proc *proc;
+	struct __stp_tf_vma_array *vmas;
 	struct __stp_tf_vma_entry *found_entry = NULL;
 	int rc = -ESRCH;
-	unsigned long flags;
+	unsigned i;
 
 	if (__stp_tf_vma_map == NULL)
 		return rc;
 
-	stp_read_lock_irqsave(&__stp_tf_vma_lock, flags);
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-	stap_hlist_for_each_entry(entry, node, head, hlist) {
-		if (tsk->pid == entry->pid
-		    && user == entry->user) {
-			found_entry = entry;
+	rcu_read_lock_sched();
+	proc = __stp_tf_get_vma_proc(tsk);
+	vmas = proc ? rcu_dereference_sched(proc->vmas) : NULL;
+	for (i = 0; vmas != NULL && i < vmas->num; i++) {
+		if (user == vmas->entries[i]->user) {
+			found_entry = vmas->entries[i];
 			break;
 		}
 	}
@@ -352,28 +525,23 @@ stap_find_vma_map_info_user(struct task_struct *tsk, void *user,
 			*path = found_entry->path;
 		rc = 0;
 	}
-	stp_read_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	rcu_read_unlock_sched();
 	return rc;
 }
 
 static int
 stap_drop_vma_maps(struct task_struct *tsk)
 {
-	struct hlist_head *head;
-	struct hlist_node *node;
-	struct hlist_node *n;
-	struct __stp_tf_vma_entry *entry;
+	struct __stp_tf_vma_proc *proc;
 
 	unsigned long flags;
-	stp_write_lock_irqsave(&__stp_tf_vma_lock, flags);
-	head = &__stp_tf_vma_map[__stp_tf_vma_map_hash(tsk)];
-        stap_hlist_for_each_entry_safe(entry, node, n, head, hlist) {
-            if (tsk->pid == entry->pid) {
-		    hlist_del(&entry->hlist);
-		    __stp_tf_vma_release_entry(entry);
-            }
-        }
-	stp_write_unlock_irqrestore(&__stp_tf_vma_lock, flags);
+	stp_spin_lock_irqsave(&__stp_tf_vma_lock, flags);
+	proc = __stp_tf_get_vma_proc(tsk);
+	if (proc != NULL) {
+		hlist_del_rcu(&proc->hlist);
+		__stp_tf_call_rcu(&proc->rcu, __stp_tf_vma_release_proc_rcu);
+	}
+	stp_spin_unlock_irqrestore(&__stp_tf_vma_lock, flags);
 	return 0;
 }
 
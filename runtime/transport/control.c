@@ -21,6 +21,9 @@ static struct list_head _stp_ctl_ready_q;
 static DEFINE_SPINLOCK(_stp_ctl_ready_lock);
 static DEFINE_SPINLOCK(_stp_ctl_special_msg_lock);
 
+/* Set by STP_BATCHED_READS, for the stapio that has the channel open. */
+static int _stp_ctl_batched = 0;
+
 static void _stp_cleanup_and_exit(int send_exit);
 static void _stp_handle_tzinfo (struct _stp_msg_tzinfo* tzi);
 static void _stp_handle_privilege_credentials (struct _stp_msg_privilege_credentials* pc);
@@ -96,6 +99,19 @@ static ssize_t _stp_ctl_write_cmd(struct file *file, const char __user *buf, siz
                 goto out;
 #endif
 
+	case STP_PERCPU_STREAM:
+#ifdef _STP_PERCPU_STREAM
+                // no action needed
+                break;
+#else
+		rc = -EINVAL;
+                goto out;
+#endif
+
+	case STP_BATCHED_READS:
+		_stp_ctl_batched = 1;
+		break;
+
 	case STP_RELOCATION:
 		if (euid != 0) {
                         rc = -EPERM;
@@ -606,15 +622,29 @@ static int _stp_ctl_send_notify(int type, void *data, unsigned len)
 	return ret;
 }
 
+/* The bytes a message takes in a read: with batched reads, a struct
+ * _stp_ctl_frame and the message, padded for the next frame. */
+static inline size_t _stp_ctl_read_size(struct _stp_buffer *bptr, int batched)
+{
+	if (batched)
+		return STP_CTL_FRAME_ALIGN(sizeof(struct _stp_ctl_frame)
+					   + bptr->len + 4);
+	return bptr->len + 4;
+}
+
 /** Called when someone tries to read from our .cmd file.
     Will take _stp_ctl_ready_lock and pick off the next _stp_buffer
-    from the _stp_ctl_ready_q, will wait_event on _stp_ctl_wq.  */
+    from the _stp_ctl_ready_q, or with batched reads as many as fit,
+    will wait_event on _stp_ctl_wq.  */
 static ssize_t _stp_ctl_read_cmd(struct file *file, char __user *buf,
 				 size_t count, loff_t *ppos)
 {
 	struct context* __restrict__ c = NULL;
-	struct _stp_buffer *bptr;
-	int len;
+	struct _stp_buffer *bptr, *tmp;
+	LIST_HEAD(batch);
+	int batched = _stp_ctl_batched;
+	size_t total = 0, size;
+	int len, err = 0;
 	unsigned long flags;
 
 	/* Prevent probe reentrancy while grabbing probe-used locks.  */
@@ -633,33 +663,55 @@ static ssize_t _stp_ctl_read_cmd(struct file *file, char __user *buf,
 		spin_lock_irqsave(&_stp_ctl_ready_lock, flags);
 	}
 
-	/* get the next buffer off the ready list */
-	bptr = (struct _stp_buffer *)_stp_ctl_ready_q.next;
-	list_del_init(&bptr->list);
+	/* get the next buffer off the ready list, or with batched reads,
+	 * as many as fit in the user's buffer */
+	do {
+		bptr = (struct _stp_buffer *)_stp_ctl_ready_q.next;
+		size = _stp_ctl_read_size(bptr, batched);
+		if (total > 0 && total + size > count)
+			break;
+		list_move_tail(&bptr->list, &batch);
+		total += size;
+	} while (batched && !list_empty(&_stp_ctl_ready_q));
 	spin_unlock_irqrestore(&_stp_ctl_ready_lock, flags);
 
 	/* NB: we can't hold the context across copy_to_user, as it might fault.  */
 	_stp_runtime_entryfn_put_context(c);
 
-	/* write it out */
-	len = bptr->len + 4;
-	if (len > count || copy_to_user(buf, &bptr->type, len)) {
-		/* Now what?  We took it off the queue then failed to
-		 * send it.  We can't put it back on the queue because
-		 * it will likely be out-of-order.  Fortunately, this
-		 * should never happen.
-		 *
-		 * FIXME: need to mark this as a transport failure. */
-		errk("Supplied buffer too small. count:%d len:%d\n", (int)count, len);
-		return -EFAULT;
+	/* write them out */
+	total = 0;
+	list_for_each_entry(bptr, &batch, list) {
+		struct _stp_ctl_frame f = { .len = bptr->len + 4 };
+		char __user *p = buf + total;
+
+		len = bptr->len + 4;
+		size = _stp_ctl_read_size(bptr, batched);
+		if (total + size > count
+		    || (batched && copy_to_user(p, &f, sizeof(f)))
+		    || copy_to_user(p + (batched ? sizeof(f) : 0),
+				    &bptr->type, len)) {
+			/* Now what?  We took it off the queue then failed to
+			 * send it.  We can't put it back on the queue because
+			 * it will likely be out-of-order.  Fortunately, this
+			 * should never happen.
+			 *
+			 * FIXME: need to mark this as a transport failure. */
+			errk("Supplied buffer too small. count:%d len:%d\n", (int)count, len);
+			err = 1;
+			break;
+		}
+		total += size;
 	}
 
-	/* put it on the pool of free buffers */
+	/* put them on the pool of free buffers */
 	c = _stp_runtime_entryfn_get_context();
-	_stp_ctl_free_buffer(bptr);
+	list_for_each_entry_safe(bptr, tmp, &batch, list) {
+		list_del_init(&bptr->list);
+		_stp_ctl_free_buffer(bptr);
+	}
 	_stp_runtime_entryfn_put_context(c);
 
-	return len;
+	return err ? -EFAULT : total;
 }
 
 static int _stp_ctl_open_cmd(struct inode *inode, struct file *file)
@@ -668,6 +720,7 @@ static int _stp_ctl_open_cmd(struct inode *inode, struct file *file)
                 atomic_dec (&_stp_ctl_attached);
 		return -EBUSY;
         }
+	_stp_ctl_batched = 0;
 	_stp_attach();
 	return 0;
 }
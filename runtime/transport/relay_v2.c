@@ -31,26 +31,51 @@
 #include <linux/mm.h>
 #include <linux/relay.h>
 #include <linux/timer.h>
+#ifdef STAPCONF_IRQ_WORK_QUEUE
+#include <linux/irq_work.h>
+#endif
 #include "../uidgid_compatibility.h"
 #include "relay_compat.h"
 
 #ifndef STP_RELAY_TIMER_INTERVAL
-/* Wakeup timer interval in jiffies (default 10 ms) */
+/* Wakeup timer interval in jiffies while output comes (default 10 ms) */
 #define STP_RELAY_TIMER_INTERVAL		((HZ + 99) / 100)
 #endif
 
+#ifndef STP_RELAY_TIMER_MAX
+/* Longest wakeup timer interval, which the timer backs off to while no
+ * output comes (default 100 ms) */
+#define STP_RELAY_TIMER_MAX			(10 * STP_RELAY_TIMER_INTERVAL)
+#endif
+
+#ifndef STP_RELAY_WAKEUP_MARK
+/* Percentage of the sub-buffers of a buffer that, once full and not
+ * read yet, get the readers woken up and the timer checking every
+ * jiffy (default 50).  A buffer crossing the mark kicks the timer to
+ * expire at once, where irq_work can do that from any context. */
+#define STP_RELAY_WAKEUP_MARK			50
+#endif
+
 /* Note: if struct _stp_relay_data_type changes, staplog.c might need
  * to be changed. */
 struct _stp_relay_data_type {
 	struct rchan *rchan;
 	atomic_t /* enum _stp_transport_state */ transport_state;
-#ifdef _STP_USE_DROPPED_FILE
 	struct dentry *dropped_file;
 	atomic_t dropped;
+#ifdef _STP_DEFERRED_PRINT
+	struct dentry *formats_file;
 #endif
 	atomic_t wakeup;
 	struct timer_list timer;
 	int overwrite_flag;
+	struct dentry *wakeups_file;
+	atomic_t wakeups;
+	unsigned long interval;		/* of the timer, in jiffies */
+	size_t produced;		/* sub-buffers, at the last expiry */
+#ifdef STAPCONF_IRQ_WORK_QUEUE
+	struct irq_work kick;		/* expires the timer early */
+#endif
 };
 struct _stp_relay_data_type _stp_relay_data;
 
@@ -58,6 +83,8 @@ struct _stp_relay_data_type _stp_relay_data;
  * Below struct, filled in _stp_transport_data_fs_init(), fixes it. */
 static struct file_operations relay_file_operations_w_owner;
 
+static int __stp_relay_above_mark(struct rchan_buf *buf);
+
 /*
  *	__stp_relay_switch_subbuf - switch to a new sub-buffer
  *
@@ -82,7 +109,7 @@ static size_t __stp_relay_switch_subbuf(struct rchan_buf *buf, size_t length)
 		buf->dentry->d_inode->i_size += buf->chan->subbuf_size -
 			buf->padding[old_subbuf];
 		smp_mb();
-		if (waitqueue_active(&buf->read_wait))
+		if (waitqueue_active(&buf->read_wait)) {
 			/*
 			 * Calling wake_up_interruptible() and __mod_timer()
 			 * from here will deadlock if we happen to be logging
@@ -90,6 +117,14 @@ static size_t __stp_relay_switch_subbuf(struct rchan_buf *buf, size_t length)
 			 * rq->lock/timer->base->lock), so just set a flag.
 			 */
 			atomic_set(&_stp_relay_data.wakeup, 1);
+#ifdef STAPCONF_IRQ_WORK_QUEUE
+			/* ... but past the mark, don't wait out a long
+			 * timer interval; irq_work rearms it safely. */
+			if (_stp_relay_data.interval > 1
+			    && __stp_relay_above_mark(buf))
+				irq_work_queue(&_stp_relay_data.kick);
+#endif
+		}
 	}
 
 	old = buf->data;
@@ -116,41 +151,96 @@ toobig:
 static void __stp_relay_wakeup_readers(struct rchan_buf *buf)
 {
 	if (buf && waitqueue_active(&buf->read_wait) &&
-	    buf->subbufs_produced != buf->subbufs_consumed)
+	    buf->subbufs_produced != buf->subbufs_consumed) {
+		atomic_inc(&_stp_relay_data.wakeups);
 		wake_up_interruptible(&buf->read_wait);
+	}
 }
 
+/* Whether buf has enough full sub-buffers waiting to be read to wake
+ * up its readers even without a flag from __stp_relay_switch_subbuf().
+ * Nobody reads them in flight recorder mode. */
+static int __stp_relay_above_mark(struct rchan_buf *buf)
+{
+	size_t waiting;
+
+	if (!buf || _stp_relay_data.overwrite_flag)
+		return 0;
+	waiting = buf->subbufs_produced - buf->subbufs_consumed;
+	return waiting && waiting * 100 >= (size_t)STP_RELAY_WAKEUP_MARK
+				* buf->chan->n_subbufs;
+}
+
+/*
+ * The timer wakes up readers for the sub-buffers filled since it last
+ * expired, and picks its next expiry by how busy the buffers are: the
+ * next jiffy while one is filled past STP_RELAY_WAKEUP_MARK,
+ * STP_RELAY_TIMER_INTERVAL while sub-buffers get filled, and twice as
+ * late as the last time, up to STP_RELAY_TIMER_MAX, while none do.
+ */
 static void __stp_relay_wakeup_timer(unsigned long val)
 {
-#ifdef STP_BULKMODE
+	struct rchan_buf *buf;
+	int wakeup = atomic_read(&_stp_relay_data.wakeup);
+	int above_mark = 0;
+	size_t produced = 0;
+#if defined(STP_BULKMODE) || defined(_STP_PERCPU_STREAM)
 	int i;
 #endif
 
-	if (atomic_read(&_stp_relay_data.wakeup)) {
-		struct rchan_buf *buf;
-		
+	if (wakeup)
 		atomic_set(&_stp_relay_data.wakeup, 0);
-#ifdef STP_BULKMODE
-		for_each_possible_cpu(i) {
-			buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf,
-						    i);
+#if defined(STP_BULKMODE) || defined(_STP_PERCPU_STREAM)
+	for_each_possible_cpu(i) {
+		buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf, i);
+		if (!buf)
+			continue;
+		if (__stp_relay_above_mark(buf)) {
+			above_mark = 1;
 			__stp_relay_wakeup_readers(buf);
 		}
+		else if (wakeup)
+			__stp_relay_wakeup_readers(buf);
+		produced += buf->subbufs_produced;
+	}
 #else
-		buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf, 0);
-		__stp_relay_wakeup_readers(buf);
-#endif
+	buf = _stp_get_rchan_subbuf(_stp_relay_data.rchan->buf, 0);
+	if (buf) {
+		above_mark = __stp_relay_above_mark(buf);
+		if (above_mark || wakeup)
+			__stp_relay_wakeup_readers(buf);
+		produced = buf->subbufs_produced;
 	}
+#endif
+
+	if (above_mark)
+		_stp_relay_data.interval = 1;
+	else if (produced != _stp_relay_data.produced)
+		_stp_relay_data.interval = STP_RELAY_TIMER_INTERVAL;
+	else
+		_stp_relay_data.interval = min(2 * _stp_relay_data.interval,
+					       (unsigned long) STP_RELAY_TIMER_MAX);
+	_stp_relay_data.produced = produced;
 
 	if (atomic_read(&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING)
-        	mod_timer(&_stp_relay_data.timer, jiffies + STP_RELAY_TIMER_INTERVAL);
+        	mod_timer(&_stp_relay_data.timer, jiffies + _stp_relay_data.interval);
         else
 		dbug_trans(0, "relay_v2 wakeup timer expiry\n");
 }
 
+#ifdef STAPCONF_IRQ_WORK_QUEUE
+static void __stp_relay_kick_timer(struct irq_work *work)
+{
+	if (atomic_read(&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING)
+		mod_timer(&_stp_relay_data.timer, jiffies);
+}
+#endif
+
 static void __stp_relay_timer_init(void)
 {
 	atomic_set(&_stp_relay_data.wakeup, 0);
+	_stp_relay_data.interval = STP_RELAY_TIMER_INTERVAL;
+	_stp_relay_data.produced = 0;
 	init_timer(&_stp_relay_data.timer);
 	_stp_relay_data.timer.expires = jiffies + STP_RELAY_TIMER_INTERVAL;
 	_stp_relay_data.timer.function = __stp_relay_wakeup_timer;
@@ -169,27 +259,85 @@ static void _stp_transport_data_fs_overwrite(int overwrite)
 	_stp_relay_data.overwrite_flag = overwrite;
 }
 
-#ifdef _STP_USE_DROPPED_FILE
-static int __stp_relay_dropped_open(struct inode *inode, struct file *filp)
+/* The "dropped" and "wakeups" files read out the counter they were
+ * created with: the sub-buffers dropped because the buffer was full,
+ * and the times the timer woke up readers. */
+static int __stp_relay_counter_open(struct inode *inode, struct file *filp)
 {
+	filp->private_data = inode->i_private;
 	return 0;
 }
 
-static ssize_t __stp_relay_dropped_read(struct file *filp, char __user *buffer,
+static ssize_t __stp_relay_counter_read(struct file *filp, char __user *buffer,
 				size_t count, loff_t *ppos)
 {
 	char buf[16];
 
 	snprintf(buf, sizeof(buf), "%u\n",
-		 atomic_read(&_stp_relay_data.dropped));
+		 atomic_read((atomic_t *)filp->private_data));
 
 	return simple_read_from_buffer(buffer, count, ppos, buf, strlen(buf));
 }
 
-static struct file_operations __stp_relay_dropped_fops = {
+static struct file_operations __stp_relay_counter_fops = {
 	.owner =	THIS_MODULE,
-	.open =		__stp_relay_dropped_open,
-	.read =		__stp_relay_dropped_read,
+	.open =		__stp_relay_counter_open,
+	.read =		__stp_relay_counter_read,
+};
+
+/* Create a counter file in the module's directory. */
+static struct dentry *__stp_relay_counter_file(const char *name,
+					       atomic_t *counter, int *rc)
+{
+	struct dentry *file = debugfs_create_file(name, 0400,
+						  _stp_get_module_dir(),
+						  counter,
+						  &__stp_relay_counter_fops);
+	if (!file) {
+		*rc = -EIO;
+		return NULL;
+	}
+	else if (IS_ERR(file)) {
+		*rc = PTR_ERR(file);
+		return NULL;
+	}
+
+	file->d_inode->i_uid = KUIDT_INIT(_stp_uid);
+	file->d_inode->i_gid = KGIDT_INIT(_stp_gid);
+	return file;
+}
+
+#ifdef _STP_DEFERRED_PRINT
+/* The formats of the deferred print records, each ending in a '\0',
+ * for stapio to format the records with. */
+static ssize_t __stp_relay_formats_read(struct file *filp, char __user *buffer,
+					size_t count, loff_t *ppos)
+{
+	const char *fmt;
+	loff_t start = 0;
+	size_t done = 0;
+	unsigned id;
+
+	for (id = 0; done < count && (fmt = _stp_deferred_format(id)); id++) {
+		size_t len = strlen(fmt) + 1;
+
+		if (*ppos < start + len) {
+			size_t off = *ppos - start;
+			size_t bytes = min(len - off, count - done);
+
+			if (copy_to_user(buffer + done, fmt + off, bytes))
+				return -EFAULT;
+			done += bytes;
+			*ppos += bytes;
+		}
+		start += len;
+	}
+	return done;
+}
+
+static struct file_operations __stp_relay_formats_fops = {
+	.owner =	THIS_MODULE,
+	.read =		__stp_relay_formats_read,
 };
 #endif
 
@@ -204,9 +352,7 @@ static int __stp_relay_subbuf_start_callback(struct rchan_buf *buf,
 	if (_stp_relay_data.overwrite_flag || !relay_buf_full(buf))
 		return 1;
 
-#ifdef _STP_USE_DROPPED_FILE
 	atomic_inc(&_stp_relay_data.dropped);
-#endif
 	return 0;
 }
 
@@ -237,7 +383,7 @@ __stp_relay_create_buf_file_callback(const char *filename,
 	 * than the default set of per-cpu buffers.
 	 */
 	if (is_global) {
-#ifdef STP_BULKMODE
+#if defined(STP_BULKMODE) || defined(_STP_PERCPU_STREAM)
 		*is_global = 0;
 #else
 		*is_global = 1;
@@ -274,6 +420,12 @@ static void _stp_transport_data_fs_stop(void)
 	if (atomic_read (&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING) {
 		atomic_set (&_stp_relay_data.transport_state, STP_TRANSPORT_STOPPED);
 		del_timer_sync(&_stp_relay_data.timer);
+#ifdef STAPCONF_IRQ_WORK_QUEUE
+		/* No more kicks, and none left pending. */
+		_stp_relay_data.interval = 0;
+		smp_mb();
+		irq_work_sync(&_stp_relay_data.kick);
+#endif
 		dbug_trans(0, "flushing...\n");
 		if (_stp_relay_data.rchan)
 			relay_flush(_stp_relay_data.rchan);
@@ -283,9 +435,13 @@ static void _stp_transport_data_fs_stop(void)
 static void _stp_transport_data_fs_close(void)
 {
 	_stp_transport_data_fs_stop();
-#ifdef _STP_USE_DROPPED_FILE
 	if (_stp_relay_data.dropped_file)
 		debugfs_remove(_stp_relay_data.dropped_file);
+	if (_stp_relay_data.wakeups_file)
+		debugfs_remove(_stp_relay_data.wakeups_file);
+#ifdef _STP_DEFERRED_PRINT
+	if (_stp_relay_data.formats_file)
+		debugfs_remove(_stp_relay_data.formats_file);
 #endif
 	if (_stp_relay_data.rchan) {
 		relay_close(_stp_relay_data.rchan);
@@ -302,32 +458,54 @@ static int _stp_transport_data_fs_init(void)
 	atomic_set(&_stp_relay_data.transport_state, STP_TRANSPORT_STOPPED);
 	_stp_relay_data.overwrite_flag = 0;
 	_stp_relay_data.rchan = NULL;
+	_stp_relay_data.dropped_file = NULL;
+#ifdef _STP_DEFERRED_PRINT
+	_stp_relay_data.formats_file = NULL;
+#endif
 
-#ifdef _STP_USE_DROPPED_FILE
 	atomic_set(&_stp_relay_data.dropped, 0);
-	_stp_relay_data.dropped_file = NULL;
+	atomic_set(&_stp_relay_data.wakeups, 0);
+	_stp_relay_data.wakeups_file = NULL;
+	_stp_relay_data.interval = 0;
+#ifdef STAPCONF_IRQ_WORK_QUEUE
+	init_irq_work(&_stp_relay_data.kick, __stp_relay_kick_timer);
+#endif
 
-	/* Create "dropped" file. */
+	/* Create "dropped" and "wakeups" files. */
 	_stp_relay_data.dropped_file
-		= debugfs_create_file("dropped", 0400, _stp_get_module_dir(),
-				      NULL, &__stp_relay_dropped_fops);
-	if (!_stp_relay_data.dropped_file) {
+		= __stp_relay_counter_file("dropped",
+					   &_stp_relay_data.dropped, &rc);
+	if (!_stp_relay_data.dropped_file)
+		goto err;
+	_stp_relay_data.wakeups_file
+		= __stp_relay_counter_file("wakeups",
+					   &_stp_relay_data.wakeups, &rc);
+	if (!_stp_relay_data.wakeups_file)
+		goto err;
+
+#ifdef _STP_DEFERRED_PRINT
+	/* Create "formats" file, which also tells stapio to expect
+	 * deferred print records. */
+	_stp_relay_data.formats_file
+		= debugfs_create_file("formats", 0400, _stp_get_module_dir(),
+				      NULL, &__stp_relay_formats_fops);
+	if (!_stp_relay_data.formats_file) {
 		rc = -EIO;
 		goto err;
 	}
-	else if (IS_ERR(_stp_relay_data.dropped_file)) {
-		rc = PTR_ERR(_stp_relay_data.dropped_file);
-		_stp_relay_data.dropped_file = NULL;
+	else if (IS_ERR(_stp_relay_data.formats_file)) {
+		rc = PTR_ERR(_stp_relay_data.formats_file);
+		_stp_relay_data.formats_file = NULL;
 		goto err;
 	}
 
-	_stp_relay_data.dropped_file->d_inode->i_uid = KUIDT_INIT(_stp_uid);
-	_stp_relay_data.dropped_file->d_inode->i_gid = KGIDT_INIT(_stp_gid);
+	_stp_relay_data.formats_file->d_inode->i_uid = KUIDT_INIT(_stp_uid);
+	_stp_relay_data.formats_file->d_inode->i_gid = KGIDT_INIT(_stp_gid);
 #endif
 
 	/* Create "trace" file. */
 	npages = _stp_subbuf_size * _stp_nsubbufs;
-#ifdef STP_BULKMODE
+#if defined(STP_BULKMODE) || defined(_STP_PERCPU_STREAM)
 	npages *= num_online_cpus();
 #endif
 	npages >>= PAGE_SHIFT;
@@ -366,7 +544,7 @@ static int _stp_transport_data_fs_init(void)
         {
                 u64 relay_mem;
                 relay_mem = _stp_subbuf_size * _stp_nsubbufs;
-#ifdef STP_BULKMODE
+#if defined(STP_BULKMODE) || defined(_STP_PERCPU_STREAM)
                 relay_mem *= num_online_cpus();
 #endif
                 _stp_allocated_net_memory += relay_mem;
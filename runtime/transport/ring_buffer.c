@@ -25,10 +25,16 @@ static inline int _stp_ring_buffer_cpu_disabled(void)
 }
 
 #ifndef STP_RELAY_TIMER_INTERVAL
-/* Wakeup timer interval in jiffies (default 10 ms) */
+/* Wakeup timer interval in jiffies while output comes (default 10 ms) */
 #define STP_RELAY_TIMER_INTERVAL		((HZ + 99) / 100)
 #endif
 
+#ifndef STP_RELAY_TIMER_MAX
+/* Longest wakeup timer interval, which the timer backs off to while no
+ * output comes (default 100 ms) */
+#define STP_RELAY_TIMER_MAX			(10 * STP_RELAY_TIMER_INTERVAL)
+#endif
+
 struct _stp_data_entry {
 	size_t			len;
 	unsigned char		buf[];
@@ -62,6 +68,8 @@ struct _stp_relay_data_type {
 	cpumask_var_t trace_reader_cpumask;
 	struct timer_list timer;
 	int overwrite_flag;
+	atomic_t wakeups;
+	unsigned long interval;		/* of the timer, in jiffies */
 };
 static struct _stp_relay_data_type _stp_relay_data;
 
@@ -538,6 +546,23 @@ static struct file_operations __stp_data_fops = {
 	.read		= _stp_data_read_trace,
 };
 
+/* The "wakeups" file reads out the times the timer woke up readers,
+ * as with the relay transport. */
+static ssize_t _stp_wakeups_read(struct file *filp, char __user *ubuf,
+				 size_t cnt, loff_t *ppos)
+{
+	char buf[16];
+
+	snprintf(buf, sizeof(buf), "%u\n",
+		 atomic_read(&_stp_relay_data.wakeups));
+	return simple_read_from_buffer(ubuf, cnt, ppos, buf, strlen(buf));
+}
+
+static struct file_operations __stp_wakeups_fops = {
+	.owner		= THIS_MODULE,
+	.read		= _stp_wakeups_read,
+};
+
 static struct _stp_iterator *_stp_get_iterator(void)
 {
 #ifdef STP_BULKMODE
@@ -691,18 +716,32 @@ static int _stp_data_write_commit(void *entry)
 #endif
 }
 
+/* The timer wakes up readers if there is data, and then expires again
+ * after STP_RELAY_TIMER_INTERVAL; while there is none, it backs off to
+ * twice as late as the last time, up to STP_RELAY_TIMER_MAX. */
 static void __stp_relay_wakeup_timer(unsigned long val)
 {
-	if (waitqueue_active(&_stp_poll_wait) && ! _stp_ring_buffer_empty())
-		wake_up_interruptible(&_stp_poll_wait);
+	if (! _stp_ring_buffer_empty()) {
+		_stp_relay_data.interval = STP_RELAY_TIMER_INTERVAL;
+		if (waitqueue_active(&_stp_poll_wait)) {
+			atomic_inc(&_stp_relay_data.wakeups);
+			wake_up_interruptible(&_stp_poll_wait);
+		}
+	}
+	else
+		_stp_relay_data.interval = min(2 * _stp_relay_data.interval,
+					       (unsigned long) STP_RELAY_TIMER_MAX);
+
 	if (atomic_read(&_stp_relay_data.transport_state) == STP_TRANSPORT_RUNNING)
-        	mod_timer(&_stp_relay_data.timer, jiffies + STP_RELAY_TIMER_INTERVAL);
+        	mod_timer(&_stp_relay_data.timer, jiffies + _stp_relay_data.interval);
         else
-		dbug_trans(0, "ring_buffer wakeup timer expiry\n");
+		dbug_trans(0, "ring_buffer wakeup timer expiry, %u wakeups\n",
+			   atomic_read(&_stp_relay_data.wakeups));
 }
 
 static void __stp_relay_timer_start(void)
 {
+	_stp_relay_data.interval = STP_RELAY_TIMER_INTERVAL;
 	init_timer(&_stp_relay_data.timer);
 	_stp_relay_data.timer.expires = jiffies + STP_RELAY_TIMER_INTERVAL;
 	_stp_relay_data.timer.function = __stp_relay_wakeup_timer;
@@ -717,6 +756,7 @@ static void __stp_relay_timer_stop(void)
 }
 
 static struct dentry *__stp_entry[NR_CPUS] = { NULL };
+static struct dentry *__stp_wakeups_entry = NULL;
 
 static int _stp_transport_data_fs_init(void)
 {
@@ -725,6 +765,7 @@ static int _stp_transport_data_fs_init(void)
 
 	atomic_set (&_stp_relay_data.transport_state, STP_TRANSPORT_STOPPED);
 	_stp_relay_data.rb = NULL;
+	atomic_set(&_stp_relay_data.wakeups, 0);
 
 	// allocate buffer
 	dbug_trans(1, "entry...\n");
@@ -732,6 +773,20 @@ static int _stp_transport_data_fs_init(void)
 	if (rc != 0)
 		return rc;
 
+	__stp_wakeups_entry = debugfs_create_file("wakeups", 0400,
+						  _stp_get_module_dir(), NULL,
+						  &__stp_wakeups_fops);
+	if (!__stp_wakeups_entry || IS_ERR(__stp_wakeups_entry)) {
+		rc = __stp_wakeups_entry ? PTR_ERR(__stp_wakeups_entry)
+					 : -ENOENT;
+		__stp_wakeups_entry = NULL;
+		pr_warning("Could not create debugfs 'wakeups' entry\n");
+		__stp_free_ring_buffer();
+		return rc;
+	}
+	__stp_wakeups_entry->d_inode->i_uid = KUIDT_INIT(_stp_uid);
+	__stp_wakeups_entry->d_inode->i_gid = KGIDT_INIT(_stp_gid);
+
 	// create file(s)
 	for_each_online_cpu(cpu) {
 		char cpu_file[9];	/* 5(trace) + 3(XXX) + 1(\0) = 9 */
@@ -748,13 +803,14 @@ static int _stp_transport_data_fs_init(void)
 
 		if (!__stp_entry[cpu]) {
 			pr_warning("Could not create debugfs 'trace' entry\n");
-			__stp_free_ring_buffer();
+			_stp_transport_data_fs_close();
 			return -ENOENT;
 		}
 		else if (IS_ERR(__stp_entry[cpu])) {
 			rc = PTR_ERR(__stp_entry[cpu]);
+			__stp_entry[cpu] = NULL;
 			pr_warning("Could not create debugfs 'trace' entry\n");
-			__stp_free_ring_buffer();
+			_stp_transport_data_fs_close();
 			return rc;
 		}
 
@@ -813,6 +869,9 @@ static void _stp_transport_data_fs_close(void)
 			debugfs_remove(__stp_entry[cpu]);
 		__stp_entry[cpu] = NULL;
 	}
+	if (__stp_wakeups_entry)
+		debugfs_remove(__stp_wakeups_entry);
+	__stp_wakeups_entry = NULL;
 
 	__stp_free_ring_buffer();
 }
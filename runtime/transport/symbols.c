@@ -205,6 +205,9 @@ static int _stp_module_notifier (struct notifier_block * nb,
 		return NOTIFY_DONE;
 #endif
 
+        /* Section addresses may have changed, re-sort them. */
+        _stp_kmod_sec_index_rebuild();
+
         /* Give the probes a chance to update themselves. */
         /* Proper kprobes support for this appears to be relatively
            recent.  Example prerequisite commits: 0deddf436a f24659d9 */
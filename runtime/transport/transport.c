@@ -58,6 +58,31 @@ static atomic_t _stp_transport_state = ATOMIC_INIT(_STP_TS_UNINITIALIZED);
 #define STP_TRANSPORT_VERSION 2
 #endif
 
+/* With STP_PERCPU_PRINT, stream mode output goes to per-cpu relay
+ * buffers like bulk mode, without a global lock, but each flush gets a
+ * struct _stp_trace header, by which stapio merges the buffers back
+ * into one stream. */
+#if defined(STP_PERCPU_PRINT) && !defined(STP_BULKMODE) \
+    && STP_TRANSPORT_VERSION == 2
+#define _STP_PERCPU_STREAM 1
+#endif
+
+/* With STP_DEFERRED_PRINT, stream mode printf calls send the number
+ * of their format and the raw arguments, which stapio formats with the
+ * table the translator emits and the "formats" file exposes (see
+ * print.c). */
+#if defined(STP_DEFERRED_PRINT) && !defined(STP_BULKMODE) \
+    && STP_TRANSPORT_VERSION == 2
+#define _STP_DEFERRED_PRINT 1
+static const char *_stp_deferred_format(unsigned id);
+#endif
+
+/* With STP_LOSSLESS_PRINT, a flush waits a while for room in full
+ * transport buffers before it drops output (see print_flush.c). */
+#ifdef STP_LOSSLESS_PRINT
+static void _stp_print_lossless_report(void);
+#endif
+
 #include "control.h"
 #if STP_TRANSPORT_VERSION == 1
 #include "relayfs.c"
@@ -180,6 +205,9 @@ static void _stp_handle_start(struct _stp_msg_start *st)
                 rcu_read_unlock();
 #endif
 
+		/* staprun has sent all its relocations by now. */
+		_stp_kmod_sec_index_rebuild();
+
 		st->res = systemtap_module_init();
 		if (st->res == 0) {
 			_stp_probes_started = 1;
@@ -254,6 +282,9 @@ static void _stp_cleanup_and_exit(int send_exit)
 		failures = atomic_read(&_stp_transport_failures);
 		if (failures)
 			_stp_warn("There were %d transport failures.\n", failures);
+#ifdef STP_LOSSLESS_PRINT
+		_stp_print_lossless_report();
+#endif
 
 		dbug_trans(1, "*** calling _stp_transport_data_fs_stop ***\n");
 		_stp_transport_data_fs_stop();
@@ -381,6 +412,7 @@ static void _stp_transport_close(void)
 	_stp_unregister_ctl_channel();
 	_stp_transport_fs_close();
 	_stp_print_cleanup();	/* free print buffers */
+	_stp_kmod_sec_index_free();
 	_stp_mem_debug_done();
 
 	dbug_trans(1, "---- CLOSED ----\n");
@@ -473,6 +505,10 @@ static int _stp_transport_init(void)
 	if (_stp_module_update_self() < 0)
 		goto err3;
 
+	/* allocate the kernel section address index */
+	if (_stp_kmod_sec_index_init() < 0)
+		goto err4;
+
 	/* start transport */
 	_stp_transport_data_fs_start();
 
@@ -487,6 +523,8 @@ static int _stp_transport_init(void)
 	dbug_trans(1, "returning 0...\n");
 	return 0;
 
+err4:
+	_stp_kmod_sec_index_free();
 err3:
 	_stp_print_cleanup();
 err2:
@@ -24,6 +24,15 @@ struct _stp_trace {
 	uint32_t pdu_len;	/* length of data after this trace */
 };
 
+/* With STP_DEFERRED_PRINT, stream mode output is a sequence of these,
+   each followed by len bytes: text if id is 0, otherwise the arguments
+   of format id - 1, numbers as int64_t and strings as a uint32_t length
+   and the bytes. */
+struct _stp_print_record {
+	uint32_t id;		/* 0, or format number + 1 */
+	uint32_t len;		/* length of data after this record */
+};
+
 /* stp control channel command values */
 enum
 {
@@ -87,7 +96,16 @@ enum
 	STP_MAX_CMD,
   /** Sent by stapio after having recevied STP_TRANSPORT. Notifies
       the module of the target namespaces pid.*/
-  STP_NAMESPACES_PID
+  STP_NAMESPACES_PID,
+	/** Sent by staprun when initializing relayfs, like STP_BULK.
+	    Absorbed by a module built with STP_PERCPU_PRINT, whose stream
+	    mode output comes in per-cpu files of struct _stp_trace records,
+	    otherwise returns -EINVAL.  */
+	STP_PERCPU_STREAM,
+	/** Sent by stapio at startup to have each read of the control
+	    channel return as many queued messages as fit, each in a
+	    struct _stp_ctl_frame.  Older modules return -EINVAL.  */
+	STP_BATCHED_READS
 };
 
 #ifdef DEBUG_TRANS
@@ -110,9 +128,20 @@ static const char *_stp_command_name[] = {
 	"STP_PRIVILEGE_CREDENTIALS",
 	"STP_REMOTE_ID",
   "STP_NAMESPACES_PID",
+	"STP_PERCPU_STREAM",
+	"STP_BATCHED_READS",
 };
 #endif /* DEBUG_TRANS */
 
+/* With STP_BATCHED_READS, each message read from the control channel
+   comes after one of these, and the next one starts at the next
+   multiple of 4 bytes. */
+struct _stp_ctl_frame {
+	uint32_t len;		/* length of the type and payload after this */
+};
+
+#define STP_CTL_FRAME_ALIGN(len) (((len) + 3) & ~3)
+
 /* control channel messages */
 
 /* command to execute: module->stapio */
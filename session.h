@@ -41,6 +41,7 @@ extern "C" {
 #define STAT_OP_MAX       1 << 4
 #define STAT_OP_AVG       1 << 5
 #define STAT_OP_VARIANCE  1 << 6
+#define STAT_OP_QUANTILE  1 << 10
 
 // forward decls for all referenced systemtap types
 class stap_hash;
@@ -320,6 +321,7 @@ public:
   bool poison_cache;            // consider the cache to be write-only
   std::string cache_path;       // usually ~/.systemtap/cache
   std::string hash_path;        // path to the cached script module
+  std::string early_hash_path;  // path to the pre-pass-1 link to hash_path
   std::string stapconf_path;    // path to the cached stapconf
   stap_hash *base_hash;         // hash common to all caching
 
@@ -396,6 +398,9 @@ public:
   // unparser data
   translator_output* op;
   std::vector<translator_output*> auxiliary_outputs;
+  std::vector<std::string> symbol_objects; // cached symbol data objects to link
+  std::vector<std::pair<std::string,std::string> > symbol_object_cache;
+                                // (built symbol data object, cache path)
   unparser* up;
 
   // some symbol addresses
@@ -409,6 +414,8 @@ public:
   bool unwindsym_ldd;
   struct module_cache* module_cache;
   std::vector<std::string> build_ids;
+  // The files those build ids came from, for the early cache link
+  std::set<std::string> build_id_files;
 
   // Secret benchmarking options
   unsigned long benchmark_sdt_loops;
@@ -522,6 +522,10 @@ setup_dwfl_user(std::vector<std::string>::const_iterator &begin,
 
       //Store the build ID in the session
       s.build_ids.push_back(hex);
+      const char *mainfile = NULL;
+      dwfl_module_info (mod, NULL, NULL, NULL, NULL, NULL, &mainfile, NULL);
+      if (mainfile)
+        s.build_id_files.insert(mainfile);
     }
 
   if (dwfl)
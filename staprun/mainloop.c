@@ -608,6 +608,206 @@ void cleanup_and_exit(int detach, int rc)
 }
 
 
+/* Room for the messages of one read of the control channel. */
+#define CTL_RECVBUF_SIZE 65536
+
+static int error_detected = 0;
+
+/* Act on one message from the module, with nb bytes of payload. */
+static void handle_ctl_msg(uint32_t type, char *data, ssize_t nb)
+{
+  int rc;
+
+  PROBE3(staprun, recv__ctlmsg, type, data, nb);
+
+  switch (type) {
+#if STP_TRANSPORT_VERSION == 1
+  case STP_REALTIME_DATA:
+    if (write_realtime_data(data, nb)) {
+      _perr(_("write error (nb=%ld)"), (long)nb);
+      cleanup_and_exit(0, 1);
+    }
+    break;
+#endif
+  case STP_OOB_DATA:
+    /* Note that "WARNING:" should not be translated, since it is
+     * part of the module cmd protocol. */
+    if (strncmp(data, "WARNING: ", 9) == 0) {
+            if (suppress_warnings) break;
+            if (verbose) { /* don't eliminate duplicates */
+                    if (monitor)
+                            monitor_remember_output_line (data, nb);
+                    else
+                            /* trim "WARNING: " */
+                            warn("%.*s", (int) nb-9, data+9);
+                    break;
+            } else { /* eliminate duplicates */
+                    static void *seen = 0;
+                    static unsigned seen_count = 0;
+                    char *dupstr = strndup (data, (int) nb);
+                    char *retval;
+
+                    if (! dupstr) {
+                            /* OOM, should not happen. */
+                            if (monitor)
+                                    monitor_remember_output_line (data, nb);
+                            else
+                                    /* trim "WARNING: " */
+                                    warn("%.*s", (int) nb-9, data+9);
+                            break;
+                    }
+
+                    retval = tfind (dupstr, & seen, (int (*)(const void*, const void*))strcmp);
+                    if (! retval) { /* new message */
+                            if (monitor)
+                                    monitor_remember_output_line (data, nb);
+                            else
+                                    /* trim "WARNING: " */
+                                    warn("%.*s", strlen(dupstr)-9, dupstr+9);
+
+                            /* We set a maximum for stored warning messages,
+                               to prevent a misbehaving script/environment
+                               from emitting countless _stp_warn()s, and
+                               overflow staprun's memory. */
+#define MAX_STORED_WARNINGS 1024
+                            if (seen_count++ == MAX_STORED_WARNINGS) {
+                                    eprintf(_("WARNING deduplication table full\n"));
+                                    free (dupstr);
+                            }
+                            else if (seen_count > MAX_STORED_WARNINGS) {
+                                    /* Be quiet in the future, but stop counting to
+                                       preclude overflow. */
+                                    free (dupstr);
+                                    seen_count = MAX_STORED_WARNINGS+1;
+                            }
+                            else if (seen_count < MAX_STORED_WARNINGS) {
+                                    /* NB: don't free dupstr; it's going into the tree. */
+                                    retval = tsearch (dupstr, & seen,
+                                                      (int (*)(const void*, const void*))strcmp);
+                                    if (retval == 0) {
+                                            /* OOM, should not happen */
+                                            /* Next time we should get the 'full' message. */
+                                            free (dupstr);
+                                            seen_count = MAX_STORED_WARNINGS;
+                                    }
+                            }
+                    } else { /* old message */
+                            free (dupstr);
+                    }
+            } /* duplicate elimination */
+    /* Note that "ERROR:" should not be translated, since it is
+     * part of the module cmd protocol. */
+    } else if (strncmp(data, "ERROR: ", 7) == 0) {
+            if (monitor)
+                    monitor_remember_output_line (data, nb);
+            else
+                    /* trim "ERROR: " */
+                    err("%.*s", (int) nb-7, data+7);
+            error_detected = 1;
+    } else { /* neither warning nor error */
+            if (monitor)
+                    monitor_remember_output_line (data, nb);
+            else
+                    eprintf("%.*s", (int) nb, data);
+    }
+    break;
+  case STP_EXIT:
+    {
+      /* module asks us to unload it and exit */
+      dbug(2, "got STP_EXIT\n");
+      if (monitor)
+              monitor_exited();
+      else
+              cleanup_and_exit(0, error_detected);
+      /* monitor mode exit handled elsewhere, later. */
+      break;
+    }
+  case STP_REQUEST_EXIT:
+    {
+      /* module asks us to start exiting, so send STP_EXIT */
+      dbug(2, "got STP_REQUEST_EXIT\n");
+      int32_t rc, btype = STP_EXIT;
+      rc = write(control_channel, &btype, sizeof(btype));
+      (void) rc; /* XXX: notused */
+      break;
+    }
+  case STP_START:
+    {
+      struct _stp_msg_start *t = (struct _stp_msg_start *) data;
+      dbug(2, "systemtap_module_init() returned %d\n", t->res);
+      if (t->res < 0) {
+        if (target_cmd)
+          kill(target_pid, SIGKILL);
+        cleanup_and_exit(0, 1);
+      } else if (target_cmd) {
+        dbug(1, "detaching pid %d\n", target_pid);
+#if WORKAROUND_BZ467568
+        /* Let's just send our pet signal to the child
+           process that should be waiting for us, mid-pause(). */
+        kill (target_pid, SIGUSR1);
+#else
+        /* Were it not for PR6964, we'd like to do it this way: */
+        int rc = ptrace (PTRACE_DETACH, target_pid, 0, 0);
+        if (rc < 0)
+          {
+            perror (_("ptrace detach"));
+            if (target_cmd)
+              kill(target_pid, SIGKILL);
+            cleanup_and_exit(0, 1);
+          }
+#endif
+      }
+      break;
+    }
+  case STP_SYSTEM:
+    {
+      struct _stp_msg_cmd *c = (struct _stp_msg_cmd *) data;
+      dbug(2, "STP_SYSTEM: %s\n", c->cmd);
+      system_cmd(c->cmd);
+      break;
+    }
+  case STP_NAMESPACES_PID:
+    {
+      struct _stp_msg_ns_pid *nspid = (struct _stp_msg_ns_pid *) data;
+      dbug(2, "STP_NAMESPACES_PID: %d\n", nspid->target);
+      break;
+    }
+  case STP_TRANSPORT:
+    {
+      struct _stp_msg_start ts;
+      struct _stp_msg_ns_pid nspid;
+      if (use_old_transport) {
+        if (init_oldrelayfs() < 0)
+          cleanup_and_exit(0, 1);
+      } else {
+        if (init_relayfs() < 0)
+          cleanup_and_exit(0, 1);
+      }
+
+      if (target_namespaces_pid > 0) {
+        nspid.target = target_namespaces_pid;
+        rc = send_request(STP_NAMESPACES_PID, &nspid, sizeof(nspid));
+        if (rc != 0) {
+		perror ("Unable to send STP_NAMESPACES_PID");
+		cleanup_and_exit (1, rc);
+	      }
+      }
+
+      ts.target = target_pid;
+      rc = send_request(STP_START, &ts, sizeof(ts));
+      if (rc != 0) {
+	perror ("Unable to send STP_START");
+	cleanup_and_exit(0, rc);
+      }
+      if (load_only)
+        cleanup_and_exit(1, 0);
+      break;
+    }
+  default:
+    warn(_("Ignored message of type %d\n"), type);
+  }
+}
+
 /**
  *	stp_main_loop - loop forever reading data
  */
@@ -616,18 +816,11 @@ int stp_main_loop(void)
 {
   ssize_t nb;
   FILE *ofp = stdout;
-  struct
-  {
-    uint32_t type;
-    union
-    {
-      char data[8192];
-      struct _stp_msg_start start;
-      struct _stp_msg_cmd cmd;
-      struct _stp_msg_ns_pid nspid;
-    } payload;
-  } recvbuf;
-  int error_detected = 0;
+  /* one message, its type first, or with batched reads, many in frames */
+  static uint32_t recvbuf[CTL_RECVBUF_SIZE / sizeof(uint32_t)];
+  int batched;
+  size_t off;
+  uint32_t len;
   int select_supported;
   int flags;
   int res;
@@ -650,6 +843,10 @@ int stp_main_loop(void)
     cleanup_and_exit(0, rc);
   }
 
+  /* Older modules don't know STP_BATCHED_READS, and say so. */
+  batched = (send_request(STP_BATCHED_READS, NULL, 0) == 0);
+  dbug(2, "batched reads: %d\n", batched);
+
   flags = fcntl(control_channel, F_GETFL);
 
   /* Make select return immediately.  We just check whether
@@ -715,7 +912,7 @@ int stp_main_loop(void)
     fcntl(control_channel, F_SETFL, flags);
 
     dbug(3, "nb=%ld\n", (long)nb);
-    if (nb < (ssize_t) sizeof(recvbuf.type)) {
+    if (nb < (ssize_t) sizeof(uint32_t)) {
       if (nb >= 0 || (errno != EINTR && errno != EAGAIN)) {
         _perr(_("Unexpected EOF in read (nb=%ld)"), (long)nb);
         cleanup_and_exit(0, 1);
@@ -741,194 +938,26 @@ int stp_main_loop(void)
       continue;
     }
 
-    nb -= sizeof(recvbuf.type);
-    PROBE3(staprun, recv__ctlmsg, recvbuf.type, recvbuf.payload.data, nb);
+    if (!batched) {
+      handle_ctl_msg(recvbuf[0], (char *) &recvbuf[1],
+                     nb - sizeof(uint32_t));
+      continue;
+    }
 
-    switch (recvbuf.type) {
-#if STP_TRANSPORT_VERSION == 1
-    case STP_REALTIME_DATA:
-      if (write_realtime_data(recvbuf.payload.data, nb)) {
-        _perr(_("write error (nb=%ld)"), (long)nb);
+    /* Each message comes in a frame; see struct _stp_ctl_frame. */
+    for (off = 0; off + sizeof(struct _stp_ctl_frame) + sizeof(uint32_t) <= (size_t) nb;
+         off += STP_CTL_FRAME_ALIGN(sizeof(struct _stp_ctl_frame) + len)) {
+      char *frame = (char *) recvbuf + off;
+      uint32_t type;
+
+      memcpy(&len, frame, sizeof(len));
+      if (len < sizeof(type) || off + sizeof(struct _stp_ctl_frame) + len > (size_t) nb) {
+        _perr(_("Bad message frame in read (nb=%ld)"), (long)nb);
         cleanup_and_exit(0, 1);
       }
-      break;
-#endif
-    case STP_OOB_DATA:
-      /* Note that "WARNING:" should not be translated, since it is
-       * part of the module cmd protocol. */
-      if (strncmp(recvbuf.payload.data, "WARNING: ", 9) == 0) {
-              if (suppress_warnings) break;
-              if (verbose) { /* don't eliminate duplicates */
-                      if (monitor)
-                              monitor_remember_output_line (recvbuf.payload.data, nb);
-                      else
-                              /* trim "WARNING: " */
-                              warn("%.*s", (int) nb-9, recvbuf.payload.data+9);
-                      break;
-              } else { /* eliminate duplicates */
-                      static void *seen = 0;
-                      static unsigned seen_count = 0;
-                      char *dupstr = strndup (recvbuf.payload.data, (int) nb);
-                      char *retval;
-
-                      if (! dupstr) {
-                              /* OOM, should not happen. */
-                              if (monitor)
-                                      monitor_remember_output_line (recvbuf.payload.data, nb);
-                              else
-                                      /* trim "WARNING: " */
-                                      warn("%.*s", (int) nb-9, recvbuf.payload.data+9);
-                              break;
-                      }
-
-                      retval = tfind (dupstr, & seen, (int (*)(const void*, const void*))strcmp);
-                      if (! retval) { /* new message */
-                              if (monitor)
-                                      monitor_remember_output_line (recvbuf.payload.data, nb);
-                              else
-                                      /* trim "WARNING: " */
-                                      warn("%.*s", strlen(dupstr)-9, dupstr+9);
-
-                              /* We set a maximum for stored warning messages,
-                                 to prevent a misbehaving script/environment
-                                 from emitting countless _stp_warn()s, and
-                                 overflow staprun's memory. */
-#define MAX_STORED_WARNINGS 1024
-                              if (seen_count++ == MAX_STORED_WARNINGS) {
-                                      eprintf(_("WARNING deduplication table full\n"));
-                                      free (dupstr);
-                              }
-                              else if (seen_count > MAX_STORED_WARNINGS) {
-                                      /* Be quiet in the future, but stop counting to
-                                         preclude overflow. */
-                                      free (dupstr);
-                                      seen_count = MAX_STORED_WARNINGS+1;
-                              }
-                              else if (seen_count < MAX_STORED_WARNINGS) {
-                                      /* NB: don't free dupstr; it's going into the tree. */
-                                      retval = tsearch (dupstr, & seen,
-                                                        (int (*)(const void*, const void*))strcmp);
-                                      if (retval == 0) {
-                                              /* OOM, should not happen */
-                                              /* Next time we should get the 'full' message. */
-                                              free (dupstr);
-                                              seen_count = MAX_STORED_WARNINGS;
-                                      }
-                              }
-                      } else { /* old message */
-                              free (dupstr);
-                      }
-              } /* duplicate elimination */
-      /* Note that "ERROR:" should not be translated, since it is
-       * part of the module cmd protocol. */
-      } else if (strncmp(recvbuf.payload.data, "ERROR: ", 7) == 0) {
-              if (monitor)
-                      monitor_remember_output_line (recvbuf.payload.data, nb);
-              else
-                      /* trim "ERROR: " */
-                      err("%.*s", (int) nb-7, recvbuf.payload.data+7);
-              error_detected = 1;
-      } else { /* neither warning nor error */
-              if (monitor)
-                      monitor_remember_output_line (recvbuf.payload.data, nb);
-              else
-                      eprintf("%.*s", (int) nb, recvbuf.payload.data);
-      }
-      break;
-    case STP_EXIT:
-      {
-        /* module asks us to unload it and exit */
-        dbug(2, "got STP_EXIT\n");
-        if (monitor)
-                monitor_exited();
-        else
-                cleanup_and_exit(0, error_detected);
-        /* monitor mode exit handled elsewhere, later. */
-        break;
-      }
-    case STP_REQUEST_EXIT:
-      {
-        /* module asks us to start exiting, so send STP_EXIT */
-        dbug(2, "got STP_REQUEST_EXIT\n");
-        int32_t rc, btype = STP_EXIT;
-        rc = write(control_channel, &btype, sizeof(btype));
-        (void) rc; /* XXX: notused */
-        break;
-      }
-    case STP_START:
-      {
-        struct _stp_msg_start *t = &recvbuf.payload.start;
-        dbug(2, "systemtap_module_init() returned %d\n", t->res);
-        if (t->res < 0) {
-          if (target_cmd)
-            kill(target_pid, SIGKILL);
-          cleanup_and_exit(0, 1);
-        } else if (target_cmd) {
-          dbug(1, "detaching pid %d\n", target_pid);
-#if WORKAROUND_BZ467568
-          /* Let's just send our pet signal to the child
-             process that should be waiting for us, mid-pause(). */
-          kill (target_pid, SIGUSR1);
-#else
-          /* Were it not for PR6964, we'd like to do it this way: */
-          int rc = ptrace (PTRACE_DETACH, target_pid, 0, 0);
-          if (rc < 0)
-            {
-              perror (_("ptrace detach"));
-              if (target_cmd)
-                kill(target_pid, SIGKILL);
-              cleanup_and_exit(0, 1);
-            }
-#endif
-        }
-        break;
-      }
-    case STP_SYSTEM:
-      {
-        struct _stp_msg_cmd *c = &recvbuf.payload.cmd;
-        dbug(2, "STP_SYSTEM: %s\n", c->cmd);
-        system_cmd(c->cmd);
-        break;
-      }
-    case STP_NAMESPACES_PID:
-      {
-        struct _stp_msg_ns_pid *nspid = &recvbuf.payload.nspid;
-        dbug(2, "STP_NAMESPACES_PID: %d\n", nspid->target);
-        break;
-      }
-    case STP_TRANSPORT:
-      {
-        struct _stp_msg_start ts;
-        struct _stp_msg_ns_pid nspid;
-        if (use_old_transport) {
-          if (init_oldrelayfs() < 0)
-            cleanup_and_exit(0, 1);
-        } else {
-          if (init_relayfs() < 0)
-            cleanup_and_exit(0, 1);
-        }
-
-        if (target_namespaces_pid > 0) {
-          nspid.target = target_namespaces_pid;
-          rc = send_request(STP_NAMESPACES_PID, &nspid, sizeof(nspid));
-          if (rc != 0) {
-	          perror ("Unable to send STP_NAMESPACES_PID");
-	          cleanup_and_exit (1, rc);
-	        }
-        }
-
-        ts.target = target_pid;
-        rc = send_request(STP_START, &ts, sizeof(ts));
-	if (rc != 0) {
-	  perror ("Unable to send STP_START");
-	  cleanup_and_exit(0, rc);
-	}
-        if (load_only)
-          cleanup_and_exit(1, 0);
-        break;
-      }
-    default:
-      warn(_("Ignored message of type %d\n"), recvbuf.type);
+      frame += sizeof(struct _stp_ctl_frame);
+      memcpy(&type, frame, sizeof(type));
+      handle_ctl_msg(type, frame + sizeof(type), len - sizeof(type));
     }
   }
   fclose(ofp);
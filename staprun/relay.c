@@ -20,11 +20,23 @@ static int avail_cpus[NR_CPUS];
 static int switch_file[NR_CPUS];
 static pthread_mutex_t mutex[NR_CPUS];
 static int bulkmode = 0;
+static int percpu_stream = 0;
+static int use_splice = 0;
 static volatile int stop_threads = 0;
 static time_t *time_backlog[NR_CPUS];
 static int backlog_order=0;
 #define BACKLOG_MASK ((1 << backlog_order) - 1)
 #define MONITORLINELENGTH 4096
+#define SPLICE_CHUNK 131072
+
+/* Outside bulk mode, the kernel only wakes up the readers for full
+   sub-buffers, so they poll with a timeout for the rest.  Unless -T
+   fixes it, the timeout halves after each poll that brought data, down
+   to POLL_MIN_MS, and doubles after each that didn't, up to
+   POLL_MAX_MS.  It starts out doubled from POLL_START_MS. */
+#define POLL_MIN_MS 20
+#define POLL_START_MS 100
+#define POLL_MAX_MS 800
 
 #ifdef NEED_PPOLL
 int ppoll(struct pollfd *fds, nfds_t nfds,
@@ -119,6 +131,506 @@ static int switch_outfile(int cpu, int *fnum)
 	return 0;
 }
 
+/* Switch to the next output file if one was requested, or if writing
+   another 'bytes' would take the current one past fsize_max. */
+static int maybe_switch_outfile(int cpu, ssize_t bytes, off_t *wsize, int *fnum)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&mutex[cpu]);
+	if ((fsize_max && ((*wsize + bytes) > fsize_max)) ||
+	    switch_file[cpu]) {
+		if (switch_outfile(cpu, fnum) < 0)
+			rc = -1;
+		switch_file[cpu] = 0;
+		*wsize = 0;
+	}
+	pthread_mutex_unlock(&mutex[cpu]);
+	return rc;
+}
+
+/* Set tim to the next poll timeout of a reader, whose last one was *ms
+   and brought data if busy. */
+static void adapt_timeout(struct timespec *tim, unsigned *ms, int busy)
+{
+	if (reader_timeout_ms)
+		return;
+	if (busy)
+		*ms = *ms / 2 > POLL_MIN_MS ? *ms / 2 : POLL_MIN_MS;
+	else
+		*ms = *ms * 2 < POLL_MAX_MS ? *ms * 2 : POLL_MAX_MS;
+	tim->tv_sec = *ms / 1000;
+	tim->tv_nsec = (*ms % 1000) * 1000000;
+}
+
+/**
+ *	write_output - write data to the output of a cpu
+ *
+ *	Returns 0 on success, negative on error.
+ */
+static int write_output(int cpu, char *wbuf, ssize_t wbytes, off_t *wsize)
+{
+	ssize_t rc;
+
+	/* Copy loop.  Must repeat write(2) in case of a pipe overflow
+	   or other transient fullness. */
+	while (wbytes > 0) {
+		if (monitor) {
+			ssize_t bytes = wbytes > MONITORLINELENGTH ? MONITORLINELENGTH : wbytes;
+			/* Start scanning the wbuf[] for lines - \n.
+			  Plop each one found into the h_queue.lines[] ring. */
+			char *p = wbuf; /* scan position */
+			char *p_end = wbuf + bytes; /* one past last byte */
+			char *line = p;
+			while (p < p_end) {
+				if (*p == '\n') { /* got a line */
+					monitor_remember_output_line(line, (p-line)+1); /* strlen, including \n */
+					line = p+1;
+				}
+				p++;
+			}
+			/* Flush remaining output */
+			if (line != p_end)
+				monitor_remember_output_line(line, (p_end - line));
+			wbytes -= bytes;
+			wbuf += bytes;
+			*wsize += bytes;
+		} else {
+			rc = write(out_fd[cpu], wbuf, wbytes);
+			if (rc <= 0) {
+				perr("Couldn't write to output %d for cpu %d, exiting.",
+				     out_fd[cpu], cpu);
+				return -1;
+			}
+			wbytes -= rc;
+			wbuf += rc;
+			*wsize += rc;
+		}
+	}
+	return 0;
+}
+
+/* Deferred print mode.  A module built with STP_DEFERRED_PRINT sends
+   most printf calls as a struct _stp_print_record with the number of
+   the format and the raw arguments, and leaves the formatting to us.
+   The formats come from its "formats" file, in the form of the
+   translator's print_format::components_to_string(), and are formatted
+   here the way the runtime's compiled printfs do (runtime/vsprintf.c). */
+
+static char *deferred_table;	/* contents of the "formats" file */
+static char **deferred_formats;
+static unsigned n_deferred_formats;
+
+/* The runtime clamps widths and precisions to its print buffer size. */
+#define DEFERRED_MAX_WIDTH 8192
+
+/* The largest record we wait for; far more than the print buffer. */
+#define DEFERRED_MAX_RECORD 65536
+
+/* the number() flags of runtime/vsprintf.h */
+enum deferred_flag { DF_ZEROPAD = 1, DF_SIGN = 2, DF_PLUS = 4, DF_SPACE = 8,
+		     DF_LEFT = 16, DF_SPECIAL = 32, DF_LARGE = 64 };
+
+/* The text of the records formatted so far. */
+struct deferred_out {
+	char *data;
+	size_t len, size;
+};
+
+/**
+ *	read_deferred_formats - read the formats of a deferred print module
+ *
+ *	Returns 1 if the module has them, 0 if not, negative on error.
+ */
+static int read_deferred_formats(void)
+{
+	char buf[PATH_MAX];
+	size_t len = 0, size = 0;
+	ssize_t rc;
+	unsigned i;
+	int fd = -1;
+
+#ifdef HAVE_OPENAT
+	if (relay_basedir_fd >= 0)
+		fd = openat_cloexec(relay_basedir_fd, "formats", O_RDONLY, 0);
+#endif
+	if (fd < 0) {
+		if (sprintf_chk(buf, "/sys/kernel/debug/systemtap/%s/formats",
+				modname))
+			return -1;
+		fd = open_cloexec(buf, O_RDONLY, 0);
+	}
+	if (fd < 0)
+		return 0;
+
+	do {
+		if (size - len < 4096) {
+			char *data = realloc(deferred_table, size + 65536);
+			if (data == NULL)
+				goto nomem;
+			deferred_table = data;
+			size += 65536;
+		}
+		rc = read(fd, deferred_table + len, size - len);
+		if (rc > 0)
+			len += rc;
+	} while (rc > 0);
+	close(fd);
+	if (rc < 0) {
+		perr("Couldn't read the print formats of the module");
+		return -1;
+	}
+
+	for (i = 0; i < len; i++)
+		if (deferred_table[i] == '\0')
+			n_deferred_formats++;
+	deferred_formats = calloc(n_deferred_formats + 1,
+				  sizeof(*deferred_formats));
+	if (deferred_formats == NULL)
+		goto nomem;
+	for (i = 0; i < n_deferred_formats; i++)
+		deferred_formats[i] = i ? deferred_formats[i - 1]
+			+ strlen(deferred_formats[i - 1]) + 1 : deferred_table;
+	dbug(2, "%u deferred print formats\n", n_deferred_formats);
+	return 1;
+
+nomem:
+	close(fd);
+	_err("Memory allocation failed\n");
+	return -1;
+}
+
+/* Append len bytes of str, or n copies of c if str is NULL, to out. */
+static int deferred_put(struct deferred_out *out, const char *str,
+			char c, long n)
+{
+	if (n <= 0)
+		return 0;
+	if (out->size - out->len < (size_t)n) {
+		size_t size = out->size ? out->size : 4096;
+		char *data;
+		while (size - out->len < (size_t)n)
+			size *= 2;
+		data = realloc(out->data, size);
+		if (data == NULL) {
+			_err("Memory allocation failed\n");
+			return -1;
+		}
+		out->data = data;
+		out->size = size;
+	}
+	if (str)
+		memcpy(out->data + out->len, str, n);
+	else
+		memset(out->data + out->len, c, n);
+	out->len += n;
+	return 0;
+}
+
+/* Format num like the runtime's number(). */
+static int deferred_number(struct deferred_out *out, uint64_t num, int base,
+			   int size, int precision, int type)
+{
+	const char *digits = (type & DF_LARGE) ? "0123456789ABCDEF"
+		: "0123456789abcdef";
+	char tmp[66], sign = 0, c;
+	int i = 0;
+
+	if (type & DF_LEFT)
+		type &= ~DF_ZEROPAD;
+	c = (type & DF_ZEROPAD) ? '0' : ' ';
+	if (type & DF_SIGN) {
+		if ((int64_t) num < 0) {
+			sign = '-';
+			num = - num;
+			size--;
+		} else if (type & DF_PLUS) {
+			sign = '+';
+			size--;
+		} else if (type & DF_SPACE) {
+			sign = ' ';
+			size--;
+		}
+	}
+	if (type & DF_SPECIAL) {
+		if (base == 16)
+			size -= 2;
+		else if (base == 8)
+			size--;
+	}
+	do {
+		tmp[i++] = digits[num % base];
+		num /= base;
+	} while (num != 0);
+	if (i > precision)
+		precision = i;
+	size -= precision;
+
+	if (!(type & (DF_ZEROPAD | DF_LEFT))) {
+		if (deferred_put(out, NULL, ' ', size) < 0)
+			return -1;
+		size = 0;
+	}
+	if (sign && deferred_put(out, &sign, 0, 1) < 0)
+		return -1;
+	if (type & DF_SPECIAL) {
+		if (base == 8 && deferred_put(out, "0", 0, 1) < 0)
+			return -1;
+		if (base == 16 && deferred_put(out, (type & DF_LARGE)
+					       ? "0X" : "0x", 0, 2) < 0)
+			return -1;
+	}
+	if (!(type & DF_LEFT)) {
+		if (deferred_put(out, NULL, c, size) < 0)
+			return -1;
+		size = 0;
+	}
+	if (deferred_put(out, NULL, '0', precision - i) < 0)
+		return -1;
+	while (i-- > 0)
+		if (deferred_put(out, &tmp[i], 0, 1) < 0)
+			return -1;
+	return deferred_put(out, NULL, ' ', size);
+}
+
+/* Append len bytes of str to out, padded with spaces to width. */
+static int deferred_pad(struct deferred_out *out, const char *str, long len,
+			int width, int flags)
+{
+	if (!(flags & DF_LEFT) && deferred_put(out, NULL, ' ', width - len) < 0)
+		return -1;
+	if (deferred_put(out, str, 0, len) < 0)
+		return -1;
+	if ((flags & DF_LEFT) && deferred_put(out, NULL, ' ', width - len) < 0)
+		return -1;
+	return 0;
+}
+
+/* Take the next number argument from *args, clamped to a width. */
+static int deferred_width(const char **args, const char *end, int *width)
+{
+	int64_t num;
+
+	if (end - *args < (ssize_t)sizeof(num))
+		return -1;
+	memcpy(&num, *args, sizeof(num));
+	*args += sizeof(num);
+	*width = num < 0 ? 0 : num > DEFERRED_MAX_WIDTH
+		? DEFERRED_MAX_WIDTH : (int)num;
+	return 0;
+}
+
+/* Format the arguments of a record with fmt.  Returns 0 on success,
+   negative if they don't match. */
+static int deferred_format(struct deferred_out *out, const char *fmt,
+			   const char *args, size_t len)
+{
+	const char *end = args + len;
+
+	while (*fmt) {
+		int flags = 0, width = -1, precision = -1, base = 10;
+		int64_t num;
+		uint32_t slen, shown;
+		char c;
+
+		if (*fmt != '%' || fmt[1] == '%') {
+			const char *lit = fmt;
+			if (*fmt == '%')
+				lit = ++fmt;
+			while (*++fmt && *fmt != '%')
+				;
+			if (deferred_put(out, lit, 0, fmt - lit) < 0)
+				return -1;
+			continue;
+		}
+
+		for (;;) {
+			switch (*++fmt) {
+			case '0': flags |= DF_ZEROPAD; continue;
+			case '+': flags |= DF_PLUS; continue;
+			case ' ': flags |= DF_SPACE; continue;
+			case '-': flags |= DF_LEFT; continue;
+			case '#': flags |= DF_SPECIAL; continue;
+			}
+			break;
+		}
+		if (*fmt == '*') {
+			fmt++;
+			if (deferred_width(&args, end, &width) < 0)
+				return -1;
+		} else if (isdigit(*fmt)) {
+			width = strtol(fmt, (char **)&fmt, 10);
+			if (width > DEFERRED_MAX_WIDTH)
+				width = DEFERRED_MAX_WIDTH;
+		}
+		if (*fmt == '.') {
+			if (*++fmt == '*') {
+				fmt++;
+				if (deferred_width(&args, end, &precision) < 0)
+					return -1;
+			} else {
+				precision = strtol(fmt, (char **)&fmt, 10);
+				if (precision > DEFERRED_MAX_WIDTH)
+					precision = DEFERRED_MAX_WIDTH;
+			}
+		}
+		while (*fmt == 'l')
+			fmt++;
+
+		switch (*fmt++) {
+		case 's':
+			if (end - args < (ssize_t)sizeof(slen))
+				return -1;
+			memcpy(&slen, args, sizeof(slen));
+			args += sizeof(slen);
+			if ((size_t)(end - args) < slen)
+				return -1;
+			shown = slen;
+			if (precision >= 0 && (uint32_t)precision < slen)
+				shown = precision;
+			if (deferred_pad(out, args, shown, width, flags) < 0)
+				return -1;
+			args += slen;
+			continue;
+
+		case 'c':
+			if (end - args < (ssize_t)sizeof(num))
+				return -1;
+			memcpy(&num, args, sizeof(num));
+			args += sizeof(num);
+			c = (char)num;
+			if (deferred_pad(out, &c, 1, width, flags) < 0)
+				return -1;
+			continue;
+
+		case 'd':
+			flags |= DF_SIGN;
+			break;
+		case 'u':
+			break;
+		case 'o':
+			base = 8;
+			break;
+		case 'X':
+			flags |= DF_LARGE;
+			/* Fallthrough */
+		case 'x':
+			base = 16;
+			break;
+		default:
+			return -1;
+		}
+
+		if (end - args < (ssize_t)sizeof(num))
+			return -1;
+		memcpy(&num, args, sizeof(num));
+		args += sizeof(num);
+		if (deferred_number(out, num, base, width, precision, flags) < 0)
+			return -1;
+	}
+	return args == end ? 0 : -1;
+}
+
+/**
+ *	deferred_write - format the deferred print records in buf and
+ *	write them to the output of a cpu
+ *
+ *	Returns the number of bytes of buf used up, which leaves out a
+ *	record cut short at the end, or negative on error.
+ */
+static ssize_t deferred_write(int cpu, char *buf, size_t len, off_t *wsize)
+{
+	static struct deferred_out out;
+	struct _stp_print_record r;
+	size_t off = 0;
+
+	out.len = 0;
+	while (len - off >= sizeof(r)) {
+		memcpy(&r, buf + off, sizeof(r));
+		if (r.id > n_deferred_formats || r.len > DEFERRED_MAX_RECORD) {
+			_err("Bad print record %u of %u bytes\n", r.id, r.len);
+			return -1;
+		}
+		if (len - off - sizeof(r) < r.len)
+			break;
+		off += sizeof(r);
+
+		if (r.id == 0) {
+			if (deferred_put(&out, buf + off, 0, r.len) < 0)
+				return -1;
+		} else if (deferred_format(&out, deferred_formats[r.id - 1],
+					   buf + off, r.len) < 0) {
+			_err("Bad arguments for print format \"%s\"\n",
+			     deferred_formats[r.id - 1]);
+			return -1;
+		}
+		off += r.len;
+	}
+
+	if (write_output(cpu, out.data, out.len, wsize) < 0)
+		return -1;
+	return off;
+}
+
+#ifdef SPLICE_F_MOVE
+/**
+ *	splice_relay - move available relay data to the output file
+ *
+ *	Moves the data through a pipe with splice(2), so that it never
+ *	gets copied through user space.  Relay hands over only complete
+ *	sub-buffers this way; the rest has to be read().  Returns 0 once
+ *	no more can be spliced, 1 if either end doesn't support splicing (any data
+ *	already in the pipe has been written out), negative on error.
+ */
+static int splice_relay(int cpu, int pipefd[2], off_t *wsize, int *fnum)
+{
+	ssize_t in, out;
+
+	while ((in = splice(relay_fd[cpu], NULL, pipefd[1], NULL, SPLICE_CHUNK,
+			    SPLICE_F_MOVE | SPLICE_F_NONBLOCK)) > 0) {
+		if (maybe_switch_outfile(cpu, in, wsize, fnum) < 0)
+			return -1;
+
+		while (in > 0) {
+			out = splice(pipefd[0], NULL, out_fd[cpu], NULL, in,
+				     SPLICE_F_MOVE);
+			if (out < 0 && errno == EINVAL) {
+				/* The output can't be spliced to (e.g. an
+				   O_APPEND file), so copy out what's left. */
+				char buf[4096];
+				while (in > 0) {
+					ssize_t n = read(pipefd[0], buf,
+							 in > (ssize_t)sizeof(buf)
+							 ? (ssize_t)sizeof(buf) : in);
+					if (n <= 0 || write(out_fd[cpu], buf, n) != n) {
+						perr("Couldn't write to output %d for cpu %d, exiting.",
+						     out_fd[cpu], cpu);
+						return -1;
+					}
+					in -= n;
+					*wsize += n;
+				}
+				return 1;
+			}
+			if (out <= 0) {
+				perr("Couldn't write to output %d for cpu %d, exiting.",
+				     out_fd[cpu], cpu);
+				return -1;
+			}
+			in -= out;
+			*wsize += out;
+		}
+	}
+	if (in < 0 && (errno == EINVAL || errno == ENOSYS))
+		return 1;
+	if (in < 0 && errno != EAGAIN && errno != EINTR) {
+		perr("Couldn't splice from relay file for cpu %d, exiting.", cpu);
+		return -1;
+	}
+	return 0;
+}
+#endif
+
 /**
  *	reader_thread - per-cpu channel buffer reader
  */
@@ -129,8 +641,24 @@ static void *reader_thread(void *data)
         struct pollfd pollfd;
 	struct timespec tim = {.tv_sec=0, .tv_nsec=200000000}, *timeout = &tim;
 	sigset_t sigs;
-	off_t wsize = 0;
+	off_t wsize = 0, last_wsize = 0;
 	int fnum = 0;
+	size_t left = 0;
+	unsigned timeout_ms = POLL_START_MS;
+	int pipefd[2] = { -1, -1 };
+
+#ifdef SPLICE_F_MOVE
+	if (use_splice) {
+		if (pipe2(pipefd, O_CLOEXEC) < 0) {
+			dbug(2, "thread %d can't create splice pipe, copying\n", cpu);
+			pipefd[0] = pipefd[1] = -1;
+		}
+#ifdef HAVE_F_SETPIPE_SZ
+		else
+			(void) fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_CHUNK);
+#endif
+	}
+#endif
 
 	sigemptyset(&sigs);
 	sigaddset(&sigs,SIGUSR2);
@@ -164,14 +692,21 @@ static void *reader_thread(void *data)
 	pollfd.events = POLLIN;
 
         do {
+		if (!bulkmode) {
+			adapt_timeout(timeout, &timeout_ms,
+				      wsize != last_wsize);
+			last_wsize = wsize;
+		}
 		dbug(3, "thread %d start ppoll\n", cpu);
                 rc = ppoll(&pollfd, 1, timeout, &sigs);
 		dbug(3, "thread %d end ppoll:%d\n", cpu, rc);
                 if (rc < 0) {
 			dbug(3, "cpu=%d poll=%d errno=%d\n", cpu, rc, errno);
 			if (errno == EINTR) {
+				/* Drain what is left once more before
+				   leaving. */
 				if (stop_threads)
-					break;
+					goto drain;
 
 				pthread_mutex_lock(&mutex[cpu]);
 				if (switch_file[cpu]) {
@@ -190,14 +725,223 @@ static void *reader_thread(void *data)
 			}
                 }
 
-		while ((rc = read(relay_fd[cpu], buf, sizeof(buf))) > 0) {
-                        int wbytes = rc;
-                        char *wbuf = buf;
+drain:
+#ifdef SPLICE_F_MOVE
+		/* Relay only splices whole sub-buffers, so whatever is
+		   in the one still being filled is read below. */
+		if (pipefd[0] >= 0) {
+			rc = splice_relay(cpu, pipefd, &wsize, &fnum);
+			if (rc < 0)
+				goto error_out;
+			if (rc > 0) {
+				/* Fall back to copying from now on. */
+				dbug(2, "thread %d can't splice, copying\n", cpu);
+				close(pipefd[0]);
+				close(pipefd[1]);
+				pipefd[0] = pipefd[1] = -1;
+			}
+		}
+#endif
 
+		while ((rc = read(relay_fd[cpu], buf + left,
+				  sizeof(buf) - left)) > 0) {
 			/* Switching file */
+			if (maybe_switch_outfile(cpu, rc, &wsize, &fnum) < 0)
+				goto error_out;
+
+			if (deferred_formats) {
+				/* keep a record cut short for the next read */
+				ssize_t used = deferred_write(cpu, buf,
+							      left + rc, &wsize);
+				if (used < 0)
+					goto error_out;
+				left += rc - used;
+				memmove(buf, buf + used, left);
+			} else if (write_output(cpu, buf, rc, &wsize) < 0)
+				goto error_out;
+		}
+        } while (!stop_threads);
+	dbug(3, "exiting thread for cpu %d\n", cpu);
+	if (pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+	return(NULL);
+
+error_out:
+	if (pipefd[0] >= 0) {
+		close(pipefd[0]);
+		close(pipefd[1]);
+	}
+	/* Signal the main thread that we need to quit */
+	kill(getpid(), SIGTERM);
+	dbug(2, "exiting thread for cpu %d after error\n", cpu);
+	return(NULL);
+}
+
+/* Per-cpu stream mode.  A module built with STP_PERCPU_PRINT writes
+   its stream mode output to per-cpu relay files, as records of a
+   struct _stp_trace header and the data.  One thread reads all the
+   files and writes the data out in the order of the sequence numbers.
+   The kernel takes a sequence number only for a record that it
+   writes, so missing numbers are in flight, and get waited for until
+   the next poll.  Beyond that (say, after the flight recorder mode
+   overwrote some records), they are skipped. */
+
+/* The data read from the relay file of one cpu; the records from off
+   on are not written out yet. */
+struct stream_buf {
+	char *data;
+	size_t off, len, size;
+};
+
+/* Read what there is in the relay file of cpu into sb.  Returns 0 on
+   success, negative on error. */
+static int stream_fill(int cpu, struct stream_buf *sb)
+{
+	ssize_t rc;
+
+	/* drop what was written out */
+	if (sb->off) {
+		memmove(sb->data, sb->data + sb->off, sb->len - sb->off);
+		sb->len -= sb->off;
+		sb->off = 0;
+	}
+
+	do {
+		if (sb->size - sb->len < SPLICE_CHUNK) {
+			size_t size = sb->size ? 2 * sb->size : 2 * SPLICE_CHUNK;
+			char *data = realloc(sb->data, size);
+			if (data == NULL) {
+				_err("Memory allocation failed\n");
+				return -1;
+			}
+			sb->data = data;
+			sb->size = size;
+		}
+		rc = read(relay_fd[cpu], sb->data + sb->len, sb->size - sb->len);
+		if (rc > 0)
+			sb->len += rc;
+	} while (rc > 0);
+
+	if (rc < 0 && errno != EAGAIN && errno != EINTR) {
+		perr("Couldn't read relay file for cpu %d, exiting.", cpu);
+		return -1;
+	}
+	return 0;
+}
+
+/* Get the header of the first record of sb into t, if sb has all of
+   that record.  Returns 1 if so, 0 otherwise. */
+static int stream_head(struct stream_buf *sb, struct _stp_trace *t)
+{
+	if (sb->len - sb->off < sizeof(*t))
+		return 0;
+	memcpy(t, sb->data + sb->off, sizeof(*t));
+	return sb->len - sb->off - sizeof(*t) >= t->pdu_len;
+}
+
+/* Write out the records of all cpus in order, as long as they follow
+   on *next.  With skip, give up on the missing record *next once.
+   Returns 1 if records wait for a missing one, 0 if none are left,
+   negative on error. */
+static int stream_merge(struct stream_buf *sbs, uint32_t *next, int skip,
+			int cpu, off_t *wsize, int *fnum)
+{
+	struct _stp_trace t, first;
+	struct stream_buf *sb;
+	char *data;
+	int i;
+
+	for (;;) {
+		sb = NULL;
+		for (i = 0; i < ncpus; i++) {
+			if (stream_head(&sbs[i], &t) &&
+			    (sb == NULL || (int32_t)(t.sequence - first.sequence) < 0)) {
+				first = t;
+				sb = &sbs[i];
+			}
+		}
+		if (sb == NULL)
+			return 0;
+		if (first.sequence != *next) {
+			if (!skip)
+				return 1;
+			dbug(2, "skipping records %u to %u\n", *next,
+			     first.sequence - 1);
+			*next = first.sequence;
+			skip = 0;
+		}
+
+		data = sb->data + sb->off + sizeof(first);
+		if (maybe_switch_outfile(cpu, first.pdu_len, wsize, fnum) < 0)
+			return -1;
+		if (deferred_formats
+		    ? deferred_write(cpu, data, first.pdu_len, wsize) < 0
+		    : write_output(cpu, data, first.pdu_len, wsize) < 0)
+			return -1;
+		sb->off += sizeof(first) + first.pdu_len;
+		*next = first.sequence + 1;
+	}
+}
+
+/**
+ *	stream_thread - reader of all the per-cpu relay files, in per-cpu
+ *	stream mode
+ */
+static void *stream_thread(void *data)
+{
+	int rc, i, waited = 0;
+	uint32_t missing = 0;
+	int cpu = avail_cpus[0];	/* whose output we write */
+	struct pollfd *pollfds;
+	struct stream_buf *sbs;
+	struct timespec tim = {.tv_sec=0, .tv_nsec=200000000};
+	sigset_t sigs;
+	off_t wsize = 0, last_wsize = 0;
+	int fnum = 0;
+	unsigned timeout_ms = POLL_START_MS;
+	uint32_t next = 1;
+
+	(void) data;
+	pollfds = calloc(ncpus, sizeof(*pollfds));
+	sbs = calloc(ncpus, sizeof(*sbs));
+	if (pollfds == NULL || sbs == NULL) {
+		_err("Memory allocation failed\n");
+		goto error_out;
+	}
+
+	sigemptyset(&sigs);
+	sigaddset(&sigs,SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+	sigfillset(&sigs);
+	sigdelset(&sigs,SIGUSR2);
+
+        if (reader_timeout_ms) {
+                tim.tv_sec = reader_timeout_ms / 1000;
+                tim.tv_nsec = (reader_timeout_ms - tim.tv_sec * 1000) * 1000000;
+        }
+
+	for (i = 0; i < ncpus; i++) {
+		pollfds[i].fd = relay_fd[avail_cpus[i]];
+		pollfds[i].events = POLLIN;
+	}
+
+	do {
+		adapt_timeout(&tim, &timeout_ms, wsize != last_wsize);
+		last_wsize = wsize;
+		rc = ppoll(pollfds, ncpus, &tim, &sigs);
+		if (rc < 0) {
+			if (errno != EINTR) {
+				_perr("poll error");
+				goto error_out;
+			}
+			if (stop_threads)
+				break;
+
 			pthread_mutex_lock(&mutex[cpu]);
-			if ((fsize_max && ((wsize + rc) > fsize_max)) ||
-			    switch_file[cpu]) {
+			if (switch_file[cpu]) {
 				if (switch_outfile(cpu, &fnum) < 0) {
 					switch_file[cpu] = 0;
 					pthread_mutex_unlock(&mutex[cpu]);
@@ -207,51 +951,47 @@ static void *reader_thread(void *data)
 				wsize = 0;
 			}
 			pthread_mutex_unlock(&mutex[cpu]);
-
-                        /* Copy loop.  Must repeat write(2) in case of a pipe overflow
-                           or other transient fullness. */
-                        while (wbytes > 0) {
-				if (monitor) {
-					ssize_t bytes = wbytes > MONITORLINELENGTH ? MONITORLINELENGTH : wbytes;
-					/* Start scanning the wbuf[] for lines - \n.
-					  Plop each one found into the h_queue.lines[] ring. */
-					char *p = wbuf; /* scan position */
-					char *p_end = wbuf + bytes; /* one past last byte */
-					char *line = p;
-					while (p < p_end) {
-						if (*p == '\n') { /* got a line */
-							monitor_remember_output_line(line, (p-line)+1); /* strlen, including \n */
-							line = p+1;
-						}
-						p++;
-					}
-					/* Flush remaining output */
-					if (line != p_end)
-						monitor_remember_output_line(line, (p_end - line));
-					wbytes -= bytes;
-					wbuf += bytes;
-					wsize += bytes;
-				} else {
-	                                rc = write(out_fd[cpu], wbuf, wbytes);
-	                                if (rc <= 0) {
-						perr("Couldn't write to output %d for cpu %d, exiting.",
-	                                             out_fd[cpu], cpu);
-	                                        goto error_out;
-	                                }
-	                                wbytes -= rc;
-	                                wbuf += rc;
-	                                wsize += rc;
-				}
-                        }
 		}
-        } while (!stop_threads);
-	dbug(3, "exiting thread for cpu %d\n", cpu);
+
+		for (i = 0; i < ncpus; i++)
+			if (stream_fill(avail_cpus[i], &sbs[i]) < 0)
+				goto error_out;
+
+		/* a record still missing after a whole round is lost */
+		rc = stream_merge(sbs, &next, waited && next == missing,
+				  cpu, &wsize, &fnum);
+		if (rc < 0)
+			goto error_out;
+		waited = rc;
+		missing = next;
+	} while (!stop_threads);
+
+	/* write out whatever is left, in order */
+	for (i = 0; i < ncpus; i++)
+		if (stream_fill(avail_cpus[i], &sbs[i]) < 0)
+			goto error_out;
+	while ((rc = stream_merge(sbs, &next, 1, cpu, &wsize, &fnum)) > 0)
+		;
+	if (rc < 0)
+		goto error_out;
+
+	dbug(3, "exiting stream thread\n");
+	for (i = 0; i < ncpus; i++)
+		free(sbs[i].data);
+	free(sbs);
+	free(pollfds);
 	return(NULL);
 
 error_out:
+	if (sbs) {
+		for (i = 0; i < ncpus; i++)
+			free(sbs[i].data);
+		free(sbs);
+	}
+	free(pollfds);
 	/* Signal the main thread that we need to quit */
 	kill(getpid(), SIGTERM);
-	dbug(2, "exiting thread for cpu %d after error\n", cpu);
+	dbug(2, "exiting stream thread after error\n");
 	return(NULL);
 }
 
@@ -312,6 +1052,12 @@ int init_relayfs(void)
         /* Find out whether probe module was compiled with STP_BULKMODE. */
 	if (send_request(STP_BULK, rqbuf, sizeof(rqbuf)) == 0)
 		bulkmode = 1;
+	else if (send_request(STP_PERCPU_STREAM, rqbuf, sizeof(rqbuf)) == 0)
+		percpu_stream = 1;
+
+	/* Find out whether it was compiled with STP_DEFERRED_PRINT. */
+	if (!bulkmode && read_deferred_formats() < 0)
+		return -1;
 
 	/* Try to open a slew of per-cpu trace%d files.  Per PR19241, we
 	   need to go through all potentially present CPUs up to NR_CPUS, that
@@ -341,7 +1087,8 @@ int init_relayfs(void)
 		}
 	}
 	ncpus = cpui;
-	dbug(2, "ncpus=%d, bulkmode = %d\n", ncpus, bulkmode);
+	dbug(2, "ncpus=%d, bulkmode = %d, percpu_stream = %d\n", ncpus,
+	     bulkmode, percpu_stream);
 	for (i = 0; i < ncpus; i++)
 		dbug(2, "cpui=%d, relayfd=%d\n", i, avail_cpus[i]);
 
@@ -349,7 +1096,7 @@ int init_relayfs(void)
 		_err("couldn't open %s.\n", buf);
 		return -1;
 	}
-	if (ncpus > 1 && bulkmode == 0) {
+	if (ncpus > 1 && bulkmode == 0 && percpu_stream == 0) {
 		_err("ncpus=%d, bulkmode = %d\n", ncpus, bulkmode);
 		_err("This is inconsistent! Please file a bug report. Exiting now.\n");
 		return -1;
@@ -359,9 +1106,19 @@ int init_relayfs(void)
         if (load_only)
                 return 0;
 
+#ifdef SPLICE_F_MOVE
+	/* Only bulk mode moves enough whole sub-buffers for splicing
+	   to pay off.  Monitor mode has to scan every line of output,
+	   and deferred print records have to be formatted, so they need
+	   the data in user space anyway. */
+	use_splice = bulkmode && !monitor && !percpu_stream
+		&& !deferred_formats && getenv("SYSTEMTAP_NO_SPLICE") == NULL;
+	dbug(2, "use_splice = %d\n", use_splice);
+#endif
+
 	if (fsize_max) {
 		/* switch file mode */
-		for (i = 0; i < ncpus; i++) {
+		for (i = 0; i < (percpu_stream ? 1 : ncpus); i++) {
 			if (init_backlog(avail_cpus[i]) < 0)
 				return -1;
 			if (open_outfile(0, avail_cpus[i], 0) < 0)
@@ -429,6 +1186,15 @@ int init_relayfs(void)
                         return -1;
 		}
 	}
+	if (percpu_stream) {
+		/* one thread reads all the files */
+		if (pthread_create(&reader[avail_cpus[0]], NULL, stream_thread,
+				   NULL) < 0) {
+			_perr("failed to create thread");
+			return -1;
+		}
+		return 0;
+	}
         for (i = 0; i < ncpus; i++) {
                 if (pthread_create(&reader[avail_cpus[i]], NULL, reader_thread,
                                    (void *)(long)avail_cpus[i]) < 0) {
@@ -440,11 +1206,40 @@ int init_relayfs(void)
 	return 0;
 }
 
+/* Read one of the transport's counter files, or -1 if there is none. */
+static long read_counter(const char *name)
+{
+	char buf[PATH_MAX];
+	ssize_t len;
+	int fd = -1;
+
+#ifdef HAVE_OPENAT
+	if (relay_basedir_fd >= 0)
+		fd = openat_cloexec(relay_basedir_fd, name, O_RDONLY, 0);
+#endif
+	if (fd < 0) {
+		if (sprintf_chk(buf, "/sys/kernel/debug/systemtap/%s/%s",
+				modname, name))
+			return -1;
+		fd = open_cloexec(buf, O_RDONLY, 0);
+	}
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return -1;
+	buf[len] = '\0';
+	return strtol(buf, NULL, 10);
+}
+
 void close_relayfs(void)
 {
 	int i;
 	stop_threads = 1;
 	dbug(2, "closing\n");
+	dbug(1, "%ld sub-buffers dropped, %ld reader wakeups\n",
+	     read_counter("dropped"), read_counter("wakeups"));
 	for (i = 0; i < ncpus; i++) {
 		if (reader[avail_cpus[i]])
 			pthread_kill(reader[avail_cpus[i]], SIGUSR2);
@@ -466,5 +1261,9 @@ void close_relayfs(void)
 	for (i = 0; i < ncpus; i++) {
 		pthread_mutex_destroy(&mutex[avail_cpus[i]]);
 	}
+	free(deferred_formats);
+	free(deferred_table);
+	deferred_formats = NULL;
+	deferred_table = NULL;
 	dbug(2, "done\n");
 }
@@ -1142,6 +1142,10 @@ void stat_op::print (ostream& o) const
       o << "variance(";
       break;
 
+    case sc_quantile:
+      o << "quantile(";
+      break;
+
     case sc_none:
       assert (0); // should not happen, as sc_none is only used in foreach sorts
       break;
@@ -1150,6 +1154,8 @@ void stat_op::print (ostream& o) const
 
   if (ctype == sc_variance && params.size() == 1)
     o << ", " << params[0];
+  else if (ctype == sc_quantile && params.size() == 2)
+    o << ", " << params[0] << ", " << params[1];
 
   o << ")";
 }
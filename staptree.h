@@ -579,6 +579,7 @@ enum stat_component_type
     sc_max,
     sc_none,
     sc_variance,
+    sc_quantile,
   };
 
 struct stat_op: public expression
@@ -1126,7 +1126,12 @@ dwarf_query::query_module_dwarf()
           !startswith(function, "_Z"))
         query_module_functions();
       else
-        dw.iterate_over_cus(&query_cu, this, false);
+        {
+          // Read the function DIEs of all the CUs query_cu will visit
+          // up front, on several threads.
+          dw.prime_function_caches(spec_type == function_alone ? "" : file);
+          dw.iterate_over_cus(&query_cu, this, false);
+        }
     }
 }
 
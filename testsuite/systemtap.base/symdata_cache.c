@@ -0,0 +1,12 @@
+#include <stdio.h>
+
+int symdata_cache_func(int x)
+{
+	return x * VALUE;
+}
+
+int main(void)
+{
+	printf("%d\n", symdata_cache_func(1));
+	return 0;
+}
@@ -22,12 +22,15 @@
 #include "dwflpp.h"
 #include "stapregex.h"
 #include "stringtable.h"
+#include "cache.h"
+#include "hash.h"
 
 #include <byteswap.h>
 #include <cstdlib>
 #include <iostream>
 #include <set>
 #include <sstream>
+#include <iomanip>
 #include <string>
 #include <cassert>
 #include <cstring>
@@ -90,10 +93,18 @@ struct c_unparser: public unparser, public visitor
 
   varuse_collecting_visitor vcv_needs_global_locks;
 
+  // Global int64 arrays that are only ever incremented from probes that
+  // need global locks; these are emitted as lock-free per-cpu pmaps.
+  set<vardecl*> percpu_counters;
+
   map<string, probe*> probe_contents;
 
   map<pair<bool, string>, string> compiled_printfs;
 
+  // Formats of printfs that can be left to stapio with STP_DEFERRED_PRINT,
+  // by their number in the runtime's _stp_deferred_format().
+  map<string, unsigned> deferred_formats;
+
   c_unparser (systemtap_session* ss, translator_output* op=NULL):
     session (ss), o (op ?: ss->op), current_probe(0), current_function (0),
     assigned_functioncall (0), assigned_functioncall_retval (0),
@@ -108,6 +119,7 @@ struct c_unparser: public unparser, public visitor
   // If we've seen a dupe, return it; else remember this and return NULL.
   probe *get_probe_dupe (derived_probe *dp);
 
+  void find_percpu_counters ();
   void emit_map_type_instantiations ();
   void emit_common_header ();
   void emit_global (vardecl* v);
@@ -134,6 +146,10 @@ struct c_unparser: public unparser, public visitor
   virtual const string& get_compiled_printf (bool print_to_stream,
 					     const string& format);
 
+  void emit_deferred_formats ();
+  void declare_deferred_format (const string& format);
+  virtual unsigned get_deferred_format (const string& format);
+
   // for use by stats (pmap) foreach
   set<string> aggregations_active;
 
@@ -260,7 +276,7 @@ struct c_tmpcounter cxx_final: public c_unparser
 
   c_tmpcounter (c_unparser* p):
     c_unparser(p->session, &null_o), parent (p)
-  { }
+  { percpu_counters = p->percpu_counters; }
 
   // When vars are created *and used* (i.e. not overridden tmpvars) they call
   // var_declare(), which will forward to the parent c_unparser for output;
@@ -271,6 +287,7 @@ struct c_tmpcounter cxx_final: public c_unparser
 
   const string& get_compiled_printf (bool print_to_stream,
 				     const string& format) cxx_override;
+  unsigned get_deferred_format (const string& format) cxx_override;
 
   void start_compound_statement (const char*, statement*) cxx_override;
   void close_compound_statement (const char*, statement*) cxx_override;
@@ -454,6 +471,8 @@ public:
       result += "STAT_OP_AVG, ";
     if (sd.stat_ops & STAT_OP_VARIANCE)
       result += "STAT_OP_VARIANCE, " + lex_cast(sd.bit_shift) + ", ";
+    if (sd.stat_ops & STAT_OP_QUANTILE)
+      result += "STAT_OP_QUANTILE, ";
 
     return result;
   }
@@ -475,7 +494,9 @@ public:
   virtual string hist() const
   {
     assert (ty == pe_stats);
-    assert (sd.type != statistic_decl::none);
+    // the quantile sketch also needs the Hist to find its buckets
+    assert (sd.type != statistic_decl::none
+            || (sd.stat_ops & STAT_OP_QUANTILE));
     return "(&(" + value() + "->hist))";
   }
 
@@ -662,15 +683,16 @@ struct mapvar
   vector<exp_type> index_types;
   int maxsize;
   bool wrap;
+  bool percpu;
   mapvar (c_unparser *u,
           bool local, exp_type ty,
 	  statistic_decl const & sd,
 	  string const & name,
 	  vector<exp_type> const & index_types,
-	  int maxsize, bool wrap)
+	  int maxsize, bool wrap, bool percpu=false)
     : var (u, local, ty, sd, name),
       index_types (index_types),
-      maxsize (maxsize), wrap(wrap)
+      maxsize (maxsize), wrap(wrap), percpu(percpu)
   {}
 
   static string shortname(exp_type e);
@@ -727,7 +749,7 @@ struct mapvar
 
   bool is_parallel() const
   {
-    return type() == pe_stats;
+    return type() == pe_stats || percpu;
   }
 
   string stat_op_tokens() const
@@ -745,6 +767,8 @@ struct mapvar
       result += "STAT_OP_AVG, ";
     if (sd.stat_ops & STAT_OP_VARIANCE)
       result += "STAT_OP_VARIANCE, " + lex_cast(sd.bit_shift) + ", ";
+    if (sd.stat_ops & STAT_OP_QUANTILE)
+      result += "STAT_OP_QUANTILE, ";
 
     return result;
   }
@@ -754,8 +778,9 @@ struct mapvar
     string result = "";
     result += (sd.stat_ops & (STAT_OP_COUNT|STAT_OP_AVG|STAT_OP_VARIANCE)) ? "1, " : "0, ";
     result += (sd.stat_ops & (STAT_OP_SUM|STAT_OP_AVG|STAT_OP_VARIANCE)) ? "1, " : "0, ";
-    result += (sd.stat_ops & STAT_OP_MIN) ? "1, " : "0, ";
-    result += (sd.stat_ops & STAT_OP_MAX) ? "1, " : "0, ";
+    // the quantile estimates are clamped to @min and @max
+    result += (sd.stat_ops & (STAT_OP_MIN|STAT_OP_QUANTILE)) ? "1, " : "0, ";
+    result += (sd.stat_ops & (STAT_OP_MAX|STAT_OP_QUANTILE)) ? "1, " : "0, ";
     result += (sd.stat_ops & STAT_OP_VARIANCE) ? "1" : "0";
     return result;
   }
@@ -812,6 +837,8 @@ struct mapvar
     // impedance matching: empty strings -> NULL
     if (type() == pe_stats)
       res += (call_prefix("add", indices) + ", " + val.value() + ", " + stat_op_parms() + ")");
+    else if (type() == pe_long && percpu)
+      res += (call_prefix("add", indices) + ", " + val.value() + ", 0, 0, 0, 0, 0)");
     else
       throw SEMANTIC_ERROR(_("adding a value of an unsupported map type"));
 
@@ -849,7 +876,9 @@ struct mapvar
   string hist() const
   {
     assert (ty == pe_stats);
-    assert (sd.type != statistic_decl::none);
+    // the quantile sketch also needs the Hist to find its buckets
+    assert (sd.type != statistic_decl::none
+            || (sd.stat_ops & STAT_OP_QUANTILE));
     return "(&(" + fetch_existing_aggregate() + "->hist))";
   }
 
@@ -1154,6 +1183,9 @@ c_unparser::emit_common_header ()
 
   emit_compiled_printfs();
 
+  if (!session->runtime_usermode_p())
+    emit_deferred_formats();
+
   if (!session->runtime_usermode_p())
     {
       // Updated in probe handlers to signal that a module refresh is needed.
@@ -1226,6 +1258,56 @@ c_tmpcounter::get_compiled_printf (bool print_to_stream, const string& format)
   return parent->get_compiled_printf (print_to_stream, format);
 }
 
+void
+c_unparser::declare_deferred_format (const string& format)
+{
+  if (deferred_formats.find(format) == deferred_formats.end())
+    {
+      unsigned id = deferred_formats.size();
+      deferred_formats[format] = id;
+    }
+}
+
+unsigned
+c_unparser::get_deferred_format (const string& format)
+{
+  map<string, unsigned>::iterator it = deferred_formats.find(format);
+  if (it == deferred_formats.end())
+    throw SEMANTIC_ERROR (_("internal error translating printf"));
+  return it->second;
+}
+
+unsigned
+c_tmpcounter::get_deferred_format (const string& format)
+{
+  parent->declare_deferred_format (format);
+  return parent->get_deferred_format (format);
+}
+
+void
+c_unparser::emit_deferred_formats ()
+{
+  // The formats are in the form of print_format::components_to_string,
+  // which is what stapio parses them as.
+  vector<string> formats (deferred_formats.size());
+  map<string, unsigned>::iterator it;
+  for (it = deferred_formats.begin(); it != deferred_formats.end(); ++it)
+    formats[it->second] = it->first;
+
+  o->newline() << "#ifdef _STP_DEFERRED_PRINT";
+  o->newline() << "static const char * const _stp_deferred_formats[] = {";
+  o->indent(1);
+  for (unsigned i = 0; i < formats.size(); ++i)
+    o->newline() << '"' << formats[i] << "\",";
+  o->newline() << "NULL";
+  o->newline(-1) << "};";
+  o->newline() << "static const char *_stp_deferred_format(unsigned id) {";
+  o->newline(1) << "return id < " << formats.size()
+		<< " ? _stp_deferred_formats[id] : NULL;";
+  o->newline(-1) << "}";
+  o->newline() << "#endif // _STP_DEFERRED_PRINT";
+}
+
 void
 c_unparser::emit_compiled_printf_locals ()
 {
@@ -1635,7 +1717,7 @@ c_unparser::emit_global (vardecl *v)
 
   string type;
   if (v->arity > 0)
-    type = (v->type == pe_stats) ? "PMAP" : "MAP";
+    type = (v->type == pe_stats || percpu_counters.count(v)) ? "PMAP" : "MAP";
   else
     type = c_typename (v->type);
 
@@ -2938,6 +3020,184 @@ c_unparser::emit_probe_condition_update(derived_probe* v)
   o->newline(-1) << "}";
 }
 
+// Collect how global int64 arrays are used, to find the ones that are
+// only ever bumped with a bare "a[...] += x", "a[...]++" and the like.
+struct percpu_counter_collector: public functioncall_traversing_visitor
+{
+  systemtap_session& session;
+  set<vardecl*> counted;  // incremented by a statement whose value is unused
+  set<vardecl*> used;     // referenced in any other way
+  set<vardecl*> assigned; // written in any other way
+
+  percpu_counter_collector(systemtap_session& s): session(s) {}
+
+  vardecl* counter_target (expression* e);
+  void visit_expr_statement (expr_statement* s);
+  void visit_embeddedcode (embeddedcode* s);
+  void visit_assignment (assignment* e);
+  void visit_pre_crement (pre_crement* e);
+  void visit_post_crement (post_crement* e);
+  void visit_symbol (symbol* e);
+};
+
+
+vardecl*
+percpu_counter_collector::counter_target (expression* e)
+{
+  arrayindex* ai = dynamic_cast<arrayindex*>(e);
+  if (!ai)
+    return NULL;
+
+  symbol *array;
+  hist_op *hist;
+  classify_indexable (ai->base, array, hist);
+  if (!array || !array->referent || array->referent->type != pe_long)
+    return NULL;
+
+  return array->referent;
+}
+
+
+void
+percpu_counter_collector::visit_expr_statement (expr_statement* s)
+{
+  expression* lvalue = NULL;
+  expression* rvalue = NULL;
+
+  assignment* a = dynamic_cast<assignment*>(s->value);
+  if (a && (a->op == "+=" || a->op == "-="))
+    {
+      lvalue = a->left;
+      rvalue = a->right;
+    }
+  else if (pre_crement* pre = dynamic_cast<pre_crement*>(s->value))
+    lvalue = pre->operand;
+  else if (post_crement* post = dynamic_cast<post_crement*>(s->value))
+    lvalue = post->operand;
+
+  vardecl* v = counter_target (lvalue);
+  if (!v)
+    {
+      functioncall_traversing_visitor::visit_expr_statement (s);
+      return;
+    }
+
+  // Note the increment, but don't count the array itself as used.
+  counted.insert (v);
+  arrayindex* ai = static_cast<arrayindex*>(lvalue);
+  for (unsigned i = 0; i < ai->indexes.size(); i++)
+    if (ai->indexes[i])
+      ai->indexes[i]->visit (this);
+  if (rvalue)
+    rvalue->visit (this);
+}
+
+
+void
+percpu_counter_collector::visit_embeddedcode (embeddedcode* s)
+{
+  // Embedded-C may only touch globals through the pragmas, and it could
+  // do anything to them, so rule those out.
+  for (unsigned i = 0; i < session.globals.size(); i++)
+    {
+      vardecl* v = session.globals[i];
+      string name = v->unmangled_name;
+      if (s->code.find("/* pragma:read:" + name + " */") != string::npos ||
+          s->code.find("/* pragma:write:" + name + " */") != string::npos)
+        assigned.insert (v);
+    }
+}
+
+
+void
+percpu_counter_collector::visit_assignment (assignment* e)
+{
+  vardecl* v = counter_target (e->left);
+  if (v)
+    assigned.insert (v);
+  functioncall_traversing_visitor::visit_assignment (e);
+}
+
+
+void
+percpu_counter_collector::visit_pre_crement (pre_crement* e)
+{
+  vardecl* v = counter_target (e->operand);
+  if (v)
+    assigned.insert (v);
+  functioncall_traversing_visitor::visit_pre_crement (e);
+}
+
+
+void
+percpu_counter_collector::visit_post_crement (post_crement* e)
+{
+  vardecl* v = counter_target (e->operand);
+  if (v)
+    assigned.insert (v);
+  functioncall_traversing_visitor::visit_post_crement (e);
+}
+
+
+void
+percpu_counter_collector::visit_symbol (symbol* e)
+{
+  if (e->referent)
+    used.insert (e->referent);
+}
+
+
+// Find global int64 arrays which probes that need global locks only ever
+// increment or decrement, and which are only otherwise read or deleted by
+// probes that don't take locks at all (begin/end/error).  Since additions
+// commute, such an array can be kept as a per-cpu pmap whose values are
+// summed on read, just like the stats pmaps, and then the hot probes can
+// skip the global lock for it entirely.
+void
+c_unparser::find_percpu_counters ()
+{
+  // In stapdyn mode the maps live in shared memory and may be touched by
+  // many processes at once, so a "per-cpu" map isn't private there.
+  if (session->unoptimized || session->runtime_usermode_p())
+    return;
+
+  percpu_counter_collector locked (*session), unlocked (*session);
+  for (unsigned i=0; i<session->probes.size(); i++)
+    {
+      derived_probe* p = session->probes[i];
+      if (!p->needs_global_locks())
+        {
+          p->body->visit (& unlocked);
+          continue;
+        }
+
+      p->body->visit (& locked);
+
+      // Probe conditions are also re-evaluated inside the locked probes
+      // that affect them; see emit_probe().
+      for (set<derived_probe*>::const_iterator
+            it  = p->probes_with_affected_conditions.begin();
+            it != p->probes_with_affected_conditions.end(); ++it)
+        (*it)->sole_location()->condition->visit (& locked);
+    }
+
+  for (unsigned i = 0; i < session->globals.size(); i++)
+    {
+      vardecl* v = session->globals[i];
+      if (v->arity == 0 || v->type != pe_long)
+        continue;
+      if (!locked.counted.count(v) || locked.used.count(v) ||
+          locked.assigned.count(v) || unlocked.assigned.count(v))
+        continue;
+
+      percpu_counters.insert (v);
+      if (session->verbose > 1)
+        clog << _F("global %s kept as per-cpu counter array",
+                   v->unmangled_name.to_string().c_str()) << endl;
+    }
+}
+
+
 void
 c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
 {
@@ -2962,6 +3222,20 @@ c_unparser::emit_lock_decls(const varuse_collecting_visitor& vut)
       bool write_p = vut.written.count(v) > 0;
       if (!read_p && !write_p) continue;
 
+      // Per-cpu counters are only ever incremented here, which touches
+      // just this cpu's map, so no lock is needed at all.
+      if (percpu_counters.count(v))
+        continue;
+
+      // Likewise a "<<<" to a scalar stat only touches this cpu's
+      // stat_data.  The kernel runtime lets readers copy that under a
+      // per-cpu sequence count, and clear it by bumping a generation
+      // that each cpu applies itself, so "<<<" needs no lock either.
+      // (A "delete" counts as a read too, so it still locks.)
+      if (v->type == pe_stats && v->arity == 0 && write_p && !read_p
+          && !session->runtime_usermode_p())
+        continue;
+
       bool written_p;
       if (v->type == pe_stats) // read and write locks are flipped
         // Specifically, a "<<<" to a stats object is considered a
@@ -3126,6 +3400,11 @@ c_unparser::emit_map_type_instantiations ()
   for (map<string,functiondecl*>::iterator it = session->functions.begin(); it != session->functions.end(); it++)
     collect_map_index_types(it->second->locals, types);
 
+  // Per-cpu counters need the pmap functions for their int64 maps too.
+  set< pair<vector<exp_type>, exp_type> > pmap_types;
+  vector<vardecl*> counters (percpu_counters.begin(), percpu_counters.end());
+  collect_map_index_types(counters, pmap_types);
+
   if (!types.empty())
     o->newline() << "#include \"alloc.c\"";
 
@@ -3139,7 +3418,7 @@ c_unparser::emit_map_type_instantiations ()
 	  o->newline() << "#define KEY" << (j+1) << "_TYPE " << ktype;
 	}
       /* For statistics, flag map-gen to pull in nested pmap-gen too.  */
-      if (i->second == pe_stats)
+      if (i->second == pe_stats || pmap_types.count(*i))
 	o->newline() << "#define MAP_DO_PMAP 1";
       o->newline() << "#include \"map-gen.c\"";
       o->newline() << "#undef MAP_DO_PMAP";
@@ -3446,8 +3725,8 @@ c_unparser_assignment::c_assignop(tmpvar & res,
     {
       int stat_op_count = lval.sdecl().stat_ops & (STAT_OP_COUNT|STAT_OP_AVG|STAT_OP_VARIANCE);
       int stat_op_sum = lval.sdecl().stat_ops & (STAT_OP_SUM|STAT_OP_AVG|STAT_OP_VARIANCE);
-      int stat_op_min = lval.sdecl().stat_ops & STAT_OP_MIN;
-      int stat_op_max = lval.sdecl().stat_ops & STAT_OP_MAX;
+      int stat_op_min = lval.sdecl().stat_ops & (STAT_OP_MIN|STAT_OP_QUANTILE);
+      int stat_op_max = lval.sdecl().stat_ops & (STAT_OP_MAX|STAT_OP_QUANTILE);
       int stat_op_variance = lval.sdecl().stat_ops & STAT_OP_VARIANCE;
 
       assert(lval.type() == pe_stats);
@@ -3659,7 +3938,8 @@ c_unparser::getmap(vardecl *v, token const *tok)
   if (i != session->stat_decls.end())
     sd = i->second;
   return mapvar (this, is_local (v, tok), v->type, sd,
-      v->name, v->index_types, v->maxsize, v->wrap);
+      v->name, v->index_types, v->maxsize, v->wrap,
+      percpu_counters.count(v) > 0);
 }
 
 
@@ -4148,7 +4428,7 @@ c_unparser::visit_foreach_loop (foreach_loop *s)
 	      // If the user wanted us to sort by value, we'll sort by
 	      // @count or selected function instead for aggregates.  
 	      // See runtime/map.c
-	      if (s->sort_column == 0)
+	      if (s->sort_column == 0 && mv.type() == pe_stats)
                 switch (s->sort_aggr) {
                 default: case sc_none: case sc_count: sort_column = "SORT_COUNT"; break;
                 case sc_sum: sort_column = "SORT_SUM"; break;
@@ -5606,6 +5886,27 @@ c_unparser_assignment::visit_arrayindex (arrayindex *e)
 	  // o->newline() << lvar << " = " << rvar << ";";
 	  // o->newline() << res << " = " << rvar << ";";
 	}
+      else if (parent->percpu_counters.count(array->referent))
+	{
+	  // A per-cpu counter is only ever bumped by a bare statement
+	  // (see find_percpu_counters), so there is no old value to fetch:
+	  // just add the delta into this cpu's map.
+	  //
+	  // ({ tmp0=(idx0); ... tmpN=(idxN); rvar=(rhs);
+	  //    _stp_pmap_add_int64 (array, idx0...N, +/-rvar);
+	  //    rvar; })
+	  if (op != "+=" && op != "-=" && op != "++" && op != "--")
+	    throw SEMANTIC_ERROR (_("unexpected update of per-cpu counter"), e->tok);
+
+	  tmpvar delta = rvar;
+	  if (op == "-=" || op == "--")
+	    delta.override ("-(" + rvar.value() + ")");
+
+	  mapvar mvar = parent->getmap (array->referent, e->tok);
+	  o->newline() << "c->last_stmt = " << lex_cast_qstring(*e->tok) << ";";
+	  o->newline() << mvar.add (idx, delta) << ";";
+	  res = rvar;
+	}
       else
 	{
 	  mapvar mvar = parent->getmap (array->referent, e->tok);
@@ -5871,6 +6172,40 @@ preprocess_print_format(print_format* e, vector<tmpvar>& tmp,
 }
 
 
+// Whether stapio can format these components as well as the runtime,
+// i.e. whether a printf with them can use STP_DEFERRED_PRINT.
+static bool
+deferrable_print_format(const vector<print_format::format_component>& components)
+{
+  for (unsigned i = 0; i < components.size(); ++i)
+    {
+      const print_format::format_component& c = components[i];
+
+      // components_to_string() drops a static precision of 0
+      if (c.prectype == print_format::prec_static && c.precision <= 0)
+	return false;
+
+      switch (c.type)
+	{
+	case print_format::conv_literal:
+	case print_format::conv_number:
+	  break;
+
+	case print_format::conv_string:
+	case print_format::conv_char:
+	  // '#' escapes characters, which stapio doesn't do
+	  if (c.test_flag (print_format::fmt_flag_special))
+	    return false;
+	  break;
+
+	default:
+	  return false;
+	}
+    }
+  return true;
+}
+
+
 void
 c_unparser::visit_print_format (print_format* e)
 {
@@ -6013,6 +6348,44 @@ c_unparser::visit_print_format (print_format* e)
 	    }
 	}
 
+      // With -DSTP_DEFERRED_PRINT, send the format number and the raw
+      // arguments for stapio to format, as long as they fit in the
+      // print buffer.
+      bool deferred = (e->print_to_stream && !tmp.empty()
+		       && !session->runtime_usermode_p()
+		       && deferrable_print_format (components));
+      if (deferred)
+	{
+	  unsigned id = get_deferred_format (format_string_out);
+	  string size = "0";
+
+	  o->newline() << "#ifdef _STP_DEFERRED_PRINT";
+	  o->newline() << "{";
+	  o->indent(1);
+	  for (unsigned i = 0; i < tmp.size(); ++i)
+	    if (e->args[i]->type == pe_string)
+	      {
+		o->newline() << "uint32_t __len" << i << " = strlen("
+			     << tmp[i].value() << ");";
+		size += " + sizeof(uint32_t) + __len" + lex_cast(i);
+	      }
+	    else
+	      size += " + sizeof(int64_t)";
+	  o->newline() << "char *__rec = _stp_reserve_record (" << id
+		       << ", " << size << ");";
+	  o->newline() << "if (likely(__rec != NULL)) {";
+	  o->indent(1);
+	  for (unsigned i = 0; i < tmp.size(); ++i)
+	    if (e->args[i]->type == pe_string)
+	      o->newline() << "__rec = _stp_record_string (__rec, "
+			   << tmp[i].value() << ", __len" << i << ");";
+	    else
+	      o->newline() << "__rec = _stp_record_long (__rec, "
+			   << tmp[i].value() << ");";
+	  o->newline(-1) << "} else {";
+	  o->newline() << "#endif // _STP_DEFERRED_PRINT";
+	}
+
       // The default it to use the new compiled-printf, but one can fall back
       // to the old code with -DSTP_LEGACY_PRINT if desired.
       o->newline() << "#ifndef STP_LEGACY_PRINT";
@@ -6068,6 +6441,13 @@ c_unparser::visit_print_format (print_format* e)
 	}
       o->line() << ");";
       o->newline(-1) << "#endif // STP_LEGACY_PRINT";
+      if (deferred)
+	{
+	  o->newline() << "#ifdef _STP_DEFERRED_PRINT";
+	  o->newline() << "}";
+	  o->newline(-1) << "}";
+	  o->newline() << "#endif // _STP_DEFERRED_PRINT";
+	}
       o->newline() << "if (unlikely(c->last_error)) goto out;";
       o->newline() << res.value() << ";";
     }
@@ -6140,6 +6520,13 @@ c_unparser::visit_stat_op (stat_op* e)
         case sc_variance:
           c_assign(res, agg.value() + "->variance", e->tok);
           break;
+        case sc_quantile:
+          c_assign(res, ("_stp_stat_quantile(" + v->hist() + ", "
+                         + agg.value() + ", "
+                         + lex_cast(e->params[0]) + "LL, "
+                         + lex_cast(e->params[1]) + "LL)"),
+                   e->tok);
+          break;
         case sc_none:
           assert (0); // should not happen, as sc_none is only used in foreach sorts
         }
@@ -6206,8 +6593,67 @@ struct unwindsym_dump_context
   size_t debug_line_len;
 
   set<string> undone_unwindsym_modules;
+
+  ofstream *blob;     // raw table bytes, pulled in with .incbin; may be NULL
+  string blob_path;
+  size_t blob_len;
+
+  ostream *data;      // where the current module's tables go; NULL if they
+                      // are in an object taken from the cache
+  string data_prefix; // name prefix of the current module's tables
 };
 
+
+// Emit LEN bytes of DATA as the array NAME of the given element TYPE.
+// With a blob file, the bytes are appended to it and pulled into the
+// module with an .incbin directive, so gcc doesn't have to parse a
+// huge initializer for them.
+//
+// Tables that live in a separate symbol data object are only declared
+// in the main output.
+static void
+dump_unwindsym_bytes (unwindsym_dump_context *c, const string& type,
+		      const string& name, const void *data, size_t len)
+{
+  bool separate = (c->data != &c->output);
+  if (separate)
+    c->output << "extern " << type << " " << name << "[];\n";
+  if (c->data == NULL)
+    return;
+  ostream& o = *c->data;
+
+  if (c->blob)
+    {
+      o << "__asm__ (\".pushsection .rodata\\n\"\n";
+      if (separate)
+	o << "         \".globl " << name << "\\n\"\n";
+      o << "         \".balign 8\\n\"\n"
+	<< "         \"" << name << ":\\n\"\n"
+	<< "         \".incbin \\\"" << c->blob_path << "\\\", "
+	<< c->blob_len << ", " << len << "\\n\"\n"
+	<< "         \".popsection\");\n";
+      if (separate)
+	o << "extern " << type << " " << name << "[];\n";
+      else
+	o << "extern " << type << " " << name
+	  << "[] __attribute__((visibility(\"hidden\")));\n";
+      c->blob->write ((const char *) data, len);
+      c->blob_len += len;
+      return;
+    }
+
+  o << (separate ? "" : "static ") << type << " " << name << "[] = \n";
+  o << "  {";
+  for (size_t i = 0; i < len; i++)
+    {
+      int h = ((uint8_t *)data)[i];
+      o << h << ","; // decimal is less wordy than hex
+      if ((i + 1) % 16 == 0)
+	o << "\n" << "   ";
+    }
+  o << "};\n";
+}
+
 static bool need_byte_swap_for_target (const unsigned char e_ident[])
 {
 #if __BYTE_ORDER == __LITTLE_ENDIAN
@@ -6990,11 +7436,14 @@ dump_unwind_tables (Dwfl_Module *m,
 }
 
 static void
-dump_unwindsym_cxt_table(systemtap_session& session, ostream& output,
-			 const string& modname, unsigned modindex,
+dump_unwindsym_cxt_table(unwindsym_dump_context *c,
+			 const string& modname,
 			 const string& secname, unsigned secindex,
 			 const string& table, void*& data, size_t& len)
 {
+  systemtap_session& session = c->session;
+  ostream& output = c->output;
+
   if (data == NULL || len == 0)
     return;
 
@@ -7013,24 +7462,21 @@ dump_unwindsym_cxt_table(systemtap_session& session, ostream& output,
       return;
     }
 
+  // A separate symbol data object only carries the tables this session
+  // references; its cache key records which ones those are.
+  if (c->data != &c->output
+      && !(table == "debug_line" ? session.need_lines : session.need_unwind))
+    return;
+
   // if it is the debug_line data, do not need the unwind flags to be defined
   if(table == "debug_line")
     output << "#if defined(STP_NEED_LINE_DATA)\n";
   else
     output << "#if defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)\n";
-  output << "static uint8_t _stp_module_" << modindex << "_" << table;
+  string name = c->data_prefix + "_" + table;
   if (!secname.empty())
-    output << "_" << secindex;
-  output << "[] = \n";
-  output << "  {";
-  for (size_t i = 0; i < len; i++)
-    {
-      int h = ((uint8_t *)data)[i];
-      output << h << ","; // decimal is less wordy than hex
-      if ((i + 1) % 16 == 0)
-	output << "\n" << "   ";
-    }
-  output << "};\n";
+    name += "_" + lex_cast(secindex);
+  dump_unwindsym_bytes (c, "uint8_t", name, data, len);
   if (table == "debug_line")
     output << "#endif /* STP_NEED_LINE_DATA */\n";
   else
@@ -7058,16 +7504,60 @@ dump_unwindsym_cxt (Dwfl_Module *m,
   void *debug_line = c->debug_line;
   size_t debug_line_len = c->debug_line_len;
 
-  dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
+  // With a build-id, the module's tables can go into an object of their
+  // own, which is cached and linked into later modules as is.  Their
+  // names are then global, so they're keyed by the cache hash rather
+  // than by the module index.
+  c->data = &c->output;
+  c->data_prefix = "_stp_module_" + lex_cast(stpmod_idx);
+  if (c->build_id_len > 0 && c->session.use_cache
+      && !c->session.runtime_usermode_p())
+    {
+      ostringstream build_id;
+      for (int j = 0; j < c->build_id_len; j++)
+	build_id << hex << setfill('0') << setw(2)
+		 << (unsigned) c->build_id_bits[j];
+      string cache_path = find_symbol_object_hash (c->session, modname,
+						   build_id.str());
+      if (!cache_path.empty())
+	{
+	  string objname = cache_path.substr(cache_path.rfind('/') + 1);
+	  c->data_prefix = "_stp_" + objname.substr(0, objname.size() - 2);
+
+	  string obj_path = c->session.tmpdir + "/" + c->session.module_name
+	    + "_symdata_" + lex_cast(stpmod_idx) + ".o";
+	  if (get_symbol_object_from_cache (c->session, cache_path, obj_path))
+	    {
+	      c->data = NULL;
+	      c->session.symbol_objects.push_back (obj_path);
+	    }
+	  else
+	    {
+	      translator_output *symdata = c->session.op_create_auxiliary ();
+	      symdata->line() << "/* " << modname << ", build-id "
+			      << build_id.str() << " */\n";
+	      symdata->line() << "struct _stp_symbol {"
+			      << " unsigned long addr; const char *symbol; };\n";
+	      c->data = &symdata->line();
+
+	      obj_path = symdata->filename;
+	      obj_path[obj_path.size() - 1] = 'o';
+	      c->session.symbol_object_cache.push_back (make_pair (obj_path,
+								   cache_path));
+	    }
+	}
+    }
+
+  dump_unwindsym_cxt_table(c, modname, "", 0,
 			   "debug_frame", debug_frame, debug_len);
 
-  dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
+  dump_unwindsym_cxt_table(c, modname, "", 0,
 			   "eh_frame", eh_frame, eh_len);
 
-  dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
+  dump_unwindsym_cxt_table(c, modname, "", 0,
 			   "eh_frame_hdr", eh_frame_hdr, eh_frame_hdr_len);
 
-  dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, "", 0,
+  dump_unwindsym_cxt_table(c, modname, "", 0,
 			   "debug_line", debug_line, debug_line_len);
 
   if (c->session.need_unwind && debug_frame == NULL && eh_frame == NULL)
@@ -7088,17 +7578,40 @@ dump_unwindsym_cxt (Dwfl_Module *m,
                                   dwfl_errmsg (-1));
     }
 
+  // With a blob, the symbol names go into one string table for the
+  // whole module, and the symbols just point into it.
+  map<string, size_t> strtab_offsets;
+  if (c->blob && c->session.need_symbols && c->data)
+    {
+      string strtab;
+      for (unsigned secidx = 0; secidx < c->seclist.size(); secidx++)
+	for (addrmap_t::iterator it = c->addrmap[secidx].begin();
+	     it != c->addrmap[secidx].end(); it++)
+	  if (strtab_offsets.insert (make_pair (it->second, strtab.size ())).second)
+	    {
+	      strtab += it->second;
+	      strtab += '\0';
+	    }
+      if (!strtab.empty ())
+	dump_unwindsym_bytes (c, "char", c->data_prefix + "_strtab",
+			      strtab.data (), strtab.size ());
+    }
+
   for (unsigned secidx = 0; secidx < c->seclist.size(); secidx++)
     {
-      c->output << "static struct _stp_symbol "
-                << "_stp_module_" << stpmod_idx<< "_symbols_" << secidx << "[] = {\n";
+      string symtab = c->data_prefix + "_symbols_" + lex_cast(secidx);
+      if (c->data != &c->output)
+	c->output << "extern struct _stp_symbol " << symtab << "[];\n";
+      if (c->data)
+	*c->data << (c->data != &c->output ? "" : "static ")
+		 << "struct _stp_symbol " << symtab << "[] = {\n";
 
       string secname = c->seclist[secidx].first;
       Dwarf_Addr extra_offset;
       extra_offset = (secname == "_stext") ? c->stext_offset : 0;
 
       // Only include symbols if they will be used
-      if (c->session.need_symbols)
+      if (c->session.need_symbols && c->data)
 	{
 	  // We write out a *sorted* symbol table, so the runtime doesn't
 	  // have to sort them later.
@@ -7109,21 +7622,27 @@ dump_unwindsym_cxt (Dwfl_Module *m,
 	      if (it->first < extra_offset)
 		continue;
 
-	      c->output << "  { 0x" << hex << it->first-extra_offset << dec
-			<< ", " << lex_cast_qstring (it->second) << " },\n";
-              // XXX: these literal strings all suffer ELF relocation bloat too.
+	      *c->data << "  { 0x" << hex << it->first-extra_offset << dec << ", ";
+	      if (c->blob)
+		*c->data << c->data_prefix << "_strtab + "
+			 << strtab_offsets[it->second];
+	      else
+		*c->data << lex_cast_qstring (it->second);
+	      *c->data << " },\n";
+              // XXX: these pointers all suffer ELF relocation bloat too.
               // See if the tapsets.cxx:dwarf_derived_probe_group::emit_module_decls
               // CALCIT hack could work here.
 	    }
 	}
 
-      c->output << "};\n";
+      if (c->data)
+	*c->data << "};\n";
 
       /* For now output debug_frame index only in "magic" sections. */
       if (secname == ".dynamic" || secname == ".absolute"
 	  || secname == ".text" || secname == "_stext")
 	{
-	  dump_unwindsym_cxt_table(c->session, c->output, modname, stpmod_idx, secname, secidx,
+	  dump_unwindsym_cxt_table(c, modname, secname, secidx,
 				   "debug_frame_hdr", debug_frame_hdr, debug_frame_hdr_len);
 	}
     }
@@ -7138,7 +7657,7 @@ dump_unwindsym_cxt (Dwfl_Module *m,
       c->output << "{\n"
                 << ".name = " << lex_cast_qstring(c->seclist[secidx].first) << ",\n"
                 << ".size = 0x" << hex << c->seclist[secidx].second << dec << ",\n"
-                << ".symbols = _stp_module_" << stpmod_idx << "_symbols_" << secidx << ",\n"
+                << ".symbols = " << c->data_prefix << "_symbols_" << secidx << ",\n"
                 << ".num_symbols = " << c->addrmap[secidx].size() << ",\n";
 
       /* For now output debug_frame index only in "magic" sections. */
@@ -7150,7 +7669,7 @@ dump_unwindsym_cxt (Dwfl_Module *m,
 		    << " && defined(STP_NEED_UNWIND_DATA)\n";
 
           c->output << ".debug_hdr = "
-		    << "_stp_module_" << stpmod_idx
+		    << c->data_prefix
 		    << "_debug_frame_hdr_" << secidx << ",\n";
           c->output << ".debug_hdr_len = " << debug_frame_hdr_len << ", \n";
 
@@ -7224,7 +7743,7 @@ dump_unwindsym_cxt (Dwfl_Module *m,
     {
       c->output << "#if defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)\n";
       c->output << ".debug_frame = "
-		<< "_stp_module_" << stpmod_idx << "_debug_frame, \n";
+		<< c->data_prefix << "_debug_frame, \n";
       c->output << ".debug_frame_len = " << debug_len << ", \n";
       c->output << "#else\n";
     }
@@ -7239,12 +7758,12 @@ dump_unwindsym_cxt (Dwfl_Module *m,
     {
       c->output << "#if defined(STP_USE_DWARF_UNWINDER) && defined(STP_NEED_UNWIND_DATA)\n";
       c->output << ".eh_frame = "
-		<< "_stp_module_" << stpmod_idx << "_eh_frame, \n";
+		<< c->data_prefix << "_eh_frame, \n";
       c->output << ".eh_frame_len = " << eh_len << ", \n";
       if (eh_frame_hdr)
         {
           c->output << ".unwind_hdr = "
-                    << "_stp_module_" << stpmod_idx << "_eh_frame_hdr, \n";
+                    << c->data_prefix << "_eh_frame_hdr, \n";
           c->output << ".unwind_hdr_len = " << eh_frame_hdr_len << ", \n";
         }
       else
@@ -7266,7 +7785,7 @@ dump_unwindsym_cxt (Dwfl_Module *m,
     {
       c->output << "#if defined(STP_NEED_LINE_DATA)\n";
       c->output << ".debug_line = "
-		<< "_stp_module_" << stpmod_idx << "_debug_line, \n";
+		<< c->data_prefix << "_debug_line, \n";
       c->output << ".debug_line_len = " << debug_line_len << ", \n";
       c->output << "#else\n";
     }
@@ -7597,6 +8116,13 @@ emit_symbol_data (systemtap_session& s)
 
   ofstream kallsyms_out ((s.tmpdir + "/" + symfile).c_str());
 
+  // The bulk of the tables goes into a binary file next to it, unless
+  // its path can't be quoted simply in an .incbin directive.
+  string blobfile = resolve_path(s.tmpdir) + "/stap-symbols.bin";
+  ofstream blob_out;
+  if (blobfile.find_first_of("\"\\\n") == string::npos)
+    blob_out.open (blobfile.c_str(), ios::out | ios::binary);
+
   vector<pair<string,unsigned> > seclist;
   map<unsigned, addrmap_t> addrmap;
   unwindsym_dump_context ctx = { s, kallsyms_out,
@@ -7618,7 +8144,12 @@ emit_symbol_data (systemtap_session& s)
 				 0, /* eh_frame_hdr_addr */
 				 NULL, /* debug_line */
 				 0, /* debug_line_len */
-				 s.unwindsym_modules };
+				 s.unwindsym_modules,
+				 blob_out.is_open() ? &blob_out : NULL,
+				 blobfile,
+				 0, /* blob_len */
+				 &kallsyms_out, /* data */
+				 "" /* data_prefix */ };
 
   // Micro optimization, mainly to speed up tiny regression tests
   // using just begin probe.
@@ -7749,6 +8280,14 @@ emit_symbol_data_done (unwindsym_dump_context *ctx, systemtap_session& s)
     ctx->output << "0x" << hex << ctx->stp_kretprobe_trampoline_addr << dec
 		<< ";\n";
 
+  if (ctx->blob)
+    {
+      ctx->blob->close();
+      if (ctx->blob->fail())
+	throw SEMANTIC_ERROR (_F("failed to write symbol data to %s",
+				 ctx->blob_path.c_str()));
+    }
+
   // Some nonexistent modules may have been identified with "-d".  Note them.
   if (! s.suppress_warnings)
     for (set<string>::iterator it = ctx->undone_unwindsym_modules.begin();
@@ -7964,6 +8503,7 @@ translate_pass (systemtap_session& s)
           s.op->newline() << s.embeds[i]->code << "\n";
         }
 
+      cup.find_percpu_counters ();
       s.up->emit_common_header (); // context etc.
 
       if (s.need_unwind)